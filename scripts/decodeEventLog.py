@@ -0,0 +1,124 @@
+import datetime
+import os
+import re
+import struct
+import sys
+
+# Decodes events.bin written by the event log with EVENT_LOG_RAW (see src/tools/EventLog.h).
+# The records only hold the addresses of the format strings, which are read from the .elf
+# file of the firmware that wrote the log.
+#
+# Usage: decodeEventLog.py <events.bin> [firmware.elf]
+
+PROJECT_DIR = os.path.abspath(".")
+ELF_FILE = os.path.join(PROJECT_DIR, ".pio/build/debug/firmware.elf")
+
+HEADER = struct.Struct("<HBBIQII")     # EventLogRecordHeader
+FLAG_DEBUG = 0x01
+FLAG_CORE1 = 0x02
+
+# Loaded sections of a 32 bit little endian ELF file as (address, data)
+def readElfSections(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:4] != b"\x7fELF" or data[4] != 1 or data[5] != 1:
+        raise ValueError(f"{path} is not a 32 bit little endian ELF file")
+    shoff, = struct.unpack_from("<I", data, 0x20)
+    shentsize, shnum = struct.unpack_from("<HH", data, 0x2E)
+    sections = []
+    for i in range(shnum):
+        _, shtype, flags, addr, offset, size = struct.unpack_from("<IIIIII", data, shoff + i * shentsize)
+        if flags & 0x2 and shtype == 1 and size > 0:     # SHF_ALLOC, SHT_PROGBITS
+            sections.append((addr, data[offset:offset + size]))
+    return sections
+
+def readString(sections, address):
+    for start, data in sections:
+        if start <= address < start + len(data):
+            end = data.find(b"\0", address - start)
+            return data[address - start:end].decode("utf-8", "replace")
+    return None
+
+def readArgs(record, position, count):
+    args = []
+    for _ in range(count):
+        t = chr(record[position])
+        position += 1
+        if t == "i":
+            args.append(struct.unpack_from("<i", record, position)[0]); position += 4
+        elif t in "up":
+            args.append(struct.unpack_from("<I", record, position)[0]); position += 4
+        elif t == "q":
+            args.append(struct.unpack_from("<q", record, position)[0]); position += 8
+        elif t == "Q":
+            args.append(struct.unpack_from("<Q", record, position)[0]); position += 8
+        elif t == "d":
+            args.append(struct.unpack_from("<d", record, position)[0]); position += 8
+        elif t == "s":
+            n = record[position]
+            args.append(record[position + 1:position + 1 + n].decode("utf-8", "replace")); position += 1 + n
+        else:
+            break
+    return args
+
+# Python's % formatting understands the printf conversions apart from the length modifiers
+# and %p; the argument types decide, as in CEventLog::formatEvent
+SPEC = re.compile(r"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d+))?[hlLqjzt]*([a-zA-Z%])")
+
+def formatEvent(fmt, args):
+    args = list(args)
+
+    def replace(m):
+        flags, width, precision, conversion = m.groups()
+        if conversion == "%":
+            return "%"
+        if width == "*":
+            width = str(args.pop(0)) if args else ""
+        if precision == "*":
+            precision = str(args.pop(0)) if args else ""
+        if not args:
+            return "<?>"
+        value = args.pop(0)
+        spec = "%" + flags + (width or "") + ("." + precision if precision else "")
+        if isinstance(value, str):
+            return (spec + "s") % value
+        if isinstance(value, float):
+            return (spec + (conversion if conversion in "fFeEgG" else "g")) % value
+        if conversion == "p":
+            return "0x%x" % value
+        if conversion == "c":
+            return chr(value)
+        return (spec + (conversion if conversion in "diouxX" else "d")) % value
+
+    return SPEC.sub(replace, fmt)
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        print(f"Usage: {sys.argv[0]} <events.bin> [firmware.elf]", file=sys.stderr)
+        return 1
+    sections = readElfSections(sys.argv[2] if len(sys.argv) == 3 else ELF_FILE)
+    with open(sys.argv[1], "rb") as f:
+        data = f.read()
+
+    position = 0
+    while position + HEADER.size <= len(data):
+        length, argCount, flags, time, _, fmtAddress, _ = HEADER.unpack_from(data, position)
+        if length < HEADER.size or position + length > len(data):
+            print(f"Invalid record at offset {position}, stopping", file=sys.stderr)
+            break
+        record = data[position:position + length]
+        position += length
+
+        fmt = readString(sections, fmtAddress)
+        args = readArgs(record, HEADER.size, argCount)
+        if fmt is None:
+            text = f"<unknown format 0x{fmtAddress:08x}> {args}\n"
+        else:
+            text = formatEvent(fmt, args)
+        timestamp = datetime.datetime.fromtimestamp(time, datetime.timezone.utc).strftime("%Y-%m-%d %H:%M:%S")
+        core = 1 if flags & FLAG_CORE1 else 0
+        sys.stdout.write(f"{timestamp} | {core} | {text}")
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
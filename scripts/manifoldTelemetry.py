@@ -0,0 +1,121 @@
+import argparse
+import random
+import socket
+import struct
+import time
+import zlib
+
+# Sends and receives manifold data packets (see src/heatingControl/ManifoldTelemetry.h).
+# Both work on one computer, so the format can be tested without any hardware:
+#
+#   manifoldTelemetry.py listen
+#   manifoldTelemetry.py send --name "Living Room" --rate 10
+#
+# "send" simulates a manifold; "listen" shows what the heating controller would receive.
+
+GROUP = "239.255.77.77"
+PORT = 4277
+MAGIC = 0x3144464D
+VERSION = 1
+FLAG_ON = 0x01
+
+HEADER = struct.Struct("<IBBHIII6fBB")     # ManifoldPacketHeader
+FIELDS = ["roomSetpoint", "roomTemperature", "flowSetpoint", "flowTemperature", "valvePosition", "flowDemand"]
+
+def encode(bootId, sequence, name, hostname, ipAddress, on, values):
+    name = name.encode()[:63]
+    hostname = hostname.encode()[:63]
+    length = HEADER.size + len(name) + len(hostname) + 4
+    header = HEADER.pack(MAGIC, VERSION, FLAG_ON if on else 0, length, bootId, sequence,
+                         struct.unpack("<I", socket.inet_aton(ipAddress))[0],
+                         *[values[f] for f in FIELDS], len(name), len(hostname))
+    packet = header + name + hostname
+    return packet + struct.pack("<I", zlib.crc32(packet))
+
+# Returns a dict, or raises ValueError
+def decode(packet):
+    if len(packet) < HEADER.size + 4:
+        raise ValueError("too short")
+    magic, version, flags, length, bootId, sequence, ip, *rest = HEADER.unpack_from(packet)
+    values = dict(zip(FIELDS, rest[:6]))
+    nameLength, hostnameLength = rest[6:]
+    if magic != MAGIC:
+        raise ValueError("wrong magic number")
+    if version != VERSION:
+        raise ValueError(f"unsupported version {version}")
+    if length != len(packet) or HEADER.size + nameLength + hostnameLength + 4 != len(packet):
+        raise ValueError("wrong length")
+    crc, = struct.unpack_from("<I", packet, len(packet) - 4)
+    if zlib.crc32(packet[:-4]) != crc:
+        raise ValueError("wrong CRC")
+    names = packet[HEADER.size:-4]
+    return dict(
+        bootId=bootId, sequence=sequence, on=bool(flags & FLAG_ON),
+        name=names[:nameLength].decode("utf-8", "replace"),
+        hostname=names[nameLength:].decode("utf-8", "replace"),
+        ipAddress=socket.inet_ntoa(struct.pack("<I", ip)),
+        **values)
+
+def listen(args):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", args.port))
+    membership = socket.inet_aton(args.group) + socket.inet_aton(args.interface)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, membership)
+
+    senders = {}
+    while True:
+        packet, (address, _) = sock.recvfrom(1500)
+        try:
+            d = decode(packet)
+        except ValueError as e:
+            print(f"{address}: invalid packet: {e}")
+            continue
+        last = senders.get(d["name"])
+        if last and last[0] == d["bootId"] and not 0 < (d["sequence"] - last[1]) & 0xFFFFFFFF < 0x80000000:
+            print(f"{address}: {d['name']}: out of order packet {d['sequence']} (last {last[1]})")
+            continue
+        lost = d["sequence"] - last[1] - 1 if last and last[0] == d["bootId"] else 0
+        senders[d["name"]] = (d["bootId"], d["sequence"])
+        print(f"{address}: {d['name']} #{d['sequence']}{f' ({lost} lost)' if lost else ''}: "
+              f"{'on' if d['on'] else 'off'}, room {d['roomTemperature']:.1f}/{d['roomSetpoint']:.1f}, "
+              f"flow {d['flowTemperature']:.1f}/{d['flowSetpoint']:.1f}, valve {d['valvePosition']:.0f}%, "
+              f"demand {d['flowDemand']:.1f}")
+
+def send(args):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 1)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton(args.interface))
+    bootId = random.getrandbits(32) | 1
+    values = dict(roomSetpoint=20.0, roomTemperature=19.5, flowSetpoint=32.0,
+                  flowTemperature=30.0, valvePosition=50.0, flowDemand=32.0)
+    sequence = 0
+    while args.count == 0 or sequence < args.count:
+        values["roomTemperature"] += random.uniform(-0.05, 0.05)
+        values["flowTemperature"] += random.uniform(-0.2, 0.2)
+        packet = encode(bootId, sequence, args.name, args.name.replace(" ", "-").lower() + ".local",
+                        "127.0.0.1", True, values)
+        sock.sendto(packet, (args.group, args.port))
+        sequence += 1
+        time.sleep(1 / args.rate)
+
+def main():
+    parser = argparse.ArgumentParser(description="Send or receive manifold data by UDP multicast")
+    parser.add_argument("--group", default=GROUP)
+    parser.add_argument("--port", type=int, default=PORT)
+    parser.add_argument("--interface", default="0.0.0.0", help="address of the network interface to use")
+    commands = parser.add_subparsers(dest="command", required=True)
+    commands.add_parser("listen", help="show the packets received")
+    s = commands.add_parser("send", help="send packets for a simulated manifold")
+    s.add_argument("--name", default="Test Manifold")
+    s.add_argument("--rate", type=float, default=1.0, help="packets per second")
+    s.add_argument("--count", type=int, default=0, help="number of packets (default: until stopped)")
+    args = parser.parse_args()
+
+    try:
+        listen(args) if args.command == "listen" else send(args)
+    except KeyboardInterrupt:
+        pass
+
+if __name__ == "__main__":
+    main()
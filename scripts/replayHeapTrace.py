@@ -0,0 +1,149 @@
+import argparse
+import collections
+import struct
+import sys
+
+# Replays an allocation trace downloaded from /memory/trace.bin (see src/tools/MemDebug.h)
+# and reports, by tag, the memory in use and its peak, the blocks still in use at the end
+# (or at a given time) and the holes between them.
+#
+# Only allocations made while the trace was recording are known. Blocks allocated earlier
+# show up as frees of unknown blocks, and the holes between the known blocks may be
+# occupied by older ones, so the hole histogram is an upper bound.
+#
+# Usage: replayHeapTrace.py <trace.bin> [--at SECONDS] [--leaks SECONDS]
+
+HEADER = struct.Struct("<IHHIIB3x")     # MemTraceHeader
+RECORD = struct.Struct("<IIIBBBx")      # MemTraceRecord
+MAGIC = 0x31525448
+TAG_NAME_SIZE = 8
+OP_ALLOC = 1
+OP_FREE = 2
+
+MAX_HOLE = 64 * 1024    # Larger gaps between known blocks are not considered holes
+
+def readTrace(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    magic, version, recordSize, count, dropped, tagCount = HEADER.unpack_from(data, 0)
+    if magic != MAGIC:
+        raise ValueError(f"{path} is not a heap trace")
+    if recordSize != RECORD.size:
+        raise ValueError(f"{path}: unsupported record size {recordSize}")
+    position = HEADER.size
+    tags = []
+    for i in range(tagCount):
+        tags.append(data[position:position + TAG_NAME_SIZE].rstrip(b"\0").decode())
+        position += TAG_NAME_SIZE
+
+    records = []
+    lastMicros = None
+    offset = 0
+    for i in range(count):
+        if position + RECORD.size > len(data):
+            print(f"Warning: trace truncated after {i} records", file=sys.stderr)
+            break
+        micros, address, size, op, tag, core = RECORD.unpack_from(data, position)
+        position += RECORD.size
+        if lastMicros is not None and micros < lastMicros and lastMicros - micros > 0x80000000:
+            offset += 1 << 32      # The 32 bit microsecond counter wrapped
+        lastMicros = micros
+        records.append((micros + offset, address, size, op, tag, core))
+    return tags, records, dropped
+
+def sizeClass(size):
+    limit = 16
+    while size > limit:
+        limit *= 2
+    return limit
+
+def formatTable(header, rows):
+    widths = [max(len(str(r[i])) for r in [header] + rows) for i in range(len(header))]
+    lines = [" | ".join(str(h).rjust(w) for h, w in zip(header, widths))]
+    lines.append("-+-".join("-" * w for w in widths))
+    for r in rows:
+        lines.append(" | ".join(str(c).rjust(w) for c, w in zip(r, widths)))
+    return "\n".join(lines)
+
+def replay(tags, records, untilMicros):
+    live = {}
+    allocations = collections.Counter()
+    frees = collections.Counter()
+    unknownFrees = 0
+    inUse = collections.Counter()
+    peak = collections.Counter()
+    for micros, address, size, op, tag, core in records:
+        if micros > untilMicros:
+            break
+        if op == OP_ALLOC:
+            if address in live:                 # The free was not recorded (interrupt, cache off)
+                oldSize, oldTag, _ = live[address]
+                inUse[oldTag] -= oldSize
+            live[address] = (size, tag, micros)
+            allocations[tag] += 1
+            inUse[tag] += size
+            peak[tag] = max(peak[tag], inUse[tag])
+        elif op == OP_FREE:
+            block = live.pop(address, None)
+            if block is None:
+                unknownFrees += 1
+                continue
+            frees[block[1]] += 1
+            inUse[block[1]] -= block[0]
+    return live, allocations, frees, unknownFrees, inUse, peak
+
+def holes(live):
+    result = collections.Counter()
+    blocks = sorted((address, size) for address, (size, _, _) in live.items())
+    for (a, sa), (b, _) in zip(blocks, blocks[1:]):
+        gap = b - (a + sa)
+        if 0 < gap <= MAX_HOLE:
+            result[sizeClass(gap)] += 1
+    return result
+
+def main():
+    parser = argparse.ArgumentParser(description="Replay a heap trace from /memory/trace.bin")
+    parser.add_argument("trace")
+    parser.add_argument("--at", type=float, help="state this many seconds after the start of the trace (default: end)")
+    parser.add_argument("--leaks", type=float, metavar="SECONDS", help="list blocks in use for longer than this")
+    args = parser.parse_args()
+
+    tags, records, dropped = readTrace(args.trace)
+    if not records:
+        print("The trace is empty")
+        return
+    start = records[0][0]
+    until = start + args.at * 1e6 if args.at is not None else records[-1][0]
+    live, allocations, frees, unknownFrees, inUse, peak = replay(tags, records, until)
+
+    tagName = lambda t: tags[t] if t < len(tags) else str(t)
+    print(f"{len(records)} records over {(records[-1][0] - start) / 1e6:.1f} s, {dropped} dropped")
+    if dropped:
+        print("The buffer was full; everything after the last record is missing")
+    print(f"State at {(until - start) / 1e6:.1f} s; {unknownFrees} frees of blocks allocated before the trace")
+    print()
+
+    rows = []
+    for t in sorted(set(allocations) | set(frees)):
+        rows.append([tagName(t), allocations[t], frees[t], inUse[t], peak[t]])
+    print(formatTable(["tag", "allocations", "frees", "bytes in use", "peak bytes"], rows))
+    print()
+
+    bySize = collections.Counter()
+    for size, _, _ in live.values():
+        bySize[sizeClass(size)] += 1
+    holeCounts = holes(live)
+    rows = [[f"<= {c}", bySize[c], holeCounts[c]] for c in sorted(set(bySize) | set(holeCounts))]
+    print(formatTable(["size", "blocks in use", "holes"], rows))
+
+    if args.leaks is not None:
+        print()
+        old = collections.Counter()
+        for size, tag, micros in live.values():
+            if until - micros > args.leaks * 1e6:
+                old[(tagName(tag), size)] += 1
+        rows = [[tag, size, n, size * n] for (tag, size), n in sorted(old.items(), key=lambda i: -i[0][1] * i[1])]
+        print(formatTable(["tag", "block size", "blocks", "bytes"], rows))
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,319 @@
+import argparse
+import base64
+import http.client
+import json
+import os
+import random
+import re
+import socket
+import struct
+import sys
+import threading
+import time
+
+import manifoldTelemetry
+
+# Simulates a number of manifolds sending their data to a heating controller, to see how it
+# copes with 10, 50 or 200 of them:
+#
+#   simulateManifolds.py --host heating.local --count 50 --rate 1 --duration 120
+#   simulateManifolds.py --host heating.local --count 200 --multicast
+#   simulateManifolds.py --host heating.local --count 10 --post
+#
+# Each manifold runs the control of src/heatingControl/ValveManager.cpp (room PI controller
+# giving the flow setpoint, flow PI controller giving the valve position) against a simple
+# model of a room and its underfloor heating, and sends the data like the firmware does:
+# JSON messages on the WebSocket /demand/ws, or UDP multicast packets. With --post, the JSON
+# is posted to /demand instead (the controller closes the connection after every post).
+#
+# At the end it reports the updates sent per second, the latency of the posts, the updates
+# lost and, from /metrics of the controller before and after, the change in heap and in
+# the manifolds counted by the demand aggregator.
+
+SUPPLY_TEMPERATURE = 60.0       # From the boiler
+OUTSIDE_TEMPERATURE = 5.0
+
+# PidController without the derivative term, as configured by CValveManager::loadConfig()
+class PiController:
+    def __init__(self, gain, integralSeconds, minOutput, maxOutput, output):
+        self.gain = gain
+        self.integralGain = gain / integralSeconds if integralSeconds else 0
+        self.minOutput = minOutput
+        self.maxOutput = maxOutput
+        self.output = output
+        self.cumulativeError = None
+
+    def calculate(self, setpoint, value, dt):
+        error = setpoint - value
+        if self.cumulativeError is None:
+            # Start at the current output, as resetState() does
+            self.cumulativeError = (self.output - self.gain * error) / self.integralGain if self.integralGain else 0
+        self.cumulativeError += error * dt
+        if self.integralGain:
+            self.cumulativeError = min(max(self.cumulativeError, self.minOutput / self.integralGain),
+                                       self.maxOutput / self.integralGain)
+        output = self.gain * error + self.integralGain * self.cumulativeError
+        self.output = min(max(output, self.minOutput), self.maxOutput)
+        return self.output
+
+class Manifold:
+    def __init__(self, index, args):
+        self.name = f"Sim {index:03d}"
+        self.hostname = f"sim-{index:03d}.local"
+        self.ipAddress = f"10.77.{index // 250}.{index % 250 + 1}"
+        self.roomSetpoint = random.choice([19.0, 20.0, 21.0, 22.0])
+        self.roomTemperature = self.roomSetpoint + random.uniform(-2, 0.5)
+        self.flowTemperature = random.uniform(25, 35)
+        self.lossRate = random.uniform(0.5, 1.5)        # Per degree to outside
+        self.emitRate = random.uniform(1.0, 3.0)        # Per degree flow to room
+        self.roomCapacity = random.uniform(3000, 8000)  # Seconds per degree at rate 1
+        self.flowLag = random.uniform(60, 180)          # Seconds
+        self.roomController = PiController(args.room_gain, args.room_integral_minutes * 60,
+                                           args.flow_min, args.flow_max, self.flowTemperature)
+        self.flowController = PiController(args.flow_gain, args.flow_integral_seconds, 0, 100, 50)
+        self.flowSetpoint = self.flowTemperature
+        self.valvePosition = 50.0
+        self.bootId = random.getrandbits(32) | 1
+        self.sequence = 0
+
+    # Advance the model and the controllers by dt seconds
+    def step(self, dt):
+        self.flowSetpoint = self.roomController.calculate(self.roomSetpoint, self.roomTemperature, dt)
+        self.valvePosition = self.flowController.calculate(self.flowSetpoint, self.flowTemperature, dt)
+
+        returnTemperature = self.roomTemperature + (self.flowTemperature - self.roomTemperature) * 0.6
+        mixed = returnTemperature + self.valvePosition / 100 * (SUPPLY_TEMPERATURE - returnTemperature)
+        self.flowTemperature += (mixed - self.flowTemperature) * min(dt / self.flowLag, 1)
+        heat = self.emitRate * (self.flowTemperature - self.roomTemperature)
+        loss = self.lossRate * (self.roomTemperature - OUTSIDE_TEMPERATURE)
+        self.roomTemperature += (heat - loss) * dt / self.roomCapacity
+
+    def values(self):
+        return dict(roomSetpoint=self.roomSetpoint, roomTemperature=self.roomTemperature,
+                    flowSetpoint=self.flowSetpoint, flowTemperature=self.flowTemperature,
+                    valvePosition=self.valvePosition, flowDemand=self.flowSetpoint)
+
+    def toJson(self):
+        return json.dumps(dict(name=self.name, hostname=self.hostname, ipAddress=self.ipAddress,
+                               on=True, **self.values()))
+
+class Results:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.sent = 0
+        self.failed = 0
+        self.connects = 0
+        self.latencies = []
+
+    def add(self, latency=None, failed=False, connected=False):
+        with self.lock:
+            self.sent += 1
+            if failed: self.failed += 1
+            if connected: self.connects += 1
+            if latency is not None: self.latencies.append(latency)
+
+# Minimal WebSocket client (RFC 6455): sends text frames, reads nothing after the handshake
+class WebSocket:
+    def __init__(self, host, port, path, timeout):
+        self.sock = socket.create_connection((host, port), timeout=timeout)
+        key = base64.b64encode(os.urandom(16)).decode()
+        self.sock.sendall((f"GET {path} HTTP/1.1\r\nHost: {host}\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                           f"Sec-WebSocket-Key: {key}\r\nSec-WebSocket-Version: 13\r\n\r\n").encode())
+        response = b""
+        while b"\r\n\r\n" not in response:
+            data = self.sock.recv(1024)
+            if not data: raise OSError("connection closed in the handshake")
+            response += data
+        if not response.startswith(b"HTTP/1.1 101"):
+            self.sock.close()
+            raise OSError("not a WebSocket: " + response.split(b"\r\n")[0].decode("utf-8", "replace"))
+
+    def sendText(self, text):
+        payload = text.encode()
+        header = bytes([0x81])      # Final text frame
+        if len(payload) < 126: header += bytes([0x80 | len(payload)])
+        else: header += bytes([0x80 | 126]) + struct.pack(">H", len(payload))
+        mask = os.urandom(4)
+        self.sock.sendall(header + mask + bytes(b ^ mask[i % 4] for i, b in enumerate(payload)))
+
+    def close(self):
+        self.sock.close()
+
+# Sends like ManifoldDataPostJob: one WebSocket per manifold, opened again if it fails
+def runWebSocket(manifold, args, results, stop):
+    ws = None
+    interval = 1 / args.rate
+    nextTime = time.monotonic() + random.uniform(0, interval)
+    while not stop.is_set():
+        time.sleep(max(nextTime - time.monotonic(), 0))
+        nextTime += interval
+        manifold.step(interval * args.speed)
+        body = manifold.toJson()
+
+        start = time.monotonic()
+        latency = None
+        connected = False
+        try:
+            if ws is None:
+                ws = WebSocket(args.host, args.port, "/demand/ws", args.timeout)
+                connected = True
+            ws.sendText(body)
+            latency = time.monotonic() - start
+        except OSError:
+            if ws: ws.close()
+            ws = None
+        results.add(latency, failed=latency is None, connected=connected)
+    if ws: ws.close()
+
+# Posts to /demand: one connection per manifold, reconnect once if it was closed
+def runHttp(manifold, args, results, stop):
+    connection = None
+    interval = 1 / args.rate
+    nextTime = time.monotonic() + random.uniform(0, interval)
+    while not stop.is_set():
+        time.sleep(max(nextTime - time.monotonic(), 0))
+        nextTime += interval
+        manifold.step(interval * args.speed)
+        body = manifold.toJson()
+
+        start = time.monotonic()
+        latency = None
+        connected = False
+        for attempt in range(2):
+            try:
+                if connection is None:
+                    connection = http.client.HTTPConnection(args.host, args.port, timeout=args.timeout)
+                    connection.connect()
+                    connected = True
+                connection.request("POST", "/demand", body, {"Content-Type": "application/json"})
+                response = connection.getresponse()
+                response.read()
+                if response.status == 200: latency = time.monotonic() - start
+                if response.getheader("Connection", "").lower() == "close":
+                    connection.close()
+                    connection = None
+                break
+            except (OSError, http.client.HTTPException):
+                if connection: connection.close()
+                connection = None
+                if connected: break     # Only retry on a connection that was reused
+        results.add(latency, failed=latency is None, connected=connected)
+
+def runMulticast(manifold, args, results, stop, sock):
+    interval = 1 / args.rate
+    nextTime = time.monotonic() + random.uniform(0, interval)
+    while not stop.is_set():
+        time.sleep(max(nextTime - time.monotonic(), 0))
+        nextTime += interval
+        manifold.step(interval * args.speed)
+        packet = manifoldTelemetry.encode(manifold.bootId, manifold.sequence, manifold.name,
+                                          manifold.hostname, manifold.ipAddress, True, manifold.values())
+        manifold.sequence += 1
+        try:
+            sock.sendto(packet, (manifoldTelemetry.GROUP, manifoldTelemetry.PORT))
+            results.add()
+        except OSError:
+            results.add(failed=True)
+
+# Values from /metrics of the controller as {"name{labels}": value}, or None
+def readMetrics(args):
+    try:
+        connection = http.client.HTTPConnection(args.host, args.port, timeout=5)
+        connection.request("GET", "/metrics")
+        response = connection.getresponse()
+        text = response.read().decode("utf-8", "replace")
+        if response.status != 200: return None
+    except (OSError, http.client.HTTPException):
+        return None
+    metrics = {}
+    for line in text.splitlines():
+        m = re.match(r"^([a-zA-Z_:][\w:]*(?:\{[^}]*\})?)\s+(\S+)$", line)
+        if m: metrics[m.group(1)] = float(m.group(2))
+    return metrics
+
+def percentile(values, p):
+    if not values: return float("nan")
+    return values[min(int(len(values) * p / 100), len(values) - 1)]
+
+def report(args, results, elapsed, before, after):
+    print(f"{args.count} manifolds, {elapsed:.0f} s, {'multicast' if args.multicast else 'HTTP' if args.post else 'WebSocket'}")
+    print(f"  updates sent: {results.sent} ({results.sent / elapsed:.1f}/s), failed: {results.failed}")
+    if not args.multicast:
+        latencies = sorted(results.latencies)
+        print(f"  connections opened: {results.connects}")
+        print("  latency ms: " + ", ".join(
+            f"p{p} {percentile(latencies, p) * 1000:.1f}" for p in (50, 90, 99)) +
+            f", max {latencies[-1] * 1000 if latencies else float('nan'):.1f}")
+
+    if before is None or after is None:
+        print("  /metrics of the controller not available")
+        return
+    def delta(name): return after.get(name, 0) - before.get(name, 0)
+    if args.multicast:
+        packets = lambda result: delta('manifold_telemetry_packets_total{result="%s"}' % result)
+        accepted = packets("accepted")
+        print(f"  packets accepted by the controller: {accepted:.0f}, lost: {results.sent - results.failed - accepted:.0f}")
+        print(f"  invalid: {packets('invalid'):.0f}, out of order: {packets('out_of_order'):.0f}")
+    manifolds = lambda state: after.get('demand_manifolds{state="%s"}' % state, 0)
+    print(f"  manifolds counted: {manifolds('current'):.0f} current, {manifolds('aged'):.0f} aged")
+    print(f"  heap free: {before.get('heap_free_bytes', 0):.0f} -> {after.get('heap_free_bytes', 0):.0f} bytes, "
+          f"largest block {before.get('heap_largest_free_block_bytes', 0):.0f} -> "
+          f"{after.get('heap_largest_free_block_bytes', 0):.0f}")
+    for name in sorted(after):
+        m = re.match(r'^heap_allocated_bytes_total\{tag="(\w+)"\}$', name)
+        if m and delta(name):
+            print(f"  allocated by {m.group(1)}: {delta(name) / elapsed:.0f} bytes/s")
+
+def main():
+    parser = argparse.ArgumentParser(description="Simulate manifolds sending data to a heating controller")
+    parser.add_argument("--host", required=True, help="heating controller (also used for /metrics)")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--count", type=int, default=10, help="number of manifolds")
+    parser.add_argument("--rate", type=float, default=1.0, help="updates per second per manifold")
+    parser.add_argument("--duration", type=float, default=60, help="seconds")
+    parser.add_argument("--speed", type=float, default=1.0, help="simulated seconds per second")
+    parser.add_argument("--timeout", type=float, default=1.0, help="seconds to wait for a response")
+    parser.add_argument("--multicast", action="store_true", help="send UDP multicast packets instead of WebSocket messages")
+    parser.add_argument("--post", action="store_true", help="post to /demand instead of sending WebSocket messages")
+    parser.add_argument("--interface", default="0.0.0.0", help="address of the network interface for multicast")
+    parser.add_argument("--flow-min", type=float, default=25.0)
+    parser.add_argument("--flow-max", type=float, default=50.0)
+    parser.add_argument("--room-gain", type=float, default=10.0)
+    parser.add_argument("--room-integral-minutes", type=float, default=30.0)
+    parser.add_argument("--flow-gain", type=float, default=4.0)
+    parser.add_argument("--flow-integral-seconds", type=float, default=60.0)
+    args = parser.parse_args()
+
+    manifolds = [Manifold(i, args) for i in range(args.count)]
+    results = Results()
+    stop = threading.Event()
+    before = readMetrics(args)
+
+    sock = None
+    if args.multicast:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 1)
+        sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton(args.interface))
+    threads = [
+        threading.Thread(target=runMulticast, args=(m, args, results, stop, sock), daemon=True) if args.multicast
+        else threading.Thread(target=runHttp, args=(m, args, results, stop), daemon=True) if args.post
+        else threading.Thread(target=runWebSocket, args=(m, args, results, stop), daemon=True)
+        for m in manifolds
+    ]
+
+    start = time.monotonic()
+    for t in threads: t.start()
+    try:
+        while time.monotonic() - start < args.duration:
+            time.sleep(0.5)
+    except KeyboardInterrupt:
+        pass
+    stop.set()
+    for t in threads: t.join(args.timeout * 2 + 1)
+    elapsed = time.monotonic() - start
+
+    time.sleep(1)   # Let the controller count the last packets
+    report(args, results, elapsed, before, readMetrics(args))
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,285 @@
+#include "LogMaintenance.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "GzipWriter.h"
+#include "LogStorage.h"
+#include "MyLog.h"
+#include "MyRtc.h"
+#include "SensorHistory.h"
+#include "SensorLogBinary.h"
+#include "SensorLogWriter.h"
+
+#define ARCHIVE_DIRECTORY "/archive"
+
+// Writes to an open file, locking the SD card for each write
+class LockedFilePrint : public Print {
+  private:
+    FsFile& m_file;
+    SdAccessLock* m_mutex;
+
+  public:
+    LockedFilePrint(FsFile& file, SdAccessLock* mutex) : m_file(file), m_mutex(mutex) {}
+    size_t write(uint8_t c) override { return this->write(&c, 1); }
+    size_t write(const uint8_t* buffer, size_t size) override
+    {
+        if (!this->m_mutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_BACKGROUND)) return 0;
+        size_t result = this->m_file.write(buffer, size);
+        this->m_mutex->unlock();
+        return result;
+    }
+};
+
+// Day of the last "yyyy-mm-dd" in a file name, -1 if there is none
+static long dayFromFileName(const char* name)
+{
+    long result = -1;
+    for (const char* p = name; strlen(p) >= 10; p++) {
+        int year, month, day;
+        if (isdigit(p[0]) && p[4] == '-' && p[7] == '-' && sscanf(p, "%4d-%2d-%2d", &year, &month, &day) == 3) {
+            result = daysFromCivil(year, month, day);
+        }
+    }
+    return result;
+}
+
+static void formatDay(char* buffer, size_t size, long day)
+{
+    time_t t = (time_t)day * 86400;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    snprintf(buffer, size, "%04d-%02d-%02d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+}
+
+void CLogMaintenance::setup(SdFs* sd, SdAccessLock* sdMutex)
+{
+    this->m_sd = sd;
+    this->m_sdMutex = sdMutex;
+    if (this->m_task) return;
+    BaseType_t ok = xTaskCreate(
+        staticMaintenanceTask,
+        "LogMaintenance",
+        4096,
+        this,   // argument passed to task
+        0,      // only runs when nothing else does
+        &this->m_task
+    );
+    if (ok != pdPASS) this->m_task = nullptr;
+}
+
+void CLogMaintenance::staticMaintenanceTask(void* arg)
+{
+    static_cast<CLogMaintenance*>(arg)->maintenanceTask();
+}
+
+void CLogMaintenance::maintenanceTask()
+{
+    for (;;) {
+        MyRtcTime now = MyRtc.getTime();
+        if (now.isValid()) {
+            long today = now.getUnixTime() / 86400;
+            if (this->m_day < 0) {
+                // After a restart, only catch up with what is independent of the text logs
+                this->m_day = today;
+                this->archiveSensorLogs(today);
+                this->migrateFlashLogs();
+                this->compressArchive();
+                this->enforceRetention(today);
+            }
+            else if (today != this->m_day) {
+                this->rotateTextLogs(this->m_day);
+                this->m_day = today;
+                this->archiveSensorLogs(today);
+                this->migrateFlashLogs();
+                this->compressArchive();
+                this->enforceRetention(today);
+            }
+        }
+        vTaskDelay(pdMS_TO_TICKS(60 * 1000));
+    }
+}
+
+// Move the text logs into the archive with the day they are for in their name. Logs on
+// the flash tier are detached here and copied to the card by migrateFlashLogs().
+void CLogMaintenance::rotateTextLogs(long day)
+{
+    char date[12];
+    formatDay(date, sizeof(date), day);
+
+    for (int i = 0; i < this->m_textLogCount; i++) {
+        const char* fileName = this->m_textLogs[i];
+        const char* extension = strrchr(fileName, '.');
+        int baseLength = extension ? extension - fileName : strlen(fileName);
+        char name[80];
+        snprintf(name, sizeof(name), "%.*s %s%s", baseLength, fileName, date, extension ? extension : "");
+        bool onFlash = LogStorage.detach(fileName, name);
+
+        // Anything on the card was written while flash was not available
+        char archiveName[96];
+        if (onFlash) {
+            snprintf(archiveName, sizeof(archiveName), ARCHIVE_DIRECTORY "/%.*s %s.sd%s", baseLength, fileName, date, extension ? extension : "");
+        }
+        else {
+            snprintf(archiveName, sizeof(archiveName), ARCHIVE_DIRECTORY "/%s", name);
+        }
+
+        char path[72];
+        snprintf(path, sizeof(path), "/%s", fileName);
+        if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_BACKGROUND)) return;
+        this->m_sd->mkdir(ARCHIVE_DIRECTORY);
+        FsFile f = this->m_sd->open(path, O_RDONLY);
+        bool hasContent = f.isOpen() && f.size() > 0;
+        f.close();
+        bool moved = hasContent && !this->m_sd->exists(archiveName) && this->m_sd->rename(path, archiveName);
+        this->m_sdMutex->unlock();
+        if (moved) MyLog.printf("Moved %s to %s\n", fileName, archiveName);
+    }
+}
+
+// Move sensor logs that are no longer kept uncompressed into the archive
+void CLogMaintenance::archiveSensorLogs(long today)
+{
+    std::vector<String> names;
+    this->listDirectory("/", names);
+    for (const String& name : names) {
+        if (!name.startsWith("Sensor Values ")) continue;
+        long day = dayFromFileName(name.c_str());
+        if (day < 0 || day > today - KEEP_SENSOR_LOG_DAYS) continue;
+
+        String path = "/" + name;
+        String archiveName = ARCHIVE_DIRECTORY "/" + name;
+        SensorLogWriter.release(path.c_str());
+        SensorBinaryLog.release(path.c_str());
+        if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_BACKGROUND)) return;
+        this->m_sd->mkdir(ARCHIVE_DIRECTORY);
+        if (this->m_sd->exists(archiveName)) this->m_sd->remove(archiveName.c_str());
+        this->m_sd->rename(path.c_str(), archiveName.c_str());
+        this->m_sdMutex->unlock();
+    }
+}
+
+// Copy the text logs detached from the flash tier into the archive
+void CLogMaintenance::migrateFlashLogs()
+{
+    if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_BACKGROUND)) return;
+    this->m_sd->mkdir(ARCHIVE_DIRECTORY);
+    this->m_sdMutex->unlock();
+    LogStorage.migrate(ARCHIVE_DIRECTORY);
+}
+
+// Compress everything in the archive that is not compressed yet
+void CLogMaintenance::compressArchive()
+{
+    std::vector<String> names;
+    this->listDirectory(ARCHIVE_DIRECTORY, names);
+    for (const String& name : names) {
+        if (name.endsWith(".gz")) continue;
+        String path = ARCHIVE_DIRECTORY "/" + name;
+        this->compressFile(path.c_str());
+    }
+}
+
+// Compress fileName to fileName.gz and delete it
+bool CLogMaintenance::compressFile(const char* fileName)
+{
+    String gzName = String(fileName) + ".gz";
+    if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_BACKGROUND)) return false;
+    FsFile in = this->m_sd->open(fileName, O_RDONLY);
+    FsFile out = this->m_sd->open(gzName, O_WRONLY | O_CREAT | O_TRUNC);
+    uint64_t inSize = in.isOpen() ? in.size() : 0;
+    this->m_sdMutex->unlock();
+
+    bool result = in.isOpen() && out.isOpen();
+    if (result) {
+        LockedFilePrint outPrint(out, this->m_sdMutex);
+        GzipWriter* gz = new GzipWriter(outPrint, MyRtc.getTime().getUnixTime());
+        uint8_t buffer[512];
+        for (;;) {
+            if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_BACKGROUND)) {
+                result = false;
+                break;
+            }
+            int n = in.read(buffer, sizeof(buffer));
+            this->m_sdMutex->unlock();
+            if (n < 0) result = false;
+            if (n <= 0) break;
+            result &= gz->write(buffer, n);
+        }
+        result &= gz->finish();
+        delete gz;
+    }
+
+    if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_BACKGROUND)) return false;
+    uint64_t outSize = out.isOpen() ? out.size() : 0;
+    in.close();
+    out.close();
+    if (result) this->m_sd->remove(fileName);
+    else this->m_sd->remove(gzName.c_str());
+    this->m_sdMutex->unlock();
+
+    if (result) {
+        MyLog.printf("Compressed %s from %llukB to %llukB\n", fileName, inSize / 1024, outSize / 1024);
+    }
+    else {
+        MyLog.printf("Compressing %s failed\n", fileName);
+    }
+    return result;
+}
+
+// Delete archive files that are too old, then the oldest ones until the archive is small enough
+void CLogMaintenance::enforceRetention(long today)
+{
+    std::vector<String> names;
+    std::vector<uint64_t> sizes;
+    this->listDirectory(ARCHIVE_DIRECTORY, names, &sizes);
+
+    struct ArchiveFile {
+        String path;
+        uint64_t size;
+        long day;
+    };
+    std::vector<ArchiveFile> files;
+    uint64_t total = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+        ArchiveFile f = {ARCHIVE_DIRECTORY "/" + names[i], sizes[i], dayFromFileName(names[i].c_str())};
+        files.push_back(f);
+        total += sizes[i];
+    }
+    std::sort(files.begin(), files.end(), [](const ArchiveFile& a, const ArchiveFile& b) { return a.day < b.day; });
+
+    int deleted = 0;
+    for (const ArchiveFile& f : files) {
+        if (f.day >= today - MAX_ARCHIVE_DAYS && total <= MAX_ARCHIVE_BYTES) break;
+        if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_BACKGROUND)) return;
+        bool removed = this->m_sd->remove(f.path.c_str());
+        this->m_sdMutex->unlock();
+        if (removed) {
+            total -= f.size;
+            deleted++;
+        }
+    }
+    if (deleted > 0) MyLog.printf("Deleted %d old archive files\n", deleted);
+}
+
+void CLogMaintenance::listDirectory(const char* path, std::vector<String>& names, std::vector<uint64_t>* sizes /* = nullptr */)
+{
+    if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_BACKGROUND)) return;
+    FsFile dir = this->m_sd->open(path, O_RDONLY);
+    if (dir.isOpen() && dir.isDir()) {
+        FsFile file;
+        char name[64];
+        while (file.openNext(&dir, O_RDONLY)) {
+            if (!file.isDir() && !file.isHidden()) {
+                file.getName(name, sizeof(name));
+                names.push_back(name);
+                if (sizes) sizes->push_back(file.size());
+            }
+            file.close();
+        }
+    }
+    dir.close();
+    this->m_sdMutex->unlock();
+}
+
+CLogMaintenance LogMaintenance;
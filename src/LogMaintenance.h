@@ -0,0 +1,62 @@
+#ifndef __LOG_MAINTENANCE_H
+#define __LOG_MAINTENANCE_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+
+#include <vector>
+
+#include "SdAccessLock.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Daily maintenance of the log files on the SD card, in a low priority task
+//
+// At midnight (UTC, like the sensor log file names) the text logs are moved to
+// /archive/<name> yyyy-mm-dd.txt and compressed to .gz; logs on the flash tier (see
+// LogStorage.h) are migrated to the card on the way. The logs are simply recreated by the
+// next write. Sensor logs are moved and compressed once they are KEEP_SENSOR_LOG_DAYS
+// old; until then they stay where the history queries and downloads find them. Finally
+// archive files older than MAX_ARCHIVE_DAYS are deleted, and the oldest ones beyond
+// MAX_ARCHIVE_BYTES.
+//
+// The SD card is locked for each read and write only, so the other users of the card
+// wait at most for one block while a file is being compressed. Files left uncompressed
+// in /archive by a restart are compressed on the next run.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+class CLogMaintenance {
+  public:
+    static const int KEEP_SENSOR_LOG_DAYS = 7;
+    static const int MAX_ARCHIVE_DAYS = 365;
+    static const uint64_t MAX_ARCHIVE_BYTES = 1024ULL * 1024 * 1024;
+    static const int MAX_TEXT_LOGS = 4;
+
+  private:
+    SdFs* m_sd = nullptr;
+    SdAccessLock* m_sdMutex = nullptr;
+    TaskHandle_t m_task = nullptr;
+    const char* m_textLogs[MAX_TEXT_LOGS];
+    int m_textLogCount = 0;
+    long m_day = -1;                // Day the text logs are being written for
+
+  public:
+    void setup(SdFs* sd, SdAccessLock* sdMutex);
+    void addTextLog(const char* fileName) { if (this->m_textLogCount < MAX_TEXT_LOGS) this->m_textLogs[this->m_textLogCount++] = fileName; }
+
+  private:
+    static void staticMaintenanceTask(void* arg);
+    void maintenanceTask();
+    void rotateTextLogs(long day);
+    void archiveSensorLogs(long today);
+    void migrateFlashLogs();
+    void compressArchive();
+    bool compressFile(const char* fileName);
+    void enforceRetention(long today);
+    void listDirectory(const char* path, std::vector<String>& names, std::vector<uint64_t>* sizes = nullptr);
+};
+
+extern CLogMaintenance LogMaintenance;
+
+#endif
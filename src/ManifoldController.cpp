@@ -5,10 +5,13 @@
 #include "Arduino.h"
 #include "EspTools.h"
 #include "LedBlink.h"
+#include "MdnsDiscovery.h"
 #include "MemDebug.h"
+#include "Metrics.h"
 #include "MyConfig.h"
 #include "MyLog.h"  // Logging to serial and, if available, SD card
 #include "MyMutex.h"
+#include "SdAccessLock.h"
 #include "MyRtc.h"   // Real time clock
 #include "MyWiFi.h"  // WiFi access
 #include "NeohubManager.h"
@@ -19,7 +22,15 @@
 #include "webserver/MyWebServer.h"  // Request handing and web page generator
 #include "sensorLog.h"
 #include "ManifoldManager.h"
+#include "ManifoldTelemetry.h"
 #include "BackgroundFileWriter.h"
+#include "BoilerDemand.h"
+#include "EventLog.h"
+#include "LogMaintenance.h"
+#include "LogStorage.h"
+#include "RecentHistory.h"
+#include "SensorLogBinary.h"
+#include "SensorLogWriter.h"
 
 // Pin Assignments - digital pins --------------------------------
 const uint8_t openThermInPin = A0;  // Repurposed analog pins for OpenTherm module I/O
@@ -44,7 +55,7 @@ const uint8_t sdCardCsPin = D10;  // SD card chip select
 
 // SD Card access
 SdFs sd;
-MyMutex sdCardMutex("::sdCardMutex");
+SdAccessLock sdCardMutex("::sdCardMutex");
 #define SD_CONFIG SdSpiConfig(sdCardCsPin, SD_SCK_MHZ(50))
 
 // The valve position (preserved across resets)
@@ -102,22 +113,36 @@ void setup()
         sd.initErrorHalt(&Serial);
     }
     MyLog.println("done.");
-    BackgroundFileWriter.setup(&sd, &sdCardMutex);
+    LogStorage.setup(&sd, &sdCardMutex);
+    BackgroundFileWriter.setup();
+    SensorLogWriter.setup(&sd, &sdCardMutex);
+    SensorBinaryLog.setup(&sd, &sdCardMutex);
     MyLog.enableSdCardLog("log.txt");
     MyWebLog.enableSdCardLog("weblog.txt");
     MyCrashLog.enableSdCardLog("crashlog.txt");
+    EventLog.setup();
+    LogMaintenance.addTextLog("log.txt");
+    LogMaintenance.addTextLog("weblog.txt");
+    LogMaintenance.addTextLog("crashlog.txt");
+    LogMaintenance.setup(&sd, &sdCardMutex);
 
     MyLog.println("-------------------------------------------------------------------------------------------");
     Config.loadFromSdCard(sd, sdCardMutex, "config.json");
     SensorMap.clearChanged();
 
+    // Before any manifold data can arrive
+    ManifoldManager.setDemandWeights(Config.getDemandWeights());
+    BoilerDemand.setup();
+
     MyLog.printlnSdOnly("-------------------------------------------------------------------------------------------");
 
     // Connect to WiFi and initialise clock
     MyWiFi.connect();
     if (Config.getHostname() != "") {
         MyWiFi.setHostname(Config.getHostname());
+        ManifoldManager.advertise();
     }
+    ManifoldTelemetry.listen();     // Manifolds sending by multicast
     MyWiFi.updateRtcFromTimeServer(&MyRtc);
 
     // Deal with resets and crashes
@@ -159,6 +184,7 @@ void setup()
         MyLog.printf("Initialising valve position to %.0f%%\n", lastKownValvePosition);
         ValveManager.setValvePosition(lastKownValvePosition);
     }
+    RecentHistory.setup();
     MyWebServer.setup(&sd, &sdCardMutex);
     ledBlinkSetup();
 
@@ -176,6 +202,7 @@ void loop()
     const unsigned long memoryCheckInterval = 10000;        // Check for possible memory leaks
     const unsigned long blinkInterval = 100;                // Blink so we can see the loop is running
     const unsigned long otaCheckInterval = 1000;            // Over-The-Air updates
+    const unsigned long discoveryInterval = CMdnsDiscovery::BROWSE_TTL_MS;  // Manifolds on the network (controller only)
 
     // When we last did that
     static unsigned long lastTimeSync = 0;
@@ -184,6 +211,7 @@ void loop()
     static unsigned long lastMemoryCheck = 0;
     static unsigned long lastBlink = 0;
     static unsigned long lastOtaCheck = 0;
+    static unsigned long lastDiscovery = 0;
     static bool first = true;
 
     // Do stuff
@@ -208,11 +236,13 @@ void loop()
         if (dayChanged()) {
             logSensorIssues();
         }
+        MyWebServer.cleanupClients();
     }
 
     if (first || timeNow - lastMemoryCheck >= memoryCheckInterval) {
         lastMemoryCheck = timeNow;
         checkMemoryChange(4096);  // Report if we have lost more than 4kB since last check
+        MemDebug.sample();
     }
 
     if (first || timeNow - lastOtaCheck >= otaCheckInterval) {
@@ -220,6 +250,11 @@ void loop()
         ArduinoOTA.handle();
     }
 
+    if (Config.getActAsHeatingController() && (first || timeNow - lastDiscovery >= discoveryInterval)) {
+        lastDiscovery = timeNow;
+        ManifoldManager.discover();
+    }
+
     if (first || timeNow - lastBlink >= blinkInterval) {
         lastBlink = timeNow;
         ledBlinkLoop();
@@ -248,10 +283,12 @@ bool dayChanged()
 
 void readSensors()
 {
+    uint32_t startMicros = micros();
     UBaseType_t prio = uxTaskPriorityGet(NULL);
     vTaskPrioritySet(NULL, 3);
     OneWireManager.readAllSensors();
     vTaskPrioritySet(NULL, prio);
+    Metrics.sensorReadTime.observe(micros() - startMicros);
 }
 
 TaskHandle_t valveControlTaskHandle = NULL;  // Task for boiler control
@@ -279,8 +316,9 @@ void manageValveControls()
     ValveManager.calculateValvePosition();
     ValveManager.sendCurrentValvePosition();
 
-    lastKnownFlowSetpoint = ValveManager.outputs.targetFlowTemperature;
-    lastKownValvePosition = ValveManager.outputs.targetValvePosition;
+    ControlState state = ValveManager.getState();
+    lastKnownFlowSetpoint = state.outputs.targetFlowTemperature;
+    lastKownValvePosition = state.outputs.targetValvePosition;
 
     // Serial.printf(
     //   "In: %0.1lf, Setpoint: %0.1lf, Valve: %0.1lf, Flow: %0.1lf, Return: %0.1lf\n",
@@ -302,6 +340,7 @@ void triggerValveControls(bool writeLogLine)
 void valveControlTask(void* parameter)
 {
     bool writeLogLine = false;
+    uint32_t lastCycleMicros = 0;
     readSensors();
     for (;;) {
         // Wait for notification from main loop
@@ -313,30 +352,41 @@ void valveControlTask(void* parameter)
             }
 
             // Control loop first
+            uint32_t startMicros = micros();
+            if (lastCycleMicros != 0) Metrics.controlLoopInterval.observe(startMicros - lastCycleMicros);
+            lastCycleMicros = startMicros;
             manageValveControls();
+            Metrics.controlTime.observe(micros() - startMicros);
 
             // Then log if requested
             if (writeLogLine) {
+                uint32_t logStartMicros = micros();
                 logSensors();
-                // Then send our stats to the central heating controller (if configured)
-                const String &host = Config.getHeatingControllerAddress();
-                if (host != "" && host != "null") {
-                    ManifoldData data;
-                    String hostname = Config.getHostname();
-                    if (hostname != "" && hostname.indexOf('.') == -1) hostname = hostname + ".local";
-                    data.name = Config.getName() == "" ? hostname : Config.getName();
-                    data.hostname = Config.getHostname() + ".local";
-                    data.ipAddress = MyWiFi.getIpAddress();
-                    data.roomSetpoint = ValveManager.getRoomSetpoint();
-                    data.roomTemperature = ValveManager.inputs.roomTemperature;
-                    data.roomDeltaT = data.roomTemperature - data.roomSetpoint;
-                    data.flowSetpoint = ValveManager.getFlowSetpoint();
-                    data.flowTemperature = ValveManager.inputs.flowTemperature;
-                    data.flowDeltaT = data.flowTemperature - data.flowSetpoint;
-                    data.valvePosition = ValveManager.getValvePosition();
-                    data.flowDemand = data.flowSetpoint;
-                    ManifoldDataPostJob::post(data, host);
-                }
+                Metrics.sensorLogTime.observe(micros() - logStartMicros);
+            }
+
+            // Then send our stats to the central heating controller (if configured). This
+            // happens every cycle; the post task slows down if it has to reconnect every time.
+            const String &host = Config.getHeatingControllerAddress();
+            bool multicast = Config.getHeatingControllerMulticast();
+            if (multicast || (host != "" && host != "null")) {
+                ManifoldData data;
+                String hostname = Config.getHostname();
+                if (hostname != "" && hostname.indexOf('.') == -1) hostname = hostname + ".local";
+                data.name = Config.getName() == "" ? hostname : Config.getName();
+                data.hostname = Config.getHostname() + ".local";
+                data.ipAddress = MyWiFi.getIpAddress();
+                ControlState state = ValveManager.getState();
+                data.roomSetpoint = state.roomSetpoint;
+                data.roomTemperature = state.inputs.roomTemperature;
+                data.roomDeltaT = data.roomTemperature - data.roomSetpoint;
+                data.flowSetpoint = state.outputs.targetFlowTemperature;
+                data.flowTemperature = state.inputs.flowTemperature;
+                data.flowDeltaT = data.flowTemperature - data.flowSetpoint;
+                data.valvePosition = state.valvePosition;
+                data.flowDemand = data.flowSetpoint;
+                if (multicast) ManifoldTelemetry.send(data);
+                else ManifoldDataPostJob::post(data, host);
             }
 
             // Finally, read the sensors for the next iteration
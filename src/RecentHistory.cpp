@@ -0,0 +1,366 @@
+#include "RecentHistory.h"
+
+#include <esp_heap_caps.h>
+
+#include "MyLog.h"
+
+CRecentHistory RecentHistory;
+
+const int CRecentHistory::BLOCK_SAMPLES;
+const int16_t CRecentHistory::MISSING;
+
+CRecentHistory::CRecentHistory() : m_mutex("RecentHistory::m_mutex")
+{
+    this->m_generation = 0;
+    this->m_arena = nullptr;
+    this->m_arenaSize = 0;
+    this->m_writeOffset = 0;
+    this->m_blocks = nullptr;
+    this->m_firstSequence = 0;
+    this->m_nextSequence = 0;
+    this->m_stagingCount = 0;
+    this->m_stagingStartTime = 0;
+}
+
+void CRecentHistory::setup()
+{
+    uint32_t caps = MALLOC_CAP_8BIT;
+    size_t size = INTERNAL_ARENA_SIZE;
+    if (psramFound()) {
+        caps = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+        size = PSRAM_ARENA_SIZE;
+    }
+
+    this->m_blocks = (BlockDescriptor*)heap_caps_malloc(MAX_BLOCKS * sizeof(BlockDescriptor), caps);
+    this->m_arena = (uint8_t*)heap_caps_malloc(size, caps);
+    if (!this->m_blocks || !this->m_arena) {
+        free(this->m_blocks);
+        free(this->m_arena);
+        this->m_blocks = nullptr;
+        this->m_arena = nullptr;
+        MyLog.println("Recent history: unable to allocate memory");
+        return;
+    }
+    this->m_arenaSize = size;
+    MyLog.printf("Recent history: %u kB in %s\n", (unsigned)(size / 1024), psramFound() ? "PSRAM" : "internal RAM");
+}
+
+void CRecentHistory::setColumns(const std::vector<String>& names)
+{
+    this->m_mutex.lock(__PRETTY_FUNCTION__);
+    if (names != this->m_columns) {
+        this->m_columns = names;
+        this->m_staging.assign((names.size() + 1) * BLOCK_SAMPLES, MISSING);
+        this->clear();
+    }
+    this->m_mutex.unlock();
+}
+
+void CRecentHistory::clear()
+{
+    this->m_generation++;
+    this->m_firstSequence = this->m_nextSequence;
+    this->m_writeOffset = 0;
+    this->m_stagingCount = 0;
+}
+
+static int16_t quantise(float value)
+{
+    if (isnan(value)) return CRecentHistory::MISSING;
+    long result = lroundf(value * 10);
+    if (result > INT16_MAX) return INT16_MAX;
+    if (result <= INT16_MIN) return INT16_MIN + 1;
+    return result;
+}
+
+void CRecentHistory::append(time_t time, const float* values, int count)
+{
+    const time_t maxBlockSpan = 30000;  // Time offsets must fit into int16
+
+    this->m_mutex.lock(__PRETTY_FUNCTION__);
+    if (!this->m_arena || count != (int)this->m_columns.size()) {
+        this->m_mutex.unlock();
+        return;
+    }
+
+    // Start a new block after long gaps or if the clock went backwards
+    if (this->m_stagingCount > 0) {
+        time_t lastTime = this->m_stagingStartTime + this->m_staging[this->m_stagingCount - 1];
+        if (time < lastTime || time - this->m_stagingStartTime > maxBlockSpan) this->storeStagingBlock();
+    }
+    if (this->m_stagingCount == 0) this->m_stagingStartTime = time;
+
+    int16_t* column = this->m_staging.data();
+    column[this->m_stagingCount] = time - this->m_stagingStartTime;
+    for (int i = 0; i < count; i++) {
+        column += BLOCK_SAMPLES;
+        column[this->m_stagingCount] = quantise(values[i]);
+    }
+    this->m_stagingCount++;
+
+    if (this->m_stagingCount == BLOCK_SAMPLES) this->storeStagingBlock();
+    this->m_mutex.unlock();
+}
+
+size_t CRecentHistory::maxEncodedColumnSize()
+{
+    // Header, missing value mask, first value, 17 bit differences
+    return 1 + 8 + 2 + ((BLOCK_SAMPLES - 1) * 17 + 7) / 8;
+}
+
+void CRecentHistory::storeStagingBlock()
+{
+    if (this->m_stagingCount == 0) return;
+
+    int columns = this->m_columns.size() + 1;
+    size_t maxSize = maxEncodedColumnSize() * columns;
+    if (maxSize > this->m_arenaSize) {
+        this->m_stagingCount = 0;
+        return;
+    }
+
+    // Wrap around if the worst case does not fit at the end, then drop the oldest
+    // blocks until there is room for the worst case and a free descriptor
+    uint32_t offset = this->m_writeOffset;
+    if (offset + maxSize > this->m_arenaSize) offset = 0;
+    while (this->m_firstSequence != this->m_nextSequence) {
+        BlockDescriptor& oldest = this->m_blocks[this->m_firstSequence % MAX_BLOCKS];
+        bool overlaps = oldest.offset < offset + maxSize && oldest.offset + oldest.length > offset;
+        if (!overlaps && this->m_nextSequence - this->m_firstSequence < MAX_BLOCKS) break;
+        this->m_firstSequence++;
+    }
+
+    uint8_t* p = this->m_arena + offset;
+    for (int i = 0; i < columns; i++) {
+        p += encodeColumn(this->m_staging.data() + i * BLOCK_SAMPLES, this->m_stagingCount, p);
+    }
+
+    BlockDescriptor& block = this->m_blocks[this->m_nextSequence % MAX_BLOCKS];
+    block.startTime = this->m_stagingStartTime;
+    block.offset = offset;
+    block.length = p - (this->m_arena + offset);
+    block.sampleCount = this->m_stagingCount;
+    this->m_nextSequence++;
+
+    this->m_writeOffset = offset + block.length;
+    this->m_stagingCount = 0;
+}
+
+// Column encoding:
+//   header byte:  bits 0-4: bit width of the differences, bit 6: all values missing,
+//                 bit 7: a 64 bit mask of missing values follows
+//   [mask]        little endian, bit n set = value n missing
+//   first value   int16, little endian
+//   differences   zig-zag encoded, bit-packed LSB first
+// Missing values repeat the previous value so they cost nothing in the differences.
+
+size_t CRecentHistory::encodeColumn(const int16_t* values, int count, uint8_t* out)
+{
+    uint64_t missingMask = 0;
+    int first = -1;
+    for (int i = 0; i < count; i++) {
+        if (values[i] == MISSING) {
+            missingMask |= 1ULL << i;
+        }
+        else if (first < 0) {
+            first = i;
+        }
+    }
+    if (first < 0) {
+        out[0] = 0x40;
+        return 1;
+    }
+
+    int16_t previous = values[first];
+    uint32_t allBits = 0;
+    for (int i = 1; i < count; i++) {
+        int16_t value = values[i] == MISSING ? previous : values[i];
+        int32_t difference = (int32_t)value - previous;
+        allBits |= (uint32_t)((difference << 1) ^ (difference >> 31));
+        previous = value;
+    }
+    int width = allBits ? 32 - __builtin_clz(allBits) : 0;
+
+    uint8_t* p = out;
+    *p++ = width | (missingMask ? 0x80 : 0);
+    if (missingMask) {
+        for (int i = 0; i < 8; i++) *p++ = missingMask >> (i * 8);
+    }
+    previous = values[first];
+    *p++ = (uint16_t)previous;
+    *p++ = (uint16_t)previous >> 8;
+
+    uint64_t bits = 0;
+    int bitCount = 0;
+    for (int i = 1; i < count && width > 0; i++) {
+        int16_t value = values[i] == MISSING ? previous : values[i];
+        int32_t difference = (int32_t)value - previous;
+        bits |= (uint64_t)(uint32_t)((difference << 1) ^ (difference >> 31)) << bitCount;
+        bitCount += width;
+        while (bitCount >= 8) {
+            *p++ = bits;
+            bits >>= 8;
+            bitCount -= 8;
+        }
+        previous = value;
+    }
+    if (bitCount > 0) *p++ = bits;
+    return p - out;
+}
+
+size_t CRecentHistory::decodeColumn(const uint8_t* in, int count, int16_t* values)
+{
+    const uint8_t* p = in;
+    uint8_t header = *p++;
+    if (header & 0x40) {
+        for (int i = 0; i < count; i++) values[i] = MISSING;
+        return 1;
+    }
+
+    int width = header & 0x1f;
+    uint64_t missingMask = 0;
+    if (header & 0x80) {
+        for (int i = 0; i < 8; i++) missingMask |= (uint64_t)*p++ << (i * 8);
+    }
+    int16_t value = (int16_t)(p[0] | (p[1] << 8));
+    p += 2;
+
+    values[0] = value;
+    uint64_t bits = 0;
+    int bitCount = 0;
+    uint32_t widthMask = (1UL << width) - 1;
+    for (int i = 1; i < count; i++) {
+        if (width > 0) {
+            while (bitCount < width) {
+                bits |= (uint64_t)*p++ << bitCount;
+                bitCount += 8;
+            }
+            uint32_t zigzag = bits & widthMask;
+            bits >>= width;
+            bitCount -= width;
+            value += (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+        }
+        values[i] = value;
+    }
+
+    for (int i = 0; missingMask && i < count; i++) {
+        if (missingMask & (1ULL << i)) values[i] = MISSING;
+    }
+    return p - in;
+}
+
+uint32_t CRecentHistory::getColumns(std::vector<String>& names)
+{
+    this->m_mutex.lock(__PRETTY_FUNCTION__);
+    names = this->m_columns;
+    uint32_t generation = this->m_generation;
+    this->m_mutex.unlock();
+    return generation;
+}
+
+bool CRecentHistory::readBlock(uint32_t generation, uint32_t& sequence, time_t& startTime, int& sampleCount, int16_t* buffer, bool& staging)
+{
+    bool result = false;
+    staging = false;
+
+    this->m_mutex.lock(__PRETTY_FUNCTION__);
+    int columns = this->m_columns.size() + 1;
+    if (generation == this->m_generation && this->m_arena) {
+        if ((int32_t)(sequence - this->m_firstSequence) < 0) sequence = this->m_firstSequence;
+
+        if (sequence != this->m_nextSequence) {
+            const BlockDescriptor& block = this->m_blocks[sequence % MAX_BLOCKS];
+            startTime = block.startTime;
+            sampleCount = block.sampleCount;
+            const uint8_t* p = this->m_arena + block.offset;
+            for (int i = 0; i < columns; i++) {
+                p += decodeColumn(p, sampleCount, buffer + i * BLOCK_SAMPLES);
+            }
+            sequence++;
+            result = true;
+        }
+        else if (this->m_stagingCount > 0) {
+            // The block being filled
+            startTime = this->m_stagingStartTime;
+            sampleCount = this->m_stagingCount;
+            for (int i = 0; i < columns; i++) {
+                memcpy(buffer + i * BLOCK_SAMPLES, this->m_staging.data() + i * BLOCK_SAMPLES, sampleCount * sizeof(int16_t));
+            }
+            staging = true;
+            result = true;
+        }
+    }
+    this->m_mutex.unlock();
+    return result;
+}
+
+time_t CRecentHistory::getOldestTime()
+{
+    this->m_mutex.lock(__PRETTY_FUNCTION__);
+    time_t result = 0;
+    if (this->m_firstSequence != this->m_nextSequence) {
+        result = this->m_blocks[this->m_firstSequence % MAX_BLOCKS].startTime;
+    }
+    else if (this->m_stagingCount > 0) {
+        result = this->m_stagingStartTime;
+    }
+    this->m_mutex.unlock();
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// RecentHistoryQuery
+////////////////////////////////////////////////////////////////////////////////////////////
+
+RecentHistoryQuery::RecentHistoryQuery(time_t from, time_t to, uint32_t step, SensorHistoryAggregator::Format format)
+    : m_aggregator(from, to, step, format)
+{
+    this->m_generation = 0;
+    this->m_sequence = 0;
+    this->m_columnCount = 0;
+    this->m_started = false;
+    this->m_reachedEnd = false;
+}
+
+size_t RecentHistoryQuery::read(uint8_t* buffer, size_t maxLen)
+{
+    const int blockSamples = CRecentHistory::BLOCK_SAMPLES;
+
+    if (!this->m_started) {
+        std::vector<String> names;
+        this->m_generation = RecentHistory.getColumns(names);
+        this->m_aggregator.mapSourceColumns(names);
+        this->m_columnCount = names.size();
+        this->m_buffer.resize((this->m_columnCount + 1) * blockSamples);
+        this->m_started = true;
+    }
+
+    while (this->m_aggregator.pendingOutput() == 0 && !this->m_aggregator.isFinished()) {
+        time_t startTime;
+        int sampleCount;
+        bool staging;
+        if (this->m_reachedEnd || !RecentHistory.readBlock(this->m_generation, this->m_sequence, startTime, sampleCount, this->m_buffer.data(), staging)) {
+            this->m_aggregator.finish();
+            break;
+        }
+        // Nothing comes after the block being filled
+        if (staging) this->m_reachedEnd = true;
+
+        const int16_t* timeOffsets = this->m_buffer.data();
+        for (int i = 0; i < sampleCount; i++) {
+            time_t t = startTime + timeOffsets[i];
+            if (t < this->m_aggregator.getFrom()) continue;
+            if (t >= this->m_aggregator.getTo()) {
+                this->m_reachedEnd = true;
+                break;
+            }
+            this->m_aggregator.beginSample(t);
+            const int16_t* values = timeOffsets + i;
+            for (int column = 0; column < this->m_columnCount; column++) {
+                values += blockSamples;
+                if (*values != CRecentHistory::MISSING) this->m_aggregator.addValue(column, *values / 10.0f);
+            }
+        }
+    }
+    return this->m_aggregator.readOutput(buffer, maxLen);
+}
@@ -0,0 +1,110 @@
+#ifndef __RECENT_HISTORY_H
+#define __RECENT_HISTORY_H
+
+#include <Arduino.h>
+
+#include <vector>
+
+#include "MyMutex.h"
+#include "SensorHistory.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Recent sensor history in memory
+//
+// Every sensor log line is also appended here, so charts of the last day or so can be
+// drawn without touching the SD card. Values are stored in columns, quantised to 0.1
+// (the resolution of the CSV files), in blocks of 64 samples. When a block is full, each
+// column is compressed on its own: the first value is stored as is, the remaining ones as
+// zig-zag encoded differences to their predecessor, bit-packed with the smallest width that
+// fits the whole block. Temperatures change slowly, so most columns need 2-4 bits per
+// sample. A per-block bit mask marks missing values, if there are any.
+//
+// Compressed blocks go into a byte ring ("arena") in PSRAM if available; the oldest blocks
+// are dropped when space runs out. A change in the columns clears the history.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+class CRecentHistory {
+  public:
+    static const int BLOCK_SAMPLES = 64;
+    static const int16_t MISSING = INT16_MIN;
+
+  private:
+    static const int MAX_BLOCKS = 1024;                   // 64 * 5s * 1024 = 91 hours
+    static const size_t PSRAM_ARENA_SIZE = 512 * 1024;    // ~40 hours with 30 columns
+    static const size_t INTERNAL_ARENA_SIZE = 48 * 1024;  // Without PSRAM: a few hours only
+
+    struct BlockDescriptor {
+        time_t startTime;
+        uint32_t offset;
+        uint16_t length;
+        uint8_t sampleCount;
+    };
+
+    MyMutex m_mutex;
+
+    std::vector<String> m_columns;
+    uint32_t m_generation;          // Incremented whenever the history is cleared
+
+    // Compressed blocks
+    uint8_t* m_arena;
+    size_t m_arenaSize;
+    uint32_t m_writeOffset;
+    BlockDescriptor* m_blocks;      // Ring of MAX_BLOCKS, indexed by sequence number
+    uint32_t m_firstSequence;       // Oldest block still held
+    uint32_t m_nextSequence;        // Sequence number of the block being filled
+
+    // Block being filled, uncompressed. Column 0 is the time offset in seconds
+    // from the start of the block, columns 1.. are the values.
+    std::vector<int16_t> m_staging;
+    int m_stagingCount;
+    time_t m_stagingStartTime;
+
+  public:
+    CRecentHistory();
+    void setup();
+
+    // Set the columns; clears the history if they are different from the previous ones
+    void setColumns(const std::vector<String>& names);
+    int getColumnCount() const { return this->m_columns.size(); }
+    void append(time_t time, const float* values, int count);
+
+    // Reading. A reader first takes a copy of the columns and the generation, then reads
+    // blocks by sequence number, starting with 0. The buffer needs room for
+    // (column count + 1) * BLOCK_SAMPLES values. The block still being filled comes last:
+    // staging is then set and sequence stays where it is, so the reader must stop there.
+    uint32_t getColumns(std::vector<String>& names);
+    bool readBlock(uint32_t generation, uint32_t& sequence, time_t& startTime, int& sampleCount, int16_t* buffer, bool& staging);
+
+    time_t getOldestTime();
+
+  private:
+    void clear();
+    void storeStagingBlock();
+    static size_t maxEncodedColumnSize();
+    static size_t encodeColumn(const int16_t* values, int count, uint8_t* out);
+    static size_t decodeColumn(const uint8_t* in, int count, int16_t* values);
+};
+
+extern CRecentHistory RecentHistory;
+
+// Source for the /data/recent chunked response
+class RecentHistoryQuery {
+  private:
+    SensorHistoryAggregator m_aggregator;
+    uint32_t m_generation;
+    uint32_t m_sequence;
+    int m_columnCount;
+    std::vector<int16_t> m_buffer;
+    bool m_started;
+    bool m_reachedEnd;
+
+  public:
+    RecentHistoryQuery(time_t from, time_t to, uint32_t step, SensorHistoryAggregator::Format format);
+    SensorHistoryAggregator& getAggregator() { return this->m_aggregator; }
+    size_t read(uint8_t* buffer, size_t maxLen);
+    bool isDone() const { return this->m_aggregator.isFinished() && this->m_aggregator.pendingOutput() == 0; }
+};
+
+#endif
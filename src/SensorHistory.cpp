@@ -0,0 +1,627 @@
+#include "SensorHistory.h"
+
+#include "MyLog.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Time helpers
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// Days since 1970-01-01 for a date in the proleptic Gregorian calendar
+long daysFromCivil(int year, int month, int day)
+{
+    year -= month <= 2;
+    const long era = (year >= 0 ? year : year - 399) / 400;
+    const unsigned yearOfEra = (unsigned)(year - era * 400);
+    const unsigned dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const unsigned dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + (long)dayOfEra - 719468;
+}
+
+static bool parseDigits(const char*& p, int count, int* result)
+{
+    int value = 0;
+    for (int i = 0; i < count; i++) {
+        if (*p < '0' || *p > '9') return false;
+        value = value * 10 + (*p++ - '0');
+    }
+    *result = value;
+    return true;
+}
+
+// Parse "yyyy-mm-dd", "yyyy-mm-dd hh:mm" or "yyyy-mm-dd hh:mm:ss" (also with 'T' as separator)
+// as UTC, which is what the sensor logs use
+bool parseSensorLogTime(const char* text, time_t* result)
+{
+    const char* p = text;
+    int year, month, day, hour = 0, minute = 0, second = 0;
+    if (!parseDigits(p, 4, &year) || *p++ != '-') return false;
+    if (!parseDigits(p, 2, &month) || *p++ != '-') return false;
+    if (!parseDigits(p, 2, &day)) return false;
+    if (*p == ' ' || *p == 'T') {
+        p++;
+        if (!parseDigits(p, 2, &hour) || *p++ != ':') return false;
+        if (!parseDigits(p, 2, &minute)) return false;
+        if (*p == ':') {
+            p++;
+            if (!parseDigits(p, 2, &second)) return false;
+        }
+    }
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 59) return false;
+
+    *result = (time_t)daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+    return true;
+}
+
+static void formatSensorLogTime(time_t t, char* buffer, size_t size)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    snprintf(
+        buffer, size, "%04d-%02d-%02d %02d:%02d:%02d",
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+        tm.tm_hour, tm.tm_min, tm.tm_sec
+    );
+}
+
+static long dayOf(time_t t)
+{
+    return (long)(t >= 0 ? t / 86400 : (t - 86399) / 86400);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// SensorHistoryAggregator
+////////////////////////////////////////////////////////////////////////////////////////////
+
+SensorHistoryAggregator::SensorHistoryAggregator(time_t from, time_t to, uint32_t step, Format format)
+{
+    this->m_from = from;
+    this->m_to = to;
+    this->m_step = step > 0 ? step : 1;
+    this->m_format = format;
+    this->m_bucketStart = from;
+    this->m_bucketHasData = false;
+    this->m_headerWritten = false;
+    this->m_finished = false;
+    this->m_rowsWritten = 0;
+    this->m_outPosition = 0;
+    this->m_out.reserve(1024);
+}
+
+void SensorHistoryAggregator::setColumns(const String& commaSeparatedNames)
+{
+    this->m_columns.clear();
+    int start = 0;
+    while (start <= (int)commaSeparatedNames.length()) {
+        int end = commaSeparatedNames.indexOf(',', start);
+        if (end < 0) end = commaSeparatedNames.length();
+        String name = commaSeparatedNames.substring(start, end);
+        name.trim();
+        if (name.length() > 0) this->m_columns.push_back(name);
+        start = end + 1;
+    }
+    this->m_buckets.resize(this->m_columns.size());
+    this->clearBucket();
+}
+
+void SensorHistoryAggregator::mapSourceColumns(const std::vector<String>& sourceNames)
+{
+    // No columns requested - take everything from the first source we see
+    if (this->m_columns.empty() && !this->m_headerWritten) {
+        this->m_columns = sourceNames;
+        this->m_buckets.resize(this->m_columns.size());
+        this->clearBucket();
+    }
+
+    this->m_sourceToColumn.assign(sourceNames.size(), -1);
+    for (size_t source = 0; source < sourceNames.size(); source++) {
+        for (size_t column = 0; column < this->m_columns.size(); column++) {
+            if (sourceNames[source] == this->m_columns[column]) {
+                this->m_sourceToColumn[source] = column;
+                break;
+            }
+        }
+    }
+}
+
+void SensorHistoryAggregator::beginSample(time_t t)
+{
+    time_t bucketStart = this->m_from + ((t - this->m_from) / this->m_step) * this->m_step;
+    if (bucketStart != this->m_bucketStart) {
+        this->flushBucket();
+        this->m_bucketStart = bucketStart;
+    }
+}
+
+void SensorHistoryAggregator::addValue(int sourceColumn, float value)
+{
+    if (sourceColumn < 0 || sourceColumn >= (int)this->m_sourceToColumn.size()) return;
+    int column = this->m_sourceToColumn[sourceColumn];
+    if (column < 0) return;
+
+    Accumulator& a = this->m_buckets[column];
+    if (a.count == 0 || value < a.min) a.min = value;
+    if (a.count == 0 || value > a.max) a.max = value;
+    a.sum += value;
+    if (a.count < UINT16_MAX) a.count++;
+    this->m_bucketHasData = true;
+}
+
+void SensorHistoryAggregator::clearBucket()
+{
+    for (Accumulator& a : this->m_buckets) {
+        a.min = 0;
+        a.max = 0;
+        a.sum = 0;
+        a.count = 0;
+    }
+    this->m_bucketHasData = false;
+}
+
+void SensorHistoryAggregator::writeValue(float value)
+{
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), ",%.1f", value);
+    this->m_out += buffer;
+}
+
+void SensorHistoryAggregator::flushBucket()
+{
+    if (!this->m_bucketHasData) return;
+    if (!this->m_headerWritten) this->writeHeader();
+
+    char buffer[24];
+    if (this->m_format == FORMAT_JSON) {
+        snprintf(buffer, sizeof(buffer), "%s[%lld", this->m_rowsWritten > 0 ? "," : "", (long long)this->m_bucketStart);
+        this->m_out += buffer;
+    }
+    else {
+        formatSensorLogTime(this->m_bucketStart, buffer, sizeof(buffer));
+        this->m_out += buffer;
+    }
+
+    const char* missing = this->m_format == FORMAT_JSON ? ",null,null,null" : ",,,";
+    for (Accumulator& a : this->m_buckets) {
+        if (a.count == 0) {
+            this->m_out += missing;
+            continue;
+        }
+        this->writeValue(a.min);
+        snprintf(buffer, sizeof(buffer), ",%.2f", a.sum / a.count);
+        this->m_out += buffer;
+        this->writeValue(a.max);
+    }
+
+    this->m_out += this->m_format == FORMAT_JSON ? "]" : "\r\n";
+    this->m_rowsWritten++;
+    this->clearBucket();
+}
+
+static void appendJsonString(String& out, const String& s)
+{
+    out += '"';
+    for (unsigned int i = 0; i < s.length(); i++) {
+        char c = s[i];
+        if (c == '"' || c == '\\') out += '\\';
+        if ((unsigned char)c >= ' ') out += c;
+    }
+    out += '"';
+}
+
+void SensorHistoryAggregator::writeHeader()
+{
+    if (this->m_format == FORMAT_JSON) {
+        char buffer[80];
+        snprintf(
+            buffer, sizeof(buffer), "{\"from\":%lld,\"to\":%lld,\"step\":%u,\"columns\":[",
+            (long long)this->m_from, (long long)this->m_to, (unsigned)this->m_step
+        );
+        this->m_out += buffer;
+        for (size_t i = 0; i < this->m_columns.size(); i++) {
+            if (i > 0) this->m_out += ',';
+            appendJsonString(this->m_out, this->m_columns[i]);
+        }
+        this->m_out += "],\"fields\":[\"min\",\"avg\",\"max\"],\"data\":[";
+    }
+    else {
+        this->m_out += "Time";
+        for (const String& name : this->m_columns) {
+            this->m_out += ',';
+            this->m_out += name;
+            this->m_out += " Min,";
+            this->m_out += name;
+            this->m_out += " Avg,";
+            this->m_out += name;
+            this->m_out += " Max";
+        }
+        this->m_out += "\r\n";
+    }
+    this->m_headerWritten = true;
+}
+
+void SensorHistoryAggregator::finish()
+{
+    if (this->m_finished) return;
+    this->flushBucket();
+    if (!this->m_headerWritten) this->writeHeader();
+    if (this->m_format == FORMAT_JSON) this->m_out += "]}";
+    this->m_finished = true;
+}
+
+size_t SensorHistoryAggregator::readOutput(uint8_t* buffer, size_t maxLen)
+{
+    size_t n = this->pendingOutput();
+    if (n > maxLen) n = maxLen;
+    memcpy(buffer, this->m_out.c_str() + this->m_outPosition, n);
+    this->m_outPosition += n;
+    if (this->m_outPosition >= this->m_out.length()) {
+        this->m_out = "";  // keeps the allocated buffer
+        this->m_outPosition = 0;
+    }
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// SensorHistoryFileReader
+////////////////////////////////////////////////////////////////////////////////////////////
+
+SensorHistoryFileReader::SensorHistoryFileReader(SdFs* sd, SdAccessLock* sdMutex, SensorHistoryAggregator& aggregator)
+    : m_aggregator(aggregator),
+      m_binaryReader(sd, sdMutex)
+{
+    this->m_sd = sd;
+    this->m_sdMutex = sdMutex;
+    this->m_day = dayOf(aggregator.getFrom());
+    this->m_lastDay = dayOf(aggregator.getTo() - 1);
+    this->m_dayOpened = false;
+    this->m_filePosition = 0;
+    this->m_schemaFieldCount = 0;
+    this->m_verifySchema = false;
+    this->m_restartDay = false;
+    this->m_done = false;
+    this->m_binary = false;
+    this->m_fileSize = 0;
+    this->m_inSegment = false;
+    this->m_lineLength = 0;
+    this->m_lineOverflow = false;
+    this->m_skipPartialLine = false;
+}
+
+void SensorHistoryFileReader::getFileName(char* buffer, size_t size, const char* extension) const
+{
+    time_t dayStart = (time_t)this->m_day * 86400;
+    struct tm tm;
+    gmtime_r(&dayStart, &tm);
+    snprintf(buffer, size, "Sensor Values %04d-%02d-%02d.%s", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, extension);
+}
+
+// Read one block from the current day's file into m_readBuffer. Returns the number of
+// bytes read, or -1 if the file does not exist.
+int SensorHistoryFileReader::readAt(uint64_t position, uint64_t* fileSize)
+{
+    if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__)) return -1;
+    int bytesRead = -1;
+    if (!this->m_file.isOpen()) {
+        char fileName[40];
+        this->getFileName(fileName, sizeof(fileName), "csv");
+        this->m_file = this->m_sd->open(fileName, O_RDONLY);
+    }
+    if (this->m_file.isOpen()) {
+        bytesRead = 0;
+        if (fileSize) *fileSize = this->m_file.size();
+        if (this->m_file.seek(position)) {
+            bytesRead = this->m_file.read(this->m_readBuffer, READ_BUFFER_SIZE);
+            if (bytesRead < 0) bytesRead = 0;
+        }
+    }
+    this->m_sdMutex->unlock();
+    return bytesRead;
+}
+
+void SensorHistoryFileReader::closeFile()
+{
+    this->m_binaryReader.close();
+    if (!this->m_file.isOpen()) return;
+    if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__)) return;
+    this->m_file.close();
+    this->m_sdMutex->unlock();
+}
+
+// Find the start position for reading the current day. For a binary file, that is done
+// per segment in readBinaryBlock(). For CSV, the header line is always read,
+// then, if the range starts later in the day, bisect the file for the first line at or
+// after the start time rather than reading through the whole morning.
+void SensorHistoryFileReader::openDay()
+{
+    this->m_dayOpened = true;
+    this->m_filePosition = 0;
+    this->m_schemaFieldCount = 0;
+    this->m_verifySchema = false;
+    this->m_lineLength = 0;
+    this->m_lineOverflow = false;
+    this->m_skipPartialLine = false;
+
+    char fileName[40];
+    this->getFileName(fileName, sizeof(fileName), "bin");
+    this->m_binaryReader.setFileName(fileName);
+    this->m_binary = this->m_binaryReader.readAt(0, nullptr, 0, &this->m_fileSize) >= 0;
+    this->m_inSegment = false;
+    if (this->m_binary) return;
+
+    time_t from = this->m_aggregator.getFrom();
+    time_t dayStart = (time_t)this->m_day * 86400;
+    if (from <= dayStart + 60) return;
+
+    uint64_t fileSize = 0;
+    int bytesRead = this->readAt(0, &fileSize);
+    if (bytesRead <= 0) return;
+
+    const char* end = (const char*)memchr(this->m_readBuffer, '\n', bytesRead);
+    if (!end || strncmp(this->m_readBuffer, "Time,", 5) != 0) return;
+    int length = end - this->m_readBuffer;
+    memcpy(this->m_line, this->m_readBuffer, length);
+    this->m_line[length] = '\0';
+    if (length > 0 && this->m_line[length - 1] == '\r') this->m_line[length - 1] = '\0';
+    this->processHeaderLine();
+
+    uint64_t position = this->findPosition(from, fileSize);
+    if (position > (uint64_t)length) {
+        this->m_filePosition = position;
+        this->m_skipPartialLine = true;
+        this->m_verifySchema = true;
+    }
+    else {
+        this->m_filePosition = end - this->m_readBuffer + 1;
+    }
+}
+
+// Largest block-aligned position before the first line with a time stamp >= t
+uint64_t SensorHistoryFileReader::findPosition(time_t t, uint64_t fileSize)
+{
+    uint64_t low = 0;
+    uint64_t high = fileSize;
+    while (high - low > READ_BUFFER_SIZE) {
+        uint64_t middle = low + (high - low) / 2;
+        int bytesRead = this->readAt(middle);
+        if (bytesRead <= 0) break;
+
+        // Find the first complete data line in the block
+        time_t lineTime = 0;
+        bool found = false;
+        const char* p = this->m_readBuffer;
+        const char* bufferEnd = this->m_readBuffer + bytesRead;
+        while (!found) {
+            const char* lineStart = (const char*)memchr(p, '\n', bufferEnd - p);
+            if (!lineStart || bufferEnd - lineStart < 21) break;
+            lineStart++;
+            char timestamp[20];
+            memcpy(timestamp, lineStart, 19);
+            timestamp[19] = '\0';
+            found = parseSensorLogTime(timestamp, &lineTime);
+            p = lineStart;
+        }
+
+        if (found && lineTime < t) {
+            low = middle;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void SensorHistoryFileReader::nextDay()
+{
+    // Last line without a line break
+    if (this->m_lineLength > 0) {
+        this->m_line[this->m_lineLength] = '\0';
+        this->processLine();
+    }
+    this->closeFile();
+    this->m_day++;
+    this->m_dayOpened = false;
+    if (this->m_day > this->m_lastDay) this->m_done = true;
+}
+
+bool SensorHistoryFileReader::readBlocks(int maxBlocks)
+{
+    for (int block = 0; block < maxBlocks && !this->m_done; block++) {
+        if (!this->m_dayOpened) this->openDay();
+
+        if (this->m_binary) {
+            if (!this->readBinaryBlock()) this->nextDay();
+            continue;
+        }
+
+        int bytesRead = this->readAt(this->m_filePosition);
+        if (bytesRead <= 0) {
+            this->nextDay();
+            continue;
+        }
+        this->m_filePosition += bytesRead;
+
+        for (int i = 0; i < bytesRead && !this->m_done && !this->m_restartDay; i++) {
+            char c = this->m_readBuffer[i];
+            if (c == '\n') {
+                if (this->m_skipPartialLine) {
+                    this->m_skipPartialLine = false;
+                }
+                else if (!this->m_lineOverflow) {
+                    if (this->m_lineLength > 0 && this->m_line[this->m_lineLength - 1] == '\r') this->m_lineLength--;
+                    this->m_line[this->m_lineLength] = '\0';
+                    this->processLine();
+                }
+                this->m_lineLength = 0;
+                this->m_lineOverflow = false;
+            }
+            else if (this->m_skipPartialLine) {
+                continue;
+            }
+            else if (this->m_lineLength < LINE_BUFFER_SIZE - 1) {
+                this->m_line[this->m_lineLength++] = c;
+            }
+            else {
+                this->m_lineOverflow = true;
+            }
+        }
+
+        if (this->m_restartDay) {
+            this->m_restartDay = false;
+            this->m_filePosition = 0;
+            this->m_schemaFieldCount = 0;
+            this->m_lineLength = 0;
+            this->m_lineOverflow = false;
+            this->m_skipPartialLine = false;
+        }
+    }
+    return !this->m_done;
+}
+
+void SensorHistoryFileReader::processLine()
+{
+    if (this->m_lineLength == 0) return;
+    if (strncmp(this->m_line, "Time,", 5) == 0) {
+        this->processHeaderLine();
+    }
+    else {
+        this->processDataLine();
+    }
+}
+
+void SensorHistoryFileReader::processHeaderLine()
+{
+    std::vector<String> names;
+    const char* p = strchr(this->m_line, ',');
+    while (p) {
+        p++;
+        const char* end = strchr(p, ',');
+        String name;
+        if (end) {
+            name.concat(p, end - p);
+        }
+        else {
+            name = p;
+        }
+        names.push_back(name);
+        p = end;
+    }
+    this->m_aggregator.mapSourceColumns(names);
+    this->m_schemaFieldCount = names.size() + 1;
+}
+
+void SensorHistoryFileReader::processDataLine()
+{
+    if (this->m_schemaFieldCount == 0) return;  // no header - can't tell what the columns are
+
+    time_t t;
+    if (!parseSensorLogTime(this->m_line, &t)) return;
+    if (t >= this->m_aggregator.getTo()) {
+        this->m_done = true;
+        return;
+    }
+
+    // After skipping into the middle of a file, the header we read at its start must still
+    // apply. If the sensors changed in the part we skipped, read the day from the start.
+    if (this->m_verifySchema) {
+        this->m_verifySchema = false;
+        int fieldCount = 1;
+        for (const char* p = this->m_line; (p = strchr(p, ',')) != nullptr; p++) fieldCount++;
+        if (fieldCount != this->m_schemaFieldCount) {
+            this->m_restartDay = true;
+            return;
+        }
+    }
+
+    if (t < this->m_aggregator.getFrom()) return;
+
+    this->m_aggregator.beginSample(t);
+    int column = 0;
+    const char* p = strchr(this->m_line, ',');
+    while (p) {
+        p++;
+        char* end;
+        float value = strtof(p, &end);
+        if (end != p) this->m_aggregator.addValue(column, value);
+        column++;
+        p = strchr(p, ',');
+    }
+}
+
+// One segment header or block of rows from the binary file of the current day. Returns
+// false at the end of the file.
+bool SensorHistoryFileReader::readBinaryBlock()
+{
+    if (!this->m_inSegment) {
+        if (this->m_filePosition >= this->m_fileSize) return false;
+        if (!this->m_binaryReader.readSegment(this->m_filePosition, this->m_fileSize, this->m_segment, this->m_line, LINE_BUFFER_SIZE)) return false;
+
+        std::vector<String> names;
+        splitSensorLogColumnNames(this->m_line, names);
+        this->m_aggregator.mapSourceColumns(names);
+
+        // Rows have a fixed size - go straight to the first one in the range
+        uint32_t firstRow = this->m_binaryReader.findRow(this->m_segment, this->m_aggregator.getFrom());
+        this->m_filePosition = this->m_segment.dataStart + (uint64_t)firstRow * this->m_segment.rowSize();
+        this->m_inSegment = true;
+        return true;
+    }
+
+    size_t rowSize = this->m_segment.rowSize();
+    uint64_t remaining = (this->m_segment.end() - this->m_filePosition) / rowSize;
+    if (remaining == 0) {
+        this->m_inSegment = false;
+        return true;
+    }
+    size_t rows = READ_BUFFER_SIZE / rowSize;
+    if (rows > remaining) rows = remaining;
+
+    int bytesRead = this->m_binaryReader.readAt(this->m_filePosition, this->m_readBuffer, rows * rowSize);
+    if (bytesRead < (int)rowSize) return false;
+    rows = bytesRead / rowSize;
+    this->m_filePosition += rows * rowSize;
+
+    const uint8_t* row = (const uint8_t*)this->m_readBuffer;
+    for (size_t r = 0; r < rows; r++, row += rowSize) {
+        uint16_t offset;
+        memcpy(&offset, row, sizeof(offset));
+        time_t t = this->m_segment.baseTime + offset;
+        if (t >= this->m_aggregator.getTo()) {
+            this->m_done = true;
+            break;
+        }
+        if (t < this->m_aggregator.getFrom()) continue;
+
+        this->m_aggregator.beginSample(t);
+        for (int column = 0; column < this->m_segment.columnCount; column++) {
+            int16_t value;
+            memcpy(&value, row + 2 + 2 * column, sizeof(value));
+            if (value != SENSOR_LOG_BINARY_MISSING) this->m_aggregator.addValue(column, decodeSensorLogBinaryValue(value));
+        }
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// SensorHistoryQuery
+////////////////////////////////////////////////////////////////////////////////////////////
+
+SensorHistoryQuery::SensorHistoryQuery(SdFs* sd, SdAccessLock* sdMutex, time_t from, time_t to, uint32_t step, SensorHistoryAggregator::Format format)
+    : m_aggregator(from, to, step, format),
+      m_reader(sd, sdMutex, m_aggregator)
+{
+}
+
+size_t SensorHistoryQuery::read(uint8_t* buffer, size_t maxLen)
+{
+    if (this->m_aggregator.pendingOutput() == 0 && !this->m_aggregator.isFinished()) {
+        int blocks = 0;
+        while (this->m_aggregator.pendingOutput() == 0 && blocks < MAX_BLOCKS_PER_CHUNK) {
+            if (!this->m_reader.readBlocks(1)) {
+                this->m_aggregator.finish();
+                break;
+            }
+            blocks++;
+        }
+    }
+    return this->m_aggregator.readOutput(buffer, maxLen);
+}
@@ -0,0 +1,172 @@
+#ifndef __SENSOR_HISTORY_H
+#define __SENSOR_HISTORY_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+
+#include <vector>
+
+#include "SdAccessLock.h"
+#include "SensorLogBinary.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Time range queries over the sensor history
+//
+// The aggregator collects samples into fixed-width time buckets and keeps min / sum / max
+// and a count for each requested column, so memory use only depends on the number of
+// columns, not on the length of the time range. Each bucket is formatted into a small
+// output buffer as soon as it is complete, from where the web server drains it into
+// a chunked response.
+//
+// Samples are fed with the column index of their source (e.g. the column position in a
+// CSV file); mapSourceColumns() translates these to output columns by name, so data from
+// files with different column layouts (sensors added or removed during the day) ends up
+// in the right output column.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+class SensorHistoryAggregator {
+  public:
+    enum Format { FORMAT_JSON,
+                  FORMAT_CSV };
+
+  private:
+    struct Accumulator {
+        float min;
+        float max;
+        float sum;
+        uint16_t count;
+    };
+
+    time_t m_from;
+    time_t m_to;
+    uint32_t m_step;
+    Format m_format;
+
+    std::vector<String> m_columns;        // Output column names
+    std::vector<int> m_sourceToColumn;    // Source column index -> output column (-1 = not selected)
+    std::vector<Accumulator> m_buckets;   // One per output column
+    time_t m_bucketStart;
+    bool m_bucketHasData;
+
+    bool m_headerWritten;
+    bool m_finished;
+    int m_rowsWritten;
+    String m_out;
+    size_t m_outPosition;
+
+  public:
+    SensorHistoryAggregator(time_t from, time_t to, uint32_t step, Format format);
+
+    time_t getFrom() const { return this->m_from; }
+    time_t getTo() const { return this->m_to; }
+    uint32_t getStep() const { return this->m_step; }
+
+    // Output columns. If no columns were requested, the first source schema defines them.
+    void setColumns(const String& commaSeparatedNames);
+    bool hasColumns() const { return !this->m_columns.empty(); }
+    void mapSourceColumns(const std::vector<String>& sourceNames);
+
+    // Feed data. Samples must arrive in ascending time order.
+    void beginSample(time_t t);
+    void addValue(int sourceColumn, float value);
+    void finish();
+    bool isFinished() const { return this->m_finished; }
+
+    // Drain formatted output
+    size_t pendingOutput() const { return this->m_out.length() - this->m_outPosition; }
+    size_t readOutput(uint8_t* buffer, size_t maxLen);
+
+  private:
+    void clearBucket();
+    void flushBucket();
+    void writeHeader();
+    void writeValue(float value);
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Reads the daily "Sensor Values yyyy-mm-dd" files for a time range and feeds them to
+// an aggregator. The binary file of a day is read if there is one, the CSV file otherwise.
+// The file of a day stays open while it is read, the SD card is locked for one block read
+// at a time only, and at most a few blocks are read per call, so the web server is never
+// held up for long by a large query.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+class SensorHistoryFileReader {
+  private:
+    static const int READ_BUFFER_SIZE = 512;
+    static const int LINE_BUFFER_SIZE = 1024;
+
+    SdFs* m_sd;
+    SdAccessLock* m_sdMutex;
+    SensorHistoryAggregator& m_aggregator;
+    SensorLogBinaryReader m_binaryReader;
+    FsFile m_file;             // CSV file of the current day, once opened
+
+    long m_day;                // Day currently being read (days since 1970-01-01)
+    long m_lastDay;            // Last day to read
+    bool m_dayOpened;          // Start position within the current day has been determined
+    uint64_t m_filePosition;   // Next position to read from the current file
+    int m_schemaFieldCount;    // Number of fields in the last header line, 0 = no header seen
+    bool m_verifySchema;       // We skipped part of the file; check the next data line against the header
+    bool m_restartDay;         // The check failed; read the current day from the start
+    bool m_done;
+
+    // Binary files
+    bool m_binary;             // The current day has a binary file
+    uint64_t m_fileSize;
+    bool m_inSegment;
+    SensorLogBinarySegment m_segment;
+
+    char m_readBuffer[READ_BUFFER_SIZE];
+    char m_line[LINE_BUFFER_SIZE];
+    int m_lineLength;
+    bool m_lineOverflow;
+    bool m_skipPartialLine;    // Discard everything up to the first line break
+
+  public:
+    SensorHistoryFileReader(SdFs* sd, SdAccessLock* sdMutex, SensorHistoryAggregator& aggregator);
+    ~SensorHistoryFileReader() { this->closeFile(); }
+
+    // Read up to maxBlocks blocks; returns false when there is nothing more to read
+    bool readBlocks(int maxBlocks);
+
+  private:
+    int readAt(uint64_t position, uint64_t* fileSize = nullptr);
+    void closeFile();
+    void getFileName(char* buffer, size_t size, const char* extension) const;
+    void openDay();
+    uint64_t findPosition(time_t t, uint64_t fileSize);
+    void nextDay();
+    void processLine();
+    void processHeaderLine();
+    void processDataLine();
+    bool readBinaryBlock();
+};
+
+// Source for the /data/history chunked response
+class SensorHistoryQuery {
+  private:
+    static const int MAX_BLOCKS_PER_CHUNK = 16;
+
+    SensorHistoryAggregator m_aggregator;
+    SensorHistoryFileReader m_reader;
+
+  public:
+    SensorHistoryQuery(SdFs* sd, SdAccessLock* sdMutex, time_t from, time_t to, uint32_t step, SensorHistoryAggregator::Format format);
+    SensorHistoryAggregator& getAggregator() { return this->m_aggregator; }
+
+    // Returns the number of bytes written to the buffer; 0 with isDone() == false means
+    // no complete bucket is available yet
+    size_t read(uint8_t* buffer, size_t maxLen);
+    bool isDone() const { return this->m_aggregator.isFinished() && this->m_aggregator.pendingOutput() == 0; }
+};
+
+// Helpers for UTC time stamps in the sensor logs
+long daysFromCivil(int year, int month, int day);
+bool parseSensorLogTime(const char* text, time_t* result);
+
+#endif
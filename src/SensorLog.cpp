@@ -6,72 +6,72 @@
 #include "ValveManager.h"
 #include "SensorLog.h"
 #include "NeohubManager.h"
-#include "ValveManager.h"
-
-extern MyMutex sdCardMutex;
-extern SdFs sd;
+#include "RecentHistory.h"
+#include "SensorLogBinary.h"
+#include "SensorLogWriter.h"
 
 char sensorDataFileName[] = "Sensor Values yyyy-mm-dd.csv";
-char* getSensorDataFileName()
+char* getSensorDataFileName(const char* extension)
 {
-    sprintf(sensorDataFileName, "Sensor Values %s.csv", MyRtc.getTime().getDateText().c_str());
+    sprintf(sensorDataFileName, "Sensor Values %s.%s", MyRtc.getTime().getDateText().c_str(), extension);
     return sensorDataFileName;
 }
 
 void logSensors()
 {
-    if (sdCardMutex.lock(__PRETTY_FUNCTION__)) {
-        char* dataFileName = getSensorDataFileName();
-
-        bool printHeaderLine = !sd.exists(dataFileName);
-        if (SensorMap.hasChanged()) {
-            printHeaderLine = true;
-            // SensorMap.dump(Serial);
-            SensorMap.clearChanged();
-        }
-
-        FsFile dataFile = sd.open(dataFileName, (O_RDWR | O_CREAT | O_AT_END));
-        String logLine = getSensorLogLine();
-        if (dataFile && dataFile.isOpen()) {
-            if (printHeaderLine) dataFile.println(getSensorHeaderLine());
-            logLine = getSensorLogLine();
-            dataFile.println(logLine);
-            dataFile.close();
-            sdCardMutex.unlock();
-        }
-        else {
-            sdCardMutex.unlock();
-            MyLog.print("error opening ");
-            MyLog.println(dataFileName);
-        }
+    MyRtcTime now = MyRtc.getTime();
+    float values[SENSOR_LOG_MAX_COLUMNS];
+    int count = getSensorLogValues(values, SENSOR_LOG_MAX_COLUMNS);
+    bool columnsChanged = SensorMap.hasChanged();
+
+    // Recent history in memory first - this does not depend on the SD card
+    if (columnsChanged || RecentHistory.getColumnCount() != count) {
+        std::vector<String> names;
+        getSensorLogColumnNames(names);
+        RecentHistory.setColumns(names);
     }
-}
-
-void logSensorHeaderLine()
-{
-    if (sdCardMutex.lock(__PRETTY_FUNCTION__)) {
-        char* dataFileName = getSensorDataFileName();
-        FsFile dataFile = sd.open(dataFileName, (O_RDWR | O_CREAT | O_AT_END));
-        if (dataFile && dataFile.isOpen()) {
-            dataFile.println(getSensorHeaderLine());
-            dataFile.close();
-        }
-        sdCardMutex.unlock();
+    RecentHistory.append(now.getUnixTime(), values, count);
+
+    // Keep the change flag until the new columns have been written
+    bool written = true;
+#if SENSOR_LOG_BINARY
+    written &= SensorBinaryLog.append(getSensorDataFileName("bin"), now.getUnixTime(), values, count, columnsChanged);
+#endif
+#if SENSOR_LOG_CSV
+    bool printHeaderLine;
+    if (SensorLogWriter.open(getSensorDataFileName("csv"), &printHeaderLine)) {
+        if (printHeaderLine || columnsChanged) SensorLogWriter.writeLine(getSensorHeaderLine().c_str());
+        SensorLogWriter.writeLine(formatSensorLogLine(now, values, count).c_str());
+    }
+    else {
+        written = false;
+    }
+#endif
+    if (columnsChanged && written) {
+        // SensorMap.dump(Serial);
+        SensorMap.clearChanged();
     }
 }
 
-String getSensorLogLine()
+// Values for all columns after the time stamp, in the same order as the header line.
+// Missing values are NAN. Returns the number of columns.
+int getSensorLogValues(float* values, int maxCount)
 {
-    String result;
-    result = MyRtc.getTime().getTimestampText();
+    int n = 0;
+    auto add = [&](float value) {
+        if (n < maxCount) values[n] = value;
+        n++;
+    };
+    auto addTemperature = [&](double value) {
+        add(value > -50 ? (float)value : NAN);
+    };
 
     // Room control
     //  - Setpoint
     //  - Actual
-    result += ",";
-    result += String(ValveManager.getRoomSetpoint(), 1);
-    result += ",";
-    if (ValveManager.inputs.roomTemperature > -50) result += String(ValveManager.inputs.flowTemperature, 1);
+    ControlState state = ValveManager.getState();
+    add(state.roomSetpoint);
+    addTemperature(state.inputs.roomTemperature);
 
     // Manifold control
     //   - Setpoint
@@ -79,43 +79,23 @@ String getSensorLogLine()
     //   - return temperature
     //   - valve position
     //   - flow temperature
-    result += ",";
-    result += String(ValveManager.getFlowSetpoint(), 1);
-    result += ",";
-    if (ValveManager.inputs.inputTemperature > -50) result += String(ValveManager.inputs.inputTemperature, 1);
-    result += ",";
-    if (ValveManager.inputs.returnTemperature > -50) result += String(ValveManager.inputs.returnTemperature, 1);
-    result += ",";
-    result += String(ValveManager.outputs.targetValvePosition, 1);
-    result += "%,";
-    if (ValveManager.inputs.flowTemperature > -50) result += String(ValveManager.inputs.flowTemperature, 1);
+    add(state.outputs.targetFlowTemperature);
+    addTemperature(state.inputs.inputTemperature);
+    addTemperature(state.inputs.returnTemperature);
+    add(state.outputs.targetValvePosition);
+    addTemperature(state.inputs.flowTemperature);
 
     // All room sensors
-
     for (NeohubZone z : NeohubManager.getActiveZones()) {
         NeohubZoneData* d = NeohubManager.getZoneData(z.id);
-        if (!d) { result += ",,"; continue; }
-        result += ",";
-        if (d->roomTemperature != NeohubZoneData::NO_TEMPERATURE) {
-            result += String(d->roomTemperature, 1);
-        }
-        result += ",";
-        if (d->floorTemperature != NeohubZoneData::NO_TEMPERATURE) {
-            result += String(d->floorTemperature, 1);
-        }
+        addTemperature(d ? d->roomTemperature : NeohubZoneData::NO_TEMPERATURE);
+        addTemperature(d ? d->floorTemperature : NeohubZoneData::NO_TEMPERATURE);
     }
 
     for (NeohubZone z : NeohubManager.getMonitoredZones()) {
         NeohubZoneData* d = NeohubManager.getZoneData(z.id);
-        if (!d) { result += ",,"; continue; }
-        result += ",";
-        if (d->roomTemperature != NeohubZoneData::NO_TEMPERATURE) {
-            result += String(d->roomTemperature, 1);
-        }
-        result += ",";
-        if (d->floorTemperature != NeohubZoneData::NO_TEMPERATURE) {
-            result += String(d->floorTemperature, 1);
-        }
+        addTemperature(d ? d->roomTemperature : NeohubZoneData::NO_TEMPERATURE);
+        addTemperature(d ? d->floorTemperature : NeohubZoneData::NO_TEMPERATURE);
     }
 
     // All other sensors
@@ -123,8 +103,8 @@ String getSensorLogLine()
     String flowSensorId = Config.getFlowSensorId();
     String returnSensorId = Config.getReturnSensorId();
 
-    int n = SensorMap.getCount();
-    for (int i = 0; i < n; i++) {
+    int count = SensorMap.getCount();
+    for (int i = 0; i < count; i++) {
         SensorMapEntry* entry = SensorMap[i];
         if (entry->id == inputSensorId) continue;
         if (entry->id == flowSensorId) continue;
@@ -134,35 +114,55 @@ String getSensorLogLine()
         if (sensor) {
             temperature = sensor->calibratedTemperature();
         }
+        addTemperature(temperature);
+    }
+    return n < maxCount ? n : maxCount;
+}
+
+String formatSensorLogLine(const MyRtcTime& time, const float* values, int count)
+{
+    String result;
+    result.reserve(20 + count * 6);
+    result = time.getTimestampText();
+    for (int i = 0; i < count; i++) {
         result += ",";
-        if (temperature > -50) {
-            result += String(temperature, 1);
-        }
+        if (!isnan(values[i])) result += String(values[i], 1);
+        if (i == SENSOR_LOG_VALVE_COLUMN) result += "%";
     }
     return result;
 }
 
-String getSensorHeaderLine()
+String getSensorLogLine()
 {
-    String result;
-    result = "Time,Room Setpoint,Room,Flow Setpoint,Input,Return,Valve,Flow";
+    float values[SENSOR_LOG_MAX_COLUMNS];
+    int count = getSensorLogValues(values, SENSOR_LOG_MAX_COLUMNS);
+    return formatSensorLogLine(MyRtc.getTime(), values, count);
+}
+
+// Column names after "Time", in the same order as getSensorLogValues()
+void getSensorLogColumnNames(std::vector<String>& names)
+{
+    names.clear();
+    names.push_back("Room Setpoint");
+    names.push_back("Room");
+    names.push_back("Flow Setpoint");
+    names.push_back("Input");
+    names.push_back("Return");
+    names.push_back("Valve");
+    names.push_back("Flow");
 
     String inputSensorId = Config.getInputSensorId();
     String flowSensorId = Config.getFlowSensorId();
     String returnSensorId = Config.getReturnSensorId();
 
     for (NeohubZone z : NeohubManager.getActiveZones()) {
-        result += ",";
-        result += z.name;
-        result += ",";
-        result += z.name + "Floor";
+        names.push_back(z.name);
+        names.push_back(z.name + "Floor");
     }
 
     for (NeohubZone z : NeohubManager.getMonitoredZones()) {
-        result += ",";
-        result += z.name;
-        result += ",";
-        result += z.name + "Floor";
+        names.push_back(z.name);
+        names.push_back(z.name + "Floor");
     }
 
     int n = SensorMap.getCount();
@@ -171,10 +171,23 @@ String getSensorHeaderLine()
         if (entry->id == inputSensorId) continue;
         if (entry->id == flowSensorId) continue;
         if (entry->id == returnSensorId) continue;
-        result += ",";
-        result += entry->name;
+        names.push_back(entry->name);
     }
 
+    if (names.size() > SENSOR_LOG_MAX_COLUMNS) names.resize(SENSOR_LOG_MAX_COLUMNS);
+}
+
+String getSensorHeaderLine()
+{
+    std::vector<String> names;
+    getSensorLogColumnNames(names);
+
+    String result;
+    result = "Time";
+    for (const String& name : names) {
+        result += ",";
+        result += name;
+    }
     return result;
 }
 
@@ -2,9 +2,32 @@
 #define __SENSOR_LOG_H
 
 #include <Arduino.h>
+
+#include <vector>
+
+#include "MyRtc.h"
+
+// Columns in the sensor log after the time stamp
+#define SENSOR_LOG_MAX_COLUMNS 64
+#define SENSOR_LOG_VALVE_COLUMN 5  // Written with a "%" suffix
+
+// Formats of the daily "Sensor Values yyyy-mm-dd" files. The binary format (see
+// SensorLogBinary.h) takes about a third of the space; /files converts it to CSV
+// for downloads, so the CSV files are only needed for tools reading the SD card.
+#ifndef SENSOR_LOG_BINARY
+#define SENSOR_LOG_BINARY 1
+#endif
+#ifndef SENSOR_LOG_CSV
+#define SENSOR_LOG_CSV 0
+#endif
+
 void logSensors();
 String getSensorHeaderLine();
 String getSensorLogLine();
 void logSensorIssues();
 
+int getSensorLogValues(float* values, int maxCount);
+void getSensorLogColumnNames(std::vector<String>& names);
+String formatSensorLogLine(const MyRtcTime& time, const float* values, int count);
+
 #endif
@@ -0,0 +1,347 @@
+#include "SensorLogBinary.h"
+
+#include <memory>
+
+#include "MyLog.h"
+#include "SensorLog.h"
+
+static const size_t NAMES_BUFFER_SIZE = 1024;
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Decoding helpers
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// Checks the header and fills in the segment; the row count is as stored (0 = open segment)
+bool parseSensorLogBinaryHeader(const uint8_t* data, size_t len, uint64_t position, uint64_t fileSize, SensorLogBinarySegment& segment, uint16_t* namesLength)
+{
+    if (len < sizeof(SensorLogBinaryHeader)) return false;
+    SensorLogBinaryHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != SENSOR_LOG_BINARY_MAGIC || header.version != SENSOR_LOG_BINARY_VERSION) return false;
+    if (header.columnCount == 0 || header.columnCount > SENSOR_LOG_MAX_COLUMNS) return false;
+    if (header.headerSize < sizeof(header) + header.namesLength) return false;
+    if (position + header.headerSize > fileSize) return false;
+
+    segment.position = position;
+    segment.dataStart = position + header.headerSize;
+    segment.rowCount = header.rowCount;
+    segment.columnCount = header.columnCount;
+    segment.baseTime = header.baseTime;
+    if (namesLength) *namesLength = header.namesLength;
+    return true;
+}
+
+void splitSensorLogColumnNames(const char* names, std::vector<String>& result)
+{
+    result.clear();
+    const char* p = names;
+    for (;;) {
+        const char* end = strchr(p, ',');
+        String name;
+        if (end) {
+            name.concat(p, end - p);
+        }
+        else {
+            name = p;
+        }
+        result.push_back(name);
+        if (!end) break;
+        p = end + 1;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// CSensorBinaryLog
+////////////////////////////////////////////////////////////////////////////////////////////
+
+CSensorBinaryLog::CSensorBinaryLog() : m_file("SensorBinaryLog::m_mutex")
+{
+    this->m_fileName[0] = '\0';
+    this->m_segmentOpen = false;
+}
+
+void CSensorBinaryLog::setup(SdFs* sd, SdAccessLock* sdMutex)
+{
+    this->m_file.setup(sd, sdMutex);
+}
+
+bool CSensorBinaryLog::append(const char* fileName, time_t time, const float* values, int count, bool columnsChanged)
+{
+    if (count > SENSOR_LOG_MAX_COLUMNS) count = SENSOR_LOG_MAX_COLUMNS;
+
+    if (!this->m_file.isOpen() || strcmp(fileName, this->m_fileName) != 0) {
+        if (this->m_segmentOpen) this->closeSegment();
+        if (!this->openFile(fileName)) return false;
+    }
+
+    if (this->m_segmentOpen) {
+        if (columnsChanged || count != this->m_segment.columnCount || time < this->m_segment.baseTime || time - this->m_segment.baseTime > 0xFFFF) {
+            this->closeSegment();
+        }
+    }
+    if (!this->m_segmentOpen && !this->startSegment(time, count)) return false;
+
+    uint16_t row[1 + SENSOR_LOG_MAX_COLUMNS];
+    row[0] = (uint16_t)(time - this->m_segment.baseTime);
+    for (int i = 0; i < count; i++) {
+        float v = values[i];
+        int16_t encoded = SENSOR_LOG_BINARY_MISSING;
+        if (!isnan(v)) {
+            long centi = lroundf(v * 100.0f);
+            if (centi > INT16_MAX) centi = INT16_MAX;
+            if (centi < -INT16_MAX) centi = -INT16_MAX;
+            encoded = (int16_t)centi;
+        }
+        row[1 + i] = (uint16_t)encoded;
+    }
+
+    if (!this->m_file.write(row, this->m_segment.rowSize())) {
+        // Possibly a partial row: reopen and recover the file before the next row
+        this->m_segmentOpen = false;
+        this->m_fileName[0] = '\0';
+        return false;
+    }
+    this->m_segment.rowCount++;
+    return true;
+}
+
+bool CSensorBinaryLog::openFile(const char* fileName)
+{
+    bool isEmpty;
+    this->m_segmentOpen = false;
+    if (!this->m_file.open(fileName, &isEmpty)) return false;
+    strlcpy(this->m_fileName, fileName, sizeof(this->m_fileName));
+    if (!isEmpty) this->recover();
+    return true;
+}
+
+// The file was not closed properly: set the row count of the segment that was being
+// written, and cut off a partial row or anything else that can't be read back
+void CSensorBinaryLog::recover()
+{
+    uint64_t size = this->m_file.size();
+    uint64_t position = 0;
+    while (position < size) {
+        uint8_t buffer[sizeof(SensorLogBinaryHeader)];
+        SensorLogBinarySegment segment;
+        int n = this->m_file.readAt(position, buffer, sizeof(buffer));
+        if (n != sizeof(buffer) || !parseSensorLogBinaryHeader(buffer, n, position, size, segment, nullptr)) break;
+
+        if (segment.rowCount == 0) {
+            uint32_t rows = (size - segment.dataStart) / segment.rowSize();
+            if (rows == 0) break;
+            segment.rowCount = rows;
+            this->m_file.patch(position + offsetof(SensorLogBinaryHeader, rowCount), &rows, sizeof(rows));
+        }
+        if (segment.end() > size) break;
+        position = segment.end();
+    }
+
+    if (position < size) {
+        MyLog.print("Truncating ");
+        MyLog.println(this->m_fileName);
+        this->m_file.truncate(position);
+    }
+}
+
+bool CSensorBinaryLog::startSegment(time_t time, int count)
+{
+    std::vector<String> names;
+    getSensorLogColumnNames(names);
+    String joined;
+    for (size_t i = 0; i < names.size(); i++) {
+        if (i > 0) joined += ",";
+        joined += names[i];
+    }
+    if (joined.length() >= NAMES_BUFFER_SIZE) joined.remove(NAMES_BUFFER_SIZE - 1);
+
+    SensorLogBinaryHeader header;
+    header.magic = SENSOR_LOG_BINARY_MAGIC;
+    header.version = SENSOR_LOG_BINARY_VERSION;
+    header.headerSize = sizeof(header) + joined.length();
+    header.baseTime = time;
+    header.rowCount = 0;
+    header.columnCount = count;
+    header.namesLength = joined.length();
+
+    uint64_t position = this->m_file.size();
+    if (!this->m_file.write(&header, sizeof(header)) || !this->m_file.write(joined.c_str(), joined.length())) {
+        this->m_fileName[0] = '\0';
+        return false;
+    }
+
+    this->m_segment.position = position;
+    this->m_segment.dataStart = position + header.headerSize;
+    this->m_segment.rowCount = 0;
+    this->m_segment.columnCount = count;
+    this->m_segment.baseTime = time;
+    this->m_segmentOpen = true;
+    return true;
+}
+
+void CSensorBinaryLog::closeSegment()
+{
+    uint32_t rows = this->m_segment.rowCount;
+    this->m_file.patch(this->m_segment.position + offsetof(SensorLogBinaryHeader, rowCount), &rows, sizeof(rows));
+    this->m_segmentOpen = false;
+}
+
+CSensorBinaryLog SensorBinaryLog;
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// SensorLogBinaryReader
+////////////////////////////////////////////////////////////////////////////////////////////
+
+SensorLogBinaryReader::SensorLogBinaryReader(SdFs* sd, SdAccessLock* sdMutex, const char* fileName /* = "" */)
+{
+    this->m_sd = sd;
+    this->m_sdMutex = sdMutex;
+    this->m_fileName[0] = '\0';
+    this->setFileName(fileName);
+}
+
+void SensorLogBinaryReader::setFileName(const char* fileName)
+{
+    if (strcmp(this->m_fileName, fileName) == 0) return;
+    this->close();
+    strlcpy(this->m_fileName, fileName, sizeof(this->m_fileName));
+}
+
+void SensorLogBinaryReader::close()
+{
+    if (!this->m_file.isOpen()) return;
+    if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__)) return;
+    this->m_file.close();
+    this->m_sdMutex->unlock();
+}
+
+int SensorLogBinaryReader::readAt(uint64_t position, void* buffer, size_t len, uint64_t* fileSize)
+{
+    if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__)) return -1;
+    int bytesRead = -1;
+    if (!this->m_file.isOpen()) this->m_file = this->m_sd->open(this->m_fileName, O_RDONLY);
+    if (this->m_file.isOpen()) {
+        bytesRead = 0;
+        if (fileSize) *fileSize = this->m_file.size();
+        if (len > 0 && this->m_file.seek(position)) {
+            bytesRead = this->m_file.read(buffer, len);
+            if (bytesRead < 0) bytesRead = 0;
+        }
+    }
+    this->m_sdMutex->unlock();
+    return bytesRead;
+}
+
+bool SensorLogBinaryReader::readSegment(uint64_t position, uint64_t fileSize, SensorLogBinarySegment& segment, char* names, size_t namesSize)
+{
+    uint8_t buffer[sizeof(SensorLogBinaryHeader)];
+    uint16_t namesLength;
+    int n = this->readAt(position, buffer, sizeof(buffer));
+    if (n != sizeof(buffer) || !parseSensorLogBinaryHeader(buffer, n, position, fileSize, segment, &namesLength)) return false;
+    if (namesLength >= namesSize) return false;
+    if (this->readAt(position + sizeof(SensorLogBinaryHeader), names, namesLength) != namesLength) return false;
+    names[namesLength] = '\0';
+
+    // The segment being written extends to the end of the file
+    if (segment.rowCount == 0) segment.rowCount = (fileSize - segment.dataStart) / segment.rowSize();
+    return true;
+}
+
+uint32_t SensorLogBinaryReader::findRow(const SensorLogBinarySegment& segment, time_t t)
+{
+    if (t <= segment.baseTime) return 0;
+    if (t > segment.baseTime + 0xFFFF) return segment.rowCount;
+
+    uint32_t low = 0;
+    uint32_t high = segment.rowCount;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        uint16_t offset;
+        if (this->readAt(segment.dataStart + (uint64_t)middle * segment.rowSize(), &offset, sizeof(offset)) != sizeof(offset)) break;
+        if (segment.baseTime + offset < t) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// SensorLogBinaryCsvSource
+////////////////////////////////////////////////////////////////////////////////////////////
+
+SensorLogBinaryCsvSource::SensorLogBinaryCsvSource(SdFs* sd, SdAccessLock* sdMutex, const char* fileName)
+    : m_reader(sd, sdMutex, fileName)
+{
+    this->m_position = 0;
+    this->m_inSegment = false;
+    this->m_done = false;
+    this->m_outPosition = 0;
+}
+
+size_t SensorLogBinaryCsvSource::read(uint8_t* buffer, size_t maxLen)
+{
+    while (this->m_outPosition >= this->m_out.length() && !this->m_done) {
+        this->m_out = "";  // keeps the allocated buffer
+        this->m_outPosition = 0;
+        this->readMore();
+    }
+
+    size_t n = this->m_out.length() - this->m_outPosition;
+    if (n > maxLen) n = maxLen;
+    memcpy(buffer, this->m_out.c_str() + this->m_outPosition, n);
+    this->m_outPosition += n;
+    return n;
+}
+
+// Convert the next segment header or block of rows into m_out
+void SensorLogBinaryCsvSource::readMore()
+{
+    if (!this->m_inSegment) {
+        uint64_t fileSize = 0;
+        if (this->m_reader.readAt(0, nullptr, 0, &fileSize) < 0 || this->m_position >= fileSize) {
+            this->m_done = true;
+            return;
+        }
+        std::unique_ptr<char[]> names(new char[NAMES_BUFFER_SIZE]);
+        if (!this->m_reader.readSegment(this->m_position, fileSize, this->m_segment, names.get(), NAMES_BUFFER_SIZE)) {
+            this->m_done = true;
+            return;
+        }
+        this->m_out += "Time,";
+        this->m_out += names.get();
+        this->m_out += "\r\n";
+        this->m_position = this->m_segment.dataStart;
+        this->m_inSegment = true;
+        return;
+    }
+
+    size_t rowSize = this->m_segment.rowSize();
+    uint64_t remaining = (this->m_segment.end() - this->m_position) / rowSize;
+    if (remaining == 0) {
+        this->m_inSegment = false;
+        return;
+    }
+    size_t rows = READ_BUFFER_SIZE / rowSize;
+    if (rows > remaining) rows = remaining;
+
+    uint16_t buffer[READ_BUFFER_SIZE / 2];
+    int bytesRead = this->m_reader.readAt(this->m_position, buffer, rows * rowSize);
+    if (bytesRead < (int)rowSize) {
+        this->m_done = true;
+        return;
+    }
+    rows = bytesRead / rowSize;
+
+    float values[SENSOR_LOG_MAX_COLUMNS];
+    int count = this->m_segment.columnCount;
+    for (size_t r = 0; r < rows; r++) {
+        const uint16_t* row = buffer + r * (rowSize / 2);
+        for (int i = 0; i < count; i++) values[i] = decodeSensorLogBinaryValue((int16_t)row[1 + i]);
+        this->m_out += formatSensorLogLine(MyRtcTime(this->m_segment.baseTime + row[0]), values, count);
+        this->m_out += "\r\n";
+    }
+    this->m_position += rows * rowSize;
+}
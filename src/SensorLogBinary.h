@@ -0,0 +1,137 @@
+#ifndef __SENSOR_LOG_BINARY_H
+#define __SENSOR_LOG_BINARY_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+
+#include <vector>
+
+#include "SdAccessLock.h"
+#include "SensorLogWriter.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Binary sensor log "Sensor Values yyyy-mm-dd.bin"
+//
+// The file is a sequence of segments. Each segment starts with a header (below) followed
+// by the column names, comma separated as in the CSV header line but without "Time".
+// Then follow fixed size rows:
+//
+//    uint16_t    seconds since the base time of the segment
+//    int16_t     value of each column in 1/100 (degrees or %), INT16_MIN if missing
+//
+// All numbers are little endian. A new segment is started when the columns change, when
+// the time no longer fits into 16 bits (after ~18 hours) and when the file is reopened
+// after a restart. The last segment has a row count of 0 while it is being written; it
+// extends to the end of the file. With rows of a fixed size, any row of a segment can be
+// read directly, so queries bisect for the start time instead of reading from the top.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+#define SENSOR_LOG_BINARY_MAGIC 0x31425653  // "SVB1"
+#define SENSOR_LOG_BINARY_VERSION 1
+#define SENSOR_LOG_BINARY_MISSING INT16_MIN
+
+struct __attribute__((packed)) SensorLogBinaryHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize;    // Including the column names
+    uint32_t baseTime;      // UTC, seconds since 1970
+    uint32_t rowCount;      // 0 for the segment being written
+    uint16_t columnCount;
+    uint16_t namesLength;
+};
+
+// Position and layout of a segment in a file
+struct SensorLogBinarySegment {
+    uint64_t position;
+    uint64_t dataStart;
+    uint32_t rowCount;
+    uint16_t columnCount;
+    time_t baseTime;
+
+    size_t rowSize() const { return 2 + 2 * this->columnCount; }
+    uint64_t end() const { return this->dataStart + (uint64_t)this->rowCount * this->rowSize(); }
+};
+
+// Writes the binary log; called by logSensors()
+class CSensorBinaryLog {
+  private:
+    CSensorLogWriter m_file;
+    char m_fileName[64];
+    bool m_segmentOpen;
+    SensorLogBinarySegment m_segment;
+
+  public:
+    CSensorBinaryLog();
+    void setup(SdFs* sd, SdAccessLock* sdMutex);
+    bool append(const char* fileName, time_t time, const float* values, int count, bool columnsChanged);
+    void flush() { this->m_file.flush(); }
+    void release(const char* fileName) { this->m_file.release(fileName); }
+
+  private:
+    bool openFile(const char* fileName);
+    void recover();
+    bool startSegment(time_t time, int count);
+    void closeSegment();
+};
+
+extern CSensorBinaryLog SensorBinaryLog;
+
+// Reads parts of a binary log file, locking the SD card for each read only. The file is
+// opened by the first read and stays open until the name changes or the reader goes away.
+class SensorLogBinaryReader {
+  private:
+    SdFs* m_sd;
+    SdAccessLock* m_sdMutex;
+    char m_fileName[64];
+    FsFile m_file;
+
+  public:
+    SensorLogBinaryReader(SdFs* sd, SdAccessLock* sdMutex, const char* fileName = "");
+    ~SensorLogBinaryReader() { this->close(); }
+    SensorLogBinaryReader(const SensorLogBinaryReader&) = delete;
+    SensorLogBinaryReader& operator=(const SensorLogBinaryReader&) = delete;
+
+    void setFileName(const char* fileName);
+    void close();
+
+    // Returns the number of bytes read, -1 if the file does not exist
+    int readAt(uint64_t position, void* buffer, size_t len, uint64_t* fileSize = nullptr);
+
+    // Read the segment header at position; the column names go into names (zero terminated)
+    bool readSegment(uint64_t position, uint64_t fileSize, SensorLogBinarySegment& segment, char* names, size_t namesSize);
+
+    // First row of the segment with a time >= t (rowCount if there is none)
+    uint32_t findRow(const SensorLogBinarySegment& segment, time_t t);
+};
+
+// Decoding helpers
+bool parseSensorLogBinaryHeader(const uint8_t* data, size_t len, uint64_t position, uint64_t fileSize, SensorLogBinarySegment& segment, uint16_t* namesLength);
+inline float decodeSensorLogBinaryValue(int16_t value) { return value == SENSOR_LOG_BINARY_MISSING ? NAN : value / 100.0f; }
+void splitSensorLogColumnNames(const char* names, std::vector<String>& result);
+
+// CSV text for a binary log file, for downloads
+class SensorLogBinaryCsvSource {
+  private:
+    static const int READ_BUFFER_SIZE = 512;
+
+    SensorLogBinaryReader m_reader;
+    SensorLogBinarySegment m_segment;
+    uint64_t m_position;
+    bool m_inSegment;
+    bool m_done;
+    String m_out;
+    size_t m_outPosition;
+
+  public:
+    SensorLogBinaryCsvSource(SdFs* sd, SdAccessLock* sdMutex, const char* fileName);
+
+    // Returns 0 when the file has been converted completely
+    size_t read(uint8_t* buffer, size_t maxLen);
+
+  private:
+    void readMore();
+};
+
+#endif
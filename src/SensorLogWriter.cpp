@@ -0,0 +1,206 @@
+#include "SensorLogWriter.h"
+
+#include "MyLog.h"
+
+CSensorLogWriter::CSensorLogWriter(const char* name) : m_mutex(name)
+{
+    this->m_fileName[0] = '\0';
+}
+
+void CSensorLogWriter::setup(SdFs* sd, SdAccessLock* sdMutex)
+{
+    this->m_sd = sd;
+    this->m_sdMutex = sdMutex;
+}
+
+bool CSensorLogWriter::open(const char* fileName, bool* isEmpty)
+{
+    if (!this->m_sd) return false;
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return false;
+
+    bool result = true;
+    if (this->m_file.isOpen() && strcmp(fileName, this->m_fileName) == 0) {
+        *isEmpty = this->m_fileSize + this->m_used == 0;
+    }
+    else {
+        if (this->m_file.isOpen()) this->closeFile();
+
+        if (this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_CONTROL)) {
+            this->m_file = this->m_sd->open(fileName, O_RDWR | O_CREAT | O_AT_END);
+            if (this->m_file.isOpen()) {
+                this->m_fileSize = this->m_file.fileSize();
+                if (this->m_fileSize == 0) {
+                    // Not fatal if there is no contiguous space, the file just grows as usual
+                    this->m_file.preAllocate(PREALLOCATE_SIZE);
+                }
+                else {
+                    // Release clusters preallocated before a reset that did not close the file
+                    this->m_file.truncate();
+                }
+            }
+            this->m_sdMutex->unlock();
+        }
+
+        if (this->m_file.isOpen()) {
+            strlcpy(this->m_fileName, fileName, sizeof(this->m_fileName));
+            this->m_used = 0;
+            this->m_dirty = false;
+            this->m_lastSyncMillis = millis();
+            *isEmpty = this->m_fileSize == 0;
+        }
+        else {
+            this->m_fileName[0] = '\0';
+            MyLog.print("error opening ");
+            MyLog.println(fileName);
+            result = false;
+        }
+    }
+
+    this->m_mutex.unlock();
+    return result;
+}
+
+bool CSensorLogWriter::write(const void* data, size_t len)
+{
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return false;
+    bool result = this->append(data, len);
+    this->m_mutex.unlock();
+    return result;
+}
+
+bool CSensorLogWriter::writeLine(const char* line)
+{
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return false;
+    bool result = this->append(line, strlen(line)) && this->append("\r\n", 2);
+    this->m_mutex.unlock();
+    return result;
+}
+
+// Fill the buffer up to the next sector boundary in the file, then write it. Must hold m_mutex.
+bool CSensorLogWriter::append(const void* data, size_t len)
+{
+    if (!this->m_file.isOpen()) return false;
+
+    bool result = true;
+    const uint8_t* p = (const uint8_t*)data;
+    while (len > 0) {
+        size_t room = SECTOR_SIZE - (this->m_fileSize + this->m_used) % SECTOR_SIZE;
+        size_t n = len < room ? len : room;
+        memcpy(this->m_buffer + this->m_used, p, n);
+        this->m_used += n;
+        p += n;
+        len -= n;
+        if (n == room) result &= this->writeBuffer();
+    }
+
+    if (millis() - this->m_lastSyncMillis >= SYNC_INTERVAL_MS) result &= this->sync();
+    return result;
+}
+
+uint64_t CSensorLogWriter::size()
+{
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return 0;
+    uint64_t result = this->m_fileSize + this->m_used;
+    this->m_mutex.unlock();
+    return result;
+}
+
+int CSensorLogWriter::readAt(uint64_t position, void* buffer, size_t len)
+{
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return -1;
+    int result = -1;
+    if (this->m_file.isOpen() && this->writeBuffer() && this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_CONTROL)) {
+        if (this->m_file.seekSet(position)) result = this->m_file.read(buffer, len);
+        this->m_file.seekSet(this->m_fileSize);
+        this->m_sdMutex->unlock();
+    }
+    this->m_mutex.unlock();
+    return result;
+}
+
+bool CSensorLogWriter::patch(uint64_t position, const void* data, size_t len)
+{
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return false;
+    bool result = false;
+    if (this->m_file.isOpen() && this->writeBuffer() && this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_CONTROL)) {
+        if (this->m_file.seekSet(position)) result = this->m_file.write((const uint8_t*)data, len) == len;
+        this->m_file.seekSet(this->m_fileSize);
+        this->m_sdMutex->unlock();
+        this->m_dirty = true;
+    }
+    this->m_mutex.unlock();
+    return result;
+}
+
+bool CSensorLogWriter::truncate(uint64_t size)
+{
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return false;
+    bool result = false;
+    if (this->m_file.isOpen() && this->writeBuffer() && this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_CONTROL)) {
+        result = this->m_file.truncate(size);
+        this->m_fileSize = this->m_file.fileSize();
+        this->m_file.seekSet(this->m_fileSize);
+        this->m_sdMutex->unlock();
+        this->m_dirty = true;
+    }
+    this->m_mutex.unlock();
+    return result;
+}
+
+void CSensorLogWriter::flush()
+{
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return;
+    if (this->m_file.isOpen()) this->sync();
+    this->m_mutex.unlock();
+}
+
+void CSensorLogWriter::release(const char* fileName)
+{
+    if (fileName[0] == '/') fileName++;
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return;
+    if (this->m_file.isOpen() && strcmp(fileName, this->m_fileName) == 0) this->closeFile();
+    this->m_mutex.unlock();
+}
+
+// Write the buffer. Must hold m_mutex.
+bool CSensorLogWriter::writeBuffer()
+{
+    if (this->m_used == 0) return true;
+    if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_CONTROL)) return false;
+    size_t written = this->m_file.write(this->m_buffer, this->m_used);
+    this->m_sdMutex->unlock();
+
+    // On a write error the buffer is dropped; it only holds a few lines
+    this->m_fileSize += written;
+    this->m_used = 0;
+    this->m_dirty = true;
+    return written > 0;
+}
+
+// Write the buffer and update the directory entry. Must hold m_mutex.
+bool CSensorLogWriter::sync()
+{
+    bool result = this->writeBuffer();
+    if (this->m_dirty && this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_CONTROL)) {
+        result &= this->m_file.sync();
+        this->m_sdMutex->unlock();
+        this->m_dirty = false;
+    }
+    this->m_lastSyncMillis = millis();
+    return result;
+}
+
+// Must hold m_mutex.
+void CSensorLogWriter::closeFile()
+{
+    this->writeBuffer();
+    if (this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_CONTROL)) {
+        this->m_file.truncate();    // Unused preallocated clusters
+        this->m_file.close();
+        this->m_sdMutex->unlock();
+    }
+    this->m_fileName[0] = '\0';
+    this->m_dirty = false;
+}
+
+CSensorLogWriter SensorLogWriter("SensorLogWriter::m_mutex");
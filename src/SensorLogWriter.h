@@ -0,0 +1,80 @@
+#ifndef __SENSOR_LOG_WRITER_H
+#define __SENSOR_LOG_WRITER_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+
+#include "MyMutex.h"
+#include "SdAccessLock.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Writer for the daily sensor log files (CSV and binary)
+//
+// The file of the day is kept open instead of being opened, appended to and closed for
+// every line. A new file is preallocated so it gets contiguous clusters. Lines are
+// collected in a buffer and written in whole, sector aligned blocks of 512 bytes, which
+// SdFat passes straight to the card. The file is synced (which updates the FAT and the
+// directory entry, and so the file size other readers see) every SYNC_INTERVAL_MS and
+// when the day changes. Unused preallocated space is released when the file is closed.
+//
+// Lines not yet synced are lost on a power failure or reset.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+class CSensorLogWriter {
+  private:
+    static const size_t SECTOR_SIZE = 512;
+    static const uint32_t PREALLOCATE_SIZE = 4 * 1024 * 1024;   // ~200 bytes every 5s for a day
+    static const uint32_t SYNC_INTERVAL_MS = 60 * 1000;
+
+    SdFs* m_sd = nullptr;
+    SdAccessLock* m_sdMutex = nullptr;
+    MyMutex m_mutex;
+
+    FsFile m_file;
+    char m_fileName[64];
+    uint64_t m_fileSize = 0;        // Bytes written to the file, not including the buffer
+
+    uint8_t m_buffer[SECTOR_SIZE];
+    size_t m_used = 0;
+    bool m_dirty = false;           // Written since the last sync
+    uint32_t m_lastSyncMillis = 0;
+
+  public:
+    CSensorLogWriter(const char* name);
+    void setup(SdFs* sd, SdAccessLock* sdMutex);
+    bool isOpen() const { return this->m_file.isOpen(); }
+
+    // Make fileName the file lines are written to. Closes the previous file if it is a
+    // different one. isEmpty is set if the file is new, i.e. needs a header line.
+    bool open(const char* fileName, bool* isEmpty);
+
+    // Append data, or a line (a CR/LF is added)
+    bool write(const void* data, size_t len);
+    bool writeLine(const char* line);
+
+    // Size including buffered data
+    uint64_t size();
+
+    // Access to earlier parts of the file; these write the buffer first
+    int readAt(uint64_t position, void* buffer, size_t len);
+    bool patch(uint64_t position, const void* data, size_t len);
+    bool truncate(uint64_t size);
+
+    // Write buffered lines and update the directory entry
+    void flush();
+
+    // Close the file if it is the one being written, e.g. before it is deleted
+    void release(const char* fileName);
+
+  private:
+    bool append(const void* data, size_t len);
+    bool writeBuffer();
+    bool sync();
+    void closeFile();
+};
+
+extern CSensorLogWriter SensorLogWriter;    // CSV
+
+#endif
@@ -1,20 +1,25 @@
 #include "MyConfig.h"
 
 #include "../heatingControl/NeohubManager.h"
+#include "MemDebug.h"
 #include "MyLog.h"
 #include "SensorMap.h"
 
 CConfig Config;
 
-void CConfig::saveToSdCard(SdFs& fs, MyMutex& fsMutex, const String& filename) const
+void CConfig::saveToSdCard(SdFs& fs, SdAccessLock& fsMutex, const String& filename) const
 {
-    JsonDocument configJson;
+    JsonDocument configJson(&JsonAllocator);
 
     configJson["name"]                     = name;
     configJson["hostname"]                 = hostname;
     configJson["neohubAddress"]            = neohubAddress;
     configJson["neohubToken"]              = neohubToken;
     configJson["heatingControllerAddress"] = heatingControllerAddress;
+    configJson["heatingControllerMulticast"] = heatingControllerMulticast;
+    configJson["actAsHeatingController"]   = actAsHeatingController;
+    configJson["demandWeights"]            = demandWeights;
+    configJson["boilerUseWeightedAverage"] = boilerUseWeightedAverage;
 
     configJson["flowMaxSetpoint"]          = flowMaxSetpoint;
     configJson["flowMinSetpoint"]          = flowMinSetpoint;
@@ -26,6 +31,7 @@ void CConfig::saveToSdCard(SdFs& fs, MyMutex& fsMutex, const String& filename) c
     configJson["flowProportionalGain"]     = flowProportionalGain;
     configJson["flowIntegralSeconds"]      = flowIntegralSeconds;  
     configJson["flowValveInverted"]        = flowValveInverted;
+    configJson["flowFeedforward"]          = flowFeedforward;
 
     configJson["roomSetpoint"]             = roomSetpoint;
     configJson["roomProportionalGain"]     = roomProportionalGain;  
@@ -53,7 +59,7 @@ void CConfig::saveToSdCard(SdFs& fs, MyMutex& fsMutex, const String& filename) c
 
     // Serialize to SD card
     MyLog.print("Saving configuration...");
-    if (fsMutex.lock(__PRETTY_FUNCTION__)) {
+    if (fsMutex.lock(__PRETTY_FUNCTION__, SD_PRIORITY_LOG)) {
         FsFile file = fs.open(filename, O_WRONLY | O_CREAT | O_TRUNC);
         if (!file) {
             MyLog.print("Failed to open config file for writing: ");
@@ -68,12 +74,12 @@ void CConfig::saveToSdCard(SdFs& fs, MyMutex& fsMutex, const String& filename) c
     MyLog.println("done");
 }
 
-void CConfig::loadFromSdCard(SdFs& fs, MyMutex& fsMutex, const String& filename)
+void CConfig::loadFromSdCard(SdFs& fs, SdAccessLock& fsMutex, const String& filename)
 {
     MyLog.print("Loading configuration...");
 
     String contents;
-    if (fsMutex.lock(__PRETTY_FUNCTION__)) {
+    if (fsMutex.lock(__PRETTY_FUNCTION__, SD_PRIORITY_LOG)) {
         FsFile file = fs.open(filename, O_RDONLY);
         if (!file) {
             fsMutex.unlock();
@@ -87,7 +93,7 @@ void CConfig::loadFromSdCard(SdFs& fs, MyMutex& fsMutex, const String& filename)
         fsMutex.unlock();
     }
 
-    JsonDocument configJson;
+    JsonDocument configJson(&JsonAllocator);
     DeserializationError error = deserializeJson(configJson, contents);
     if (error) {
         MyLog.print("Failed to parse config file: ");
@@ -101,6 +107,10 @@ void CConfig::loadFromSdCard(SdFs& fs, MyMutex& fsMutex, const String& filename)
     neohubAddress               = configJson["neohubAddress"] | emptyString;
     neohubToken                 = configJson["neohubToken"] | emptyString;
     heatingControllerAddress    = configJson["heatingControllerAddress"] | emptyString;
+    heatingControllerMulticast  = configJson["heatingControllerMulticast"].as<bool>();
+    actAsHeatingController      = configJson["actAsHeatingController"] | false;
+    demandWeights               = configJson["demandWeights"] | emptyString;
+    boilerUseWeightedAverage    = configJson["boilerUseWeightedAverage"] | false;
 
     flowMaxSetpoint             = configJson["flowMaxSetpoint"];
     flowMinSetpoint             = configJson["flowMinSetpoint"];
@@ -112,6 +122,7 @@ void CConfig::loadFromSdCard(SdFs& fs, MyMutex& fsMutex, const String& filename)
     flowProportionalGain        = configJson["flowProportionalGain"].as<double>();
     flowIntegralSeconds         = configJson["flowIntegralSeconds"].as<double>(); 
     flowValveInverted           = configJson["flowValveInverted"].as<bool>();
+    flowFeedforward             = configJson["flowFeedforward"] | false;
 
     roomSetpoint                = configJson["roomSetpoint"].as<double>();
     roomProportionalGain        = configJson["roomProportionalGain"].as<double>();
@@ -143,9 +154,18 @@ void CConfig::loadFromSdCard(SdFs& fs, MyMutex& fsMutex, const String& filename)
 void CConfig::print(CMyLog& p) const
 {
     p.println("Config:");
-    p.printf("  hostname: %s\n", hostname.c_str());
+    p.printf("  hostname: %s%s\n", hostname.c_str(), actAsHeatingController ? " (heating controller)" : "");
     p.printf("  Room: %.1f, Kp = %.1f, Ti = %.0f minutes\n", roomSetpoint, roomProportionalGain, roomIntegralMinutes);
-    p.printf("  Flow: %.1f-%.1f, Kp = %.1f, Ti = %.0f seconds\n", flowMinSetpoint, flowMaxSetpoint, flowProportionalGain, flowIntegralSeconds);
+    p.printf(
+        "  Flow: %.1f-%.1f, Kp = %.1f, Ti = %.0f seconds%s\n", flowMinSetpoint, flowMaxSetpoint,
+        flowProportionalGain, flowIntegralSeconds, flowFeedforward ? ", feedforward" : ""
+    );
+    if (actAsHeatingController) {
+        p.printf(
+            "  Boiler flow: %s, weights: %s\n", boilerUseWeightedAverage ? "weighted average" : "highest demand",
+            demandWeights == "" ? "none" : demandWeights.c_str()
+        );
+    }
 }
 
 void CConfig::applyDefaults()
@@ -159,4 +179,5 @@ void CConfig::applyDefaults()
     
     this->flowProportionalGain    = 3;
     this->flowIntegralSeconds     = 10;
+    this->flowFeedforward         = true;
 }
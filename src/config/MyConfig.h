@@ -6,6 +6,7 @@
 #include <SdFat.h>
 
 #include "MyLog.h"
+#include "SdAccessLock.h"
 
 class CConfig {
   private:
@@ -14,6 +15,10 @@ class CConfig {
     String neohubAddress;
     String neohubToken;
     String heatingControllerAddress;
+    bool heatingControllerMulticast;    // Send manifold data by UDP multicast instead of HTTP
+    bool actAsHeatingController;        // Advertise as the controller and discover the manifolds
+    String demandWeights;               // Controller: "name=weight, ..." for the weighted demand
+    bool boilerUseWeightedAverage;      // Controller: boiler flow from the weighted average instead of the highest demand
 
     double flowMaxSetpoint;
     double flowMinSetpoint;
@@ -25,6 +30,7 @@ class CConfig {
     double flowProportionalGain;
     double flowIntegralSeconds;
     bool flowValveInverted;
+    bool flowFeedforward;               // Valve position from input and return temperature, trimmed by the controller
 
     double roomSetpoint;
     double roomProportionalGain;
@@ -36,6 +42,10 @@ class CConfig {
     inline const String& getNeohubAddress() const { return neohubAddress; };
     inline const String& getNeohubToken() const { return neohubToken; };
     inline const String& getHeatingControllerAddress() const { return heatingControllerAddress; };
+    inline bool getHeatingControllerMulticast() const { return heatingControllerMulticast; };
+    inline bool getActAsHeatingController() const { return actAsHeatingController; };
+    inline const String& getDemandWeights() const { return demandWeights; };
+    inline bool getBoilerUseWeightedAverage() const { return boilerUseWeightedAverage; };
 
     inline double getFlowMaxSetpoint() const { return flowMaxSetpoint; };
     inline double getFlowMinSetpoint() const { return flowMinSetpoint; };
@@ -47,6 +57,7 @@ class CConfig {
     inline double getFlowProportionalGain() const { return flowProportionalGain; };
     inline double getFlowIntegralSeconds() const { return flowIntegralSeconds; };
     inline bool getFlowValveInverted() const { return flowValveInverted; };
+    inline bool getFlowFeedforward() const { return flowFeedforward; };
 
     inline double getRoomSetpoint() const { return roomSetpoint; };
     inline double getRoomProportionalGain() const { return roomProportionalGain; };
@@ -57,6 +68,10 @@ class CConfig {
     inline void setNeohubAddress(const String& value) { neohubAddress = value; };
     inline void setNeohubToken(const String& value) { neohubToken = value; };
     inline void setHeatingControllerAddress(const String& value) { heatingControllerAddress = value; };
+    inline void setHeatingControllerMulticast(bool value) { heatingControllerMulticast = value; };
+    inline void setActAsHeatingController(bool value) { actAsHeatingController = value; };
+    inline void setDemandWeights(const String& value) { demandWeights = value; };
+    inline void setBoilerUseWeightedAverage(bool value) { boilerUseWeightedAverage = value; };
 
     inline void setFlowMaxSetpoint(double value) { flowMaxSetpoint = value; };
     inline void setFlowMinSetpoint(double value) { flowMinSetpoint = value; };
@@ -68,13 +83,14 @@ class CConfig {
     inline void setFlowProportionalGain(double value) { flowProportionalGain = value; };
     inline void setFlowIntegralSeconds(double value) { flowIntegralSeconds = value; };
     inline void setFlowValveInverted(bool value) { flowValveInverted = value; };
+    inline void setFlowFeedforward(bool value) { flowFeedforward = value; };
 
     inline void setRoomSetpoint(double value) { roomSetpoint = value; };
     inline void setRoomProportionalGain(double value) { roomProportionalGain = value; };
     inline void setRoomIntegralMinutes(double value) { roomIntegralMinutes = value; };
 
-    void saveToSdCard(SdFs& fs, MyMutex& fsMutex, const String& filename) const;
-    void loadFromSdCard(SdFs& fs, MyMutex& fsMutex, const String& filename);
+    void saveToSdCard(SdFs& fs, SdAccessLock& fsMutex, const String& filename) const;
+    void loadFromSdCard(SdFs& fs, SdAccessLock& fsMutex, const String& filename);
 
     void applyDefaults();
     void print(CMyLog& p) const;
@@ -0,0 +1,34 @@
+#include "BoilerDemand.h"
+
+#include "MyConfig.h"
+#include "ValveManager.h"
+
+CBoilerDemand BoilerDemand;
+
+void CBoilerDemand::setup()
+{
+    DemandAggregator.subscribe([this](const DemandSummary& summary) { this->apply(summary); });
+}
+
+void CBoilerDemand::refresh()
+{
+    DemandSummary summary = DemandAggregator.getSummary();
+    this->m_changes = summary.changes - 1;  // Apply it even if it was applied before
+    this->apply(summary);
+}
+
+// Called by the DemandAggregator, in the task that changed the demand
+void CBoilerDemand::apply(const DemandSummary& summary)
+{
+    uint32_t last = this->m_changes.load();
+    do {
+        if ((int32_t)(summary.changes - last) <= 0) return;     // Older than the one applied
+    } while (!this->m_changes.compare_exchange_weak(last, summary.changes));
+
+    double request = 0;
+    if (Config.getActAsHeatingController() && summary.active > 0) {
+        request = Config.getBoilerUseWeightedAverage() ? summary.weightedAverage : summary.highest;
+    }
+    this->m_request = (int32_t)round(request * 100);
+    ValveManager.setBoilerFlowRequest(request);
+}
@@ -0,0 +1,45 @@
+#ifndef __BOILER_DEMAND_H
+#define __BOILER_DEMAND_H
+
+#include <Arduino.h>
+
+#include <atomic>
+
+#include "DemandAggregator.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Flow temperature requested from the boiler by the heating controller
+//
+// Subscribes to the DemandAggregator and turns every new summary into the flow temperature
+// the boiler has to deliver: the highest demand of the manifolds, or their weighted average
+// if so configured, and 0 when no manifold reports. The request is handed to the
+// ValveManager, whose control task sends it to the second DAC channel; the subscriber only
+// stores it, so it never blocks the task that changed the demand.
+//
+// Summaries can arrive from several tasks at once; one older than the last one applied
+// (by DemandSummary::changes) is dropped. Only if this device acts as the heating
+// controller, otherwise the request stays at 0.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+class CBoilerDemand {
+  private:
+    std::atomic<uint32_t> m_changes{0};     // Of the last summary applied
+    std::atomic<int32_t> m_request{0};      // Hundredths of a degree C
+
+  public:
+    void setup();
+
+    // Apply the configuration (role, highest or weighted average) to the current demand
+    void refresh();
+
+    double getFlowRequest() const { return this->m_request.load() / 100.0; }
+
+  private:
+    void apply(const DemandSummary& summary);
+};
+
+extern CBoilerDemand BoilerDemand;
+
+#endif
@@ -0,0 +1,219 @@
+#include "DemandAggregator.h"
+
+#include "MyLog.h"
+
+CDemandAggregator DemandAggregator;
+
+CDemandAggregator::CDemandAggregator() : m_mutex("DemandAggregator")
+{
+}
+
+void CDemandAggregator::update(uint16_t nameId, double demand)
+{
+    DemandSummary summary;
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return;
+    this->ensureTimer();
+    uint32_t now = nowSecond();
+    this->advance(now);
+
+    if (nameId >= this->m_entries.size()) this->m_entries.resize(nameId + 1);
+    Entry& e = this->m_entries[nameId];
+    if (e.present) this->add(e, -1);
+    e.present = true;
+    e.aged = false;
+    e.demand = demand;
+    e.updateSecond = now;
+    this->add(e, 1);
+
+    if (this->m_highestId < 0 || demand >= this->m_summary.highest) {
+        this->m_highestId = nameId;
+        this->m_summary.highest = demand;
+    }
+    else if (this->m_highestId == nameId) {
+        this->findHighest();    // The highest demand went down
+    }
+
+    this->schedule(nameId, now + AGED_SECONDS);
+    this->schedule(nameId, now + DEAD_SECONDS);
+    this->changed();
+    summary = this->m_summary;
+    this->m_mutex.unlock();
+
+    this->notify(summary);
+}
+
+void CDemandAggregator::remove(uint16_t nameId)
+{
+    DemandSummary summary;
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return;
+    bool removed = nameId < this->m_entries.size() && this->m_entries[nameId].present;
+    if (removed) {
+        // The wheel slots still name this entry; they are skipped as it is not present
+        Entry& e = this->m_entries[nameId];
+        this->add(e, -1);
+        e.present = false;
+        e.aged = false;
+        if (this->m_highestId == nameId) this->findHighest();
+        this->changed();
+    }
+    summary = this->m_summary;
+    this->m_mutex.unlock();
+
+    if (removed) this->notify(summary);
+}
+
+// Weight of a manifold in the weighted sum (default 1); kept when it stops reporting
+void CDemandAggregator::setWeight(uint16_t nameId, double weight)
+{
+    DemandSummary summary;
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return;
+    if (nameId >= this->m_entries.size()) this->m_entries.resize(nameId + 1);
+    Entry& e = this->m_entries[nameId];
+    bool present = e.present;
+    if (present) this->add(e, -1);
+    e.weight = weight;
+    if (present) {
+        this->add(e, 1);
+        this->changed();
+    }
+    summary = this->m_summary;
+    this->m_mutex.unlock();
+
+    if (present) this->notify(summary);
+}
+
+DemandSummary CDemandAggregator::getSummary()
+{
+    DemandSummary summary;
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return summary;
+    bool changed = this->advance(nowSecond());
+    summary = this->m_summary;
+    this->m_mutex.unlock();
+
+    if (changed) this->notify(summary);
+    return summary;
+}
+
+std::vector<CDemandAggregator::Contribution> CDemandAggregator::getContributions()
+{
+    std::vector<Contribution> result;
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return result;
+    for (size_t i = 0; i < this->m_entries.size(); i++) {
+        const Entry& e = this->m_entries[i];
+        if (e.present) result.push_back({(uint16_t)i, e.demand, e.weight, e.aged});
+    }
+    this->m_mutex.unlock();
+    return result;
+}
+
+void CDemandAggregator::subscribe(Listener listener)
+{
+    this->m_listeners.push_back(listener);
+}
+
+// Process the wheel slots up to and including second. Must hold m_mutex. Returns true if
+// a manifold became aged or dead.
+bool CDemandAggregator::advance(uint32_t second)
+{
+    bool result = false;
+
+    // After a long time without a tick every slot is due once
+    if ((int32_t)(second - this->m_wheelSecond) >= WHEEL_SLOTS) this->m_wheelSecond = second - WHEEL_SLOTS + 1;
+
+    for (; (int32_t)(second - this->m_wheelSecond) >= 0; this->m_wheelSecond++) {
+        std::vector<uint16_t>& slot = this->m_wheel[this->m_wheelSecond % WHEEL_SLOTS];
+        for (uint16_t nameId : slot) {
+            Entry& e = this->m_entries[nameId];
+            if (!e.present) continue;
+            uint32_t age = second - e.updateSecond;
+            if (age >= DEAD_SECONDS) {
+                this->add(e, -1);
+                e.present = false;
+                e.aged = false;
+                if (this->m_highestId == nameId) this->findHighest();
+                result = true;
+            }
+            else if (age >= AGED_SECONDS && !e.aged) {
+                e.aged = true;
+                this->m_summary.aged++;
+                result = true;
+            }
+            // Otherwise the manifold has reported since this was scheduled
+        }
+        slot.clear();   // Keeps the capacity, so the wheel stops allocating once it has warmed up
+    }
+
+    if (result) this->changed();
+    return result;
+}
+
+// Must hold m_mutex; second must be less than WHEEL_SLOTS ahead
+void CDemandAggregator::schedule(uint16_t nameId, uint32_t second)
+{
+    this->m_wheel[second % WHEEL_SLOTS].push_back(nameId);
+}
+
+// Add (sign 1) or take away (sign -1) the contribution of an entry. Must hold m_mutex.
+void CDemandAggregator::add(Entry& e, double sign)
+{
+    this->m_summary.weightedSum += sign * e.demand * e.weight;
+    this->m_summary.totalWeight += sign * e.weight;
+    this->m_summary.active += sign > 0 ? 1 : -1;
+    if (e.aged) this->m_summary.aged += sign > 0 ? 1 : -1;
+}
+
+// Search the highest demand after the one that had it went down. Must hold m_mutex.
+void CDemandAggregator::findHighest()
+{
+    this->m_highestId = -1;
+    this->m_summary.highest = 0;
+    for (size_t i = 0; i < this->m_entries.size(); i++) {
+        const Entry& e = this->m_entries[i];
+        if (!e.present) continue;
+        if (this->m_highestId < 0 || e.demand > this->m_summary.highest) {
+            this->m_highestId = i;
+            this->m_summary.highest = e.demand;
+        }
+    }
+}
+
+// Must hold m_mutex
+void CDemandAggregator::changed()
+{
+    DemandSummary& s = this->m_summary;
+    if (s.active == 0) {
+        // Do not let rounding errors pile up
+        s.weightedSum = 0;
+        s.totalWeight = 0;
+    }
+    s.weightedAverage = s.totalWeight > 0 ? s.weightedSum / s.totalWeight : 0;
+    s.changes++;
+}
+
+// Must not hold m_mutex, so listeners can call back
+void CDemandAggregator::notify(const DemandSummary& summary)
+{
+    for (Listener& listener : this->m_listeners) listener(summary);
+}
+
+// Must hold m_mutex
+void CDemandAggregator::ensureTimer()
+{
+    if (this->m_timer) return;
+    this->m_timer = xTimerCreate("DemandAging", pdMS_TO_TICKS(1000), pdTRUE, this, timerCallback);
+    if (!this->m_timer || xTimerStart(this->m_timer, 0) != pdPASS) {
+        MyLog.println("Demand aggregator: unable to start the aging timer");
+    }
+}
+
+// Runs in the FreeRTOS timer service task, which must not block
+void CDemandAggregator::timerCallback(TimerHandle_t timer)
+{
+    CDemandAggregator* self = (CDemandAggregator*)pvTimerGetTimerID(timer);
+    if (!self->m_mutex.tryLock(__PRETTY_FUNCTION__)) return;    // The holder advances the wheel
+    bool changed = self->advance(nowSecond());
+    DemandSummary summary = self->m_summary;
+    self->m_mutex.unlock();
+
+    if (changed) self->notify(summary);
+}
@@ -0,0 +1,109 @@
+#ifndef __DEMAND_AGGREGATOR_H
+#define __DEMAND_AGGREGATOR_H
+
+#include <Arduino.h>
+
+#include <functional>
+#include <vector>
+
+#include "MyMutex.h"
+#include "freertos/timers.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Flow demand of all manifolds for the boiler control
+//
+// The ManifoldManager reports every update here, and the highest demand, the weighted sum
+// and the contribution of each manifold are adjusted for that one manifold instead of
+// being recomputed over all of them. Only when the manifold with the highest demand goes
+// down is the maximum searched again.
+//
+// A manifold that has not reported for AGED_SECONDS is marked as aged (it still counts);
+// after DEAD_SECONDS it no longer counts. Instead of checking all manifolds periodically,
+// every update puts the manifold into the slots of a timer wheel (one slot per second)
+// for these two points in time. The wheel is advanced once a second by a FreeRTOS timer
+// and on every update; the entries in a slot are only acted on if the manifold has not
+// reported again since.
+//
+// Subscribers are called with the new summary after every change, in the task that made
+// the change: the one receiving the manifold data (async_tcp, the UDP task), a reader, or
+// the FreeRTOS timer service task. They must not block; a subscriber with real work to do
+// hands the summary over to a task of its own (see BoilerDemand). The timer does not
+// wait for the mutex either: if it is locked, the holder advances the wheel anyway.
+// Subscribe during setup only.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+struct DemandSummary {
+    double highest = 0;
+    double weightedSum = 0;         // Sum of demand * weight
+    double totalWeight = 0;         // Of the manifolds counted
+    double weightedAverage = 0;
+    int active = 0;                 // Manifolds counted, including aged ones
+    int aged = 0;
+    uint32_t changes = 0;
+};
+
+class CDemandAggregator {
+  public:
+    static const uint32_t AGED_SECONDS = 30;
+    static const uint32_t DEAD_SECONDS = 120;
+
+    struct Contribution {
+        uint16_t nameId;            // As interned by the ManifoldManager
+        double demand;
+        double weight;
+        bool aged;
+    };
+
+    typedef std::function<void(const DemandSummary&)> Listener;
+
+  private:
+    static const int WHEEL_SLOTS = 128;     // More than DEAD_SECONDS
+
+    struct Entry {
+        bool present = false;
+        bool aged = false;
+        double demand = 0;
+        double weight = 1.0;
+        uint32_t updateSecond = 0;
+    };
+
+    MyMutex m_mutex;
+    std::vector<Entry> m_entries;           // By name id
+    DemandSummary m_summary;
+    int m_highestId = -1;                   // Entry with the highest demand
+
+    std::vector<uint16_t> m_wheel[WHEEL_SLOTS];     // Name ids due in that second
+    uint32_t m_wheelSecond = 0;             // Next second to process
+
+    TimerHandle_t m_timer = nullptr;
+    std::vector<Listener> m_listeners;
+
+  public:
+    CDemandAggregator();
+
+    void update(uint16_t nameId, double demand);
+    void remove(uint16_t nameId);
+    void setWeight(uint16_t nameId, double weight);
+
+    DemandSummary getSummary();
+    std::vector<Contribution> getContributions();
+
+    void subscribe(Listener listener);
+
+  private:
+    static uint32_t nowSecond() { return millis() / 1000; }
+    bool advance(uint32_t second);
+    void schedule(uint16_t nameId, uint32_t second);
+    void add(Entry& e, double sign);
+    void findHighest();
+    void changed();
+    void notify(const DemandSummary& summary);
+    void ensureTimer();
+    static void timerCallback(TimerHandle_t timer);
+};
+
+extern CDemandAggregator DemandAggregator;
+
+#endif
@@ -2,6 +2,10 @@
 
 #include <WiFi.h>
 
+#include "DemandAggregator.h"
+#include "MdnsDiscovery.h"
+#include "MemDebug.h"
+#include "MyConfig.h"
 #include "MyLog.h"
 #include <lwip/sockets.h>
 #include <errno.h>
@@ -17,7 +21,7 @@ CManifoldManager ManifoldManager;
 // Fill the data from a JSON formatted string. returns false if an error occured
 bool ManifoldData::fillFromJson(const String& s)
 {
-    JsonDocument json;
+    JsonDocument json(&JsonAllocator);
     DeserializationError error = deserializeJson(json, s);
     if (error) {
         MyLog.print("Failed to parse manifold data file: ");
@@ -52,7 +56,7 @@ bool ManifoldData::fillFromJson(JsonDocument& json)
 // Delivers the data in this object as a JSON  formatted string
 String ManifoldData::toJson() const
 {
-    JsonDocument json;
+    JsonDocument json(&JsonAllocator);
     json["name"] = this->name;
     json["hostname"] = this->hostname;
     json["ipAddress"] = this->ipAddress;
@@ -74,39 +78,37 @@ String ManifoldData::toJson() const
 /// ManifoldDataPostJob - sending manifold data (fire-and-forget style)
 //
 
-QueueHandle_t ManifoldDataPostJob::m_senderQueue = nullptr;      // Queue of FireAndForgetPostJob*
-TaskHandle_t ManifoldDataPostJob::m_senderTask = nullptr;  // A task executing these jobs
-
-void ManifoldDataPostJob::post(const ManifoldData& data, String host)
+MyMutex ManifoldDataPostJob::m_pendingMutex("ManifoldDataPostJob");
+ManifoldDataPostJob ManifoldDataPostJob::m_pending;
+bool ManifoldDataPostJob::m_hasPending = false;
+TaskHandle_t ManifoldDataPostJob::m_senderTask = nullptr;  // A task sending the data
+
+ManifoldDataPostJob ManifoldDataPostJob::m_sending;
+WebSocketsClient ManifoldDataPostJob::m_client;
+String ManifoldDataPostJob::m_hostName;
+IPAddress ManifoldDataPostJob::m_address;
+uint16_t ManifoldDataPostJob::m_port = 0;
+uint32_t ManifoldDataPostJob::m_reconnectMs = MIN_RECONNECT_MS;
+uint32_t ManifoldDataPostJob::m_backoffMillis = 0;
+ManifoldDataPostJob::Stats ManifoldDataPostJob::m_stats;
+
+void ManifoldDataPostJob::post(const ManifoldData& data, const String& host)
 {
     if (host == emptyString) return;
-    ensurePostTask();                                               // Ensure the task that posts the jobexists
-
-    // Drain the queue so all pending requests with older data will
-    // not be sent
-    ManifoldDataPostJob* oldJob = nullptr;
-    while (xQueueReceive(m_senderQueue, &oldJob, 0) == pdPASS) delete oldJob;
+    ensurePostTask();                                               // Ensure the task that posts the job exists
 
-    // Create a new job and send it to the queue
-    ManifoldDataPostJob* job = new ManifoldDataPostJob(host, data);  // Create a job
-    BaseType_t ok = xQueueSendToBack(m_senderQueue, &job, 0 /* no wait */);
+    // Replace the data waiting to be sent, if any: only the latest data is sent
+    if (!m_pendingMutex.lock(__PRETTY_FUNCTION__)) return;
+    m_pending.host = host;
+    m_pending.data = data;
+    m_hasPending = true;
+    m_pendingMutex.unlock();
 
-    if (ok != pdTRUE) {
-        delete job;        // queue full or error - ignore, this is "fire and forget"
-        return;
-    }
+    xTaskNotifyGive(m_senderTask);
 }
 
 void ManifoldDataPostJob::ensurePostTask()
 {
-    // Ensure the post queue exists
-    // Queue depth is 1 because we really only want a single post request pending
-    // If another newer request is made it will replace the one pending because
-    // we only want to send the latest data
-    if (!m_senderQueue) {
-        m_senderQueue = xQueueCreate(1, sizeof(ManifoldDataPostJob*));
-    }
-
     if (!m_senderTask) {
         xTaskCreatePinnedToCore(
             postTask,
@@ -122,105 +124,228 @@ void ManifoldDataPostJob::ensurePostTask()
 
 void ManifoldDataPostJob::postTask(void *arg)
 {
-    ManifoldDataPostJob* job = nullptr;
+    m_client.onEvent(ManifoldDataPostJob::webSocketEventHandler, nullptr);
+    m_client.setReconnectInterval(MIN_RECONNECT_MS);
+    m_client.enableHeartbeat(15000, 3000, 2);
 
     for (;;) {
-        if (xQueueReceive(m_senderQueue, &job, portMAX_DELAY) != pdTRUE) {
-            continue;
+        // Woken by post(), otherwise often enough for the heartbeat and reconnecting
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOOP_INTERVAL_MS));
+
+        bool hasData = false;
+        if (m_pendingMutex.lock(__PRETTY_FUNCTION__)) {
+            if (m_hasPending) {
+                m_sending.host = m_pending.host;
+                m_sending.data = m_pending.data;
+                m_hasPending = false;
+                hasData = true;
+            }
+            m_pendingMutex.unlock();
         }
-        if (!job) {
+
+        if (WiFi.status() != WL_CONNECTED) {
+            m_client.disconnect();
+            if (hasData) m_stats.failures++;
             continue;
         }
-        if (job->host == emptyString) return;
-
-        if (WiFi.status() == WL_CONNECTED) {
-            WiFiClient client;
-            client.stop();
-            client.setTimeout(1000);
-            String body = job->data.toJson();
-            // DEBUG_LOG("Sending JSON to %s - %-200s", job->host.c_str(), body.c_str());
-            if (client.connect(job->host.c_str(), 80)) {
-                const size_t bodyLen = body.length();
-                client.print("POST /demand HTTP/1.1");
-                client.print("\r\nContent-Type: application/json");
-                client.print("\r\nHost: ");
-                client.print(job->host);
-                client.print("\r\nContent-Length: ");
-                client.print(bodyLen);
-                client.print("\r\nConnection: close\r\n\r\n");
-                client.print(body);
-                client.flush();
-
-                // Wait until the response has started
-                unsigned long deadline = millis() + 1000;   // 1 second timeout
-                while (millis() < deadline && client.connected() && !client.available()) delay(10);
-
-                // String response = "";
-                // while (millis() < deadline && client.connected()) {
-                //     while (client.available()) {
-                //         int c = client.read();
-                //         if (c < 0) break;
-                //         response += (char) c;
-                //     }
-                //     delay(10)
-                // }
-                // DEBUG_LOG("Response: \n%s\n", response.c_str());
-
-                client.stop();
-            }
-            // else {
-            //     DEBUG_LOG("Sending failed, error: %d (%s)\n", errno, strerror(errno));
-            // }
+
+        if (hasData) connect(m_sending.host);
+        m_client.loop();
+        if (!m_client.isConnected()) backoff();
+
+        if (hasData) {
+            String body = m_sending.data.toJson();
+            // DEBUG_LOG("Sending JSON to %s - %-200s", m_hostName.c_str(), body.c_str());
+            if (m_client.isConnected() && m_client.sendTXT(body)) m_stats.requests++;
+            else m_stats.failures++;
         }
+    }
+}
+
+// Start the client for the controller at host, unless it already is for that address. The
+// address is looked up through the cache of MdnsDiscovery.
+void ManifoldDataPostJob::connect(const String& host)
+{
+    uint16_t port = 80;
+    m_hostName = host;
+    if (host.equalsIgnoreCase("auto") && !MdnsDiscovery.findController(m_hostName, port)) return;
+
+    IPAddress address;
+    if (!MdnsDiscovery.resolve(m_hostName, address)) return;
+    if (address == m_address && port == m_port) return;
+
+    m_address = address;
+    m_port = port;
+    m_reconnectMs = MIN_RECONNECT_MS;
+    m_backoffMillis = millis();
+    m_client.disconnect();
+    m_client.setReconnectInterval(m_reconnectMs);
+    m_client.begin(address, port, "/demand/ws");
+}
+
+// While there is no connection, the client tries again every m_reconnectMs. Each time that
+// passes without a connection, the time doubles.
+void ManifoldDataPostJob::backoff()
+{
+    if (m_port == 0 || millis() - m_backoffMillis < m_reconnectMs) return;
+    m_backoffMillis = millis();
+    m_reconnectMs = m_reconnectMs * 2 < MAX_RECONNECT_MS ? m_reconnectMs * 2 : MAX_RECONNECT_MS;
+    m_client.setReconnectInterval(m_reconnectMs);
+}
 
-        delete job;
+// Called from m_client.loop() in the post task
+void ManifoldDataPostJob::webSocketEventHandler(WStype_t type, uint8_t* payload, size_t length, void* clientData)
+{
+    switch (type) {
+        case WStype_CONNECTED:
+            m_stats.connects++;
+            m_reconnectMs = MIN_RECONNECT_MS;
+            m_backoffMillis = millis();
+            m_client.setReconnectInterval(m_reconnectMs);
+            break;
+
+        case WStype_DISCONNECTED:
+            // The controller may have a new address; the next data looks it up again
+            MdnsDiscovery.invalidate(m_hostName);
+            break;
+
+        default:
+            break;
     }
 }
 
-ManifoldData* CManifoldManager::addOrUpdateManifoldFromJson(const String& s)
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// 
+/// CManifoldManager - all manifolds, as snapshots
+//
+
+CManifoldManager::CManifoldManager() : m_snapshot(std::make_shared<ManifoldSnapshot>()), m_manifoldsMutex("ManifoldManager")
 {
-    JsonDocument json;
-    DeserializationError error = deserializeJson(json, s);
+}
+
+std::shared_ptr<const ManifoldData> CManifoldManager::addOrUpdateManifoldFromJson(const String& s)
+{
+    return this->addOrUpdateManifoldFromJson(s.c_str(), s.length());
+}
+
+// From a WebSocket message, which is not zero terminated
+std::shared_ptr<const ManifoldData> CManifoldManager::addOrUpdateManifoldFromJson(const char* s, size_t length)
+{
+    JsonDocument json(&JsonAllocator);
+    DeserializationError error = deserializeJson(json, s, length);
     
     if (error) {
         MyLog.print("Failed to parse manifold data file: ");
         MyLog.println(error.c_str());
         return nullptr;
     }
-    String name = json["name"].as<String>();
-    if (name == emptyString) {
+
+    // Filled in completely before it is published
+    ManifoldData data;
+    data.fillFromJson(json);
+    if (data.name == emptyString) {
         MyLog.println("Receoived manifold data with no name");
         return nullptr;
     }
+    return this->addOrUpdateManifold(data);
+}
 
-    ManifoldData *result = nullptr;
+// Update from data received by ManifoldTelemetry (or parsed from JSON)
+std::shared_ptr<const ManifoldData> CManifoldManager::addOrUpdateManifold(const ManifoldData& data)
+{
+    if (data.name == emptyString) return nullptr;
+
+    std::shared_ptr<const ManifoldData> result;
     if (m_manifoldsMutex.lock(__PRETTY_FUNCTION__)) {
-        for (auto manifold = m_manifolds.begin(); manifold != m_manifolds.end(); manifold++) {
-            if (manifold->name == name) {
-                result = &(*manifold);
-                break;
-            }
-        }
+        result = this->update(data);
+        m_manifoldsMutex.unlock();
+    }
+    return result;
+}
+
+// Publish a snapshot with data replacing the manifold of the same name. Must hold m_manifoldsMutex.
+std::shared_ptr<const ManifoldData> CManifoldManager::update(const ManifoldData& data)
+{
+    size_t nameCount = this->m_names.size();
+    uint16_t nameId = this->internName(data.name);
+    std::shared_ptr<ManifoldSnapshot> next = std::make_shared<ManifoldSnapshot>(*this->getSnapshot());
+    if (this->m_names.size() != nameCount) this->updateRanks(*next);
+
+    std::shared_ptr<ManifoldData> manifold = std::make_shared<ManifoldData>(data);
+    manifold->nameId = nameId;
+    manifold->nameRank = this->m_rankById[nameId];
+    manifold->lastUpdate = time(nullptr);
+
+    auto existing = std::find_if(
+        next->manifolds.begin(), next->manifolds.end(),
+        [nameId](const std::shared_ptr<const ManifoldData>& m) { return m->nameId == nameId; }
+    );
+    if (existing != next->manifolds.end()) {
+        manifold->sequenceNo = (*existing)->sequenceNo;
+        *existing = manifold;
+    }
+    else {
+        manifold->sequenceNo = this->m_nextSequenceNo++;
+        next->manifolds.push_back(manifold);
+    }
 
-        if (!result) {
-            m_manifolds.emplace_back();
-            result = &m_manifolds.back();
-            result->sequenceNo = m_manifolds.size()-1;
+    this->publish(next);
+    DemandAggregator.update(nameId, manifold->flowDemand);
+    return manifold;
+}
+
+// Id of a name, added if it is new. Must hold m_manifoldsMutex.
+uint16_t CManifoldManager::internName(const String& name)
+{
+    for (size_t i = 0; i < this->m_names.size(); i++) {
+        if (this->m_names[i] == name) return i;
+    }
+
+    this->m_names.push_back(name);
+    std::vector<uint16_t> order(this->m_names.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [this](uint16_t a, uint16_t b) { return this->m_names[a] < this->m_names[b]; });
+    this->m_rankById.resize(order.size());
+    for (size_t i = 0; i < order.size(); i++) this->m_rankById[order[i]] = i;
+    return this->m_names.size() - 1;
+}
+
+// A new name changes the ranks of other names. Must hold m_manifoldsMutex.
+void CManifoldManager::updateRanks(ManifoldSnapshot& snapshot)
+{
+    for (auto& m : snapshot.manifolds) {
+        if (m->nameRank != this->m_rankById[m->nameId]) {
+            std::shared_ptr<ManifoldData> copy = std::make_shared<ManifoldData>(*m);
+            copy->nameRank = this->m_rankById[m->nameId];
+            m = copy;
         }
-        m_manifoldsMutex.unlock();
     }
+}
 
-    result->fillFromJson(json);
-    return result;
+// Sort and make the snapshot the current one. Must hold m_manifoldsMutex.
+void CManifoldManager::publish(std::shared_ptr<ManifoldSnapshot>& snapshot)
+{
+    std::sort(snapshot->manifolds.begin(), snapshot->manifolds.end(),
+        [](const std::shared_ptr<const ManifoldData>& a, const std::shared_ptr<const ManifoldData>& b) {
+            if (a->nameRank != b->nameRank) return a->nameRank > b->nameRank;
+            return a->sequenceNo > b->sequenceNo;
+        }
+    );
+    snapshot->epoch++;
+    std::atomic_store(&this->m_snapshot, ManifoldSnapshotPtr(snapshot));
 }
 
 bool CManifoldManager::removeManifold(const String& name)
 {
     bool result = false;
     if (m_manifoldsMutex.lock(__PRETTY_FUNCTION__)) {
-        for (auto manifold = m_manifolds.begin(); manifold != m_manifolds.end(); manifold++) {
-            if (manifold->name == name) {
-                m_manifolds.erase(manifold);
+        std::shared_ptr<ManifoldSnapshot> next = std::make_shared<ManifoldSnapshot>(*this->getSnapshot());
+        for (auto manifold = next->manifolds.begin(); manifold != next->manifolds.end(); manifold++) {
+            if ((*manifold)->name == name) {
+                uint16_t nameId = (*manifold)->nameId;
+                next->manifolds.erase(manifold);
+                this->publish(next);
+                DemandAggregator.remove(nameId);
                 result = true;
                 break;
             }
@@ -230,50 +355,94 @@ bool CManifoldManager::removeManifold(const String& name)
     return result;
 }
 
-double CManifoldManager::getHighestDemand()
+double CManifoldManager::getHighestDemand() const
 {
-    double result = 0;
+    return DemandAggregator.getSummary().highest;
+}
+
+// Also for manifolds that have not reported yet
+void CManifoldManager::setDemandWeight(const String& name, double weight)
+{
+    if (name == emptyString) return;
     if (m_manifoldsMutex.lock(__PRETTY_FUNCTION__)) {
-        for (const ManifoldData& manifold : m_manifolds) {
-            if (manifold.flowDemand > result) result = manifold.flowDemand;
+        size_t nameCount = this->m_names.size();
+        uint16_t nameId = this->internName(name);
+        if (this->m_names.size() != nameCount) {
+            std::shared_ptr<ManifoldSnapshot> next = std::make_shared<ManifoldSnapshot>(*this->getSnapshot());
+            this->updateRanks(*next);
+            this->publish(next);
         }
+        DemandAggregator.setWeight(nameId, weight);
         m_manifoldsMutex.unlock();
     }
-    return result;
 }
 
-ManifoldData** CManifoldManager::newSortedCopy()
+// Weights as configured: "name=weight, name=weight". Manifolds not listed get weight 1.
+void CManifoldManager::setDemandWeights(const String& weights)
 {
-    ManifoldData **result = nullptr;
-    int len = 0;
+    std::vector<std::pair<String, double>> listed;
+    int start = 0;
+    while (start < (int)weights.length()) {
+        int end = weights.indexOf(',', start);
+        if (end < 0) end = weights.length();
+        String item = weights.substring(start, end);
+        start = end + 1;
+
+        int equals = item.indexOf('=');
+        if (equals < 0) continue;
+        String name = item.substring(0, equals);
+        String weight = item.substring(equals + 1);
+        name.trim();
+        weight.trim();
+        if (name == emptyString || weight.toDouble() < 0) continue;
+        listed.push_back(std::make_pair(name, weight.toDouble()));
+    }
 
     if (m_manifoldsMutex.lock(__PRETTY_FUNCTION__)) {
-        len = m_manifolds.size();
-        if (len > 0) {
-            result = (ManifoldData**) malloc (sizeof(ManifoldData*) * (len + 1));
-            for (size_t i = 0; i < len; i++) {
-                result[i] = new ManifoldData(m_manifolds[i]);
-            }
-            result[m_manifolds.size()] = nullptr;
+        for (size_t i = 0; i < this->m_names.size(); i++) DemandAggregator.setWeight(i, 1.0);
+
+        size_t nameCount = this->m_names.size();
+        for (const auto& item : listed) DemandAggregator.setWeight(this->internName(item.first), item.second);
+        if (this->m_names.size() != nameCount) {
+            std::shared_ptr<ManifoldSnapshot> next = std::make_shared<ManifoldSnapshot>(*this->getSnapshot());
+            this->updateRanks(*next);
+            this->publish(next);
         }
         m_manifoldsMutex.unlock();
     }
+}
 
-    if (result && len > 2) {
-        std::sort(result, result + len, 
-            [](const ManifoldData* a, const ManifoldData* b) {
-                if (a->name != b->name) return a->name > b->name;
-                return a->sequenceNo > b->sequenceNo;
-            }
-        );
+void CManifoldManager::advertise()
+{
+    if (Config.getHostname() == "") return;     // No mDNS
+    MdnsDiscovery.advertise(MANIFOLD_SERVICE, 80, Config.getName());
+    if (Config.getActAsHeatingController()) {
+        MdnsDiscovery.advertise(MANIFOLD_CONTROLLER_SERVICE, 80, Config.getName());
+    }
+    else {
+        MdnsDiscovery.withdraw(MANIFOLD_CONTROLLER_SERVICE);
     }
-    return result;
 }
 
-void CManifoldManager::deleteSortedCopy(ManifoldData** arr)
+// From the main task only; the query takes up to a second
+void CManifoldManager::discover()
 {
-    for (size_t i = 0; arr[i] != nullptr; i++) {
-        delete arr[i];       // free each element
+    std::vector<DiscoveredService> found = MdnsDiscovery.browse(MANIFOLD_SERVICE);
+    ManifoldSnapshotPtr snapshot = this->getSnapshot();
+    String self = Config.getHostname() + ".local";
+    for (const DiscoveredService& s : found) {
+        if (s.hostname.equalsIgnoreCase(self)) continue;
+        if (std::find(this->m_discovered.begin(), this->m_discovered.end(), s.hostname) != this->m_discovered.end()) continue;
+        this->m_discovered.push_back(s.hostname);
+
+        bool reporting = false;
+        for (const auto& m : snapshot->manifolds) {
+            if (m->hostname.equalsIgnoreCase(s.hostname)) reporting = true;
+        }
+        MyLog.printf(
+            "Manifold %s found at %s (%s)%s\n",
+            s.name.c_str(), s.hostname.c_str(), s.address.toString().c_str(),
+            reporting ? "" : ", not sending data yet - set its heating controller to auto"
+        );
     }
-    free (arr);
 }
@@ -3,11 +3,13 @@
 
 #include <Arduino.h>
 
+#include <memory>
 #include <vector>
 
+#include <WebSocketsClient.h>
+
 #include "ArduinoJson.h"
 #include "MyMutex.h"
-#include "freertos/queue.h"
 #include "freertos/task.h"
 
 struct ManifoldData {
@@ -26,6 +28,8 @@ struct ManifoldData {
     double valvePosition;
     double flowDemand;
     time_t lastUpdate;
+    uint16_t nameId = 0;        // Interned name, see CManifoldManager
+    uint16_t nameRank = 0;      // Position of the name in alphabetical order
 
     bool fillFromJson(const String& s);
     bool fillFromJson(JsonDocument& json);
@@ -36,40 +40,127 @@ struct ManifoldData {
 
 };
 
+// Sends the data of this manifold to the heating controller in the background, as a text
+// message on the WebSocket /demand/ws of the controller. The connection stays open, so
+// the data can be sent every control cycle. With the host "auto", the controller is found
+// by mDNS (see MdnsDiscovery). If the connection fails, it is opened again after a time
+// that doubles up to MAX_RECONNECT_MS; data that comes in meanwhile is dropped.
+//
+// There is one job waiting to be sent, which newer data overwrites (the Strings keep their
+// buffers), and the post task is woken with a task notification; nothing is allocated
+// per post.
 struct ManifoldDataPostJob {
+    struct Stats {
+        uint32_t connects = 0;
+        uint32_t requests = 0;
+        uint32_t failures = 0;      // Data that could not be sent
+    };
+
     String host;
     ManifoldData data;
 
-    static void post(const ManifoldData& data, String host);
+    static void post(const ManifoldData& data, const String& host);
+    static const Stats& getStats() { return m_stats; }
 
   private:
-    ManifoldDataPostJob(String host, const ManifoldData& data) : host(host), data(data) {}
+    static const uint32_t LOOP_INTERVAL_MS = 100;           // For the WebSocket heartbeat
+    static const uint32_t MIN_RECONNECT_MS = 1000;
+    static const uint32_t MAX_RECONNECT_MS = 60 * 1000;
+
     ManifoldDataPostJob(){};
     static void ensurePostTask();
     static void postTask(void* arg);
-    static QueueHandle_t m_senderQueue;
+    static void connect(const String& host);
+    static void backoff();
+    static void webSocketEventHandler(WStype_t type, uint8_t* payload, size_t length, void* clientData);
+
+    static MyMutex m_pendingMutex;
+    static ManifoldDataPostJob m_pending;   // Protected by m_pendingMutex
+    static bool m_hasPending;
     static TaskHandle_t m_senderTask;
+
+    // Used by the post task only
+    static ManifoldDataPostJob m_sending;
+    static WebSocketsClient m_client;
+    static String m_hostName;               // Of the controller
+    static IPAddress m_address;             // The client was started for
+    static uint16_t m_port;
+    static uint32_t m_reconnectMs;
+    static uint32_t m_backoffMillis;        // When the reconnect time was last doubled
+    static Stats m_stats;
 };
 
-// OneWireManager is a class giving access to one OneWireTemperatureSensor struct
-// for every sensor. The constructor takes the I/O pin for the OneWire bus as parameter
+// The manifolds at one point in time, sorted by name (descending) and then by the order
+// in which they were added (descending). Never changes once published.
+struct ManifoldSnapshot {
+    std::vector<std::shared_ptr<const ManifoldData>> manifolds;
+    uint32_t epoch = 0;         // Incremented with every change
+
+    size_t size() const { return this->manifolds.size(); }
+    const ManifoldData& operator[](size_t i) const { return *this->manifolds[i]; }
+};
+
+typedef std::shared_ptr<const ManifoldSnapshot> ManifoldSnapshotPtr;
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// The manifolds known to the heating controller
+//
+// Readers get the current ManifoldSnapshot and keep it for as long as they need it, e.g.
+// while rendering a page, without a lock and without copying the data. Every change
+// publishes a new snapshot (copy on write): the list of pointers is copied, the data of
+// unchanged manifolds is shared with the previous snapshot. Changes are serialised by
+// m_manifoldsMutex; the snapshot pointer is read and replaced atomically.
+//
+// Every change is also passed to the DemandAggregator, which keeps the demand of all
+// manifolds up to date and tells its subscribers, i.e. the BoilerDemand. The weights of
+// the manifolds in the weighted demand are configured as a list (see setDemandWeights).
+//
+// Names are interned, so a manifold is found by comparing its name once against the
+// (few) known names, and sorting compares the rank of the name instead of the strings.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
 class CManifoldManager {
   private:
-    std::vector<ManifoldData> m_manifolds;
+    ManifoldSnapshotPtr m_snapshot;
     MyMutex m_manifoldsMutex;
 
+    // Protected by m_manifoldsMutex
+    std::vector<String> m_names;        // By name id
+    std::vector<uint16_t> m_rankById;
+    int m_nextSequenceNo = 0;
+
+    std::vector<String> m_discovered;   // Host names of the manifolds found by discover()
+
   public:
-    CManifoldManager() : m_manifoldsMutex("ManifoldManager") { m_manifolds.reserve(6); }
+    CManifoldManager();
 
-    int getCount() { return m_manifolds.size(); }
+    ManifoldSnapshotPtr getSnapshot() const { return std::atomic_load(&this->m_snapshot); }
+    int getCount() const { return this->getSnapshot()->size(); }
 
-    ManifoldData* addOrUpdateManifoldFromJson(const String&);
+    std::shared_ptr<const ManifoldData> addOrUpdateManifoldFromJson(const String&);
+    std::shared_ptr<const ManifoldData> addOrUpdateManifoldFromJson(const char* s, size_t length);
+    std::shared_ptr<const ManifoldData> addOrUpdateManifold(const ManifoldData& data);
     bool removeManifold(const String& name);
-    double getHighestDemand();
 
-    ManifoldData** newSortedCopy();
-    void deleteSortedCopy(ManifoldData** arr);
+    // Highest flow demand of the manifolds that reported in the last two minutes; the
+    // weighted sum and the contributions are in DemandAggregator
+    double getHighestDemand() const;
+    void setDemandWeight(const String& name, double weight);
+    void setDemandWeights(const String& weights);
+
+    // mDNS: advertise this device as a manifold, and as the heating controller if it is
+    // configured to be one. The controller calls discover() periodically, which browses
+    // for the manifolds and logs new ones, and those that do not send their data.
+    void advertise();
+    void discover();
 
+  private:
+    std::shared_ptr<const ManifoldData> update(const ManifoldData& data);
+    uint16_t internName(const String& name);
+    void updateRanks(ManifoldSnapshot& snapshot);
+    void publish(std::shared_ptr<ManifoldSnapshot>& snapshot);
 };
 
 extern CManifoldManager ManifoldManager;
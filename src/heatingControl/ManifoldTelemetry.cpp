@@ -0,0 +1,138 @@
+#include "ManifoldTelemetry.h"
+
+#include <esp_system.h>
+
+#include "GzipWriter.h"  // For crc32Update()
+#include "MyLog.h"
+
+CManifoldTelemetry ManifoldTelemetry;
+
+size_t encodeManifoldPacket(const ManifoldData& data, uint32_t bootId, uint32_t sequence, uint8_t* buffer, size_t size)
+{
+    size_t nameLength = data.name.length() < MANIFOLD_PACKET_MAX_NAME ? data.name.length() : MANIFOLD_PACKET_MAX_NAME;
+    size_t hostnameLength = data.hostname.length() < MANIFOLD_PACKET_MAX_NAME ? data.hostname.length() : MANIFOLD_PACKET_MAX_NAME;
+    size_t length = sizeof(ManifoldPacketHeader) + nameLength + hostnameLength + sizeof(uint32_t);
+    if (length > size) return 0;
+
+    IPAddress ipAddress;
+    ipAddress.fromString(data.ipAddress);
+
+    ManifoldPacketHeader header;
+    header.magic = MANIFOLD_PACKET_MAGIC;
+    header.version = MANIFOLD_PACKET_VERSION;
+    header.flags = data.on ? MANIFOLD_PACKET_ON : 0;
+    header.length = length;
+    header.bootId = bootId;
+    header.sequence = sequence;
+    header.ipAddress = (uint32_t)ipAddress;
+    header.roomSetpoint = data.roomSetpoint;
+    header.roomTemperature = data.roomTemperature;
+    header.flowSetpoint = data.flowSetpoint;
+    header.flowTemperature = data.flowTemperature;
+    header.valvePosition = data.valvePosition;
+    header.flowDemand = data.flowDemand;
+    header.nameLength = nameLength;
+    header.hostnameLength = hostnameLength;
+
+    uint8_t* p = buffer;
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    memcpy(p, data.name.c_str(), nameLength);
+    p += nameLength;
+    memcpy(p, data.hostname.c_str(), hostnameLength);
+    p += hostnameLength;
+    uint32_t crc = crc32Update(0, buffer, p - buffer);
+    memcpy(p, &crc, sizeof(crc));
+    return length;
+}
+
+bool decodeManifoldPacket(const uint8_t* packet, size_t len, ManifoldData& data, uint32_t* bootId, uint32_t* sequence)
+{
+    ManifoldPacketHeader header;
+    if (len < sizeof(header) + sizeof(uint32_t)) return false;
+    memcpy(&header, packet, sizeof(header));
+    if (header.magic != MANIFOLD_PACKET_MAGIC || header.version != MANIFOLD_PACKET_VERSION) return false;
+    if (header.length != len) return false;
+    if (sizeof(header) + header.nameLength + header.hostnameLength + sizeof(uint32_t) != len) return false;
+
+    uint32_t crc;
+    memcpy(&crc, packet + len - sizeof(crc), sizeof(crc));
+    if (crc32Update(0, packet, len - sizeof(crc)) != crc) return false;
+
+    if (header.nameLength > MANIFOLD_PACKET_MAX_NAME || header.hostnameLength > MANIFOLD_PACKET_MAX_NAME) return false;
+    char name[MANIFOLD_PACKET_MAX_NAME + 1];
+    const uint8_t* p = packet + sizeof(header);
+    memcpy(name, p, header.nameLength);
+    name[header.nameLength] = '\0';
+    data.name = name;
+    p += header.nameLength;
+    memcpy(name, p, header.hostnameLength);
+    name[header.hostnameLength] = '\0';
+    data.hostname = name;
+    data.ipAddress = IPAddress(header.ipAddress).toString();
+    data.on = header.flags & MANIFOLD_PACKET_ON;
+    data.roomSetpoint = header.roomSetpoint;
+    data.roomTemperature = header.roomTemperature;
+    data.flowSetpoint = header.flowSetpoint;
+    data.flowTemperature = header.flowTemperature;
+    data.valvePosition = header.valvePosition;
+    data.flowDemand = header.flowDemand;
+    data.roomDeltaT = data.roomTemperature - data.roomSetpoint;
+    data.flowDeltaT = data.flowTemperature - data.flowSetpoint;
+    *bootId = header.bootId;
+    *sequence = header.sequence;
+    return true;
+}
+
+void CManifoldTelemetry::send(const ManifoldData& data)
+{
+    if (!this->m_bootId) this->m_bootId = esp_random() | 1;
+
+    uint8_t buffer[sizeof(ManifoldPacketHeader) + 2 * MANIFOLD_PACKET_MAX_NAME + sizeof(uint32_t)];
+    size_t len = encodeManifoldPacket(data, this->m_bootId, this->m_sequence++, buffer, sizeof(buffer));
+    if (len && this->m_udp.writeTo(buffer, len, MANIFOLD_TELEMETRY_GROUP, MANIFOLD_TELEMETRY_PORT) == len) {
+        this->stats.sent++;
+    }
+    else {
+        this->stats.sendErrors++;
+    }
+}
+
+bool CManifoldTelemetry::listen()
+{
+    if (!this->m_udp.listenMulticast(MANIFOLD_TELEMETRY_GROUP, MANIFOLD_TELEMETRY_PORT)) {
+        MyLog.println("Manifold telemetry: unable to join the multicast group");
+        return false;
+    }
+    this->m_udp.onPacket([this](AsyncUDPPacket& packet) { this->receive(packet); });
+    return true;
+}
+
+void CManifoldTelemetry::receive(AsyncUDPPacket& packet)
+{
+    ManifoldData data;
+    uint32_t bootId, sequence;
+    if (!decodeManifoldPacket(packet.data(), packet.length(), data, &bootId, &sequence)) {
+        this->stats.invalid++;
+        return;
+    }
+
+    Sender* sender = nullptr;
+    for (Sender& s : this->m_senders) {
+        if (s.name == data.name) sender = &s;
+    }
+    if (!sender) {
+        this->m_senders.push_back({data.name, bootId, sequence});
+    }
+    else if (sender->bootId == bootId && (int32_t)(sequence - sender->sequence) <= 0) {
+        this->stats.outOfOrder++;
+        return;
+    }
+    else {
+        sender->bootId = bootId;
+        sender->sequence = sequence;
+    }
+
+    ManifoldManager.addOrUpdateManifold(data);
+    this->stats.accepted++;
+}
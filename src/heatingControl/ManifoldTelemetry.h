@@ -0,0 +1,100 @@
+#ifndef __MANIFOLD_TELEMETRY_H
+#define __MANIFOLD_TELEMETRY_H
+
+#include <Arduino.h>
+#include <AsyncUDP.h>
+
+#include <vector>
+
+#include "ManifoldManager.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Manifold data by UDP multicast
+//
+// Instead of posting JSON to /demand on the heating controller, each manifold can send
+// its data as a small binary packet to a multicast group. The controller listens on one
+// socket and updates the ManifoldManager directly, without HTTP and JSON parsing.
+//
+// Packet (little endian): a ManifoldPacketHeader, the name and the hostname (not zero
+// terminated, lengths in the header), then the CRC-32 (as in zlib/gzip) of everything
+// before it. The receiver drops packets with a wrong magic number, version, length or
+// CRC, and packets that are not newer than the last one from the same sender. The boot
+// id is chosen at random when the sender starts, so the sequence can start from 0 again.
+//
+// UDP packets can get lost; every packet carries the complete data, and the next one
+// follows a second later. scripts/manifoldTelemetry.py sends and receives packets for
+// testing, also on localhost.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+#define MANIFOLD_PACKET_MAGIC 0x3144464D  // "MFD1"
+#define MANIFOLD_PACKET_VERSION 1
+#define MANIFOLD_PACKET_ON 0x01
+#define MANIFOLD_PACKET_MAX_NAME 63
+#define MANIFOLD_TELEMETRY_GROUP IPAddress(239, 255, 77, 77)
+#define MANIFOLD_TELEMETRY_PORT 4277
+
+struct __attribute__((packed)) ManifoldPacketHeader {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t flags;
+    uint16_t length;            // Whole packet including the names and the CRC
+    uint32_t bootId;
+    uint32_t sequence;          // Per sender, counts up from 0 after every start
+    uint32_t ipAddress;         // As reported by the sender, network byte order
+    float roomSetpoint;
+    float roomTemperature;
+    float flowSetpoint;
+    float flowTemperature;
+    float valvePosition;
+    float flowDemand;
+    uint8_t nameLength;
+    uint8_t hostnameLength;
+};
+
+// Encode data into buffer; returns the length of the packet (0 if the buffer is too small)
+size_t encodeManifoldPacket(const ManifoldData& data, uint32_t bootId, uint32_t sequence, uint8_t* buffer, size_t size);
+
+// Decode a packet and check it; does not check the sequence
+bool decodeManifoldPacket(const uint8_t* packet, size_t len, ManifoldData& data, uint32_t* bootId, uint32_t* sequence);
+
+class CManifoldTelemetry {
+  public:
+    struct Stats {
+        uint32_t sent = 0;
+        uint32_t sendErrors = 0;
+        uint32_t accepted = 0;
+        uint32_t invalid = 0;       // Format, version or CRC
+        uint32_t outOfOrder = 0;    // Duplicates and older packets
+    };
+
+  private:
+    struct Sender {
+        String name;
+        uint32_t bootId;
+        uint32_t sequence;
+    };
+
+    AsyncUDP m_udp;
+    uint32_t m_bootId = 0;
+    uint32_t m_sequence = 0;
+    std::vector<Sender> m_senders;  // Only used in the UDP receive callback
+
+  public:
+    Stats stats;
+
+    // Manifold side: send the data of this manifold
+    void send(const ManifoldData& data);
+
+    // Controller side: update ManifoldManager from the packets of all manifolds. Called
+    // once WiFi is up and again whenever the network is restarted (see CMyWiFi).
+    bool listen();
+
+  private:
+    void receive(AsyncUDPPacket& packet);
+};
+
+extern CManifoldTelemetry ManifoldTelemetry;
+
+#endif
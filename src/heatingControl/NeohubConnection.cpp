@@ -4,6 +4,7 @@
 #include <ArduinoJson.h>
 
 #include "EspTools.h"
+#include "MemDebug.h"
 #include "MyLog.h"
 
 #undef DEBUG_LOG
@@ -197,7 +198,7 @@ void NeohubConnection::webSocketEventHandler(WStype_t type, uint8_t* payload, si
                 }
 
                 // Deserialise and report any erros
-                JsonDocument json;
+                JsonDocument json(&JsonAllocator);
                 DeserializationError error = deserializeJson(json, payload, length);
                 if (error) {
                     String message = "NeohubConnection: Failed to parse response: ";
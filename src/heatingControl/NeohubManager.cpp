@@ -1,6 +1,9 @@
 #include "NeohubManager.h"
 
 #include "MyConfig.h"
+#include "EventLog.h"
+#include "MemDebug.h"
+#include "Metrics.h"
 #include "MyLog.h"
 #include "StringTools.h"
 
@@ -135,14 +138,14 @@ bool CNeohubManager::ensureNeohubConnection()
     const String& token = Config.getNeohubToken();
     if (url == "null" || url == "") {
         if (!noUrlReported) {
-            MyLog.printf("Unable to connecet  to NeoHub - no URL: %s\n", url.c_str());
+            EVENT_LOG("Unable to connecet  to NeoHub - no URL: %s\n", url.c_str());
             noUrlReported = true;
         }
         return false;
     }
     if (token == "null" || token == "") {
         if (!noTokenReported) {
-            MyLog.printf("Unable to connecet to NeoHub - no token: %s\n", url.c_str());
+            EVENT_LOG("Unable to connecet to NeoHub - no token: %s\n", url.c_str());
             noTokenReported = true;
         }
         return false;
@@ -163,18 +166,18 @@ bool CNeohubManager::ensureNeohubConnection()
         }
 
         // Connect
-        MyLog.printf("Connecting to NeoHub %s\n", url.c_str());
+        EVENT_LOG("Connecting to NeoHub %s\n", url.c_str());
         this->m_connection->onConnect([this, url]() {
-            MyLog.printf("Connection to NeoHub %s established\n", url.c_str());
+            EVENT_LOG("Connection to NeoHub %s established\n", url.c_str());
         });
         this->m_connection->onDisconnect([this, url]() {
-            MyLog.printf("Connection to NeoHub %s disconnected\n", url.c_str());
+            EVENT_LOG("Connection to NeoHub %s disconnected\n", url.c_str());
             NeohubConnection* c = this->m_connection;
             this->m_connection = nullptr;
             c->finish();
         });
         this->m_connection->onError([this, url](String message) {
-            MyLog.printf("Error in NeoHub %s connection: %s\n", url.c_str(), message.c_str());
+            EVENT_LOG("Error in NeoHub %s connection: %s\n", url.c_str(), message.c_str());
         });
         this->m_connection->connect();
 
@@ -190,7 +193,7 @@ bool CNeohubManager::ensureNeohubConnection()
     }
 
     if (!this->m_connection || !this->m_connection->isConnected()) {
-        MyLog.printf("Establishing connection to Neohub %s failed\n", url.c_str());
+        EVENT_LOG("Establishing connection to Neohub %s failed\n", url.c_str());
         this->m_connection = nullptr;
         return false;
     }
@@ -221,12 +224,16 @@ String CNeohubManager::neohubCommand(const String& command, int timeoutMillis /*
     bool done = false;
     bool error = false;
     String result;
+    uint32_t sentMicros = 0;
+    uint32_t doneMicros = 0;
 
     if (m_neohubMutex.lock(__PRETTY_FUNCTION__)) {
+        sentMicros = micros();
         this->m_connection->send(
             command,
-            [&done, &result](String response) {
+            [&done, &result, &doneMicros](String response) {
                 result = response;
+                doneMicros = micros();
                 done = true;
             },
             [&error, &result](String message) {
@@ -242,17 +249,21 @@ String CNeohubManager::neohubCommand(const String& command, int timeoutMillis /*
             millis() - startMillis < timeoutMillis  // until timeout
             && !done && !error                      // or until completed
             ) delay(100);
+        // Requests come from several tasks, the metrics are updated under the same lock
+        if (error) Metrics.neohubErrors++;
+        else if (!done) Metrics.neohubTimeouts++;
+        else Metrics.neohubRoundTrip.observe(doneMicros - sentMicros);
         m_neohubMutex.unlock();
     }
 
     if (error) {
-        MyLog.printf("Error when waiting for Neohub response: %s\n", result.c_str());
-        MyLog.printf("Command was '%s'\n", command.c_str());
+        EVENT_LOG("Error when waiting for Neohub response: %s\n", result.c_str());
+        EVENT_LOG("Command was '%s'\n", command.c_str());
         return emptyString;
     }
     if (!done) {
-        MyLog.printf("Timeout when waiting for Neohub response: %s\n", result.c_str());
-        MyLog.printf("Command was '%s'\n", command.c_str());
+        EVENT_LOG("Timeout when waiting for Neohub response: %s\n", result.c_str());
+        EVENT_LOG("Command was '%s'\n", command.c_str());
         return emptyString;
     }
 
@@ -272,10 +283,10 @@ void CNeohubManager::loadZoneNames()
     if (!ensureNeohubConnection()) return;
 
     String response = neohubCommand("{ 'GET_ZONES': 0 }");
-    JsonDocument json;
+    JsonDocument json(&JsonAllocator);
     DeserializationError error = deserializeJson(json, response);
     if (error) {
-        MyLog.printf("Failed to deserialise JSON for GET_ZONES: %s\n", error.c_str());
+        EVENT_LOG("Failed to deserialise JSON for GET_ZONES: %s\n", error.c_str());
         return;
     }
 
@@ -402,16 +413,16 @@ void CNeohubManager::loadZoneDataFromNeohub(std::vector<String>& zoneNames)
 static void _processZoneCommand(CNeohubManager* _this, const String& command)
 {
     String response = _this->neohubCommand(command);
-    JsonDocument json;
+    JsonDocument json(&JsonAllocator);
     DeserializationError error = deserializeJson(json, response);
     if (error) {
-        MyLog.printf("Failed to deserialise JSON for INFO: %s\n", error.c_str());
+        EVENT_LOG("Failed to deserialise JSON for INFO: %s\n", error.c_str());
         return;
     }
     if (!json["error"].isNull()) {
         String error = json["error"];
-        MyLog.printf("Error retrieving data from Neohub: %s", error.c_str());
-        MyLog.printf("Command: %s", command.c_str());
+        EVENT_LOG("Error retrieving data from Neohub: %s", error.c_str());
+        EVENT_LOG("Command: %s", command.c_str());
         return;
     }
 
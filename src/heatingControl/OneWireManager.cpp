@@ -249,17 +249,21 @@ void COneWireManager::readAllSensors()
         while (attemptsLeft--) {
             result = ds18b20_read_temp(&si->ds18b20_info, &si->temperature);
             si->readings++;
+            this->totals.readings++;
             if (result == DS18B20_OK) break;
 
             // Count specific error types
             if (result == DS18B20_ERROR_CRC) {
                 si->crcErrors++;
+                this->totals.crcErrors++;
             }
             else if (result == DS18B20_ERROR_NO_DATA) {
                 si->noResponseErrors++;
+                this->totals.noResponseErrors++;
             }
             else {
                 si->otherErrors++;
+                this->totals.otherErrors++;
                 break;  // no retries for these, this makes it worse
             }
         }
@@ -268,6 +272,7 @@ void COneWireManager::readAllSensors()
         if (result != DS18B20_OK) {
             si->temperature = COneWireManager::INVALID_READING;
             si->failures++;
+            this->totals.failures++;
         }
     }
     return;
@@ -51,6 +51,15 @@ class COneWireManager {
     bool sensorPresent(OneWireBus_ROMCode& address);
 
   public:
+    // Cumulative counters across all sensors since startup (the per-sensor ones are reset daily)
+    struct Totals {
+        uint32_t readings = 0;
+        uint32_t crcErrors = 0;
+        uint32_t noResponseErrors = 0;
+        uint32_t otherErrors = 0;
+        uint32_t failures = 0;
+    } totals;
+
     int getCount() { return m_count; }
     inline OneWireSensor& operator[](int index) { return *m_sensors[index]; }
 
@@ -0,0 +1,285 @@
+#include "RelayAutotune.h"
+
+#include <math.h>
+#include <vector>
+
+#include "PidController.h"
+
+// Limits for accepting the experiment and the proposal
+static const double CONSISTENCY = 0.15;     // Periods and amplitudes of the measured cycles within 15% of their mean
+static const double MAX_OVERSHOOT = 0.2;    // Of the setpoint step
+static const double SETTLED_BAND = 0.05;
+static const double DEAD_TIME_MARGIN = 1.3;  // The gains must also settle with 30% more dead time
+static const double GAIN_MARGIN = 1.5;       // and 50% more process gain than identified
+static const int SIMULATION_STEPS_PER_PERIOD = 100;
+static const int SIMULATION_PERIODS = 40;
+static const int MAX_DELAY_STEPS = 72;      // Dead time is at most half a period, plus the margin
+
+void RelayAutotune::start(double setpoint, double outputLow, double outputHigh, double hysteresis, uint32_t maxSeconds, uint32_t nowMillis)
+{
+    this->m_state = RUNNING;
+    this->m_message = "Running";
+    this->m_result = {};
+    this->m_setpoint = setpoint;
+    this->m_outputLow = outputLow;
+    this->m_outputHigh = outputHigh;
+    this->m_hysteresis = hysteresis;
+    this->m_startMillis = nowMillis;
+    this->m_maxMillis = maxSeconds * 1000;
+    this->m_first = true;
+    this->m_high = true;
+    this->m_switchMillis = nowMillis;
+    this->m_cycles = -1;
+    this->m_cycleDeadTimeSum = 0;
+    this->m_cycleDeadTimeCount = 0;
+}
+
+void RelayAutotune::cancel()
+{
+    if (this->m_state == RUNNING) this->fail("Cancelled");
+}
+
+double RelayAutotune::step(double input, uint32_t nowMillis)
+{
+    if (this->m_state != RUNNING) return this->m_high ? this->m_outputHigh : this->m_outputLow;
+
+    if (nowMillis - this->m_startMillis > this->m_maxMillis) {
+        this->fail("The loop did not oscillate steadily in time");
+        return this->m_outputLow;
+    }
+
+    // Start in the direction of the setpoint
+    if (this->m_first) {
+        this->m_first = false;
+        this->m_high = input < this->m_setpoint;
+        this->m_extreme = input;
+        this->m_extremeMillis = nowMillis;
+    }
+
+    // The turn of the input after the last switch
+    if (this->m_high ? input < this->m_extreme : input > this->m_extreme) {
+        this->m_extreme = input;
+        this->m_extremeMillis = nowMillis;
+    }
+    if (this->m_cycles >= 0) {
+        if (input > this->m_cycleMax) this->m_cycleMax = input;
+        if (input < this->m_cycleMin) this->m_cycleMin = input;
+    }
+
+    if (this->m_high && input > this->m_setpoint + this->m_hysteresis) {
+        this->switchRelay(false, input, nowMillis);
+    }
+    else if (!this->m_high && input < this->m_setpoint - this->m_hysteresis) {
+        this->switchRelay(true, input, nowMillis);
+    }
+
+    return this->m_high ? this->m_outputHigh : this->m_outputLow;
+}
+
+void RelayAutotune::switchRelay(bool high, double input, uint32_t nowMillis)
+{
+    // Before the first complete cycle the input may still be on its way to the setpoint
+    if (this->m_cycles >= 0) {
+        this->m_cycleDeadTimeSum += (this->m_extremeMillis - this->m_switchMillis) / 1000.0;
+        this->m_cycleDeadTimeCount++;
+    }
+
+    // A cycle ends and the next begins with every switch to high
+    if (high) {
+        if (this->m_cycles >= 0) {
+            int i = this->m_cycles;
+            this->m_periods[i] = (nowMillis - this->m_cycleStartMillis) / 1000.0;
+            this->m_amplitudes[i] = (this->m_cycleMax - this->m_cycleMin) / 2;
+            this->m_deadTimes[i] = this->m_cycleDeadTimeSum / this->m_cycleDeadTimeCount;
+        }
+        this->m_cycles++;
+        this->m_cycleStartMillis = nowMillis;
+        this->m_cycleMax = input;
+        this->m_cycleMin = input;
+        this->m_cycleDeadTimeSum = 0;
+        this->m_cycleDeadTimeCount = 0;
+
+        // The first cycle only brings the loop into the oscillation
+        if (this->m_cycles > MIN_CYCLES && this->consistent()) {
+            this->evaluate();
+        }
+        else if (this->m_cycles >= MAX_CYCLES) {
+            this->fail("The oscillation did not settle");
+        }
+    }
+
+    this->m_high = high;
+    this->m_switchMillis = nowMillis;
+    this->m_extreme = input;
+    this->m_extremeMillis = nowMillis;
+}
+
+// The last MIN_CYCLES cycles are alike
+bool RelayAutotune::consistent() const
+{
+    double period = 0, amplitude = 0;
+    for (int i = this->m_cycles - MIN_CYCLES; i < this->m_cycles; i++) {
+        period += this->m_periods[i] / MIN_CYCLES;
+        amplitude += this->m_amplitudes[i] / MIN_CYCLES;
+    }
+    for (int i = this->m_cycles - MIN_CYCLES; i < this->m_cycles; i++) {
+        if (fabs(this->m_periods[i] - period) > CONSISTENCY * period) return false;
+        if (fabs(this->m_amplitudes[i] - amplitude) > CONSISTENCY * amplitude) return false;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// From the oscillation to the model and the gains
+//
+// For a first order plus dead time plant K * e^(-Ls) / (1 + Ts) under a relay of +/-d
+// with hysteresis e, the oscillation can be calculated exactly. The input turns L after
+// each switch, so the amplitude a and the half period are
+//
+//   a = Kd + (e - Kd) * e^(-L/T)
+//   Tu/2 = L + T * ln((a + Kd) / (Kd - e))
+//
+// With a, Tu and L measured, the first gives Kd for any T, and the second is solved for T
+// by bisection. This is more robust than using the phase at Tu, which depends on
+// tan(pi - 2pi L / Tu) and so on small errors in Tu and L.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// Kd for a time constant, from the amplitude
+static double relayProcessGain(double timeConstant, double deadTime, double amplitude, double hysteresis)
+{
+    double decay = exp(-deadTime / timeConstant);
+    return (amplitude - hysteresis * decay) / (1 - decay);
+}
+
+// Time constant for the half period: the half period grows with the time constant
+static double relayTimeConstant(double halfPeriod, double deadTime, double amplitude, double hysteresis)
+{
+    double low = deadTime / 100, high = deadTime * 1000;
+    for (int i = 0; i < 60; i++) {
+        double t = sqrt(low * high);
+        double kd = relayProcessGain(t, deadTime, amplitude, hysteresis);
+        double calculated = deadTime + t * log((amplitude + kd) / (kd - hysteresis));
+        if (calculated < halfPeriod) low = t; else high = t;
+    }
+    return sqrt(low * high);
+}
+
+struct Candidate {
+    const char* rule;
+    double proportionalGain;
+    double integralTimeSeconds;
+};
+
+void RelayAutotune::evaluate()
+{
+    AutotuneResult& r = this->m_result;
+
+    double period = 0, amplitude = 0, deadTime = 0;
+    for (int i = this->m_cycles - MIN_CYCLES; i < this->m_cycles; i++) {
+        period += this->m_periods[i] / MIN_CYCLES;
+        amplitude += this->m_amplitudes[i] / MIN_CYCLES;
+        deadTime += this->m_deadTimes[i] / MIN_CYCLES;
+    }
+    if (amplitude <= this->m_hysteresis * 1.05) {
+        this->fail("The oscillation is too small to measure");
+        return;
+    }
+
+    // Relay with hysteresis: the switch happens at the hysteresis, not at the setpoint
+    double d = (this->m_outputHigh - this->m_outputLow) / 2;
+    r.ultimateGain = 4 * d / (M_PI * sqrt(amplitude * amplitude - this->m_hysteresis * this->m_hysteresis));
+    r.ultimatePeriodSeconds = period;
+
+    // Between a pure dead time (Tu = 2L) and a slow plant with little dead time (Tu = 4L)
+    if (deadTime < period * 0.26) deadTime = period * 0.26;
+    if (deadTime > period * 0.49) deadTime = period * 0.49;
+    r.deadTimeSeconds = deadTime;
+    r.timeConstantSeconds = relayTimeConstant(period / 2, deadTime, amplitude, this->m_hysteresis);
+    r.processGain = relayProcessGain(r.timeConstantSeconds, deadTime, amplitude, this->m_hysteresis) / d;
+
+    // The candidates, from the fastest to the slowest
+    const int COUNT = 3;
+    const Candidate candidates[COUNT] = {
+        { "Ziegler-Nichols", 0.45 * r.ultimateGain, period / 1.2 },
+        { "Tyreus-Luyben",   r.ultimateGain / 3.2,  2.2 * period },
+        { "Conservative",    r.ultimateGain / 5,    3 * period },
+    };
+
+    // All of them at once, for a setpoint step of 1 from 0: the first COUNT runs on the
+    // model, the others on the model with more dead time and gain. On the heap, the valve
+    // control task has a small stack.
+    const int RUNS = 2 * COUNT;
+    typedef PidControllerT<double, PidFixedStep> SimulatedController;
+    std::vector<SimulatedController> controllers(RUNS);
+    std::vector<double> delayed(RUNS * MAX_DELAY_STEPS, 0.0);
+    double inputs[RUNS] = {};
+    double overshoot[RUNS] = {};
+    double error[RUNS] = {};
+    int lastOutside[RUNS] = {};
+
+    double dt = period / SIMULATION_STEPS_PER_PERIOD;
+    int delaySteps[2];
+    delaySteps[0] = (int)(deadTime / dt + 0.5);
+    delaySteps[1] = (int)(deadTime * DEAD_TIME_MARGIN / dt + 0.5);
+    for (int m = 0; m < 2; m++) {
+        if (delaySteps[m] >= MAX_DELAY_STEPS) delaySteps[m] = MAX_DELAY_STEPS - 1;
+        if (delaySteps[m] < 1) delaySteps[m] = 1;
+    }
+    double processGain[2] = { r.processGain, r.processGain * GAIN_MARGIN };
+    double alpha = 1 - exp(-dt / r.timeConstantSeconds);
+    double outputLimit = 100 / r.processGain;  // Linear, apart from absurd outputs
+
+    for (int c = 0; c < RUNS; c++) {
+        controllers[c].setStepSeconds(dt);
+        controllers[c].setOutputRange(-outputLimit, outputLimit);
+        controllers[c].configureSeconds(candidates[c % COUNT].proportionalGain, candidates[c % COUNT].integralTimeSeconds, 0);
+        controllers[c].setSetpoint(1);
+    }
+
+    int steps = SIMULATION_STEPS_PER_PERIOD * SIMULATION_PERIODS;
+    for (int s = 0; s < steps; s++) {
+        SimulatedController::step(controllers.data(), inputs, RUNS);
+        for (int c = 0; c < RUNS; c++) {
+            double* line = &delayed[c * MAX_DELAY_STEPS];
+            line[s % MAX_DELAY_STEPS] = controllers[c].getOutput();
+            double output = line[(s + MAX_DELAY_STEPS - delaySteps[c / COUNT]) % MAX_DELAY_STEPS];
+            inputs[c] += (processGain[c / COUNT] * output - inputs[c]) * alpha;
+
+            if (inputs[c] - 1 > overshoot[c]) overshoot[c] = inputs[c] - 1;
+            if (fabs(inputs[c] - 1) > SETTLED_BAND) lastOutside[c] = s + 1;
+            error[c] += fabs(1 - inputs[c]) * dt;
+        }
+    }
+
+    // The smallest integrated error that settles without too much overshoot, also with
+    // the margins
+    int best = -1;
+    for (int c = 0; c < COUNT; c++) {
+        bool settles = true;
+        for (int run = c; run < RUNS; run += COUNT) {
+            if (overshoot[run] > MAX_OVERSHOOT || lastOutside[run] > steps * 3 / 4) settles = false;
+        }
+        if (!settles) continue;
+        if (best < 0 || error[c] < error[best]) best = c;
+    }
+    if (best < 0) {
+        this->fail("None of the gains settled on the identified model");
+        return;
+    }
+
+    r.rule = candidates[best].rule;
+    r.proportionalGain = candidates[best].proportionalGain;
+    r.integralTimeSeconds = candidates[best].integralTimeSeconds;
+    r.overshoot = overshoot[best];
+    r.settlingSeconds = lastOutside[best] * dt;
+    this->m_state = DONE;
+    this->m_message = "Done";
+}
+
+void RelayAutotune::fail(const char* message)
+{
+    this->m_state = FAILED;
+    this->m_message = message;
+}
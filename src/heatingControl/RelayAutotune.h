@@ -0,0 +1,99 @@
+#ifndef __RELAY_AUTOTUNE_H
+#define __RELAY_AUTOTUNE_H
+
+#include <Arduino.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// PI gains from a relay experiment (Astrom-Hagglund)
+//
+// Instead of the controller, a relay drives the output: high while the input is below the
+// setpoint, low above it (with some hysteresis against noise). The loop then oscillates at
+// its ultimate period Tu, and the amplitude of the oscillation gives the ultimate gain Ku.
+// The time from a switch of the relay to the turn of the input is taken as the dead time.
+//
+// From the oscillation and the dead time follows a first order plus dead time model of the
+// plant. Three sets of PI gains (Ziegler-Nichols, Tyreus-Luyben and a slower one) are each
+// run on the model for a step of the setpoint, and again on a model with more dead time and
+// gain for some margin. The fastest one that settles without much overshoot on both is
+// proposed. If none does, or the oscillation does not settle, tuning fails.
+//
+// The relay should be centred on the output that holds the setpoint, the calculation
+// assumes a symmetric oscillation.
+//
+// Only the calculation: the caller feeds in the input and sends the output to the plant.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+struct AutotuneResult {
+    double ultimateGain;            // Ku, output per unit of input
+    double ultimatePeriodSeconds;   // Tu
+    double processGain;             // Model: gain, time constant and dead time
+    double timeConstantSeconds;
+    double deadTimeSeconds;
+
+    double proportionalGain;        // Proposed
+    double integralTimeSeconds;
+    const char* rule;               // Tuning rule of the proposal
+
+    double overshoot;               // Of the simulated setpoint step, as a fraction of the step
+    double settlingSeconds;         // Until it stays within 5% of the step
+};
+
+class RelayAutotune {
+  public:
+    enum State { IDLE, RUNNING, DONE, FAILED };
+
+    static const int MIN_CYCLES = 3;    // Measured, after the first (which is not)
+    static const int MAX_CYCLES = 10;
+
+  private:
+    State m_state = IDLE;
+    const char* m_message = "";
+    AutotuneResult m_result = {};
+
+    double m_setpoint = 0;
+    double m_outputLow = 0;
+    double m_outputHigh = 0;
+    double m_hysteresis = 0;
+    uint32_t m_startMillis = 0;
+    uint32_t m_maxMillis = 0;
+
+    bool m_first = true;
+    bool m_high = false;
+    uint32_t m_switchMillis = 0;        // Last switch of the relay
+    double m_extreme = 0;               // Highest (relay low) or lowest (relay high) input since the switch
+    uint32_t m_extremeMillis = 0;
+
+    // Of the complete cycles, from one switch to high to the next
+    int m_cycles = -1;                  // -1 until the first switch to high
+    uint32_t m_cycleStartMillis = 0;
+    double m_cycleMax = 0;
+    double m_cycleMin = 0;
+    double m_periods[MAX_CYCLES];
+    double m_amplitudes[MAX_CYCLES];
+    double m_deadTimes[MAX_CYCLES];
+    double m_cycleDeadTimeSum = 0;
+    int m_cycleDeadTimeCount = 0;
+
+  public:
+    void start(double setpoint, double outputLow, double outputHigh, double hysteresis, uint32_t maxSeconds, uint32_t nowMillis);
+    void cancel();
+
+    // The output for this input; only while RUNNING
+    double step(double input, uint32_t nowMillis);
+
+    State getState() const { return this->m_state; }
+    const char* getMessage() const { return this->m_message; }
+    int getCycles() const { return this->m_cycles < 0 ? 0 : this->m_cycles; }
+    uint32_t getElapsedSeconds(uint32_t nowMillis) const { return (nowMillis - this->m_startMillis) / 1000; }
+    const AutotuneResult& getResult() const { return this->m_result; }
+
+  private:
+    void switchRelay(bool high, double input, uint32_t nowMillis);
+    bool consistent() const;
+    void evaluate();
+    void fail(const char* message);
+};
+
+#endif
@@ -8,6 +8,19 @@ DFRobot_GP8403 dac(&Wire,0x5f); // I2C address 0x58
 // Define the global singleton
 CValveManager ValveManager;
 
+// Automatic tuning: the relay swings the output by this much either side of where it was,
+// switching when the input is this far off the setpoint (a little over the sensor
+// resolution), and gives up after the time given
+static const double FLOW_RELAY_AMPLITUDE = 15;          // % valve
+static const double FLOW_RELAY_HYSTERESIS = 0.2;        // degrees C flow
+static const uint32_t FLOW_AUTOTUNE_SECONDS = 2 * 3600;
+static const double ROOM_RELAY_AMPLITUDE = 5;           // degrees C flow
+static const double ROOM_RELAY_HYSTERESIS = 0.1;        // degrees C room
+static const uint32_t ROOM_AUTOTUNE_SECONDS = 48 * 3600;
+
+// Below this difference between input and return, the mixing model is not used
+static const double FEEDFORWARD_MIN_SPREAD = 3;         // degrees C
+
 // Load the initial state of the valve manager. includes loadConfig()
 void CValveManager::setup()
 {
@@ -48,6 +61,7 @@ void CValveManager::loadConfig() {
         0                                    // derivativeTimeSeconds
     );
     this->m_valveInverted = Config.getFlowValveInverted();
+    this->m_feedforwardEnabled = Config.getFlowFeedforward();
 }
 
 // Set the process variables that the controllers are managing
@@ -55,47 +69,278 @@ void CValveManager::setInputs(
     double roomTemperature, double flowTemperature, 
     double inputTemperature, double returnTemperature
 ) {
-    this->inputs.roomTemperature = roomTemperature;
-    this->inputs.flowTemperature = flowTemperature; 
-    this->inputs.inputTemperature = inputTemperature;
-    this->inputs.returnTemperature = returnTemperature;
+    this->m_inputs.roomTemperature = roomTemperature;
+    this->m_inputs.flowTemperature = flowTemperature; 
+    this->m_inputs.inputTemperature = inputTemperature;
+    this->m_inputs.returnTemperature = returnTemperature;
 };
 
 // Calculate the control loops outputs
 void CValveManager::calculateValvePosition() {
 
+    this->handleRequests();
+
     // Initialisation bump avoidance - if we have no
     // data yet, we initialise the flow setpoint with its current value
     // to avoid a massive swing.
     static bool first = true;
-    if (first && this->inputs.flowTemperature > -50) {
+    if (first && this->m_inputs.flowTemperature > -50) {
         if (
             this->m_flowController.getOutput() == Config.getFlowMinSetpoint()
             || this->m_flowController.getOutput() == Config.getFlowMaxSetpoint()
          ) {
-            MyLog.printf("Initialising flow setpoint to %.1f degrees\n", (this->inputs.flowTemperature));
-            this->m_flowController.setOutput(this->inputs.flowTemperature);
+            MyLog.printf("Initialising flow setpoint to %.1f degrees\n", (this->m_inputs.flowTemperature));
+            this->m_flowController.setOutput(this->m_inputs.flowTemperature);
         }
         first = false;
     }
 
-    // If we have a valid room temperature, we recalculate the flow
-    // temperature
-    if (this->inputs.roomTemperature != NeohubZoneData::NO_TEMPERATURE) {
-        this->m_flowController.setInput(this->inputs.roomTemperature);
-        this->m_flowController.calculateOutput();
+    if (this->m_autotuneLoop == AutotuneLoop::ROOM) {
+        // The relay sets the flow temperature while tuning the room loop
+        if (this->m_inputs.roomTemperature != NeohubZoneData::NO_TEMPERATURE) {
+            this->m_outputs.targetFlowTemperature = this->m_autotune.step(this->m_inputs.roomTemperature, millis());
+        }
+    }
+    else {
+        // If we have a valid room temperature, we recalculate the flow
+        // temperature
+        if (this->m_inputs.roomTemperature != NeohubZoneData::NO_TEMPERATURE) {
+            this->m_flowController.setInput(this->m_inputs.roomTemperature);
+            this->m_flowController.calculateOutput();
+        }
+        this->m_outputs.targetFlowTemperature = this->m_flowController.getOutput();
+        // If we don't have a valid room temperature, the target flow
+        // temperature remains unchanged. If we never had a room temperature,
+        // this is theconfigured minimum flow temperature
     }
-    this->outputs.targetFlowTemperature = this->m_flowController.getOutput();
-    // If we don't have a valid room temperature, the target flow
-    // temperature remains unchanged. If we never had a room temperature,
-    // this is theconfigured minimum flow temperature
 
     // Now that we know the target flow temperature, we recalculate
     // the valve position
-    this->m_valveController.setInput(this->inputs.flowTemperature);
-    this->m_valveController.setSetpoint(this->outputs.targetFlowTemperature);
-    this->m_valveController.calculateOutput();
-    this->outputs.targetValvePosition = this->m_valveController.getOutput();
+    this->m_valveController.setInput(this->m_inputs.flowTemperature);
+    this->m_valveController.setSetpoint(this->m_outputs.targetFlowTemperature);
+    this->updateFeedforward();
+    if (this->m_autotuneLoop == AutotuneLoop::FLOW) {
+        // The relay sets the valve while tuning the flow loop
+        if (this->m_inputs.flowTemperature > -50) {
+            this->m_outputs.targetValvePosition = this->m_autotune.step(this->m_inputs.flowTemperature, millis());
+        }
+    }
+    else {
+        this->m_valveController.calculateOutput();
+        this->m_outputs.targetValvePosition = this->m_valveController.getOutput();
+    }
+
+    this->finishAutotune();
+    this->publishState();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Automatic tuning
+//
+// The web server asks for it with startAutotune(); the valve control task starts it in its
+// next cycle, around the output of the loop at that time, which is then assumed to hold the
+// setpoint. When the experiment ends (done, failed or cancelled), the controller takes over
+// again from that output. Manual valve control cancels a tuning of the flow loop.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+bool CValveManager::startAutotune(AutotuneLoop loop)
+{
+    if (this->getAutotuneStatus().state == RelayAutotune::RUNNING) return false;
+    if (this->m_manualValveControl) return false;
+    ControlState state = this->getState();
+    uint8_t request;
+    if (loop == AutotuneLoop::FLOW) {
+        if (state.inputs.flowTemperature <= -50) return false;
+        request = REQUEST_START_FLOW_AUTOTUNE;
+    }
+    else if (loop == AutotuneLoop::ROOM) {
+        if (state.inputs.roomTemperature == NeohubZoneData::NO_TEMPERATURE) return false;
+        request = REQUEST_START_ROOM_AUTOTUNE;
+    }
+    else {
+        return false;
+    }
+
+    // Only one start at a time, the first one wins
+    uint8_t pending = this->m_requests.load();
+    do {
+        if (pending & (REQUEST_START_FLOW_AUTOTUNE | REQUEST_START_ROOM_AUTOTUNE)) return false;
+    } while (!this->m_requests.compare_exchange_weak(pending, pending | request));
+    return true;
+}
+
+// Relay output range of the given amplitude around the centre, moved to within min..max
+static void relayRange(double centre, double amplitude, double min, double max, double& low, double& high)
+{
+    low = centre - amplitude;
+    high = centre + amplitude;
+    if (low < min) { high += min - low; low = min; }
+    if (high > max) { low -= high - max; high = max; }
+    if (low < min) low = min;
+}
+
+// The requests of the other tasks, at the start of a cycle of the valve control task
+void CValveManager::handleRequests()
+{
+    uint8_t requests = this->m_requests.exchange(0);
+    if (!requests) return;
+
+    // The configuration first, so a tuning starts with the new limits
+    if (requests & REQUEST_RELOAD_CONFIG) this->loadConfig();
+    if (requests & REQUEST_CANCEL_AUTOTUNE) this->m_autotune.cancel();
+    if (!(requests & (REQUEST_START_FLOW_AUTOTUNE | REQUEST_START_ROOM_AUTOTUNE))) return;
+    if (this->m_autotuneLoop != AutotuneLoop::NONE) return;    // One at a time
+
+    AutotuneStatus& s = this->m_autotuneStart;
+    if (requests & REQUEST_START_FLOW_AUTOTUNE) {
+        s.loop = AutotuneLoop::FLOW;
+        this->m_autotuneCentre = this->m_outputs.targetValvePosition;
+        relayRange(this->m_autotuneCentre, FLOW_RELAY_AMPLITUDE, 0, 100, s.relayLow, s.relayHigh);
+        this->m_autotune.start(
+            this->m_outputs.targetFlowTemperature, s.relayLow, s.relayHigh,
+            FLOW_RELAY_HYSTERESIS, FLOW_AUTOTUNE_SECONDS, millis()
+        );
+    }
+    else {
+        s.loop = AutotuneLoop::ROOM;
+        this->m_autotuneCentre = this->m_outputs.targetFlowTemperature;
+        relayRange(
+            this->m_autotuneCentre, ROOM_RELAY_AMPLITUDE,
+            Config.getFlowMinSetpoint(), Config.getFlowMaxSetpoint(), s.relayLow, s.relayHigh
+        );
+        this->m_autotune.start(
+            this->m_roomSetpoint, s.relayLow, s.relayHigh,
+            ROOM_RELAY_HYSTERESIS, ROOM_AUTOTUNE_SECONDS, millis()
+        );
+    }
+    this->m_autotuneLoop = s.loop;
+    MyLog.printf(
+        "Autotune of the %s loop started, relay %.1f..%.1f\n",
+        s.loop == AutotuneLoop::FLOW ? "flow" : "room", s.relayLow, s.relayHigh
+    );
+}
+
+void CValveManager::finishAutotune()
+{
+    if (this->m_autotuneLoop == AutotuneLoop::NONE) return;
+    if (this->m_autotuneLoop == AutotuneLoop::FLOW && this->m_manualValveControl) this->m_autotune.cancel();
+
+    if (this->m_autotune.getState() != RelayAutotune::RUNNING) {
+        // Back to the controller, from where the experiment started
+        if (this->m_autotuneLoop == AutotuneLoop::FLOW) {
+            this->m_valveController.setOutput(this->m_autotuneCentre);
+            this->m_outputs.targetValvePosition = this->m_valveController.getOutput();
+        }
+        else {
+            this->m_flowController.setOutput(this->m_autotuneCentre);
+            this->m_outputs.targetFlowTemperature = this->m_flowController.getOutput();
+        }
+
+        const AutotuneResult& r = this->m_autotune.getResult();
+        if (this->m_autotune.getState() == RelayAutotune::DONE) {
+            MyLog.printf(
+                "Autotune done: Ku %.2f, Tu %.0fs, model K %.2f T %.0fs L %.0fs, %s Kp %.2f Ti %.0fs\n",
+                r.ultimateGain, r.ultimatePeriodSeconds, r.processGain, r.timeConstantSeconds,
+                r.deadTimeSeconds, r.rule, r.proportionalGain, r.integralTimeSeconds
+            );
+        }
+        else {
+            MyLog.printf("Autotune failed: %s\n", this->m_autotune.getMessage());
+        }
+        this->publishAutotuneStatus();
+        this->m_autotuneLoop = AutotuneLoop::NONE;
+        return;
+    }
+
+    this->publishAutotuneStatus();
+}
+
+void CValveManager::publishAutotuneStatus()
+{
+    AutotuneStatus status = this->m_autotuneStart;
+    status.state = this->m_autotune.getState();
+    status.message = this->m_autotune.getMessage();
+    status.cycles = this->m_autotune.getCycles();
+    status.elapsedSeconds = this->m_autotune.getElapsedSeconds(millis());
+    status.result = this->m_autotune.getResult();
+    this->m_autotuneStatus.write(status);
+}
+
+// Called by the web server: the gains go into the configuration here, so the caller can
+// save it, and the valve control task reloads the controllers in its next cycle
+bool CValveManager::applyAutotune()
+{
+    AutotuneStatus status = this->getAutotuneStatus();
+    if (status.state != RelayAutotune::DONE) return false;
+
+    if (status.loop == AutotuneLoop::FLOW) {
+        Config.setFlowProportionalGain(status.result.proportionalGain);
+        Config.setFlowIntegralSeconds(status.result.integralTimeSeconds);
+    }
+    else {
+        Config.setRoomProportionalGain(status.result.proportionalGain);
+        Config.setRoomIntegralMinutes(status.result.integralTimeSeconds / 60);
+    }
+    this->requestConfigReload();
+    MyLog.printf(
+        "Autotune gains applied to the %s loop: %.2f, %.0fs\n",
+        status.loop == AutotuneLoop::FLOW ? "flow" : "room",
+        status.result.proportionalGain, status.result.integralTimeSeconds
+    );
+    return true;
+}
+
+// Feedforward for the valve from the mixing model: the flow is input water mixed with
+// return water, so the valve position for the flow setpoint is roughly
+//
+//   100% * (flow setpoint - return) / (input - return)
+//
+// The controller only trims around this, so a change of the boiler temperature moves the
+// valve in the same cycle instead of waiting for the integral term. Without a usable input
+// and return temperature the last feedforward is kept. Switching it on or off is bumpless.
+void CValveManager::updateFeedforward()
+{
+    if (!this->m_feedforwardEnabled) {
+        if (this->m_feedforwardActive) {
+            this->m_valveController.setFeedforward(0);
+            this->m_valveController.setOutput(this->m_valveController.getOutput());
+            this->m_feedforwardActive = false;
+        }
+        return;
+    }
+
+    double input = this->m_inputs.inputTemperature;
+    double ret = this->m_inputs.returnTemperature;
+    if (input <= -50 || ret <= -50 || input - ret < FEEDFORWARD_MIN_SPREAD) return;
+
+    double feedforward = 100 * (this->m_outputs.targetFlowTemperature - ret) / (input - ret);
+    if (feedforward < 0) feedforward = 0;
+    if (feedforward > 100) feedforward = 100;
+    this->m_valveController.setFeedforward(feedforward);
+    if (!this->m_feedforwardActive) {
+        this->m_valveController.setOutput(this->m_valveController.getOutput());
+        this->m_feedforwardActive = true;
+    }
+}
+
+// Make the result of this cycle visible to the other tasks
+void CValveManager::publishState()
+{
+    ControlState state;
+    state.cycle = ++this->m_cycle;
+    state.timeMillis = millis();
+    state.inputs = this->m_inputs;
+    state.outputs = this->m_outputs;
+    state.valvePosition = this->m_manualValveControl ? this->m_manualValvePosition : this->m_outputs.targetValvePosition;
+    state.roomSetpoint = this->m_roomSetpoint;
+    state.roomProportionalTerm = this->m_flowController.getProportionalTerm();
+    state.roomIntegralTerm = this->m_flowController.getIntegralTerm();
+    state.flowProportionalTerm = this->m_valveController.getProportionalTerm();
+    state.flowIntegralTerm = this->m_valveController.getIntegralTerm();
+    state.flowFeedforwardTerm = this->m_valveController.getFeedforward();
+    this->m_state.write(state);
 }
 
 // Set the position of the valve and force the controller to start at that position
@@ -103,12 +348,13 @@ void CValveManager::setValvePosition(double position) {
     this->m_valveController.setOutput(position);
 }
 
+// Also called by the web server, so the automatic position comes from the published state
 double CValveManager::getValvePosition() {
     if (this->m_manualValveControl) {
         return this->m_manualValvePosition;
     }
     else {
-        return this->outputs.targetValvePosition;
+        return this->getState().outputs.targetValvePosition;
     }
 }
 
@@ -117,7 +363,7 @@ void CValveManager::sendCurrentValvePosition() {
         sendValvePosition(this->m_manualValvePosition);
     }
     else {
-        sendValvePosition(this->outputs.targetValvePosition);
+        sendValvePosition(this->getState().outputs.targetValvePosition);
     }
 }
 
@@ -133,4 +379,9 @@ void CValveManager::sendValvePosition(double valvePosition) {
     if (!m_dacInitialised) return;
     if (m_valveInverted) valvePosition = 100 - valvePosition;
     dac.setDACOutVoltage(valvePosition * 100, 0); // Scale 0..100% to 0..10,000 mV (0-10V)
+
+    uint16_t boilerFlowMillivolts = this->m_boilerFlowMillivolts;
+    if (this->m_boilerFlowMillivoltsSent.exchange(boilerFlowMillivolts) != boilerFlowMillivolts) {
+        dac.setDACOutVoltage(boilerFlowMillivolts, 1);
+    }
 }
\ No newline at end of file
@@ -1,8 +1,12 @@
 #ifndef __BOILER_MANAGER_H
 #define __BOILER_MANAGER_H
 
+#include <atomic>
+
 #include "MyConfig.h"
 #include "PidController.h"
+#include "RelayAutotune.h"
+#include "SeqLock.h"
 
 // The inputs to the contol loops
 struct ValveManagerInputs {
@@ -20,35 +24,103 @@ struct ValveManagerOutputs {
   double targetValvePosition;    // 0..100 %
 };
 
+// One control cycle: what went in, what came out and how. Published by the valve control
+// task after every cycle; other tasks get a consistent copy with getState().
+struct ControlState {
+  uint32_t cycle;               // Control cycles since the start
+  uint32_t timeMillis;          // When the cycle was calculated
+  ValveManagerInputs inputs;
+  ValveManagerOutputs outputs;
+  double valvePosition;         // As sent to the valve, the manual position if under manual control
+  double roomSetpoint;
+  double roomProportionalTerm;
+  double roomIntegralTerm;
+  double flowProportionalTerm;
+  double flowIntegralTerm;
+  double flowFeedforwardTerm;   // Valve position from the mixing model, 0 if not used
+};
+
+// The loop an automatic tuning runs on: FLOW tunes the valve controller (flow-pg, flow-is),
+// ROOM the flow setpoint controller (room-pg, room-is)
+enum class AutotuneLoop : uint8_t { NONE, FLOW, ROOM };
+
+// Progress and result of the last automatic tuning, published by the valve control task
+struct AutotuneStatus {
+  AutotuneLoop loop;            // NONE if there never was one
+  RelayAutotune::State state;
+  const char* message;
+  int cycles;                   // Complete oscillations so far
+  uint32_t elapsedSeconds;
+  double relayLow;              // Output while above / below the setpoint
+  double relayHigh;
+  AutotuneResult result;        // When DONE
+};
+
 class CValveManager {
   private:
     PidController m_flowController;
     PidController m_valveController;
 
+    // Only used by the valve control task
+    ValveManagerInputs m_inputs;
+    ValveManagerOutputs m_outputs;
+    uint32_t m_cycle = 0;
+
+    SeqLock<ControlState> m_state;
+
     double m_roomSetpoint;            // Set by from configuration/setter
 
     bool m_valveInverted = false;
     bool m_dacInitialised = false;
 
+    // Only used by the valve control task; the configuration is loaded there (see
+    // requestConfigReload()), so switching the feedforward never happens mid-cycle
+    bool m_feedforwardEnabled = true;   // From the configuration
+    bool m_feedforwardActive = false;
+
     bool m_manualValveControl = false;
     double m_manualValvePosition;
 
-  public:
-    volatile ValveManagerInputs inputs;
-    volatile ValveManagerOutputs outputs;
+    // Also sent when the web server resumes the automatic valve control
+    std::atomic<uint16_t> m_boilerFlowMillivolts{0};
+    std::atomic<uint16_t> m_boilerFlowMillivoltsSent{0};
+
+    // Requests from other tasks (the web server), carried out by the valve control task at
+    // the start of its next cycle. A bit each, so one request does not replace another.
+    enum ControlRequest : uint8_t {
+        REQUEST_RELOAD_CONFIG = 0x01,
+        REQUEST_START_FLOW_AUTOTUNE = 0x02,
+        REQUEST_START_ROOM_AUTOTUNE = 0x04,
+        REQUEST_CANCEL_AUTOTUNE = 0x08,
+    };
+    std::atomic<uint8_t> m_requests{0};
+
+    // Automatic tuning. The valve control task starts it and runs the relay instead of the
+    // controller of that loop.
+    RelayAutotune m_autotune;
+    AutotuneLoop m_autotuneLoop = AutotuneLoop::NONE;     // Running on, only used by the valve control task
+    AutotuneStatus m_autotuneStart = {};                  // Loop and relay of the last one started
+    double m_autotuneCentre;                              // Output when it started
+    SeqLock<AutotuneStatus> m_autotuneStatus;
 
+  public:
     // Load the initial state of the valve manager. includes loadConfig()
     void setup();
 
-    // Load all parameters from the configuration file.
+    // Load all parameters from the configuration file. Only before the valve control task
+    // runs; after that, from any task, requestConfigReload() to load them in its next cycle.
     void loadConfig();
+    void requestConfigReload() { this->m_requests.fetch_or(REQUEST_RELOAD_CONFIG); };
 
     // set/get the setpoint for the room temperature
     void setRooomSetpoint(double setpoint) { this->m_roomSetpoint = setpoint; m_flowController.setSetpoint(setpoint); };
     double getRoomSetpoint() { return this->m_roomSetpoint; };
 
+    // The inputs, outputs and terms of the last control cycle, from any task
+    ControlState getState() const { return this->m_state.read(); };
+
     // get the (intermediate) setpoint for the flow temperature
-    double getFlowSetpoint() { return this->outputs.targetFlowTemperature; };
+    double getFlowSetpoint() const { return this->getState().outputs.targetFlowTemperature; };
     void setFlowSetpointRange(double min, double max) { this->m_flowController.setOutputRange(min, max); };
 
     // Set the process variables that the controllers are managing
@@ -62,6 +134,10 @@ class CValveManager {
     double getValvePosition();
     void sendCurrentValvePosition();
 
+    // Heating controller: flow temperature requested from the boiler (see BoilerDemand), from
+    // any task. Sent with the valve position, as 0..10 V for 0..100 degrees C on DAC channel 1.
+    void setBoilerFlowRequest(double temperature) { this->m_boilerFlowMillivolts = constrain(temperature, 0.0, 100.0) * 100; };
+
     // Direct setting of a particular PID controller OUTPUT.
     // "Debumps" the corresponding controller so it will initially hold that output 
     void setFlowSetpoint(double setpoint) { this->m_flowController.setOutput(setpoint); this->m_valveController.setSetpoint(setpoint); };
@@ -73,18 +149,28 @@ class CValveManager {
     void resumeAutomaticValveControl() { m_manualValveControl = false; this->sendCurrentValvePosition(); };
     bool valveUnderManualControl() { return m_manualValveControl; };
 
-    // Information: get the individual components of the full PID output calculation 
-    double getRoomProportionalTerm() { return this->m_flowController.getProportionalTerm(); };
-    double getRoomIntegralTerm() { return this->m_flowController.getIntegralTerm(); };
-    double getFlowProportionalTerm() { return this->m_valveController.getProportionalTerm(); };
-    double getFlowIntegralTerm() { return this->m_valveController.getIntegralTerm(); };
-
+    // Information: the individual components of the full PID output calculation are in getState()
     double getRoomIntegralGain() { return this->m_flowController.getIntegralGain(); };
     double getFlowIntegralGain() { return this->m_valveController.getIntegralGain(); };
 
+    // Automatic tuning of a loop with a relay experiment (see RelayAutotune). Starts in the
+    // next control cycle, false if it can't (already running, no measurement, manual valve
+    // control, another start pending). The proposed gains are only used after
+    // applyAutotune(), which puts them into the configuration and requests a reload; the
+    // caller saves it.
+    bool startAutotune(AutotuneLoop loop);
+    void cancelAutotune() { this->m_requests.fetch_or(REQUEST_CANCEL_AUTOTUNE); };
+    AutotuneStatus getAutotuneStatus() const { return this->m_autotuneStatus.read(); };
+    bool applyAutotune();
+
 
   private: 
     void sendValvePosition (double valvePosition);
+    void publishState();
+    void updateFeedforward();
+    void handleRequests();
+    void finishAutotune();
+    void publishAutotuneStatus();
 
 };
 
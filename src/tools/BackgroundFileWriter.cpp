@@ -1,43 +1,24 @@
 #include "BackgroundFileWriter.h"
 
+#include "LogStorage.h"
+
 ////////////////////////////////////////////////////////////////////////////////////////////
 //
-// WriteJob - a set of data that will be written to a file
+// CBackgroundFileWriter - a background file writer using per-file ring buffers and a dedicated task
 //
 
-// Create a job to write a buffer to a file
-// the data is copied into the job's own buffer, but we do NOT copy the fileName
-// so we rely on the sender to manage the memory of fileName
-CBackgroundFileWriter::WriteJob::WriteJob(const char* fileName, const uint8_t* data, size_t len)
-{
-    // We do NOT own fileName, we rely on the sender to manage its memory
-    this->fileName = fileName,
-    this->len = len;
-    this->data = (uint8_t*)malloc(len);
-    memcpy(this->data, data, len);
-}
-
-// Destructor - free the data buffer
-// NOTE - we do not free fileName, as we do not own it
-CBackgroundFileWriter::WriteJob::~WriteJob()
+CBackgroundFileWriter::CBackgroundFileWriter() : m_registerMutex("BackgroundFileWriter::m_registerMutex")
 {
-    // DO NOT FREE fileName, it's not allocated here, we rely on
-    // the sender to manage its memory
-    if (data) free(data);
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////
-//
-// CBackgroundFileWriter - a background file writer using a queue and a dedicated task
-//
-
-// Setup the background file writer to use a particular SdFs and mutex, 
-// and create the queue
-void CBackgroundFileWriter::setup(SdFs *sdFs, MyMutex *sdMutex, int queueDepth /* = 10 */)
+// Setup the background file writer and start the task. LogStorage must have been set up.
+// Every file gets a ring buffer of bufferSize bytes when it is first written to.
+void CBackgroundFileWriter::setup(size_t bufferSize /* = 4096 */, uint32_t flushLatencyMs /* = 1000 */)
 {
-    m_sdMutex = sdMutex;
-    m_fs = sdFs;
-    m_queue = xQueueCreate(queueDepth, sizeof(WriteJob*));
+    this->m_bufferSize = bufferSize;
+    this->m_flushLatencyMs = flushLatencyMs;
+    this->m_drainBuffer = (uint8_t*)malloc(bufferSize);
+    if (!this->m_drainBuffer) return;
     startWriterTask();
 }
 
@@ -49,16 +30,62 @@ bool CBackgroundFileWriter::write(
 )
 {
     // Initialisation check
-    if (!m_queue || !m_fs || !m_sdMutex) return false;
-    WriteJob* job = new WriteJob(logFileName, output, (size_t)len);
+    if (!this->m_task) return false;
+
+    FileBuffer* file = this->findFile(logFileName);
+    if (!file) file = this->addFile(logFileName);
+    if (!file) return false;
 
-    if (xQueueSend(m_queue, &job, 0) != pdPASS) {
-        delete job;
+    if (xRingbufferSend(file->ring, output, len, 0) != pdTRUE) {
+        file->stats.bytesDropped += len;
+        xTaskNotifyGive(this->m_task);
         return false;
     }
+
+    // The counters are only approximate if several tasks write to the same file at once
+    size_t waiting = this->m_bufferSize - xRingbufferGetCurFreeSize(file->ring);
+    if (waiting > file->stats.highWater) file->stats.highWater = waiting;
+    if (waiting >= this->m_bufferSize / 2) xTaskNotifyGive(this->m_task);
     return true;
 }
 
+void CBackgroundFileWriter::flush()
+{
+    if (this->m_task) xTaskNotifyGive(this->m_task);
+}
+
+// Look up a file without locking; entries are only ever added
+CBackgroundFileWriter::FileBuffer* CBackgroundFileWriter::findFile(const char* fileName)
+{
+    int count = this->m_fileCount;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(this->m_files[i].fileName, fileName) == 0) return &this->m_files[i];
+    }
+    return nullptr;
+}
+
+CBackgroundFileWriter::FileBuffer* CBackgroundFileWriter::addFile(const char* fileName)
+{
+    if (!this->m_registerMutex.lock(__PRETTY_FUNCTION__)) return nullptr;
+
+    // Another task may have added it while we waited for the lock
+    FileBuffer* result = this->findFile(fileName);
+    if (!result && this->m_fileCount < MAX_FILES) {
+        FileBuffer& file = this->m_files[this->m_fileCount];
+        file.ring = xRingbufferCreate(this->m_bufferSize, RINGBUF_TYPE_BYTEBUF);
+        if (file.ring) {
+            strlcpy(file.fileName, fileName, sizeof(file.fileName));
+            memset(&file.stats, 0, sizeof(file.stats));
+            file.stats.fileName = file.fileName;
+            file.stats.bufferSize = this->m_bufferSize;
+            this->m_fileCount = this->m_fileCount + 1;
+            result = &file;
+        }
+    }
+
+    this->m_registerMutex.unlock();
+    return result;
+}
 
 void CBackgroundFileWriter::startWriterTask()
 {
@@ -82,27 +109,34 @@ void CBackgroundFileWriter::staticWriterTask(void* arg) {
 void CBackgroundFileWriter::writerTask()
 {
     for (;;) {
-        WriteJob* job = nullptr;
-        if (xQueueReceive(m_queue, &job, portMAX_DELAY) != pdPASS) continue;
-        if (!job) continue;
-        this->writeJobContents(job);
-        delete job;
+        // Woken early by flush() or a ring filling up, otherwise after the flush latency
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(this->m_flushLatencyMs));
+        int count = this->m_fileCount;
+        for (int i = 0; i < count; i++) this->drain(this->m_files[i]);
     }
 }
 
-void CBackgroundFileWriter::writeJobContents(WriteJob *job) {
-    if (this->m_sdMutex->lock(__PRETTY_FUNCTION__)) {
-        FsFile file = m_fs->open(job->fileName, FILE_WRITE);
-        if (!file) {
-            // MyDebugLog.print("Unable to open log file ");
-            // MyDebugLog.print(this->m_logFileName);
-            // MyDebugLog.print(". Stopping file logging");
-            // this->m_logToSdCard = false;
-            return;
-        }
-        file.write(job->data, job->len); 
-        file.close();
-        this->m_sdMutex->unlock();
+// Move everything waiting in the file's ring to the drain buffer and append it to the file
+void CBackgroundFileWriter::drain(FileBuffer& file)
+{
+    // The data may wrap around the end of the ring, so it can take two reads
+    size_t len = 0;
+    while (len < this->m_bufferSize) {
+        size_t itemSize = 0;
+        void* item = xRingbufferReceiveUpTo(file.ring, &itemSize, 0, this->m_bufferSize - len);
+        if (!item) break;
+        memcpy(this->m_drainBuffer + len, item, itemSize);
+        vRingbufferReturnItem(file.ring, item);
+        len += itemSize;
+    }
+    if (len == 0) return;
+
+    file.stats.drains++;
+    if (LogStorage.append(file.fileName, this->m_drainBuffer, len)) {
+        file.stats.bytesWritten += len;
+    }
+    else {
+        file.stats.errors++;
     }
 }
 
@@ -2,38 +2,80 @@
 #define __BACKGROUND_FILE_WRITER_H
 
 #include <Arduino.h>
-#include <SdFat.h>
+#include <freertos/ringbuf.h>
 
 #include "MyMutex.h"
 
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CBackgroundFileWriter - appends to log files from a dedicated task
+//
+// Each file has its own byte ring buffer (ESP-IDF ringbuf, which is safe to use from any
+// task and does not allocate per write). write() only copies the data into the ring. The
+// writer task drains every ring when the flush latency has passed, or earlier when a ring
+// is half full, and appends what it got with one write per file to LogStorage, which puts
+// it on the flash tier or the SD card.
+//
+// If a ring is full the data is dropped rather than blocking the caller; the high water
+// mark and the number of dropped bytes show if the buffer or the latency need adjusting.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
 class CBackgroundFileWriter {
-  private:
-    SdFs* m_fs = nullptr;
-    MyMutex* m_sdMutex = nullptr;
-    QueueHandle_t m_queue = nullptr;
-    TaskHandle_t m_task = nullptr;
+  public:
+    static const int MAX_FILES = 4;
 
-    struct WriteJob {
+    struct FileStats {
         const char* fileName;
-        uint8_t* data;
-        size_t len;
+        size_t bufferSize;
+        uint32_t highWater;         // Most bytes waiting in the buffer at one time
+        uint64_t bytesWritten;
+        uint32_t bytesDropped;      // Buffer full
+        uint32_t drains;            // Writes to the file
+        uint32_t errors;            // Open or write failed; the data drained is lost
+    };
 
-        WriteJob(const char* fileName, const uint8_t* data, size_t len);
-        ~WriteJob();
+  private:
+    struct FileBuffer {
+        char fileName[64];
+        RingbufHandle_t ring;
+        FileStats stats;
     };
 
+    MyMutex m_registerMutex;
+    TaskHandle_t m_task = nullptr;
+
+    size_t m_bufferSize = 0;
+    uint32_t m_flushLatencyMs = 0;
+    uint8_t* m_drainBuffer = nullptr;   // Only used by the writer task
+
+    FileBuffer m_files[MAX_FILES];
+    volatile int m_fileCount = 0;       // Entries below this are complete and never change
+
   public:
-    void setup(SdFs* sdFs, MyMutex* sdMutex, int queueDepth = 32);
+    CBackgroundFileWriter();
+    void setup(size_t bufferSize = 4096, uint32_t flushLatencyMs = 1000);
+    void setFlushLatency(uint32_t ms) { this->m_flushLatencyMs = ms; }
+
+    // Queue data to be appended to the file; false if it had to be dropped
     bool write(const char* logFileName, const uint8_t* output, size_t len);
 
+    // Have the writer task write all buffered data now
+    void flush();
+
+    int getFileCount() const { return this->m_fileCount; }
+    const FileStats& getFileStats(int index) const { return this->m_files[index].stats; }
+
   private:
+    FileBuffer* findFile(const char* fileName);
+    FileBuffer* addFile(const char* fileName);
     void startWriterTask();
     static void staticWriterTask(void* arg);
     void writerTask();
-    void writeJobContents(WriteJob* job);
+    void drain(FileBuffer& file);
 };
 
 
 extern CBackgroundFileWriter BackgroundFileWriter; // Global singleton
 
-#endif
\ No newline at end of file
+#endif
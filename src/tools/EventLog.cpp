@@ -0,0 +1,287 @@
+#include "EventLog.h"
+
+#include <esp_timer.h>
+
+#include "BackgroundFileWriter.h"
+#include "MyLog.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// EventLogEncoder - builds one record
+//
+
+EventLogEncoder::EventLogEncoder(const char* format, const char* location, uint8_t flags)
+{
+    EventLogRecordHeader* header = (EventLogRecordHeader*)this->m_data;
+    header->argCount = 0;
+    header->flags = flags;
+    header->time = 0;
+    header->micros = esp_timer_get_time();
+    header->format = (uint32_t)(uintptr_t)format;
+    header->location = (uint32_t)(uintptr_t)location;
+    this->m_length = sizeof(EventLogRecordHeader);
+    header->length = this->m_length;
+}
+
+void EventLogEncoder::addValue(EventLogArgType type, const void* value, size_t size)
+{
+    if (this->m_length + 1 + size > MAX_RECORD_SIZE) return;
+    this->m_data[this->m_length] = type;
+    memcpy(this->m_data + this->m_length + 1, value, size);
+    this->m_length += 1 + size;
+
+    EventLogRecordHeader* header = (EventLogRecordHeader*)this->m_data;
+    header->argCount++;
+    header->length = this->m_length;
+}
+
+// Strings are copied, truncated to the space left in the record
+void EventLogEncoder::add(const char* value)
+{
+    if (!value) value = "(null)";
+    if (this->m_length + 2 > MAX_RECORD_SIZE) return;
+    size_t len = strnlen(value, 255);
+    size_t room = MAX_RECORD_SIZE - this->m_length - 2;
+    if (len > room) len = room;
+
+    this->m_data[this->m_length] = EVENT_ARG_STRING;
+    this->m_data[this->m_length + 1] = len;
+    memcpy(this->m_data + this->m_length + 2, value, len);
+    this->m_length += 2 + len;
+
+    EventLogRecordHeader* header = (EventLogRecordHeader*)this->m_data;
+    header->argCount++;
+    header->length = this->m_length;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CEventLog - the rings and the formatter task
+//
+
+// Start the formatter task. Events logged before are kept until it runs.
+void CEventLog::setup(uint32_t intervalMs /* = 200 */)
+{
+    this->m_intervalMs = intervalMs;
+    if (this->m_task) return;
+    BaseType_t ok = xTaskCreate(
+        staticFormatterTask,
+        "EventLog",
+        4096,
+        this,   // argument passed to task
+        0,      // below everything else that runs
+        &this->m_task
+    );
+    if (ok != pdPASS) this->m_task = nullptr;
+}
+
+// Copy the record into the ring of the current core. With interrupts masked nothing else
+// can run on this core, and the task cannot move to the other core.
+void CEventLog::push(EventLogEncoder& encoder)
+{
+    uint32_t length = encoder.length();
+    UBaseType_t state = portSET_INTERRUPT_MASK_FROM_ISR();
+    int core = xPortGetCoreID();
+    Ring& ring = this->m_rings[core];
+    if (core == 1) ((EventLogRecordHeader*)encoder.data())->flags |= EVENT_LOG_FLAG_CORE1;
+
+    uint32_t head = ring.head;
+    uint32_t used = head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+    if (RING_SIZE - used < length) {
+        ring.stats.dropped++;
+    }
+    else {
+        uint32_t offset = head & (RING_SIZE - 1);
+        uint32_t first = RING_SIZE - offset < length ? RING_SIZE - offset : length;
+        memcpy(ring.data + offset, encoder.data(), first);
+        memcpy(ring.data, encoder.data() + first, length - first);
+        __atomic_store_n(&ring.head, head + length, __ATOMIC_RELEASE);
+        ring.stats.events++;
+        if (used + length > ring.stats.highWater) ring.stats.highWater = used + length;
+    }
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(state);
+}
+
+// Header of the oldest record in the ring, if there is one
+bool CEventLog::peek(Ring& ring, EventLogRecordHeader& header)
+{
+    uint32_t tail = ring.tail;
+    if (__atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) == tail) return false;
+    uint8_t* p = (uint8_t*)&header;
+    for (size_t i = 0; i < sizeof(header); i++) p[i] = ring.data[(tail + i) & (RING_SIZE - 1)];
+    return true;
+}
+
+// Take the oldest record out of the ring
+void CEventLog::read(Ring& ring, uint8_t* record, size_t length)
+{
+    uint32_t tail = ring.tail;
+    uint32_t offset = tail & (RING_SIZE - 1);
+    uint32_t first = RING_SIZE - offset < length ? RING_SIZE - offset : length;
+    memcpy(record, ring.data + offset, first);
+    memcpy(record + first, ring.data, length - first);
+    __atomic_store_n(&ring.tail, tail + length, __ATOMIC_RELEASE);
+}
+
+void CEventLog::staticFormatterTask(void* arg)
+{
+    static_cast<CEventLog*>(arg)->formatterTask();
+}
+
+void CEventLog::formatterTask()
+{
+    uint8_t record[EventLogEncoder::MAX_RECORD_SIZE];
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(this->m_intervalMs));
+
+        // Merge the two rings, oldest event first
+        for (;;) {
+            EventLogRecordHeader h0, h1;
+            bool has0 = this->peek(this->m_rings[0], h0);
+            bool has1 = this->peek(this->m_rings[1], h1);
+            if (!has0 && !has1) break;
+
+            bool use1 = has1 && (!has0 || h1.micros < h0.micros);
+            this->read(this->m_rings[use1], record, use1 ? h1.length : h0.length);
+            this->output(record);
+        }
+    }
+}
+
+void CEventLog::output(uint8_t* record)
+{
+    EventLogRecordHeader* header = (EventLogRecordHeader*)record;
+    int64_t age = esp_timer_get_time() - (int64_t)header->micros;
+    time_t t = time(nullptr) - (time_t)(age / 1000000);
+    header->time = t;
+
+    if (header->flags & EVENT_LOG_FLAG_DEBUG) {
+        // First argument is the task name
+        const uint8_t* arg = record + sizeof(EventLogRecordHeader);
+        char taskName[24];
+        size_t len = arg[1] < sizeof(taskName) - 1 ? arg[1] : sizeof(taskName) - 1;
+        memcpy(taskName, arg + 2, len);
+        taskName[len] = '\0';
+
+        char text[256];
+        formatEvent(record, text, sizeof(text));
+        MyDebugLog.printfWithLocation(DEBUG_LOG_FORMAT, taskName, (const char*)(uintptr_t)header->location, "%s", text);
+        return;
+    }
+
+#if EVENT_LOG_RAW
+    BackgroundFileWriter.write(EVENT_LOG_FILE_NAME, record, header->length);
+#else
+    char text[256];
+    formatEvent(record, text, sizeof(text));
+    MyLog.printAt(t, text);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Formatting - the same as scripts/decodeEventLog.py does on the host
+//
+
+struct EventLogArg {
+    uint8_t type;
+    int64_t i;
+    double d;
+    char s[256];
+};
+
+// Read the next argument, false if there is none left
+static bool readEventArg(const uint8_t*& p, const uint8_t* end, EventLogArg& arg)
+{
+    if (p >= end) return false;
+    arg.type = *p++;
+    switch (arg.type) {
+        case EVENT_ARG_INT32: { int32_t v; memcpy(&v, p, 4); arg.i = v; p += 4; break; }
+        case EVENT_ARG_UINT32:
+        case EVENT_ARG_POINTER: { uint32_t v; memcpy(&v, p, 4); arg.i = v; p += 4; break; }
+        case EVENT_ARG_INT64:
+        case EVENT_ARG_UINT64: memcpy(&arg.i, p, 8); p += 8; break;
+        case EVENT_ARG_DOUBLE: memcpy(&arg.d, p, 8); p += 8; break;
+        case EVENT_ARG_STRING: {
+            size_t len = *p++;
+            memcpy(arg.s, p, len);
+            arg.s[len] = '\0';
+            p += len;
+            break;
+        }
+        default: return false;
+    }
+    return p <= end;
+}
+
+size_t CEventLog::formatEvent(const uint8_t* record, char* buffer, size_t size)
+{
+    const EventLogRecordHeader* header = (const EventLogRecordHeader*)record;
+    const char* f = (const char*)(uintptr_t)header->format;
+    const uint8_t* p = record + sizeof(EventLogRecordHeader);
+    const uint8_t* end = record + header->length;
+    if (header->flags & EVENT_LOG_FLAG_DEBUG) p += 2 + p[1];   // Task name
+
+    size_t pos = 0;
+    EventLogArg arg;
+    while (*f && pos < size - 1) {
+        if (*f != '%') {
+            buffer[pos++] = *f++;
+            continue;
+        }
+        if (f[1] == '%') {
+            buffer[pos++] = '%';
+            f += 2;
+            continue;
+        }
+
+        // Collect flags, width and precision; '*' takes an argument. Length modifiers are
+        // dropped, the argument type says what the value is.
+        char spec[24] = "%";
+        size_t specLen = 1;
+        f++;
+        while (*f && strchr("-+ #0123456789.*", *f) && specLen < sizeof(spec) - 8) {
+            if (*f == '*') {
+                if (readEventArg(p, end, arg)) specLen += snprintf(spec + specLen, sizeof(spec) - specLen, "%d", (int)arg.i);
+            }
+            else {
+                spec[specLen++] = *f;
+            }
+            f++;
+        }
+        while (*f && strchr("hlLqjzt", *f)) f++;
+        char conversion = *f ? *f++ : 's';
+
+        int n;
+        if (!readEventArg(p, end, arg)) {
+            n = snprintf(buffer + pos, size - pos, "<?>");
+        }
+        else if (arg.type == EVENT_ARG_STRING) {
+            strcpy(spec + specLen, "s");
+            n = snprintf(buffer + pos, size - pos, spec, arg.s);
+        }
+        else if (arg.type == EVENT_ARG_DOUBLE) {
+            spec[specLen++] = strchr("fFeEgGaA", conversion) ? conversion : 'g';
+            spec[specLen] = '\0';
+            n = snprintf(buffer + pos, size - pos, spec, arg.d);
+        }
+        else if (arg.type == EVENT_ARG_POINTER) {
+            strcpy(spec + specLen, "p");
+            n = snprintf(buffer + pos, size - pos, spec, (void*)(uintptr_t)arg.i);
+        }
+        else {
+            bool isSigned = arg.type == EVENT_ARG_INT32 || arg.type == EVENT_ARG_INT64;
+            spec[specLen++] = 'l';
+            spec[specLen++] = 'l';
+            spec[specLen++] = strchr("diouxXc", conversion) ? conversion : (isSigned ? 'd' : 'u');
+            spec[specLen] = '\0';
+            if (conversion == 'c') n = snprintf(buffer + pos, size - pos, "%c", (int)arg.i);
+            else n = snprintf(buffer + pos, size - pos, spec, (long long)arg.i);
+        }
+        if (n > 0) pos += (size_t)n < size - pos ? n : size - pos - 1;
+    }
+    buffer[pos] = '\0';
+    return pos;
+}
+
+CEventLog EventLog;
@@ -0,0 +1,158 @@
+#ifndef __EVENT_LOG_H
+#define __EVENT_LOG_H
+
+#include <Arduino.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Event log with deferred formatting
+//
+// EVENT_LOG("format", args...) does not format anything. It records the address of the
+// format string and the raw argument values (strings are copied) in a ring buffer of the
+// core it runs on, with interrupts on that core masked for the copy. No mutex is taken
+// and the two cores never touch the same ring. A low priority task merges the rings in
+// time order, formats the events and writes them to MyLog, or, for DEBUG_LOG, to the
+// debug log.
+//
+// With EVENT_LOG_RAW, MyLog events are written to events.bin as they are instead, and
+// scripts/decodeEventLog.py formats them on the host, reading the format strings from
+// firmware.elf. The .elf must be the one of the firmware that wrote the file.
+//
+// Formats must be string literals. Events are dropped when a ring is full.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef EVENT_LOG_RAW
+#define EVENT_LOG_RAW 0
+#endif
+
+#define EVENT_LOG_FILE_NAME "events.bin"
+
+// Record header; all numbers little endian, followed by the arguments
+struct __attribute__((packed)) EventLogRecordHeader {
+    uint16_t length;        // Including this header
+    uint8_t argCount;
+    uint8_t flags;
+    uint32_t time;          // UTC; 0 in the ring, set when the event is formatted or written
+    uint64_t micros;        // Since startup, orders events across cores
+    uint32_t format;        // Address of the format string
+    uint32_t location;      // Address of __PRETTY_FUNCTION__ for debug events
+};
+
+#define EVENT_LOG_FLAG_DEBUG 0x01     // For the debug log; the first argument is the task name
+#define EVENT_LOG_FLAG_CORE1 0x02     // Recorded on core 1
+
+// Each argument is a type byte followed by the value; strings have a length byte
+enum EventLogArgType : uint8_t {
+    EVENT_ARG_INT32 = 'i',
+    EVENT_ARG_UINT32 = 'u',
+    EVENT_ARG_INT64 = 'q',
+    EVENT_ARG_UINT64 = 'Q',
+    EVENT_ARG_DOUBLE = 'd',
+    EVENT_ARG_STRING = 's',
+    EVENT_ARG_POINTER = 'p',
+};
+
+// Builds a record on the stack of the logging task
+class EventLogEncoder {
+  public:
+    static const size_t MAX_RECORD_SIZE = 320;
+
+  private:
+    uint8_t m_data[MAX_RECORD_SIZE];
+    size_t m_length;
+
+  public:
+    EventLogEncoder(const char* format, const char* location, uint8_t flags);
+
+    void add(int value) { this->addValue(EVENT_ARG_INT32, &value, 4); }
+    void add(unsigned value) { this->addValue(EVENT_ARG_UINT32, &value, 4); }
+    void add(long value) { int32_t v = value; this->addValue(EVENT_ARG_INT32, &v, 4); }
+    void add(unsigned long value) { uint32_t v = value; this->addValue(EVENT_ARG_UINT32, &v, 4); }
+    void add(long long value) { this->addValue(EVENT_ARG_INT64, &value, 8); }
+    void add(unsigned long long value) { this->addValue(EVENT_ARG_UINT64, &value, 8); }
+    void add(double value) { this->addValue(EVENT_ARG_DOUBLE, &value, 8); }
+    void add(const void* value) { uint32_t v = (uint32_t)(uintptr_t)value; this->addValue(EVENT_ARG_POINTER, &v, 4); }
+    void add(const char* value);
+    void add(const String& value) { this->add(value.c_str()); }
+
+    uint8_t* data() { return this->m_data; }
+    size_t length() const { return this->m_length; }
+
+  private:
+    void addValue(EventLogArgType type, const void* value, size_t size);
+};
+
+inline void encodeEventArgs(EventLogEncoder&) {}
+
+template <typename T, typename... Rest>
+inline void encodeEventArgs(EventLogEncoder& encoder, const T& first, const Rest&... rest)
+{
+    encoder.add(first);
+    encodeEventArgs(encoder, rest...);
+}
+
+class CEventLog {
+  public:
+    static const uint32_t RING_SIZE = 4096;     // Per core, a power of 2
+
+    struct RingStats {
+        uint32_t events;
+        uint32_t dropped;
+        uint32_t highWater;                     // Most bytes waiting at one time
+    };
+
+  private:
+    struct Ring {
+        uint8_t data[RING_SIZE];
+        volatile uint32_t head;                 // Written by the logging core only
+        volatile uint32_t tail;                 // Written by the formatter task only
+        RingStats stats;
+    };
+
+    // No constructor: the global is zero initialised before any constructor runs, so
+    // events can be logged from other constructors
+    Ring m_rings[2];
+    TaskHandle_t m_task;
+    uint32_t m_intervalMs;
+
+  public:
+    void setup(uint32_t intervalMs = 200);
+
+    template <typename... Args>
+    void log(const char* format, const Args&... args)
+    {
+        EventLogEncoder encoder(format, nullptr, 0);
+        encodeEventArgs(encoder, args...);
+        this->push(encoder);
+    }
+
+    template <typename... Args>
+    void debug(const char* location, const char* format, const Args&... args)
+    {
+        EventLogEncoder encoder(format, location, EVENT_LOG_FLAG_DEBUG);
+        encoder.add(pcTaskGetName(nullptr));
+        encodeEventArgs(encoder, args...);
+        this->push(encoder);
+    }
+
+    const RingStats& getStats(int core) const { return this->m_rings[core].stats; }
+
+    // Format the text of an event (without time, task or location) into buffer
+    static size_t formatEvent(const uint8_t* record, char* buffer, size_t size);
+
+  private:
+    void push(EventLogEncoder& encoder);
+    bool peek(Ring& ring, EventLogRecordHeader& header);
+    void read(Ring& ring, uint8_t* record, size_t length);
+    static void staticFormatterTask(void* arg);
+    void formatterTask();
+    void output(uint8_t* record);
+};
+
+extern CEventLog EventLog;
+
+#define EVENT_LOG(fmt, ...) EventLog.log("" fmt, ##__VA_ARGS__)
+#define DEBUG_EVENT(fmt, ...) EventLog.debug(__PRETTY_FUNCTION__, "" fmt, ##__VA_ARGS__)
+
+#endif
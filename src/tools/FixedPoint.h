@@ -0,0 +1,46 @@
+#ifndef __FIXED_POINT_H
+#define __FIXED_POINT_H
+
+#include <stdint.h>
+
+// Signed fixed point number with FRAC fractional bits in 32 bits, for running control
+// loops without the FPU (e.g. many simulated controllers at once). Products and quotients
+// are calculated in 64 bits and truncated; overflow is not checked.
+template <int FRAC>
+class FixedPoint {
+  private:
+    int32_t m_raw;
+
+    struct Raw {};
+    FixedPoint(int32_t raw, Raw) : m_raw(raw) {}
+
+  public:
+    FixedPoint() : m_raw(0) {}
+    FixedPoint(int value) : m_raw((int32_t)value * (1 << FRAC)) {}   // Not <<, undefined for negative values
+    FixedPoint(double value) : m_raw((int32_t)(value * (1 << FRAC) + (value < 0 ? -0.5 : 0.5))) {}
+
+    static FixedPoint fromRaw(int32_t raw) { return FixedPoint(raw, Raw()); }
+    int32_t raw() const { return this->m_raw; }
+    double toDouble() const { return (double)this->m_raw / (1 << FRAC); }
+    explicit operator double() const { return this->toDouble(); }
+
+    FixedPoint operator-() const { return fromRaw(-this->m_raw); }
+    FixedPoint operator+(FixedPoint b) const { return fromRaw(this->m_raw + b.m_raw); }
+    FixedPoint operator-(FixedPoint b) const { return fromRaw(this->m_raw - b.m_raw); }
+    FixedPoint operator*(FixedPoint b) const { return fromRaw((int32_t)(((int64_t)this->m_raw * b.m_raw) >> FRAC)); }
+    FixedPoint operator/(FixedPoint b) const { return fromRaw((int32_t)((int64_t)this->m_raw * (1 << FRAC) / b.m_raw)); }
+    FixedPoint& operator+=(FixedPoint b) { this->m_raw += b.m_raw; return *this; }
+    FixedPoint& operator-=(FixedPoint b) { this->m_raw -= b.m_raw; return *this; }
+
+    bool operator==(FixedPoint b) const { return this->m_raw == b.m_raw; }
+    bool operator!=(FixedPoint b) const { return this->m_raw != b.m_raw; }
+    bool operator<(FixedPoint b) const { return this->m_raw < b.m_raw; }
+    bool operator<=(FixedPoint b) const { return this->m_raw <= b.m_raw; }
+    bool operator>(FixedPoint b) const { return this->m_raw > b.m_raw; }
+    bool operator>=(FixedPoint b) const { return this->m_raw >= b.m_raw; }
+};
+
+// Range +/-32768 with a resolution of 0.000015, enough for temperatures and valve positions
+typedef FixedPoint<16> Fixed16;
+
+#endif
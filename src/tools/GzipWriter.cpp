@@ -0,0 +1,227 @@
+#include "GzipWriter.h"
+
+// CRC-32 as used by gzip, with a table for 4 bits at a time
+uint32_t crc32Update(uint32_t crc, const void* data, size_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+    };
+    const uint8_t* p = (const uint8_t*)data;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ table[crc & 15];
+        crc = (crc >> 4) ^ table[crc & 15];
+    }
+    return ~crc;
+}
+
+// Length and distance codes of deflate: base value and number of extra bits
+static const uint16_t s_lengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t s_lengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t s_distanceBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+static const uint8_t s_distanceExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+GzipWriter::GzipWriter(Print& out, uint32_t mtime /* = 0 */) : m_out(out)
+{
+    memset(this->m_head, 0, sizeof(this->m_head));
+    memset(this->m_previous, 0, sizeof(this->m_previous));
+
+    // gzip header: magic, deflate, no flags, mtime, no extra flags, unknown OS
+    const uint8_t header[10] = {
+        0x1f, 0x8b, 8, 0,
+        (uint8_t)mtime, (uint8_t)(mtime >> 8), (uint8_t)(mtime >> 16), (uint8_t)(mtime >> 24),
+        0, 255,
+    };
+    for (uint8_t b : header) this->putByte(b);
+
+    // Everything goes into one block with the fixed codes; finish() adds an empty final block
+    this->putBits(0, 1);    // BFINAL
+    this->putBits(1, 2);    // BTYPE fixed Huffman
+}
+
+bool GzipWriter::write(const uint8_t* data, size_t len)
+{
+    this->m_crc = crc32Update(this->m_crc, data, len);
+    this->m_size += len;
+
+    while (len > 0) {
+        if (this->m_fill == BUFFER_SIZE) {
+            this->compress(false);
+            this->slide();
+        }
+        size_t n = BUFFER_SIZE - this->m_fill;
+        if (n > len) n = len;
+        memcpy(this->m_buffer + this->m_fill, data, n);
+        this->m_fill += n;
+        data += n;
+        len -= n;
+    }
+    return this->m_ok;
+}
+
+bool GzipWriter::finish()
+{
+    this->compress(true);
+    this->putSymbol(256);   // End of block
+    this->putBits(1, 1);    // BFINAL
+    this->putBits(1, 2);
+    this->putSymbol(256);
+    if (this->m_bitCount > 0) this->putBits(0, 8 - this->m_bitCount);
+
+    for (int i = 0; i < 32; i += 8) this->putByte(this->m_crc >> i);
+    for (int i = 0; i < 32; i += 8) this->putByte(this->m_size >> i);
+    this->flushOutput();
+    return this->m_ok;
+}
+
+// Compress the buffered input. Unless flushing, MAX_MATCH bytes are left so every match
+// can be as long as possible.
+void GzipWriter::compress(bool flush)
+{
+    for (;;) {
+        size_t lookahead = this->m_fill - this->m_position;
+        if (lookahead == 0 || (!flush && lookahead < MAX_MATCH)) break;
+
+        size_t distance = 0;
+        size_t length = lookahead >= MIN_MATCH ? this->longestMatch(this->m_position, &distance) : 0;
+        if (length >= MIN_MATCH) {
+            this->putMatch(length, distance);
+        }
+        else {
+            this->putLiteral(this->m_buffer[this->m_position]);
+            length = 1;
+        }
+
+        for (size_t i = 0; i < length; i++) {
+            if (this->m_position + MIN_MATCH <= this->m_fill) this->insert(this->m_position);
+            this->m_position++;
+        }
+    }
+}
+
+uint32_t GzipWriter::hash(size_t position) const
+{
+    const uint8_t* p = this->m_buffer + position;
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+void GzipWriter::insert(size_t position)
+{
+    uint32_t h = this->hash(position);
+    this->m_previous[position & (WINDOW_SIZE - 1)] = this->m_head[h];
+    this->m_head[h] = position + 1;
+}
+
+size_t GzipWriter::longestMatch(size_t position, size_t* distance) const
+{
+    size_t maxLength = this->m_fill - position;
+    if (maxLength > MAX_MATCH) maxLength = MAX_MATCH;
+
+    size_t best = 0;
+    int chain = MAX_CHAIN;
+    uint16_t candidate = this->m_head[this->hash(position)];
+    while (candidate != 0 && chain-- > 0) {
+        size_t c = candidate - 1;
+        if (position - c > WINDOW_SIZE) break;
+
+        const uint8_t* a = this->m_buffer + c;
+        const uint8_t* b = this->m_buffer + position;
+        if (a[best] == b[best]) {
+            size_t length = 0;
+            while (length < maxLength && a[length] == b[length]) length++;
+            if (length > best) {
+                best = length;
+                *distance = position - c;
+                if (length == maxLength) break;
+            }
+        }
+
+        // Positions further back than the window may have been overwritten by newer ones
+        candidate = this->m_previous[c & (WINDOW_SIZE - 1)];
+        if (candidate > c) break;
+    }
+    return best;
+}
+
+// Drop the oldest WINDOW_SIZE bytes of the buffer; everything still needed is after them
+void GzipWriter::slide()
+{
+    memmove(this->m_buffer, this->m_buffer + WINDOW_SIZE, this->m_fill - WINDOW_SIZE);
+    this->m_fill -= WINDOW_SIZE;
+    this->m_position -= WINDOW_SIZE;
+    for (uint16_t& h : this->m_head) h = h > WINDOW_SIZE ? h - WINDOW_SIZE : 0;
+    for (uint16_t& p : this->m_previous) p = p > WINDOW_SIZE ? p - WINDOW_SIZE : 0;
+}
+
+// Bits are packed starting with the least significant bit of each byte
+void GzipWriter::putBits(uint32_t value, int count)
+{
+    this->m_bits |= value << this->m_bitCount;
+    this->m_bitCount += count;
+    while (this->m_bitCount >= 8) {
+        this->putByte(this->m_bits);
+        this->m_bits >>= 8;
+        this->m_bitCount -= 8;
+    }
+}
+
+// Huffman codes are packed starting with their most significant bit
+void GzipWriter::putHuffman(uint32_t code, int length)
+{
+    uint32_t reversed = 0;
+    for (int i = 0; i < length; i++) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+    this->putBits(reversed, length);
+}
+
+void GzipWriter::putLiteral(uint8_t c)
+{
+    if (c <= 143) this->putHuffman(0x30 + c, 8);
+    else this->putHuffman(0x190 + c - 144, 9);
+}
+
+// End of block and length symbols 256..285
+void GzipWriter::putSymbol(int symbol)
+{
+    if (symbol <= 279) this->putHuffman(symbol - 256, 7);
+    else this->putHuffman(0xc0 + symbol - 280, 8);
+}
+
+void GzipWriter::putMatch(size_t length, size_t distance)
+{
+    int code = 28;
+    while (s_lengthBase[code] > length) code--;
+    this->putSymbol(257 + code);
+    this->putBits(length - s_lengthBase[code], s_lengthExtra[code]);
+
+    code = 29;
+    while (s_distanceBase[code] > distance) code--;
+    this->putHuffman(code, 5);
+    this->putBits(distance - s_distanceBase[code], s_distanceExtra[code]);
+}
+
+void GzipWriter::putByte(uint8_t b)
+{
+    this->m_output[this->m_outputLen++] = b;
+    if (this->m_outputLen == OUTPUT_SIZE) this->flushOutput();
+}
+
+void GzipWriter::flushOutput()
+{
+    if (this->m_outputLen == 0) return;
+    if (this->m_out.write(this->m_output, this->m_outputLen) != this->m_outputLen) this->m_ok = false;
+    this->m_outputLen = 0;
+}
@@ -0,0 +1,76 @@
+#ifndef __GZIP_WRITER_H
+#define __GZIP_WRITER_H
+
+#include <Arduino.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Streaming gzip compressor with a small, fixed memory footprint
+//
+// Data written is compressed with LZ77 over a window of WINDOW_SIZE bytes and coded with
+// the fixed Huffman codes of deflate (RFC 1951), i.e. there are no code tables to build or
+// store. This gets log files to roughly a quarter of their size, not as small as zlib
+// does, with about 24kB of state. Output goes to a Print in blocks of OUTPUT_SIZE bytes.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+uint32_t crc32Update(uint32_t crc, const void* data, size_t len);   // crc is 0 to start
+
+class GzipWriter {
+  public:
+    static const size_t WINDOW_SIZE = 4096;     // Power of 2, at most 32768
+
+  private:
+    static const int HASH_BITS = 12;
+    static const size_t HASH_SIZE = 1 << HASH_BITS;
+    static const size_t MIN_MATCH = 3;
+    static const size_t MAX_MATCH = 258;
+    static const int MAX_CHAIN = 32;            // Candidates tried per position
+    static const size_t BUFFER_SIZE = 2 * WINDOW_SIZE;
+    static const size_t OUTPUT_SIZE = 512;
+
+    Print& m_out;
+    bool m_ok = true;
+
+    // Input: window and lookahead. Positions are offsets into m_buffer.
+    uint8_t m_buffer[BUFFER_SIZE];
+    size_t m_fill = 0;                          // Bytes in the buffer
+    size_t m_position = 0;                      // Next byte to compress
+    uint16_t m_head[HASH_SIZE];                 // Latest position for a hash, plus 1 (0: none)
+    uint16_t m_previous[WINDOW_SIZE];           // Previous position with the same hash, plus 1
+
+    // Output
+    uint32_t m_bits = 0;
+    int m_bitCount = 0;
+    uint8_t m_output[OUTPUT_SIZE];
+    size_t m_outputLen = 0;
+
+    uint32_t m_crc = 0;
+    uint32_t m_size = 0;
+
+  public:
+    // mtime goes into the gzip header
+    GzipWriter(Print& out, uint32_t mtime = 0);
+
+    bool write(const uint8_t* data, size_t len);
+
+    // Compress the rest and write the gzip trailer; false if any write failed
+    bool finish();
+
+  private:
+    void compress(bool flush);
+    uint32_t hash(size_t position) const;
+    void insert(size_t position);
+    size_t longestMatch(size_t position, size_t* distance) const;
+    void slide();
+
+    void putBits(uint32_t value, int count);
+    void putHuffman(uint32_t code, int length);
+    void putLiteral(uint8_t c);
+    void putSymbol(int symbol);
+    void putMatch(size_t length, size_t distance);
+    void putByte(uint8_t b);
+    void flushOutput();
+};
+
+#endif
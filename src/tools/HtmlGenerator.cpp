@@ -12,23 +12,51 @@ void HtmlGenerator::print(const char* s)
 {
     r->print(s);
 }
+void HtmlGenerator::print(int value)
+{
+    r->print(value);
+}
 
-void HtmlGenerator::element(const char* elementName, const char* parameters, std::function<void()> func)
+void HtmlGenerator::number(double value, int decimals)
 {
-    r->print('<');
-    r->print(elementName);
-    if (parameters && parameters[0]) {
-        r->print(' ');
-        r->print(parameters);
+    char buffer[NUMBER_BUFFER_SIZE];
+    r->print(formatNumber(buffer, value, decimals));
+}
+
+// Fixed point formatting like String(value, decimals), into a buffer of NUMBER_BUFFER_SIZE
+const char* HtmlGenerator::formatNumber(char* buffer, double value, int decimals)
+{
+    if (isnan(value)) return "nan";
+    if (isinf(value)) return "inf";
+    if (decimals < 0) decimals = 0;
+    if (decimals > 6) decimals = 6;
+
+    static const uint32_t scale[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+    bool negative = value < 0;
+    double scaled = (negative ? -value : value) * scale[decimals] + 0.5;
+    if (scaled >= 1e18) {
+        snprintf(buffer, NUMBER_BUFFER_SIZE, "%.*f", decimals, value);
+        return buffer;
     }
-    r->println(">");
-    if (func) func();
-    r->print("</");
-    r->print(elementName);
-    r->println(">");
+    uint64_t n = (uint64_t)scaled;
+
+    // Digits backwards from the end of the buffer
+    char* p = buffer + NUMBER_BUFFER_SIZE - 1;
+    *p = '\0';
+    for (int i = 0; i < decimals; i++) {
+        *--p = '0' + n % 10;
+        n /= 10;
+    }
+    if (decimals > 0) *--p = '.';
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    if (negative) *--p = '-';
+    return p;
 }
 
-void HtmlGenerator::element(const char* elementName, const char* parameters, const char* contents)
+void HtmlGenerator::openElement(const char* elementName, const char* parameters)
 {
     r->print('<');
     r->print(elementName);
@@ -37,41 +65,28 @@ void HtmlGenerator::element(const char* elementName, const char* parameters, con
         r->print(parameters);
     }
     r->println(">");
-    r->println(contents);
+}
+
+void HtmlGenerator::closeElement(const char* elementName)
+{
     r->print("</");
     r->print(elementName);
     r->println(">");
 }
 
-void HtmlGenerator::block(const char* title, std::function<void()> func)
+void HtmlGenerator::element(const char* elementName, const char* parameters, const char* contents)
 {
-    r->println("<div class='block'>");
-    element("div", "class='title'", title);
-    element("div", "class='content'", func);
-    r->println("</div>");
+    openElement(elementName, parameters);
+    r->println(contents);
+    closeElement(elementName);
 }
 
-void HtmlGenerator::block(const char* title, const char* contentParameters, std::function<void()> func)
+void HtmlGenerator::openBlock(const char* title)
 {
-    String combinedParameters = contentParameters ? contentParameters : "";
-    combinedParameters += " class='content'";
-    r->println("<div class='block'>");
-    element("div", "class='title'", title);
-    element("div", combinedParameters.c_str(), func);
-    r->println("</div>");
+    r->print("<div class='block'>\n<div class='title'>\n");
+    r->print(title);
 }
 
-void HtmlGenerator::block(const char* title, std::function<void()> funcTitle, std::function<void()> funcBody)
-{
-    r->println("<div class='block'>");
-    element("div", "class='title'", [this, title, funcTitle]() {
-        r->print(title);
-        if (funcTitle) funcTitle();
-    });
-    element("div", "class='content'", funcBody);
-    r->println("</div>");
-};
-
 void HtmlGenerator::input(const char* parameters, const char* value)
 {
     r->print("<input ");
@@ -81,20 +96,19 @@ void HtmlGenerator::input(const char* parameters, const char* value)
     }
     if (value) {
         r->print("value = '");
-        r->print(ESCAPE_SINGLE_QUOTES(value));
+        printEscapingSingleQuotes(value);
         r->print("'");
     }
     r->println(">");
 }
 
-void HtmlGenerator::fieldTableRow(const char* label, const char* parameters, std::function<void()> func)
+void HtmlGenerator::fieldTableRow(const char* label, const char* text)
 {
-    this->element("tr", [this, label, parameters, func] {
-        this->element("th", parameters, [this, label] {
-            this->print(label);
-        });
-        if (func) func();
-    });
+    r->println("<tr>");
+    element("th", nullptr, label);
+    r->print("<td>");
+    r->print(text);
+    r->println("</td>\n</tr>");
 }
 
 void HtmlGenerator::fieldTableInput(const char* parameters, const char* value)
@@ -113,22 +127,6 @@ void HtmlGenerator::fieldTableInput(const char* tdParameters, const char* parame
     r->println("</td>");
 }
 
-void HtmlGenerator::fieldTableSelect(const char* parameters, std::function<void()> func)
-{
-    r->print("<td>");
-    this->select(parameters, func);
-    r->println("</td>");
-}
-
-void HtmlGenerator::fieldTableSelect(const char* tdParameters, const char* parameters, std::function<void()> func)
-{
-    r->print("<td ");
-    r->print(tdParameters);
-    r->print(">");
-    this->select(parameters, func);
-    r->println("</td>");
-}
-
 void HtmlGenerator::navbar(NavbarPage activePage)
 {
     r->print("<div class='navbar'>");
@@ -160,6 +158,20 @@ void HtmlGenerator::footer()
     r->print("</div>");
 }
 
+void HtmlGenerator::printEscapingSingleQuotes(const char* cp)
+{
+    const char* start = cp;
+    while (*cp) {
+        if (*cp == '\\' || *cp == '\'') {
+            r->write((const uint8_t*)start, cp - start);
+            r->print('\\');
+            start = cp;
+        }
+        cp++;
+    }
+    r->write((const uint8_t*)start, cp - start);
+}
+
 bool HtmlGenerator::needsEscapingSingleQuotes(const char* cp)
 {
     while (*cp) {
@@ -185,7 +197,7 @@ void HtmlGenerator::option(const char* value, const char* text, bool selected)
     r->print("<option");
     if (value) {
         r->print(" value='");
-        r->print(ESCAPE_SINGLE_QUOTES(value));
+        printEscapingSingleQuotes(value);
         r->print("'");
     }
     if (selected) {
@@ -195,4 +207,11 @@ void HtmlGenerator::option(const char* value, const char* text, bool selected)
     r->print(text);
     r->println("</option>");
 }
-void option(const char* value, bool selected);
+void HtmlGenerator::option(int value, const char* text, bool selected)
+{
+    r->print("<option value='");
+    r->print(value);
+    r->print(selected ? "' selected>" : "'>");
+    r->print(text);
+    r->println("</option>");
+}
@@ -7,51 +7,114 @@ enum class NavbarPage {
   Files, Monitor, Config, System
 };
 
+// Generates HTML into a Print (usually an AsyncResponseStream).
+//
+// Content of an element is generated by a callable (usually a lambda). The callables are
+// taken by reference and called directly from the templates below; wrapping them in a
+// std::function would copy the captures to the heap for every element. Numbers are
+// formatted into a buffer on the stack and written straight to the output, so a page can
+// be rendered without creating String temporaries.
+//
+// Static markup should be written as one string literal (adjacent literals are joined
+// by the compiler), not as a sequence of print() calls.
+
 class HtmlGenerator {
 
   private:
     Print *r;
 
   public:
+    static const int NUMBER_BUFFER_SIZE = 24;
+
     HtmlGenerator (Print *printable) : r(printable) {};
     Print * getResponse() { return r; }
 
     void text(const char *s);
     void print(const char *s);
+    void print(int value);
+    void number(double value, int decimals);
+    static const char *formatNumber(char *buffer, double value, int decimals);
+
+    void openElement(const char *elementName, const char *parameters);
+    void closeElement(const char *elementName);
 
-    void element(const char *elementName, const char *parameters, std::function<void()> func);
+    template <typename F> void element(const char *elementName, const char *parameters, const F &func) {
+      openElement(elementName, parameters);
+      func();
+      closeElement(elementName);
+    }
     void element(const char *elementName, const char *parameters, const char *contents);
-    void element(const char *elementName, std::function<void()> func) { element(elementName, nullptr, func); };
-    void input (const char *parameters, double value, int precision) { input(parameters, String(value,precision).c_str()); };
+    template <typename F> void element(const char *elementName, const F &func) { element(elementName, nullptr, func); };
+    void input (const char *parameters, double value, int precision) { char b[NUMBER_BUFFER_SIZE]; input(parameters, formatNumber(b, value, precision)); };
     void input (const char *parameters, const char *value);
-    void select (const char *parameters, std::function<void()> func) { element("select", parameters, func); };
+    template <typename F> void select (const char *parameters, const F &func) { element("select", parameters, func); };
     void option (const char*value, const char *text, bool selected);
-    void blockLayout(std::function<void()> func) { element("div", "class='block-layout'", func); };
-    void block(const char *title, std::function<void()> func);
-    void block(const char *title,  std::function<void()> funcTitle, std::function<void()> funcBody);
-    void block(const char *title, const char *contentParameters, std::function<void()> func);
+    void option (int value, const char *text, bool selected);
+    template <typename F> void blockLayout(const F &func) { element("div", "class='block-layout'", func); };
 
-    void fieldTable(std::function<void()> func) { element("table", "class='field-table'", func); };
-    void fieldTableRow(const char *label, const char *parameters, std::function<void()> func);
-    void fieldTableRow(const char *label, std::function<void()> func) { fieldTableRow(label, nullptr, func); };
-    void fieldTableRow(const char *label, const char *text) { fieldTableRow(label, [this, text]{print("<td>"); print(text); print("</td>");}); };
+    template <typename F> void block(const char *title, const F &func) {
+      openBlock(title);
+      r->println("</div>\n<div class='content'>");
+      func();
+      closeBlock();
+    }
+    template <typename FT, typename FB> void block(const char *title, const FT &funcTitle, const FB &funcBody) {
+      openBlock(title);
+      funcTitle();
+      r->println("</div>\n<div class='content'>");
+      funcBody();
+      closeBlock();
+    }
+    template <typename F> void block(const char *title, const char *contentParameters, const F &func) {
+      openBlock(title);
+      r->print("</div>\n<div ");
+      if (contentParameters) { r->print(contentParameters); r->print(' '); }
+      r->println("class='content'>");
+      func();
+      closeBlock();
+    }
+
+    template <typename F> void fieldTable(const F &func) { element("table", "class='field-table'", func); };
+    template <typename F> void fieldTableRow(const char *label, const char *parameters, const F &func) {
+      r->println("<tr>");
+      element("th", parameters, label);
+      func();
+      r->println("</tr>");
+    }
+    template <typename F> void fieldTableRow(const char *label, const F &func) { fieldTableRow(label, nullptr, func); };
+    void fieldTableRow(const char *label, const char *text);
 
     void fieldTableInput(const char *parameters, const char *value);
-    void fieldTableInput(const char *parameters, int value) { fieldTableInput(parameters, String(value).c_str()); };
-    void fieldTableInput(const char *parameters, double value, int precision) { fieldTableInput(parameters, String(value,precision).c_str()); };
-    void fieldTableSelect(const char *parameters, std::function<void()> func);
+    void fieldTableInput(const char *parameters, int value) { char b[NUMBER_BUFFER_SIZE]; fieldTableInput(parameters, formatNumber(b, value, 0)); };
+    void fieldTableInput(const char *parameters, double value, int precision) { char b[NUMBER_BUFFER_SIZE]; fieldTableInput(parameters, formatNumber(b, value, precision)); };
+    template <typename F> void fieldTableSelect(const char *parameters, const F &func) {
+      r->print("<td>");
+      select(parameters, func);
+      r->println("</td>");
+    }
 
     void fieldTableInput(const char *tdParameters, const char *parameters, const char *value);
-    void fieldTableInput(const char *tdParameters, const char *parameters, int value) { fieldTableInput(parameters, String(value).c_str()); };
-    void fieldTableInput(const char *tdParameters, const char *parameters, double value, int precision) { fieldTableInput(parameters, String(value,precision).c_str()); };
-    void fieldTableSelect(const char *tdParameters, const char *parameters, std::function<void()> func);
+    void fieldTableInput(const char *tdParameters, const char *parameters, int value) { char b[NUMBER_BUFFER_SIZE]; fieldTableInput(tdParameters, parameters, formatNumber(b, value, 0)); };
+    void fieldTableInput(const char *tdParameters, const char *parameters, double value, int precision) { char b[NUMBER_BUFFER_SIZE]; fieldTableInput(tdParameters, parameters, formatNumber(b, value, precision)); };
+    template <typename F> void fieldTableSelect(const char *tdParameters, const char *parameters, const F &func) {
+      r->print("<td ");
+      r->print(tdParameters);
+      r->print(">");
+      select(parameters, func);
+      r->println("</td>");
+    }
 
     void navbar(NavbarPage activePage);
     void footer();
 
+    void printEscapingSingleQuotes(const char *s);
     bool needsEscapingSingleQuotes(const char *s);
     String escapeSingleQuotes(const char *s);
     #define ESCAPE_SINGLE_QUOTES(s) (needsEscapingSingleQuotes(s) ? escapeSingleQuotes(s).c_str() : s)
+
+  private:
+    void openBlock(const char *title);
+    void closeBlock() { r->println("</div>\n</div>"); }
 };
 
 #endif
@@ -0,0 +1,139 @@
+#include "LogStorage.h"
+
+#include <vector>
+
+#include "MyLog.h"
+
+#define MIGRATE_DIRECTORY "/migrate"
+
+void CLogStorage::setup(SdFs* sd, SdAccessLock* sdMutex, bool useFlash /* = true */)
+{
+    this->m_sd = sd;
+    this->m_sdMutex = sdMutex;
+    this->m_flash = useFlash && FFat.begin(true);
+    if (this->m_flash) FFat.mkdir(MIGRATE_DIRECTORY);
+}
+
+bool CLogStorage::append(const char* fileName, const uint8_t* data, size_t len)
+{
+    if (this->m_flash) {
+        File f = FFat.open(String("/") + fileName, FILE_APPEND);
+        size_t written = f ? f.write(data, len) : 0;
+        if (f) f.close();
+        if (written == len) {
+            this->stats.flashBytes += len;
+            return true;
+        }
+
+        // Flash full or broken: the rest goes to the SD card, where the log maintenance
+        // archives it separately
+        this->stats.flashErrors++;
+        data += written;
+        len -= written;
+        this->stats.flashBytes += written;
+    }
+    return this->appendToSd(fileName, data, len);
+}
+
+bool CLogStorage::appendToSd(const char* fileName, const uint8_t* data, size_t len)
+{
+    if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_LOG)) return false;
+    FsFile f = this->m_sd->open(fileName, FILE_WRITE);
+    size_t written = 0;
+    if (f) {
+        written = f.write(data, len);
+        f.close();
+    }
+    this->m_sdMutex->unlock();
+    this->stats.sdBytes += written;
+    return written == len;
+}
+
+bool CLogStorage::detach(const char* fileName, const char* migrateName)
+{
+    if (!this->m_flash) return false;
+    String path = String("/") + fileName;
+    if (!FFat.exists(path.c_str())) return false;
+    String migratePath = String(MIGRATE_DIRECTORY "/") + migrateName;
+    if (FFat.exists(migratePath.c_str())) return false;
+    return FFat.rename(path.c_str(), migratePath.c_str());
+}
+
+int CLogStorage::migrate(const char* sdDirectory)
+{
+    if (!this->m_flash) return 0;
+
+    // Collect the names first, the files are removed as they are migrated
+    std::vector<String> names;
+    File dir = FFat.open(MIGRATE_DIRECTORY);
+    if (dir && dir.isDirectory()) {
+        for (File f = dir.openNextFile(); f; f = dir.openNextFile()) {
+            if (!f.isDirectory()) {
+                // name() is the full path in some core versions, the file name in others
+                const char* name = strrchr(f.name(), '/');
+                names.push_back(name ? name + 1 : f.name());
+            }
+        }
+    }
+    dir.close();
+    if (names.empty()) return 0;
+
+    uint8_t* buffer = (uint8_t*)malloc(MIGRATE_BUFFER_SIZE);
+    if (!buffer) return 0;
+
+    int result = 0;
+    for (const String& name : names) {
+        String flashPath = String(MIGRATE_DIRECTORY "/") + name;
+        String sdPath = String(sdDirectory) + "/" + name;
+        if (this->migrateFile(flashPath.c_str(), sdPath.c_str(), buffer)) {
+            FFat.remove(flashPath.c_str());
+            result++;
+        }
+    }
+    free(buffer);
+    return result;
+}
+
+// Copy a file from flash to the SD card, replacing what a migration interrupted by a
+// restart left there. The SD card is locked for each block.
+bool CLogStorage::migrateFile(const char* flashPath, const char* sdPath, uint8_t* buffer)
+{
+    File in = FFat.open(flashPath, FILE_READ);
+    if (!in) return false;
+    size_t size = in.size();
+
+    if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_BACKGROUND)) return false;
+    String directory = String(sdPath).substring(0, String(sdPath).lastIndexOf('/'));
+    if (directory.length() > 0) this->m_sd->mkdir(directory.c_str());
+    FsFile out = this->m_sd->open(sdPath, O_WRONLY | O_CREAT | O_TRUNC);
+    if (out) out.preAllocate(size);    // Contiguous clusters if there are any
+    this->m_sdMutex->unlock();
+    if (!out) return false;
+
+    bool result = true;
+    size_t copied = 0;
+    while (copied < size) {
+        size_t n = in.read(buffer, MIGRATE_BUFFER_SIZE);
+        if (n == 0) break;
+        if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_BACKGROUND)) {
+            result = false;
+            break;
+        }
+        result = out.write(buffer, n) == n;
+        this->m_sdMutex->unlock();
+        if (!result) break;
+        copied += n;
+    }
+    in.close();
+
+    if (this->m_sdMutex->lock(__PRETTY_FUNCTION__, SD_PRIORITY_BACKGROUND)) {
+        out.truncate();     // Unused preallocated clusters
+        out.close();
+        this->m_sdMutex->unlock();
+    }
+    this->stats.migratedBytes += copied;
+    if (result) MyLog.printf("Migrated %s to the SD card (%ukB)\n", sdPath, (unsigned)(copied / 1024));
+    return result && copied == size;
+}
+
+CLogStorage LogStorage;
@@ -0,0 +1,73 @@
+#ifndef __LOG_STORAGE_H
+#define __LOG_STORAGE_H
+
+#include <Arduino.h>
+#include <FFat.h>
+#include <SdFat.h>
+
+#include "SdAccessLock.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Storage tiers for the text logs
+//
+// The logs written by BackgroundFileWriter get small appends every second or so. If the
+// internal "ffat" partition can be mounted they go there instead of the SD card: FFat
+// sits on the ESP-IDF wear levelling layer and does not need the SPI bus and the SD card
+// mutex, which web downloads hold for long stretches. When FFat is not available or full
+// they go to the SD card as before.
+//
+// Once a day the log maintenance detaches the files from the flash tier (they are moved
+// to /migrate on FFat, and the next append starts a new file) and migrates them to the
+// SD card in large sequential writes. Files still in /migrate after a restart are
+// migrated on the next run.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+#define LOG_STORAGE_FLASH_PREFIX "flash/"    // How flash files appear on the files page
+
+class CLogStorage {
+  private:
+    static const size_t MIGRATE_BUFFER_SIZE = 16 * 1024;
+
+    SdFs* m_sd = nullptr;
+    SdAccessLock* m_sdMutex = nullptr;
+    bool m_flash = false;
+
+  public:
+    struct Stats {
+        uint64_t flashBytes;        // Appended to the flash tier
+        uint64_t sdBytes;           // Appended to the SD card
+        uint64_t migratedBytes;     // Moved from flash to the SD card
+        uint32_t flashErrors;       // Appends that fell back to the SD card
+    } stats = {};
+
+    // Mount FFat (formatting it if it has never been used) unless useFlash is false
+    void setup(SdFs* sd, SdAccessLock* sdMutex, bool useFlash = true);
+    bool isFlashAvailable() const { return this->m_flash; }
+
+    // Append to a log file (name without leading /) on the fastest tier that works
+    bool append(const char* fileName, const uint8_t* data, size_t len);
+
+    // Move a log file out of the way of append() for migration as migrateName; false if
+    // the file is not on the flash tier
+    bool detach(const char* fileName, const char* migrateName);
+
+    // Move detached files to sdDirectory on the SD card; returns the number of files moved
+    int migrate(const char* sdDirectory);
+
+    // Access to the files on the flash tier for the files page
+    File openFlashFile(const char* fileName) { return FFat.open(String("/") + fileName, FILE_READ); }
+    File openFlashRoot() { return FFat.open("/"); }
+    bool removeFlashFile(const char* fileName) { return FFat.remove((String("/") + fileName).c_str()); }
+    size_t flashTotalBytes() { return this->m_flash ? FFat.totalBytes() : 0; }
+    size_t flashUsedBytes() { return this->m_flash ? FFat.usedBytes() : 0; }
+
+  private:
+    bool appendToSd(const char* fileName, const uint8_t* data, size_t len);
+    bool migrateFile(const char* flashPath, const char* sdPath, uint8_t* buffer);
+};
+
+extern CLogStorage LogStorage;
+
+#endif
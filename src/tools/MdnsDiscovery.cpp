@@ -0,0 +1,208 @@
+#include "MdnsDiscovery.h"
+
+#include <ESPmDNS.h>
+#include <WiFi.h>
+#include <mdns.h>
+
+#include "MyLog.h"
+
+CMdnsDiscovery MdnsDiscovery;
+
+CMdnsDiscovery::CMdnsDiscovery() : m_mutex("MdnsDiscovery"), m_queryMutex("MdnsQuery")
+{
+}
+
+void CMdnsDiscovery::advertise(const char* service, uint16_t port, const String& name)
+{
+    bool known = false;
+    for (Advertised& a : this->m_advertised) {
+        if (a.service == service) {
+            a.port = port;
+            a.name = name;
+            known = true;
+        }
+    }
+    if (!known) this->m_advertised.push_back({service, port, name});
+
+    if (!MDNS.addService(service, "tcp", port)) {
+        MyLog.printf("Unable to advertise _%s._tcp\n", service);
+        return;
+    }
+    MDNS.addServiceTxt(service, "tcp", "name", name.c_str());
+}
+
+void CMdnsDiscovery::withdraw(const char* service)
+{
+    for (auto a = this->m_advertised.begin(); a != this->m_advertised.end(); a++) {
+        if (a->service == service) {
+            this->m_advertised.erase(a);
+            // ESPmDNS has no way to remove a service, the IDF does
+            mdns_service_remove((String("_") + service).c_str(), "_tcp");
+            return;
+        }
+    }
+}
+
+void CMdnsDiscovery::readvertise()
+{
+    for (const Advertised& a : this->m_advertised) {
+        if (MDNS.addService(a.service.c_str(), "tcp", a.port)) {
+            MDNS.addServiceTxt(a.service.c_str(), "tcp", "name", a.name.c_str());
+        }
+    }
+}
+
+bool CMdnsDiscovery::resolve(const String& host, IPAddress& address)
+{
+    if (address.fromString(host)) return true;
+
+    bool stale = false;
+    IPAddress staleAddress;
+    if (this->m_mutex.lock(__PRETTY_FUNCTION__)) {
+        for (const Address& a : this->m_addresses) {
+            if (!a.host.equalsIgnoreCase(host)) continue;
+            if (millis() - a.resolvedMillis < ADDRESS_TTL_MS) {
+                address = a.address;
+                this->m_stats.cacheHits++;
+                this->m_mutex.unlock();
+                return true;
+            }
+            stale = true;
+            staleAddress = a.address;
+        }
+        this->m_mutex.unlock();
+    }
+
+    if (this->query(host, address)) {
+        this->remember(host, address);
+        return true;
+    }
+    if (stale) {
+        address = staleAddress;
+        if (this->m_mutex.lock(__PRETTY_FUNCTION__)) {
+            this->m_stats.staleAnswers++;
+            this->m_mutex.unlock();
+        }
+        return true;
+    }
+    return false;
+}
+
+void CMdnsDiscovery::invalidate(const String& host)
+{
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return;
+    for (auto a = this->m_addresses.begin(); a != this->m_addresses.end(); a++) {
+        if (a->host.equalsIgnoreCase(host)) {
+            this->m_addresses.erase(a);
+            break;
+        }
+    }
+    this->m_mutex.unlock();
+}
+
+// Look up a host name on the network. <host>.local is resolved by mDNS directly, which
+// does not wait for the DNS server first.
+bool CMdnsDiscovery::query(const String& host, IPAddress& address)
+{
+    bool result = false;
+    if (host.endsWith(".local")) {
+        if (this->m_queryMutex.lock(__PRETTY_FUNCTION__)) {
+            address = MDNS.queryHost(host.substring(0, host.length() - 6), QUERY_TIMEOUT_MS);
+            this->m_queryMutex.unlock();
+            result = (uint32_t)address != 0;
+        }
+    }
+    else {
+        result = WiFi.hostByName(host.c_str(), address) == 1;
+    }
+
+    if (this->m_mutex.lock(__PRETTY_FUNCTION__)) {
+        this->m_stats.queries++;
+        if (!result) this->m_stats.failures++;
+        this->m_mutex.unlock();
+    }
+    return result;
+}
+
+// Must not hold m_mutex
+void CMdnsDiscovery::remember(const String& host, const IPAddress& address)
+{
+    if (!this->m_mutex.lock(__PRETTY_FUNCTION__)) return;
+    bool found = false;
+    for (Address& a : this->m_addresses) {
+        if (a.host.equalsIgnoreCase(host)) {
+            a.address = address;
+            a.resolvedMillis = millis();
+            found = true;
+        }
+    }
+    if (!found) this->m_addresses.push_back({host, address, (uint32_t)millis()});
+    this->m_mutex.unlock();
+}
+
+std::vector<DiscoveredService> CMdnsDiscovery::browse(const char* service)
+{
+    if (this->m_mutex.lock(__PRETTY_FUNCTION__)) {
+        for (const Browse& b : this->m_browses) {
+            if (b.service == service && millis() - b.browsedMillis < BROWSE_TTL_MS) {
+                std::vector<DiscoveredService> results = b.results;
+                this->m_stats.cacheHits++;
+                this->m_mutex.unlock();
+                return results;
+            }
+        }
+        this->m_mutex.unlock();
+    }
+
+    std::vector<DiscoveredService> results;
+    if (!this->m_queryMutex.lock(__PRETTY_FUNCTION__)) return results;
+    int count = MDNS.queryService(service, "tcp");
+    for (int i = 0; i < count; i++) {
+        DiscoveredService s;
+        s.hostname = MDNS.hostname(i) + ".local";
+        s.address = MDNS.IP(i);
+        s.port = MDNS.port(i);
+        if (MDNS.hasTxt(i, "name")) s.name = MDNS.txt(i, "name");
+        results.push_back(s);
+    }
+    this->m_queryMutex.unlock();
+
+    // The addresses came with the answer, so connecting needs no further query
+    for (const DiscoveredService& s : results) {
+        if ((uint32_t)s.address != 0) this->remember(s.hostname, s.address);
+    }
+
+    if (this->m_mutex.lock(__PRETTY_FUNCTION__)) {
+        this->m_stats.queries++;
+        bool found = false;
+        for (Browse& b : this->m_browses) {
+            if (b.service == service) {
+                b.results = results;
+                b.browsedMillis = millis();
+                found = true;
+            }
+        }
+        if (!found) this->m_browses.push_back({service, results, (uint32_t)millis()});
+        this->m_mutex.unlock();
+    }
+    return results;
+}
+
+bool CMdnsDiscovery::findController(String& host, uint16_t& port)
+{
+    std::vector<DiscoveredService> controllers = this->browse(MANIFOLD_CONTROLLER_SERVICE);
+    if (controllers.empty()) return false;
+    host = controllers[0].hostname;
+    port = controllers[0].port;
+    return true;
+}
+
+CMdnsDiscovery::Stats CMdnsDiscovery::getStats()
+{
+    Stats result;
+    if (this->m_mutex.lock(__PRETTY_FUNCTION__)) {
+        result = this->m_stats;
+        this->m_mutex.unlock();
+    }
+    return result;
+}
@@ -0,0 +1,107 @@
+#ifndef __MDNS_DISCOVERY_H
+#define __MDNS_DISCOVERY_H
+
+#include <Arduino.h>
+
+#include <vector>
+
+#include "MyMutex.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Finding manifolds and the heating controller by mDNS
+//
+// Each manifold advertises a _manifold._tcp service, the heating controller advertises
+// _manifold-ctl._tcp, both with the display name in the "name" TXT record. A manifold
+// configured with the controller address "auto" posts to whichever controller it finds;
+// the controller can browse for the manifolds without any configuration.
+//
+// Addresses are cached for ADDRESS_TTL_MS, so connecting to <host>.local does not cost an
+// mDNS query every time. Clients call invalidate() when they cannot connect, so the next
+// lookup asks again and a new address is found after a manifold or controller has moved.
+// If a query fails, an expired address is still used; invalidate() removes it.
+//
+// The services advertised are remembered and advertised again whenever mDNS is restarted
+// for a new hostname (see CMyWiFi::setHostname). This firmware advertises _manifold._tcp
+// always, and _manifold-ctl._tcp when it is configured to act as the heating controller;
+// the controller then browses for the manifolds (see CManifoldManager::discover).
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+#define MANIFOLD_SERVICE "manifold"                 // _manifold._tcp
+#define MANIFOLD_CONTROLLER_SERVICE "manifold-ctl"  // _manifold-ctl._tcp
+
+struct DiscoveredService {
+    String hostname;            // Including .local
+    String name;                // From the TXT record, may be empty
+    IPAddress address;
+    uint16_t port;
+};
+
+class CMdnsDiscovery {
+  public:
+    static const uint32_t ADDRESS_TTL_MS = 5 * 60 * 1000;
+    static const uint32_t BROWSE_TTL_MS = 60 * 1000;
+    static const uint32_t QUERY_TIMEOUT_MS = 1000;
+
+    struct Stats {
+        uint32_t cacheHits = 0;
+        uint32_t queries = 0;
+        uint32_t failures = 0;      // Queries without an answer
+        uint32_t staleAnswers = 0;  // Failed queries answered from an expired entry
+    };
+
+  private:
+    struct Address {
+        String host;
+        IPAddress address;
+        uint32_t resolvedMillis;
+    };
+
+    struct Browse {
+        String service;
+        std::vector<DiscoveredService> results;
+        uint32_t browsedMillis;
+    };
+
+    struct Advertised {
+        String service;
+        uint16_t port;
+        String name;
+    };
+
+    MyMutex m_mutex;            // The caches and the statistics
+    MyMutex m_queryMutex;       // MDNS keeps the results of one query at a time
+    std::vector<Address> m_addresses;
+    std::vector<Browse> m_browses;
+    std::vector<Advertised> m_advertised;   // Only changed from the main task and the web server
+    Stats m_stats;
+
+  public:
+    CMdnsDiscovery();
+
+    // Advertise (or update the name of) a service of this device. Requires mDNS to be running.
+    void advertise(const char* service, uint16_t port, const String& name);
+    void withdraw(const char* service);
+    void readvertise();
+
+    // Address of a host name (also <host>.local) or an IP address in text form
+    bool resolve(const String& host, IPAddress& address);
+    void invalidate(const String& host);
+
+    // Instances of a service on the network, at most BROWSE_TTL_MS old
+    std::vector<DiscoveredService> browse(const char* service);
+
+    // Hostname and port of the heating controller, if one advertises itself
+    bool findController(String& host, uint16_t& port);
+
+    Stats getStats();
+
+  private:
+    bool query(const String& host, IPAddress& address);
+    void remember(const String& host, const IPAddress& address);
+};
+
+extern CMdnsDiscovery MdnsDiscovery;
+
+#endif
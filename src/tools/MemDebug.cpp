@@ -1,12 +1,17 @@
 #include "MemDebug.h"
 
 #include <Arduino.h>
-#include <esp_system.h>  // For esp_get_free_heap_size()
+#include <esp_spi_flash.h>  // For spi_flash_cache_enabled()
+#include <esp_system.h>     // For esp_get_free_heap_size()
+#include <esp_timer.h>
 
 #include "EspTools.h"
 #include "MyLog.h"
 #include "esp_heap_caps.h"
 
+CMemDebug MemDebug;
+CJsonAllocator JsonAllocator;
+
 extern "C" void heap_caps_alloc_failed_hook(
     size_t requested_size,
     uint32_t caps,
@@ -16,6 +21,328 @@ extern "C" void heap_caps_alloc_failed_hook(
     softwareAbort(SW_RESET_OUT_OF_MEMORY);
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////
+// Allocation hooks (linked with -Wl,--wrap=malloc etc.)
+
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+void __real_free(void* pointer);
+
+void* IRAM_ATTR __wrap_malloc(size_t size)
+{
+    void* result = __real_malloc(size);
+    MemDebug.recordAllocation(result, size);
+    return result;
+}
+
+void* IRAM_ATTR __wrap_calloc(size_t count, size_t size)
+{
+    void* result = __real_calloc(count, size);
+    MemDebug.recordAllocation(result, count * size);
+    return result;
+}
+
+// Recorded as a free and a new allocation; if the reallocation fails the
+// heap_caps_alloc_failed_hook aborts anyway
+void* IRAM_ATTR __wrap_realloc(void* pointer, size_t size)
+{
+    MemDebug.recordFree(pointer);
+    void* result = __real_realloc(pointer, size);
+    MemDebug.recordAllocation(result, size);
+    return result;
+}
+
+void IRAM_ATTR __wrap_free(void* pointer)
+{
+    MemDebug.recordFree(pointer);
+    __real_free(pointer);
+}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Tags by task
+
+static const char* tagNames[MEM_TAG_COUNT] = {"other", "neohub", "web", "log", "json"};
+
+// Tasks whose allocations are tagged by default, by task name
+static const struct {
+    const char* taskName;
+    MemTag tag;
+} defaultTaskTags[] = {
+    {"NeohubLoop", MEM_TAG_NEOHUB},
+    {"WebSocketLoop", MEM_TAG_NEOHUB},
+    {"async_tcp", MEM_TAG_WEB},
+    {"WebWorker", MEM_TAG_WEB},
+    {"BgFileWriter", MEM_TAG_LOG},
+    {"EventLog", MEM_TAG_LOG},
+    {"LogMaintenance", MEM_TAG_LOG},
+};
+
+static const uint8_t NO_SCOPE = 0xFF;
+static const int MAX_TASKS = 32;
+
+struct TaskTag {
+    TaskHandle_t task;
+    uint8_t tag;
+    uint8_t scope;  // Tag of the innermost MemTagScope, or NO_SCOPE
+};
+
+// Protects the task table and the statistics and trace in MemDebug
+static portMUX_TYPE memDebugLock = portMUX_INITIALIZER_UNLOCKED;
+static TaskTag taskTags[MAX_TASKS];
+static int taskTagCount;
+
+const char* memTagName(int tag)
+{
+    return tag >= 0 && tag < MEM_TAG_COUNT ? tagNames[tag] : "?";
+}
+
+// Entry for a task, added on the first allocation. Tasks are hardly ever deleted, so entries
+// are never removed; if there are too many tasks the rest is counted as "other".
+// Must hold memDebugLock.
+static TaskTag* findTaskTag(TaskHandle_t task)
+{
+    if (!task) return nullptr;   // Before the scheduler has started
+    for (int i = 0; i < taskTagCount; i++) {
+        if (taskTags[i].task == task) return &taskTags[i];
+    }
+    if (taskTagCount >= MAX_TASKS) return nullptr;
+
+    TaskTag* result = &taskTags[taskTagCount++];
+    result->task = task;
+    result->tag = MEM_TAG_OTHER;
+    result->scope = NO_SCOPE;
+    const char* name = pcTaskGetName(task);
+    for (auto& d : defaultTaskTags) {
+        if (strcmp(name, d.taskName) == 0) result->tag = d.tag;
+    }
+    return result;
+}
+
+MemTagScope::MemTagScope(MemTag tag)
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    portENTER_CRITICAL(&memDebugLock);
+    TaskTag* t = findTaskTag(task);
+    this->m_previous = t ? t->scope : NO_SCOPE;
+    if (t) t->scope = tag;
+    portEXIT_CRITICAL(&memDebugLock);
+}
+
+MemTagScope::~MemTagScope()
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    portENTER_CRITICAL(&memDebugLock);
+    TaskTag* t = findTaskTag(task);
+    if (t) t->scope = this->m_previous;
+    portEXIT_CRITICAL(&memDebugLock);
+}
+
+void* CJsonAllocator::allocate(size_t size)
+{
+    MemTagScope scope(MEM_TAG_JSON);
+    return malloc(size);
+}
+
+void CJsonAllocator::deallocate(void* pointer)
+{
+    MemTagScope scope(MEM_TAG_JSON);
+    free(pointer);
+}
+
+void* CJsonAllocator::reallocate(void* pointer, size_t newSize)
+{
+    MemTagScope scope(MEM_TAG_JSON);
+    return realloc(pointer, newSize);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Statistics and trace
+
+void CMemDebug::setup()
+{
+    heap_caps_register_failed_alloc_callback(heap_caps_alloc_failed_hook);
+    this->m_lastSampleMillis = millis();
+}
+
+// The hooks do nothing where the code and data of the rest (in flash and PSRAM) cannot be
+// used
+void IRAM_ATTR CMemDebug::recordAllocation(void* pointer, size_t size)
+{
+    if (!pointer || xPortInIsrContext() || !spi_flash_cache_enabled()) return;
+    this->account(pointer, size, true);
+}
+
+void IRAM_ATTR CMemDebug::recordFree(void* pointer)
+{
+    if (!pointer || xPortInIsrContext() || !spi_flash_cache_enabled()) return;
+    this->account(pointer, 0, false);
+}
+
+size_t CMemDebug::sizeClassLimit(int sizeClass)
+{
+    return sizeClass < SIZE_CLASSES - 1 ? (size_t)16 << sizeClass : 0;
+}
+
+void CMemDebug::account(void* pointer, size_t size, bool isAllocation)
+{
+    size_t blockSize = heap_caps_get_allocated_size(pointer);
+    int sizeClass = 0;
+    while (sizeClass < SIZE_CLASSES - 1 && blockSize > sizeClassLimit(sizeClass)) sizeClass++;
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+
+    portENTER_CRITICAL(&memDebugLock);
+    TaskTag* t = findTaskTag(task);
+    uint8_t tag = !t ? (uint8_t)MEM_TAG_OTHER : t->scope != NO_SCOPE ? t->scope : t->tag;
+    TagStats& s = this->m_tags[tag];
+    SizeClass& c = this->m_sizeClasses[sizeClass];
+    if (isAllocation) {
+        s.allocations++;
+        s.bytesAllocated += size;
+        c.blocks++;
+        c.bytes += blockSize;
+    }
+    else {
+        s.frees++;
+        if (c.blocks > 0) {
+            c.blocks--;
+            c.bytes = c.bytes > (int64_t)blockSize ? c.bytes - blockSize : 0;
+        }
+    }
+
+    if (this->m_tracing) {
+        if (this->m_traceCount < this->m_traceCapacity) {
+            MemTraceRecord& r = this->m_trace[this->m_traceCount++];
+            r.micros = (uint32_t)esp_timer_get_time();
+            r.address = (uint32_t)(uintptr_t)pointer;
+            r.size = blockSize;
+            r.op = isAllocation ? MEM_TRACE_ALLOC : MEM_TRACE_FREE;
+            r.tag = tag;
+            r.core = xPortGetCoreID();
+            r.reserved = 0;
+        }
+        else {
+            this->m_traceDropped++;
+        }
+    }
+    portEXIT_CRITICAL(&memDebugLock);
+}
+
+void CMemDebug::sample()
+{
+    uint32_t now = millis();
+    float seconds = (now - this->m_lastSampleMillis) / 1000.0f;
+
+    portENTER_CRITICAL(&memDebugLock);
+    for (int i = 0; i < MEM_TAG_COUNT; i++) {
+        TagStats& s = this->m_tags[i];
+        if (seconds > 0) {
+            s.allocationsPerSecond = (s.allocations - this->m_lastAllocations[i]) / seconds;
+            s.bytesPerSecond = (s.bytesAllocated - this->m_lastBytes[i]) / seconds;
+        }
+        this->m_lastAllocations[i] = s.allocations;
+        this->m_lastBytes[i] = s.bytesAllocated;
+    }
+    portEXIT_CRITICAL(&memDebugLock);
+    this->m_lastSampleMillis = now;
+}
+
+CMemDebug::TagStats CMemDebug::getTagStats(int tag)
+{
+    portENTER_CRITICAL(&memDebugLock);
+    TagStats result = this->m_tags[tag];
+    portEXIT_CRITICAL(&memDebugLock);
+    return result;
+}
+
+CMemDebug::SizeClass CMemDebug::getSizeClass(int sizeClass)
+{
+    portENTER_CRITICAL(&memDebugLock);
+    SizeClass result = this->m_sizeClasses[sizeClass];
+    portEXIT_CRITICAL(&memDebugLock);
+    return result;
+}
+
+bool CMemDebug::startTrace()
+{
+    // The buffer is allocated once and kept; heap_caps_malloc() is not traced itself
+    if (!this->m_trace) {
+        uint32_t caps = MALLOC_CAP_8BIT;
+        uint32_t capacity = TRACE_INTERNAL_RECORDS;
+        if (psramFound()) {
+            caps = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+            capacity = TRACE_PSRAM_RECORDS;
+        }
+        MemTraceRecord* trace = (MemTraceRecord*)heap_caps_malloc(capacity * sizeof(MemTraceRecord), caps);
+        if (!trace) return false;
+        this->m_trace = trace;
+        this->m_traceCapacity = capacity;
+    }
+
+    portENTER_CRITICAL(&memDebugLock);
+    this->m_traceCount = 0;
+    this->m_traceDropped = 0;
+    this->m_tracing = true;
+    portEXIT_CRITICAL(&memDebugLock);
+    return true;
+}
+
+void CMemDebug::stopTrace()
+{
+    portENTER_CRITICAL(&memDebugLock);
+    this->m_tracing = false;
+    portEXIT_CRITICAL(&memDebugLock);
+}
+
+size_t CMemDebug::getTraceSize() const
+{
+    return sizeof(MemTraceHeader) + MEM_TAG_COUNT * MEM_TRACE_TAG_NAME_SIZE + this->m_traceCount * sizeof(MemTraceRecord);
+}
+
+// The records are only ever appended while tracing, so the ones already counted do not
+// change while they are read
+size_t CMemDebug::readTrace(size_t position, uint8_t* buffer, size_t maxLen)
+{
+    MemTraceHeader header = {};
+    header.magic = MEM_TRACE_MAGIC;
+    header.version = MEM_TRACE_VERSION;
+    header.recordSize = sizeof(MemTraceRecord);
+    header.recordCount = this->m_traceCount;
+    header.dropped = this->m_traceDropped;
+    header.tagCount = MEM_TAG_COUNT;
+
+    char names[MEM_TAG_COUNT * MEM_TRACE_TAG_NAME_SIZE] = {};
+    for (int i = 0; i < MEM_TAG_COUNT; i++) strncpy(names + i * MEM_TRACE_TAG_NAME_SIZE, tagNames[i], MEM_TRACE_TAG_NAME_SIZE);
+
+    struct {
+        const uint8_t* data;
+        size_t size;
+    } parts[] = {
+        {(const uint8_t*)&header, sizeof(header)},
+        {(const uint8_t*)names, sizeof(names)},
+        {(const uint8_t*)this->m_trace, header.recordCount * sizeof(MemTraceRecord)},
+    };
+
+    size_t result = 0;
+    size_t partStart = 0;
+    for (auto& p : parts) {
+        if (position < partStart + p.size && result < maxLen) {
+            size_t offset = position - partStart;
+            size_t n = min(p.size - offset, maxLen - result);
+            memcpy(buffer + result, p.data + offset, n);
+            result += n;
+            position += n;
+        }
+        partStart += p.size;
+    }
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Free heap reporting
+
 uint32_t freeRam()
 {
     return esp_get_free_heap_size();
@@ -25,7 +352,7 @@ uint32_t ramAvailable = 0;
 
 void setupMemDebug()
 {
-    heap_caps_register_failed_alloc_callback(heap_caps_alloc_failed_hook);
+    MemDebug.setup();
 }
 
 void checkMemoryChange(bool forceOutput, int thresholdBytes /* = 1024 */)
@@ -50,6 +377,8 @@ void checkMemoryChange(char* message, bool forceOutput /* = true */, int thresho
             MyLog.print((int32_t)(newRamAvailable - ramAvailable));
             MyLog.print(")");
         }
+        MyLog.print(", largest internal block: ");
+        MyLog.print((uint32_t)heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
         MyLog.println();
         ramAvailable = newRamAvailable;
     }
@@ -1,13 +1,165 @@
 #include <Arduino.h>
+#include <ArduinoJson.h>
 #include <esp_system.h>
 #ifndef __MEMDEBUG_H
 
 #define __MEMDEBUG_H
 
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Heap monitoring
+//
+// The firmware is linked with --wrap for malloc, calloc, realloc and free (see
+// platformio.ini), which routes all allocations (including new and the libraries) through
+// the hooks in MemDebug.cpp. Allocations made with heap_caps_malloc() directly are not
+// seen. The hooks count allocations by tag and keep the number of blocks in use by size
+// class. The tag comes from the task that allocates (e.g. all allocations in the
+// "async_tcp" task are "web"); a MemTagScope overrides it for a block of code, and the
+// JsonAllocator attributes JsonDocument memory to "json".
+//
+// Frees count against the tag of the freeing task, which is not necessarily the one that
+// allocated the block, so there is no "bytes in use" by tag. For this, a trace of all
+// allocations and frees can be recorded (into PSRAM if available) and downloaded from
+// /memory/trace.bin, then analysed with scripts/replayHeapTrace.py.
+//
+// Nothing is recorded in interrupts or while the flash cache is disabled. The hooks run
+// from IRAM because that is where malloc() may be called from.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+enum MemTag : uint8_t {
+    MEM_TAG_OTHER,
+    MEM_TAG_NEOHUB,
+    MEM_TAG_WEB,
+    MEM_TAG_LOG,
+    MEM_TAG_JSON,
+    MEM_TAG_COUNT
+};
+
+const char* memTagName(int tag);
+
+// Attribute the allocations of the calling task to a tag while in scope
+class MemTagScope {
+  private:
+    uint8_t m_previous;
+
+  public:
+    MemTagScope(MemTag tag);
+    ~MemTagScope();
+};
+
+// Allocator for JsonDocument that tags the memory as MEM_TAG_JSON
+class CJsonAllocator : public ArduinoJson::Allocator {
+  public:
+    void* allocate(size_t size) override;
+    void deallocate(void* pointer) override;
+    void* reallocate(void* pointer, size_t newSize) override;
+};
+
+extern CJsonAllocator JsonAllocator;
+
+// One record of the allocation trace; the download is a MemTraceHeader, the names of
+// the tags (tagCount * MEM_TRACE_TAG_NAME_SIZE bytes, zero padded) and the records
+#define MEM_TRACE_MAGIC 0x31525448  // "HTR1"
+#define MEM_TRACE_VERSION 1
+#define MEM_TRACE_TAG_NAME_SIZE 8
+#define MEM_TRACE_ALLOC 1
+#define MEM_TRACE_FREE 2
+
+struct __attribute__((packed)) MemTraceHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize;
+    uint32_t recordCount;
+    uint32_t dropped;       // Records not written because the buffer was full
+    uint8_t tagCount;
+    uint8_t reserved[3];
+};
+
+struct __attribute__((packed)) MemTraceRecord {
+    uint32_t micros;        // Since startup, wraps after ~71 minutes
+    uint32_t address;
+    uint32_t size;          // Size of the block including the heap's rounding
+    uint8_t op;             // MEM_TRACE_ALLOC or MEM_TRACE_FREE
+    uint8_t tag;
+    uint8_t core;
+    uint8_t reserved;
+};
+
+class CMemDebug {
+  public:
+    static const int SIZE_CLASSES = 14;     // <= 16, <= 32, ... <= 64K, larger
+
+    struct TagStats {
+        uint32_t allocations;
+        uint32_t frees;
+        uint64_t bytesAllocated;            // As requested
+        float allocationsPerSecond;         // Over the last sample interval
+        float bytesPerSecond;
+    };
+
+    // Blocks allocated and not yet freed by size class. Approximate: a block allocated
+    // with heap_caps_malloc() and released with free() is only seen when it is freed.
+    struct SizeClass {
+        int32_t blocks;
+        int64_t bytes;
+    };
+
+  private:
+    static const uint32_t TRACE_PSRAM_RECORDS = 65536;     // 1 MB
+    static const uint32_t TRACE_INTERNAL_RECORDS = 1024;   // 16 KB
+
+    // Written by the hooks; no constructor, so these are zero before any allocation
+    TagStats m_tags[MEM_TAG_COUNT];
+    SizeClass m_sizeClasses[SIZE_CLASSES];
+    MemTraceRecord* m_trace;
+    uint32_t m_traceCapacity;
+    uint32_t m_traceCount;
+    uint32_t m_traceDropped;
+    bool m_tracing;
+
+    // For the rates
+    uint32_t m_lastSampleMillis;
+    uint32_t m_lastAllocations[MEM_TAG_COUNT];
+    uint64_t m_lastBytes[MEM_TAG_COUNT];
+
+  public:
+    void setup();
+
+    // Called by the allocation hooks
+    void recordAllocation(void* pointer, size_t size);
+    void recordFree(void* pointer);
+
+    // Update the allocation rates; called periodically
+    void sample();
+
+    TagStats getTagStats(int tag);
+    SizeClass getSizeClass(int sizeClass);
+    static size_t sizeClassLimit(int sizeClass);    // 0 for the last one
+
+    // Allocation trace. Starting discards the previous trace; recording stops when the
+    // buffer is full (the rest is counted as dropped) so that the trace stays consistent.
+    bool startTrace();
+    void stopTrace();
+    bool isTracing() const { return this->m_tracing; }
+    uint32_t getTraceCount() const { return this->m_traceCount; }
+    uint32_t getTraceCapacity() const { return this->m_traceCapacity; }
+    uint32_t getTraceDropped() const { return this->m_traceDropped; }
+
+    // Copy part of the trace download (header, tag names, records) into buffer
+    size_t getTraceSize() const;
+    size_t readTrace(size_t position, uint8_t* buffer, size_t maxLen);
+
+  private:
+    void account(void* pointer, size_t size, bool isAllocation);
+};
+
+extern CMemDebug MemDebug;
+
 void setupMemDebug();
 void checkMemoryChange(int thresholdBytes = 1024);
 void checkMemoryChange(bool forceOutput, int thresholdBytes = 1024);
 void checkMemoryChange(char* message, bool forceOutput = true, int thresholdBytes = 1024);
 void outOfMemory();
 
-#endif
\ No newline at end of file
+#endif
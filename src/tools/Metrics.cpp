@@ -0,0 +1,141 @@
+#include "Metrics.h"
+
+CMetrics Metrics;
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// MetricsHistogram
+////////////////////////////////////////////////////////////////////////////////////////////
+
+const uint32_t MetricsHistogram::s_bucketBoundsMicros[BUCKET_COUNT] = {
+    100, 500, 1000, 5000, 10000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+MetricsHistogram::MetricsHistogram()
+{
+    memset(this->m_buckets, 0, sizeof(this->m_buckets));
+    this->m_sumMicros = 0;
+    this->m_count = 0;
+    this->m_maxMicros = 0;
+}
+
+void MetricsHistogram::observe(uint32_t micros)
+{
+    int i = 0;
+    while (i < BUCKET_COUNT && micros > s_bucketBoundsMicros[i]) i++;
+    this->m_buckets[i]++;
+    this->m_sumMicros += micros;
+    this->m_count++;
+    if (micros > this->m_maxMicros) this->m_maxMicros = micros;
+}
+
+void MetricsHistogram::write(Print& out, const char* name, const char* labels) const
+{
+    const char* separator = labels && *labels ? "," : "";
+    if (!labels) labels = "";
+
+    uint32_t cumulative = 0;
+    for (int i = 0; i < BUCKET_COUNT; i++) {
+        cumulative += this->m_buckets[i];
+        out.printf("%s_bucket{%s%sle=\"%g\"} %u\n", name, labels, separator, s_bucketBoundsMicros[i] / 1e6, cumulative);
+    }
+    cumulative += this->m_buckets[BUCKET_COUNT];
+    out.printf("%s_bucket{%s%sle=\"+Inf\"} %u\n", name, labels, separator, cumulative);
+    out.printf("%s_sum{%s} %.6f\n", name, labels, this->m_sumMicros / 1e6);
+    out.printf("%s_count{%s} %u\n", name, labels, this->m_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// Text format helpers
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void writeMetricHeader(Print& out, const char* name, const char* type, const char* help)
+{
+    out.printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void writeMetric(Print& out, const char* name, const char* labels, double value)
+{
+    if (labels && *labels) {
+        out.printf("%s{%s} %g\n", name, labels, value);
+    }
+    else {
+        out.printf("%s %g\n", name, value);
+    }
+}
+
+void writeMetric(Print& out, const char* name, const char* labels, uint64_t value)
+{
+    if (labels && *labels) {
+        out.printf("%s{%s} %llu\n", name, labels, (unsigned long long)value);
+    }
+    else {
+        out.printf("%s %llu\n", name, (unsigned long long)value);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// HTTP route metrics
+////////////////////////////////////////////////////////////////////////////////////////////
+
+void HttpRouteMetrics::recordStatus(int code)
+{
+    // Codes that don't fit into the table any more are counted as 0
+    int free = -1;
+    for (int i = 0; i < STATUS_SLOTS; i++) {
+        if (this->statusCodes[i] == code) {
+            this->statusCounts[i]++;
+            return;
+        }
+        if (free < 0 && this->statusCodes[i] == 0) free = i;
+    }
+    if (free < 0) {
+        code = 0;
+        free = STATUS_SLOTS - 1;
+    }
+    this->statusCodes[free] = code;
+    this->statusCounts[free]++;
+}
+
+HttpRouteMetrics* CMetrics::addRoute(const char* method, const char* route)
+{
+    HttpRouteMetrics* result = new HttpRouteMetrics();
+    result->method = method;
+    result->route = route;
+    this->m_routes.push_back(result);
+    return result;
+}
+
+void CMetrics::writeHttpMetrics(Print& out)
+{
+    char labels[96];
+
+    writeMetricHeader(out, "http_requests_total", "counter", "HTTP requests by route and status code (0 = no response)");
+    for (HttpRouteMetrics* r : this->m_routes) {
+        for (int i = 0; i < HttpRouteMetrics::STATUS_SLOTS; i++) {
+            if (r->statusCounts[i] == 0) continue;
+            snprintf(labels, sizeof(labels), "method=\"%s\",route=\"%s\",code=\"%u\"", r->method, r->route, r->statusCodes[i]);
+            writeMetric(out, "http_requests_total", labels, (uint64_t)r->statusCounts[i]);
+        }
+    }
+
+    writeMetricHeader(out, "http_response_bytes_total", "counter", "Bytes sent in HTTP responses, including headers");
+    for (HttpRouteMetrics* r : this->m_routes) {
+        if (r->requests == 0) continue;
+        snprintf(labels, sizeof(labels), "method=\"%s\",route=\"%s\"", r->method, r->route);
+        writeMetric(out, "http_response_bytes_total", labels, r->bytesSent);
+    }
+
+    writeMetricHeader(out, "http_handler_duration_seconds", "histogram", "Time spent in the request handler on the async_tcp task");
+    for (HttpRouteMetrics* r : this->m_routes) {
+        if (r->requests == 0) continue;
+        snprintf(labels, sizeof(labels), "method=\"%s\",route=\"%s\"", r->method, r->route);
+        r->handlerTime.write(out, "http_handler_duration_seconds", labels);
+    }
+
+    writeMetricHeader(out, "http_request_duration_seconds", "histogram", "Time from receiving the request until the response was complete");
+    for (HttpRouteMetrics* r : this->m_routes) {
+        if (r->requests == 0) continue;
+        snprintf(labels, sizeof(labels), "method=\"%s\",route=\"%s\"", r->method, r->route);
+        r->duration.write(out, "http_request_duration_seconds", labels);
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <Arduino.h>
+
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Metrics in Prometheus text format
+//
+// Counters and histograms are plain integers, updated without locking by the single task
+// that owns them (the async_tcp task for HTTP metrics, the valve control task for the
+// control loop and so on), or under the lock of the module they belong to if several
+// tasks update them (the Neohub metrics). A scrape may see a histogram half-updated,
+// which Prometheus tolerates.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// A latency histogram with fixed buckets from 100us to 10s
+class MetricsHistogram {
+  public:
+    static const int BUCKET_COUNT = 13;
+
+  private:
+    static const uint32_t s_bucketBoundsMicros[BUCKET_COUNT];
+    uint32_t m_buckets[BUCKET_COUNT + 1];  // last one is +Inf
+    uint64_t m_sumMicros;
+    uint32_t m_count;
+    uint32_t m_maxMicros;
+
+  public:
+    MetricsHistogram();
+    void observe(uint32_t micros);
+    uint32_t getCount() const { return this->m_count; }
+    uint32_t getMaxMicros() const { return this->m_maxMicros; }
+
+    // Write the _bucket, _sum and _count lines. Labels are "name=\"value\",..." or empty.
+    void write(Print& out, const char* name, const char* labels) const;
+};
+
+// Statistics for one HTTP route
+struct HttpRouteMetrics {
+    static const int STATUS_SLOTS = 6;
+
+    const char* method;
+    const char* route;
+    uint32_t requests = 0;
+    uint64_t bytesSent = 0;
+    uint16_t statusCodes[STATUS_SLOTS] = {0};
+    uint32_t statusCounts[STATUS_SLOTS] = {0};
+    MetricsHistogram handlerTime;  // time spent in the handler, i.e. blocking async_tcp
+    MetricsHistogram duration;     // from the request until the response was complete
+
+    void recordStatus(int code);
+};
+
+// Helpers for the text format
+void writeMetricHeader(Print& out, const char* name, const char* type, const char* help);
+void writeMetric(Print& out, const char* name, const char* labels, double value);
+void writeMetric(Print& out, const char* name, const char* labels, uint64_t value);
+
+class CMetrics {
+  private:
+    std::vector<HttpRouteMetrics*> m_routes;
+
+  public:
+    // Control loop (valve control task)
+    MetricsHistogram controlLoopInterval;  // time between control cycles
+    MetricsHistogram controlTime;          // calculating and setting the valve position
+    MetricsHistogram sensorLogTime;        // writing the sensor log
+    MetricsHistogram sensorReadTime;       // reading the OneWire sensors
+
+    // Neohub (updated under the mutex of the NeohubManager)
+    MetricsHistogram neohubRoundTrip;
+    uint32_t neohubTimeouts = 0;
+    uint32_t neohubErrors = 0;
+
+    // HTTP - routes are registered once at startup and live forever
+    HttpRouteMetrics* addRoute(const char* method, const char* route);
+    void writeHttpMetrics(Print& out);
+};
+
+extern CMetrics Metrics;
+
+#endif
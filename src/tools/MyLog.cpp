@@ -17,35 +17,60 @@ void CMyLog::enableSerialLog() {
   this->m_logToSerial = true;
 }
 
-// Single-byte write - this does all the work because we want to have
-// a timestamp at the beginning of every line
+// Single-byte write
 size_t CMyLog::write(uint8_t c) {
+    return this->write(&c, 1);
+}
 
-    // If we are at the start of a line, write a timestamp
-    // this may recursively call write()
-    handleStartOfLine();
-
-    // If the buffer is full, we write it first
-    if (this->m_bufferLen >= sizeof(this->m_buffer)) {
-        this->flush();
-    }
+// Write a series of characters in a buffer - this does all the work because we want to have
+// a timestamp at the beginning of every line. The text is copied a line at a time, and the
+// buffer is flushed at the end of every line.
+size_t CMyLog::write(const uint8_t* buffer, size_t size)
+{
+    return this->write(buffer, size, 0);
+}
 
-    // Add character to buffer
-    this->m_buffer[this->m_bufferLen++] = c;
+// Text with the timestamp of an earlier time, for lines that start in it. The time is
+// passed along rather than stored, so it cannot end up on a line of another task.
+size_t CMyLog::printAt(time_t lineTime, const char* text)
+{
+    return this->write((const uint8_t*)text, strlen(text), lineTime);
+}
 
-    // if the character was a newline, flush the buffer
-    if (c == '\n') {
-        this->flush();
-        this->m_atStartOfLine = true;
+size_t CMyLog::write(const uint8_t* buffer, size_t size, time_t lineTime)
+{
+    const uint8_t* p = buffer;
+    const uint8_t* end = buffer + size;
+    while (p < end) {
+        // If we are at the start of a line, write a timestamp
+        handleStartOfLine(lineTime);
+
+        const uint8_t* newline = (const uint8_t*)memchr(p, '\n', end - p);
+        const uint8_t* segmentEnd = newline ? newline + 1 : end;
+        this->append(p, segmentEnd - p);
+        p = segmentEnd;
+
+        // if the segment ended with a newline, flush the buffer
+        if (newline) {
+            this->flush();
+            this->m_atStartOfLine = true;
+        }
     }
-    return 1;
+    return size;
 }
 
-// Write a series of characters in a buffer
-size_t CMyLog::write(const uint8_t* buffer, size_t size)
+// Add to the buffer, writing it whenever it is full
+void CMyLog::append(const uint8_t* data, size_t len)
 {
-    while (size--) write (*buffer++);
-    return size;
+    while (len > 0) {
+        if (this->m_bufferLen >= sizeof(this->m_buffer)) this->flush();
+        size_t n = sizeof(this->m_buffer) - this->m_bufferLen;
+        if (n > len) n = len;
+        memcpy(this->m_buffer + this->m_bufferLen, data, n);
+        this->m_bufferLen += n;
+        data += n;
+        len -= n;
+    }
 }
 
 void CMyLog::flush()
@@ -67,22 +92,28 @@ void CMyLog::printlnSdOnly(const char s[])
     this->m_logToSerial = serial;
 }
 
-void CMyLog::handleStartOfLine()
+void CMyLog::handleStartOfLine(time_t lineTime)
 {
+    static const char unknownTimestamp[] = "????-??-?? ??:??:?? | ";
+
     if (this->m_atStartOfLine) {
         this->m_atStartOfLine = false;
         if (this->m_rtc) {
-            MyRtcTime t = this->m_rtc->getTime();
+            MyRtcTime t = lineTime ? MyRtcTime(lineTime) : this->m_rtc->getTime();
             if (t.isValid()) {
-                this->write(this->m_rtc->getTime().getTimestampText().c_str());
-                this->write(" | ");
+                if (t.getUnixTime() != this->m_timestampTime) {
+                    t.getTimestampText(this->m_timestamp, sizeof(this->m_timestamp));
+                    strlcat(this->m_timestamp, " | ", sizeof(this->m_timestamp));
+                    this->m_timestampTime = t.getUnixTime();
+                }
+                this->append((const uint8_t*)this->m_timestamp, strlen(this->m_timestamp));
             }
             else {
-                this->write("????-??-?? ??:??:?? | ");
+                this->append((const uint8_t*)unknownTimestamp, sizeof(unknownTimestamp) - 1);
             }
         }
         else {
-            this->write("????-??-?? ??:??:?? | ");
+            this->append((const uint8_t*)unknownTimestamp, sizeof(unknownTimestamp) - 1);
         }
     }
 }
@@ -92,12 +123,13 @@ void CMyLog::handleStartOfLine()
 // CMyDebugLog - a thread-safe wrapper for stdout
 //
 
-// Single-byte write
+// Single-byte write - stdout is only flushed at the end of a line, Print::print and
+// friends mostly use the buffer write
 size_t CMyDebugLog::write(uint8_t c)
 {
     if (xSemaphoreTake(_mutex, portMAX_DELAY) == pdTRUE) {
         size_t n = fwrite(&c, 1, 1, stdout);
-        fflush(stdout);
+        if (c == '\n') fflush(stdout);
         xSemaphoreGive(_mutex);
         return n;
     }
@@ -108,7 +140,7 @@ size_t CMyDebugLog::write(uint8_t c)
 size_t CMyDebugLog::write(const uint8_t* buffer, size_t size)
 {
     if (xSemaphoreTake(_mutex, portMAX_DELAY) == pdTRUE) {
-        size_t n = fwrite(buffer, size, 1, stdout);
+        size_t n = fwrite(buffer, 1, size, stdout);
         fflush(stdout);
         xSemaphoreGive(_mutex);
         return n;
@@ -4,6 +4,7 @@
 #include <SdFat.h>    // SdFat by Bill Greiman, version 2.3.0
 #include "MyRtc.h"
 #include "MyMutex.h"
+#include "EventLog.h"
 
 
 // Logger class which can write to SD card, a serial, or both, with timestamps if required
@@ -26,7 +27,13 @@ class CMyLog : public Print {
 
     // Start of line handling
     bool m_atStartOfLine = true;                // Flag indicating we are at start of a line
-    void handleStartOfLine(void);               // if we are at start of line, print timestamp
+    void handleStartOfLine(time_t lineTime);    // if we are at start of line, print timestamp (lineTime or now)
+    void append(const uint8_t *data, size_t len);   // add to the buffer, flushing it when full
+
+    // The timestamp text is formatted once per second, not for every line
+    time_t m_timestampTime = 0;
+    char m_timestamp[24];                       // "YYYY-MM-DD HH:MM:SS | "
+    size_t write(const uint8_t *buffer, size_t size, time_t lineTime);
 
   public:
     CMyLog() : m_loggerMutex(new MyMutex("CMyLog::m_loggerMutex")) {};
@@ -34,6 +41,7 @@ class CMyLog : public Print {
     void enableSdCardLog(const char *logFileName);
     void enableSerialLog();
     void logTimestamps(CMyRtc &pRtc) { this->m_rtc = &pRtc; };
+    size_t printAt(time_t lineTime, const char *text);   // for events logged earlier
 
     virtual size_t write(uint8_t c) override;
     virtual size_t write(const uint8_t *buffer, size_t size);
@@ -69,6 +77,6 @@ private:
 // Global instance, like Serial
 extern CMyDebugLog MyDebugLog;
 #define DEBUG_LOG_FORMAT "%-20.20s | %-60.60s | "
-#define DEBUG_LOG(fmt, ...) MyDebugLog.printfWithLocation(DEBUG_LOG_FORMAT, pcTaskGetName(nullptr), __PRETTY_FUNCTION__, (fmt), ##__VA_ARGS__)
+#define DEBUG_LOG(fmt, ...) DEBUG_EVENT(fmt, ##__VA_ARGS__)   // formatted later by the event log task
 
 #endif
\ No newline at end of file
@@ -1,13 +1,44 @@
 #include <MyMutex.h>
 
+#include <esp_timer.h>
+
+MyMutex* MyMutex::s_first = nullptr;
+static portMUX_TYPE s_registryLock = portMUX_INITIALIZER_UNLOCKED;
+
 MyMutex::MyMutex(const String& name) : m_name(name)
 {
     m_semaphore = xSemaphoreCreateBinary();
     xSemaphoreGive(m_semaphore);
+
+    portENTER_CRITICAL(&s_registryLock);
+    this->m_next = s_first;
+    s_first = this;
+    portEXIT_CRITICAL(&s_registryLock);
+}
+
+MyMutex::~MyMutex()
+{
+    portENTER_CRITICAL(&s_registryLock);
+    for (MyMutex** p = &s_first; *p; p = &(*p)->m_next) {
+        if (*p == this) {
+            *p = this->m_next;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_registryLock);
+    vSemaphoreDelete(m_semaphore);
 }
 
 bool MyMutex::lock(const char* who, int timeoutMillis /* = 0 */)
 {
+    // Fast path: not locked
+    if (xSemaphoreTake(m_semaphore, 0) == pdTRUE) {
+        this->locked(who, 0, false);
+        return true;
+    }
+
+    // Not with the cycle counter, the task may move to the other core while it waits
+    int64_t startMicros = esp_timer_get_time();
     bool result;
 
     // If no timeout is specified, we will time out at the
@@ -16,19 +47,21 @@ bool MyMutex::lock(const char* who, int timeoutMillis /* = 0 */)
         unsigned long startMillis = millis();
         result = lock(safetyTimeoutMillis);
         if (result) {
-            m_lockHolder = who;
-            m_lockBacktrace = new Esp32Backtrace(1);
+            this->locked(who, startMicros, true);
             return result;
         }
         Esp32Backtrace backtrace(1);
         TaskHandle_t task = xTaskGetCurrentTaskHandle();
         softwareAbort(
             SW_RESET_MUTEX_TIMEOUT,
-            "MyMutex(%s):\n    locked by: %s in task %s\n               %s\n    failed in: %s in task %s(%d)\n               %s\n    after %d ms",
+            "MyMutex(%s):\n    locked by: %s\n               %s\n    failed in: %s in task %s(%d)\n               %s\n    after %d ms",
             m_name.c_str(),
-            m_lockHolder.c_str(),
-            backtrace.getTaskName().c_str(),
+            m_lockHolder ? m_lockHolder : "?",
+#ifdef MUTEX_DEBUG
             m_lockBacktrace ? m_lockBacktrace->toString().c_str() : "NO BACKTRACE???",
+#else
+            "(backtrace only with MUTEX_DEBUG)",
+#endif
             who,
             pcTaskGetName(task),
             uxTaskPriorityGet(task),
@@ -40,18 +73,45 @@ bool MyMutex::lock(const char* who, int timeoutMillis /* = 0 */)
     // Otherwise, we will assume this is what the calling
     // code wanted and that it will handle the timeout
     result = lock(timeoutMillis);
-    if (result) {
-        m_lockHolder = who;
-        m_lockBacktrace = new Esp32Backtrace(1);
-    }
+    if (result) this->locked(who, startMicros, true);
     return result;
 }
 
+bool MyMutex::tryLock(const char* who)
+{
+    if (xSemaphoreTake(m_semaphore, 0) != pdTRUE) return false;
+    this->locked(who, 0, false);
+    return true;
+}
+
+// Record the new holder; the statistics are protected by the mutex itself
+void MyMutex::locked(const char* who, int64_t startMicros, bool contended)
+{
+    m_lockHolder = who;
+    m_lockCycles = ESP.getCycleCount();
+    m_lockCore = xPortGetCoreID();
+#ifdef MUTEX_DEBUG
+    m_lockBacktrace = new Esp32Backtrace(2);
+#endif
+
+    m_stats.acquisitions++;
+    if (contended) {
+        m_stats.contended++;
+        m_stats.waitTime.observe((uint32_t)(esp_timer_get_time() - startMicros));
+    }
+}
+
 void MyMutex::unlock()
 {
-    m_lockHolder = "";
+    if (xPortGetCoreID() == m_lockCore) {
+        uint32_t holdCycles = ESP.getCycleCount() - m_lockCycles;
+        if (holdCycles > m_stats.maxHoldCycles) m_stats.maxHoldCycles = holdCycles;
+    }
+    m_lockHolder = nullptr;
+#ifdef MUTEX_DEBUG
     delete m_lockBacktrace;
     m_lockBacktrace = 0;
+#endif
     xSemaphoreGive(m_semaphore);
 }
 
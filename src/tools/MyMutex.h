@@ -3,6 +3,7 @@
 
 #include <Arduino.h>
 #include "EspTools.h"
+#include "Metrics.h"
 
 // #define MUTEX_DEBUG
 // #define MUTEX_DEFAULT_TIMEOUT  pdMS_TO_TICKS(10000)
@@ -10,22 +11,57 @@
 #define MUTEX_DEFAULT_TIMEOUT portMAX_DELAY
 #endif
 
+// Mutex that records who holds it, and aborts with the details if a lock without a timeout
+// waits for more than safetyTimeoutMillis.
+//
+// Locking only stores the static "who" string and a cycle count; waits are timed with
+// esp_timer, which unlike the cycle counters is the same on both cores. The backtrace of
+// the holder is only captured with MUTEX_DEBUG; without it the abort shows the backtrace
+// of the waiting task only. Every mutex counts acquisitions and contention and keeps a
+// histogram of the wait times for /metrics.
 class MyMutex {
+  public:
+    struct Stats {
+        uint32_t acquisitions = 0;
+        uint32_t contended = 0;         // Had to wait
+        uint32_t maxHoldCycles = 0;     // Converted for /metrics, not on every unlock
+        MetricsHistogram waitTime;      // Contended acquisitions only
+    };
+
   private:
     SemaphoreHandle_t m_semaphore;
-    String m_lockHolder;
+    const char* m_lockHolder = nullptr;
+    uint32_t m_lockCycles = 0;          // Cycle count when locked
+    int m_lockCore = 0;                 // The cycle counters of the two cores are not in sync
+#ifdef MUTEX_DEBUG
     Esp32Backtrace *m_lockBacktrace = 0;
+#endif
     String m_name;
+    Stats m_stats;
+
+    // All mutexes, for the metrics
+    static MyMutex* s_first;
+    MyMutex* m_next = nullptr;
 
     static const int safetyTimeoutMillis = 10000;
 
   public:
     MyMutex(const String& name);
+    MyMutex(const MyMutex&) = delete;
+    MyMutex& operator=(const MyMutex&) = delete;
+    ~MyMutex();
     bool lock(const char* who, int timeoutMillis = 0);
+    bool tryLock(const char* who);      // Without waiting, false if it is locked
     void unlock();
 
+    const String& getName() const { return this->m_name; }
+    const Stats& getStats() const { return this->m_stats; }
+    static MyMutex* first() { return s_first; }
+    MyMutex* next() const { return this->m_next; }
+
   private:
     bool lock(int timeoutMillis = 0);
+    void locked(const char* who, int64_t startMicros, bool contended);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -37,20 +37,27 @@ time_t MyRtcTime::getUnixTime() const
 String MyRtcTime::getTimestampText() const
 {
     char resultBuffer[50];
-    struct tm* currentTime = gmtime(&this->m_unixTime);
+    this->getTimestampText(resultBuffer, sizeof(resultBuffer));
+    return String(resultBuffer);
+}
+
+void MyRtcTime::getTimestampText(char* buffer, size_t size) const
+{
+    struct tm currentTime;
+    gmtime_r(&this->m_unixTime, &currentTime);
 
     // Format to YYYY-MM-DD HH:MM:SS
-    sprintf(
-        resultBuffer,
+    snprintf(
+        buffer,
+        size,
         "%04d-%02d-%02d %02d:%02d:%02d",
-        currentTime->tm_year + 1900,
-        currentTime->tm_mon + 1,
-        currentTime->tm_mday,
-        currentTime->tm_hour,
-        currentTime->tm_min,
-        currentTime->tm_sec
+        currentTime.tm_year + 1900,
+        currentTime.tm_mon + 1,
+        currentTime.tm_mday,
+        currentTime.tm_hour,
+        currentTime.tm_min,
+        currentTime.tm_sec
     );
-    return String(resultBuffer);
 }
 
 String MyRtcTime::getDateText() const
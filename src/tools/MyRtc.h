@@ -10,6 +10,7 @@ class MyRtcTime {
   public:
     MyRtcTime(time_t unixTime);
     String getTimestampText(void) const;
+    void getTimestampText(char* buffer, size_t size) const;   // YYYY-MM-DD HH:MM:SS, needs 20 bytes
     String getDateText(void) const;
     time_t getUnixTime(void) const;
     bool isValid();
@@ -2,6 +2,8 @@
 
 #include <ESPmDNS.h>
 
+#include "ManifoldTelemetry.h"
+#include "MdnsDiscovery.h"
 #include "MyLog.h"
 
 // Include the Network Time Protocol
@@ -56,6 +58,8 @@ void CMyWiFi::setHostname(const String& hostname)
             m_hostname = "";
             return;
         }
+        MdnsDiscovery.readvertise();
+        ManifoldTelemetry.listen();     // Join the multicast group again on the restarted network
         if (hostname != m_hostname) {
             MyLog.print("Hostname set to ");
             MyLog.print(hostname);
@@ -1,71 +1,281 @@
 #ifndef __PID_CONTROLLER_H
 #define __PID_CONTROLLER_H
 
-#include "MyConfig.h"
+#include <Arduino.h>
 
+#include "FixedPoint.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// PID controller for any number type T (double, float or a FixedPoint)
+//
+// The gains are turned into the coefficients used in every step when the controller is
+// configured. The integral term is accumulated directly (rather than the error) and
+// clamped to the output range, so the anti-windup limit needs no division.
+//
+// The Policy decides the time between two steps:
+//  - PidVariableStep measures it with millis(), for the control loop which is not exactly
+//    periodic
+//  - PidFixedStep uses a configured step, which is then also included in the coefficients;
+//    for simulations, where many controllers run many steps as fast as possible
+//
+// An input at or below -50 means there is no measurement (NeohubZoneData::NO_TEMPERATURE,
+// COneWireManager::SENSOR_NOT_FOUND); the controller then keeps its output.
+//
+// An optional feedforward (e.g. from a model of the plant) is added to the output, so the
+// PID terms only trim around it. The integral term is then clamped to the output range less
+// the feedforward.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// Time between steps from millis()
+class PidVariableStep {
+  private:
+    unsigned long m_previousMillis = 0;
+
+  public:
+    static const bool FIXED = false;
+
+    void start() { this->m_previousMillis = millis(); }
+
+    // Seconds since the previous step; false if no time has passed
+    template <typename T>
+    bool advance(T& dt)
+    {
+        unsigned long now = millis();
+        if (now == this->m_previousMillis) return false;
+        dt = T((double)(now - this->m_previousMillis) / 1000.0);
+        this->m_previousMillis = now;
+        return true;
+    }
+
+    void setStepSeconds(double) {}     // Measured instead
+    double getStepSeconds() const { return 0; }
+};
+
+// The same time for every step
+class PidFixedStep {
+  private:
+    double m_stepSeconds = 1;
+
+  public:
+    static const bool FIXED = true;
+
+    void start() {}
+
+    // Not used by the controller, which has the step in its coefficients
+    template <typename T>
+    bool advance(T& dt)
+    {
+        dt = T(this->m_stepSeconds);
+        return true;
+    }
+
+    void setStepSeconds(double stepSeconds) { this->m_stepSeconds = stepSeconds; }
+    double getStepSeconds() const { return this->m_stepSeconds; }
+};
+
+template <typename T>
 struct PidControllerConfig {
-  double proportionalGain;      // Control constants used directly in control algorithm
+  double proportionalGain;      // As configured
   double integralGain;
   double derivativeGain;
 
   double integralTimeSeconds;   // Alternative way to express integral gain
   double derivativeTimeSeconds; // Alternative way to express derivative gain
 
-  double minOutput;
-  double maxOutput;
+  T minOutput;
+  T maxOutput;
 
+  // Used in every step, calculated by configure()
+  T kp;
+  T ki;
+  T kd;
+  T kiStep;                     // ki * step, for a fixed step
+  T kdPerStep;                  // kd / step, for a fixed step
 };
 
+template <typename T>
 struct PidControllerState {
-  bool first;                   // In the first iteration, supporess D calculation
+  bool first;                   // In the first iteration, only remember the input
 
-  unsigned long previousTime;   // The time (millis) of the last calculation
-                                // used to scale the calculation of 
-                                // integral and derivative terms if there is jitter
-
-  double previousInput;         // The input observerd in the last iteration
+  T previousInput;              // The input observerd in the last iteration
                                 // used to calculate the derivative term
 
-  double error;                 // The current error used calculating tle last output
-  double cumulativeError;       // The cumulative error value (used for integral calculation)
+  T error;                      // The current error used calculating the last output
 
-  double proportionalTerm;
-  double integralTerm;
-  double derivativeTerm;
+  T proportionalTerm;
+  T integralTerm;               // Accumulated and clamped to the output range
+  T derivativeTerm;
 };
 
-class PidController {
+template <typename T, typename Policy = PidVariableStep>
+class PidControllerT {
   private:
-    PidControllerConfig m_config;
-    PidControllerState m_state;
-    double m_input;
-    double m_setpoint;
-    double m_output;
+    PidControllerConfig<T> m_config = {};
+    PidControllerState<T> m_state = {};
+    Policy m_policy;
+    T m_input = T(0);
+    T m_setpoint = T(0);
+    T m_output = T(0);
+    T m_feedforward = T(0);
 
   public:
-    void setOutputRange(double minOutput, double maxOutput) { m_config.minOutput = minOutput; m_config.maxOutput = maxOutput; this->setOutput(m_output); };
-    
-    void configureGains(double proportionalGain, double integralGain, double derivativeGain);
-    void configureSeconds(double proportionalGain, double integralTimeSeconds, double derivativeTimeSeconds);
-    void configureSeconds(double proportionalGain, double integralGain, double integralTimeSeconds, double derivativeGain, double derivativeTimeSeconds);
+    void setOutputRange(T minOutput, T maxOutput) { m_config.minOutput = minOutput; m_config.maxOutput = maxOutput; this->setOutput(m_output); };
+
+    void configureGains(double proportionalGain, double integralGain, double derivativeGain)
+    {
+        double integralTimeSeconds = (integralGain != 0) ? (proportionalGain / integralGain) : 0;
+        double derivativeTimeSeconds = (proportionalGain != 0) ? (derivativeGain / proportionalGain) : 0;
+        this->configure(proportionalGain, integralGain, integralTimeSeconds, derivativeGain, derivativeTimeSeconds);
+    }
 
-    void resetState();                                  // Start for the beginning with no accumulater error (yet),
-                                                        // output remains unchanged from the current position, but will not
-                                                        // be updated until the second-to-next cycle
+    void configureSeconds(double proportionalGain, double integralTimeSeconds, double derivativeTimeSeconds)
+    {
+        double integralGain = (integralTimeSeconds != 0) ? (proportionalGain / integralTimeSeconds) : 0;
+        double derivativeGain = proportionalGain * derivativeTimeSeconds;
+        this->configure(proportionalGain, integralGain, integralTimeSeconds, derivativeGain, derivativeTimeSeconds);
+    }
 
-    void setInput(double input);                        // Get/set the current input variable
-    double getInput() { return this->m_input; };
+    // A gain that is not 0 takes precedence over the corresponding time
+    void configureSeconds(double proportionalGain, double integralGain, double integralTimeSeconds, double derivativeGain, double derivativeTimeSeconds)
+    {
+        if (integralGain != 0) integralTimeSeconds = (proportionalGain != 0) ? proportionalGain / integralGain : 0;
+        else if (integralTimeSeconds != 0) integralGain = proportionalGain / integralTimeSeconds;
+        if (derivativeGain != 0) derivativeTimeSeconds = (proportionalGain != 0) ? derivativeGain / proportionalGain : 0;
+        else derivativeGain = proportionalGain * derivativeTimeSeconds;
+        this->configure(proportionalGain, integralGain, integralTimeSeconds, derivativeGain, derivativeTimeSeconds);
+    }
 
-    void setSetpoint(double setpoint);                  // Get/set the setpoint
-    double getSetpoint() { return this->m_setpoint; };
+    // For PidFixedStep; recalculates the coefficients
+    void setStepSeconds(double stepSeconds)
+    {
+        this->m_policy.setStepSeconds(stepSeconds);
+        this->calculateCoefficients();
+    }
 
-    void setOutput(double position);
-    void calculateOutput();
-    double getOutput() { return this->m_output; };
+    void resetState()                                   // Start for the beginning with no accumulater error (yet),
+    {                                                   // output remains unchanged from the current position, but will not
+        this->m_state.first = true;                     // be updated until the second-to-next cycle
+        this->m_state.previousInput = T(0);
+        this->m_state.derivativeTerm = T(0);
 
-    double getProportionalTerm() { return this->m_state.proportionalTerm; };
-    double getIntegralTerm() { return this->m_state.integralTerm; };
-    double getIntegralGain() { return this->m_config.integralGain; };
+        // If we don't have a sensible existing input, we do nothing else
+        if (!hasInput(this->m_input)) {
+            this->m_state.error = T(0);
+            this->m_state.proportionalTerm = T(0);
+            this->m_state.integralTerm = T(0);
+            return;
+        }
+
+        // If we have a sensible input, we set the integral term so we achieve the current output
+        this->m_state.error = this->m_setpoint - this->m_input;
+        this->m_state.proportionalTerm = this->m_config.kp * this->m_state.error;
+        this->m_state.integralTerm = (this->m_config.integralGain != 0) ? this->m_output - this->m_state.proportionalTerm - this->m_feedforward : T(0);
+    }
+
+    void setInput(T input) { this->m_input = input; }  // Get/set the current input variable
+    T getInput() const { return this->m_input; };
+
+    void setSetpoint(T setpoint) { this->m_setpoint = setpoint; }   // Get/set the setpoint
+    T getSetpoint() const { return this->m_setpoint; };
+
+    // Takes effect in the next calculateOutput(); setOutput() afterwards avoids a bump
+    void setFeedforward(T feedforward) { this->m_feedforward = feedforward; }
+    T getFeedforward() const { return this->m_feedforward; };
+
+    void setOutput(T newOutput)
+    {
+        this->m_output = clamp(newOutput, this->m_config.minOutput, this->m_config.maxOutput);
+        this->resetState();
+    }
+
+    void calculateOutput()
+    {
+        // if we have no measurement, we skip this iteration
+        if (!hasInput(this->m_input)) return;
+
+        // if this is the first time round, we only remember the time and input and do nothing
+        if (this->m_state.first) {
+            this->m_state.first = false;
+            this->m_policy.start();
+            this->m_state.previousInput = this->m_input;
+            return;
+        }
+
+        T kiStep = this->m_config.kiStep;
+        T kdPerStep = this->m_config.kdPerStep;
+        if (!Policy::FIXED) {
+            T dt;
+            if (!this->m_policy.advance(dt)) return;
+            kiStep = this->m_config.ki * dt;
+            if (this->m_config.kd != T(0)) kdPerStep = this->m_config.kd / dt;
+        }
+
+        this->m_state.error = this->m_setpoint - this->m_input;
+        this->m_state.proportionalTerm = this->m_config.kp * this->m_state.error;
+        this->m_state.integralTerm = clamp(
+            this->m_state.integralTerm + kiStep * this->m_state.error,
+            this->m_config.minOutput - this->m_feedforward, this->m_config.maxOutput - this->m_feedforward
+        );
+        // On the measurement, so a change of the setpoint does not kick the output
+        this->m_state.derivativeTerm = (this->m_config.kd != T(0)) ? -(kdPerStep * (this->m_input - this->m_state.previousInput)) : T(0);
+
+        this->m_output = clamp(
+            this->m_feedforward + this->m_state.proportionalTerm + this->m_state.integralTerm + this->m_state.derivativeTerm,
+            this->m_config.minOutput, this->m_config.maxOutput
+        );
+        this->m_state.previousInput = this->m_input;
+    }
+
+    T getOutput() const { return this->m_output; };
+
+    T getProportionalTerm() const { return this->m_state.proportionalTerm; };
+    T getIntegralTerm() const { return this->m_state.integralTerm; };
+    T getDerivativeTerm() const { return this->m_state.derivativeTerm; };
+    double getProportionalGain() const { return this->m_config.proportionalGain; };
+    double getIntegralGain() const { return this->m_config.integralGain; };
+    double getDerivativeGain() const { return this->m_config.derivativeGain; };
+
+    // One step for count controllers, with inputs[i] for controllers[i]; e.g. for trying
+    // many sets of gains on a simulated plant
+    static void step(PidControllerT* controllers, const T* inputs, size_t count)
+    {
+        for (size_t i = 0; i < count; i++) {
+            controllers[i].m_input = inputs[i];
+            controllers[i].calculateOutput();
+        }
+    }
+
+  private:
+    void configure(double proportionalGain, double integralGain, double integralTimeSeconds, double derivativeGain, double derivativeTimeSeconds)
+    {
+        this->m_config.proportionalGain = proportionalGain;
+        this->m_config.integralGain = integralGain;
+        this->m_config.derivativeGain = derivativeGain;
+        this->m_config.integralTimeSeconds = integralTimeSeconds;
+        this->m_config.derivativeTimeSeconds = derivativeTimeSeconds;
+        this->calculateCoefficients();
+        this->resetState();
+    }
+
+    void calculateCoefficients()
+    {
+        double step = this->m_policy.getStepSeconds();
+        this->m_config.kp = T(this->m_config.proportionalGain);
+        this->m_config.ki = T(this->m_config.integralGain);
+        this->m_config.kd = T(this->m_config.derivativeGain);
+        this->m_config.kiStep = T(this->m_config.integralGain * step);
+        this->m_config.kdPerStep = T(step > 0 ? this->m_config.derivativeGain / step : 0.0);
+    }
+
+    static bool hasInput(T input) { return input > T(-50); }
+    static T clamp(T value, T min, T max) { return value < min ? min : (value > max ? max : value); }
 };
 
-#endif
\ No newline at end of file
+// The controllers of the valve manager
+typedef PidControllerT<double, PidVariableStep> PidController;
+
+extern template class PidControllerT<double, PidVariableStep>;
+
+#endif
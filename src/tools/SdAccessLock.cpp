@@ -0,0 +1,131 @@
+#include "SdAccessLock.h"
+
+#include <esp_timer.h>
+
+#include "EspTools.h"
+
+SdAccessLock::SdAccessLock(const char* name) : m_name(name)
+{
+    for (Waiter& w : this->m_waiters) {
+        w.semaphore = xSemaphoreCreateBinary();
+        w.inUse = false;
+    }
+}
+
+bool SdAccessLock::lock(const char* who, SdAccessPriority priority /* = SD_PRIORITY_INTERACTIVE */)
+{
+    int64_t start = esp_timer_get_time();
+    Waiter* waiter = nullptr;
+
+    // Take the card if it is free and nobody is queued, otherwise join the queue. If all
+    // waiter slots are taken (not expected) try again a little later.
+    for (;;) {
+        portENTER_CRITICAL(&this->m_spinlock);
+        if (!this->m_held && this->m_queueDepth == 0) {
+            this->m_held = true;
+            this->m_heldSinceMicros = start;
+            break;
+        }
+        for (Waiter& w : this->m_waiters) {
+            if (!w.inUse) {
+                waiter = &w;
+                break;
+            }
+        }
+        if (waiter) {
+            waiter->inUse = true;
+            waiter->granted = false;
+            waiter->priority = priority;
+            waiter->sequence = this->m_sequence++;
+            waiter->enqueuedMicros = start;
+            this->m_queueDepth++;
+            if ((uint32_t)this->m_queueDepth > this->stats.maxQueueDepth) this->stats.maxQueueDepth = this->m_queueDepth;
+            break;
+        }
+        portEXIT_CRITICAL(&this->m_spinlock);
+        vTaskDelay(1);
+    }
+    portEXIT_CRITICAL(&this->m_spinlock);
+
+    // Wait until unlock() hands the card over
+    if (waiter) {
+        while (xSemaphoreTake(waiter->semaphore, pdMS_TO_TICKS(1000)) != pdTRUE) {
+            this->abortIfStuck(who, start);
+        }
+        portENTER_CRITICAL(&this->m_spinlock);
+        waiter->inUse = false;
+        portEXIT_CRITICAL(&this->m_spinlock);
+    }
+
+    // We hold the card, so the statistics are ours to update
+    this->m_holder = who;
+    this->m_holderTask = xTaskGetCurrentTaskHandle();
+    this->stats.waitTime[priority].observe((uint32_t)(esp_timer_get_time() - start));
+    return true;
+}
+
+void SdAccessLock::unlock()
+{
+    int64_t now = esp_timer_get_time();
+    this->stats.holdTime.observe((uint32_t)(now - this->m_heldSinceMicros));
+    this->m_holder = nullptr;
+    this->m_holderTask = nullptr;
+
+    // Hand over to the next waiter: a starving one, else by priority and then by age
+    portENTER_CRITICAL(&this->m_spinlock);
+    Waiter* next = nullptr;
+    for (Waiter& w : this->m_waiters) {
+        if (!w.inUse || w.granted) continue;
+        if (!next) {
+            next = &w;
+            continue;
+        }
+        bool starving = now - w.enqueuedMicros > (int64_t)STARVATION_MS * 1000;
+        bool nextStarving = now - next->enqueuedMicros > (int64_t)STARVATION_MS * 1000;
+        if (starving != nextStarving) {
+            if (starving) next = &w;
+        }
+        else if (!starving && w.priority != next->priority) {
+            if (w.priority < next->priority) next = &w;
+        }
+        else if ((int32_t)(w.sequence - next->sequence) < 0) {
+            next = &w;
+        }
+    }
+    if (next) {
+        next->granted = true;
+        this->m_queueDepth--;
+        this->m_heldSinceMicros = now;
+    }
+    else {
+        this->m_held = false;
+    }
+    portEXIT_CRITICAL(&this->m_spinlock);
+
+    if (next) xSemaphoreGive(next->semaphore);
+}
+
+// Restart if the card has been held by the same holder for too long
+void SdAccessLock::abortIfStuck(const char* who, int64_t startMicros)
+{
+    portENTER_CRITICAL(&this->m_spinlock);
+    int64_t heldMillis = (esp_timer_get_time() - this->m_heldSinceMicros) / 1000;
+    const char* holder = this->m_holder;
+    TaskHandle_t holderTask = this->m_holderTask;
+    portEXIT_CRITICAL(&this->m_spinlock);
+    if (heldMillis < SAFETY_TIMEOUT_MS) return;
+
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    softwareAbort(
+        SW_RESET_MUTEX_TIMEOUT,
+        "SdAccessLock(%s):\n    held by: %s in task %s for %d ms\n    waiting: %s in task %s(%d) for %d ms",
+        this->m_name,
+        holder ? holder : "(being handed over)",
+        holderTask ? pcTaskGetName(holderTask) : "?",
+        (int)heldMillis,
+        who,
+        pcTaskGetName(task),
+        uxTaskPriorityGet(task),
+        (int)((esp_timer_get_time() - startMicros) / 1000)
+    );
+}
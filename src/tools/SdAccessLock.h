@@ -0,0 +1,77 @@
+#ifndef __SD_ACCESS_LOCK_H
+#define __SD_ACCESS_LOCK_H
+
+#include <Arduino.h>
+
+#include "Metrics.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Access to the SD card, shared by all tasks
+//
+// Like a mutex, but tasks waiting for the card queue up by priority: when the card is
+// released it is handed straight to the waiting request with the highest priority (the
+// oldest of those if there are several), so a sensor log write waits for at most one
+// block of a web download, however many reads are queued. Users lock the card for
+// single reads and writes, so reads from different requests interleave block by block.
+// Requests that have waited for STARVATION_MS are served next regardless of priority.
+//
+// There is no timeout for waiting in the queue. Only if a single holder keeps the card
+// for more than SAFETY_TIMEOUT_MS is the device restarted (SW_RESET_MUTEX_TIMEOUT), as
+// that means a deadlock or a hung card rather than a busy one.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+enum SdAccessPriority {
+    SD_PRIORITY_CONTROL,        // Sensor logs written from the control loop
+    SD_PRIORITY_LOG,            // Text logs, configuration
+    SD_PRIORITY_INTERACTIVE,    // Web requests
+    SD_PRIORITY_BACKGROUND,     // Log maintenance
+    SD_PRIORITY_COUNT
+};
+
+class SdAccessLock {
+  public:
+    static const int MAX_WAITERS = 16;
+    static const uint32_t STARVATION_MS = 2000;
+    static const uint32_t SAFETY_TIMEOUT_MS = 10000;
+
+    struct Stats {
+        MetricsHistogram waitTime[SD_PRIORITY_COUNT];
+        MetricsHistogram holdTime;
+        uint32_t maxQueueDepth = 0;
+    } stats;
+
+  private:
+    struct Waiter {
+        SemaphoreHandle_t semaphore;
+        bool inUse;
+        bool granted;
+        SdAccessPriority priority;
+        uint32_t sequence;
+        int64_t enqueuedMicros;
+    };
+
+    const char* m_name;
+    portMUX_TYPE m_spinlock = portMUX_INITIALIZER_UNLOCKED;
+    Waiter m_waiters[MAX_WAITERS];
+    int m_queueDepth = 0;
+    uint32_t m_sequence = 0;
+
+    bool m_held = false;
+    const char* m_holder = nullptr;
+    TaskHandle_t m_holderTask = nullptr;
+    int64_t m_heldSinceMicros = 0;
+
+  public:
+    SdAccessLock(const char* name);
+    bool lock(const char* who, SdAccessPriority priority = SD_PRIORITY_INTERACTIVE);
+    void unlock();
+
+    int getQueueDepth() const { return this->m_queueDepth; }
+
+  private:
+    void abortIfStuck(const char* who, int64_t startMicros);
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef __SEQ_LOCK_H
+#define __SEQ_LOCK_H
+
+#include <Arduino.h>
+
+#include <atomic>
+#include <string.h>
+#include <type_traits>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// A value written by one task and read by any number of others without a lock
+//
+// The writer makes the sequence number odd, copies the value and makes it even again.
+// Readers copy the value and check that the sequence number was even and unchanged
+// around the copy, otherwise they copy again. Readers never block the writer and always
+// get a value from one write, never a mix of two.
+//
+// Only one task may write. T must be trivially copyable. Not for use in interrupts.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+class SeqLock {
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock needs a trivially copyable type");
+
+  private:
+    std::atomic<uint32_t> m_sequence{0};
+    T m_value;
+
+    // After this many attempts a reader waits a tick, in case it has a higher priority
+    // than a writer that was interrupted on the same core
+    static const int SPIN_ATTEMPTS = 100;
+
+  public:
+    SeqLock() : m_value() {}
+
+    void write(const T& value)
+    {
+        uint32_t sequence = this->m_sequence.load(std::memory_order_relaxed);
+        this->m_sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy((void*)&this->m_value, &value, sizeof(T));
+        this->m_sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    T read() const
+    {
+        T result;
+        for (int attempt = 1;; attempt++) {
+            uint32_t before = this->m_sequence.load(std::memory_order_acquire);
+            if (!(before & 1)) {
+                memcpy(&result, (const void*)&this->m_value, sizeof(T));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (this->m_sequence.load(std::memory_order_relaxed) == before) return result;
+            }
+            if (attempt % SPIN_ATTEMPTS == 0) vTaskDelay(1);
+        }
+    }
+
+    // Number of writes so far
+    uint32_t getVersion() const { return this->m_sequence.load(std::memory_order_acquire) / 2; }
+};
+
+#endif
@@ -12,10 +12,28 @@
 #include "scripts_string.h"
 #include "NeohubManager.h"
 #include "EspTools.h"
+#include "WebWorker.h"
+#include "Metrics.h"
+
+#include <list>
 
 CMyWebServer MyWebServer;
 
-CMyWebServer::CMyWebServer() : m_server(80) {}
+CMyWebServer::CMyWebServer() : m_server(80), m_demandSocket("/demand/ws") {}
+
+static const char* methodName(WebRequestMethodComposite m)
+{
+    switch (m) {
+        case HTTP_GET:     return "GET";
+        case HTTP_POST:    return "POST";
+        case HTTP_PUT:     return "PUT";
+        case HTTP_DELETE:  return "DELETE";
+        case HTTP_OPTIONS: return "OPTIONS";
+        case HTTP_PATCH:   return "PATCH";
+        case HTTP_HEAD:    return "HEAD";
+        default:           return "ANY";
+    }
+}
 
 String methodToString(WebRequestMethodComposite m) 
 {
@@ -31,37 +49,86 @@ String methodToString(WebRequestMethodComposite m)
     }
 }
 
-void CMyWebServer::setup(SdFs *sd, MyMutex *sdMutex)
+void CMyWebServer::setup(SdFs *sd, SdAccessLock *sdMutex)
 {
     this->m_sd = sd;
     this->m_sdMutex = sdMutex;
-    this->m_server.on(AsyncURIMatcher::exact("/"),              HTTP_GET, [this](AsyncWebServerRequest *r) { this->respondWithMonitorPage(r); });
-    this->m_server.on(AsyncURIMatcher::exact("/files"),         HTTP_GET, [this](AsyncWebServerRequest *r) { this->respondWithDirectory(r, "/"); });
-    this->m_server.on(AsyncURIMatcher::exact("/delete-file"),   HTTP_POST,[this](AsyncWebServerRequest *r) { this->processDeleteFileRequest(r); });
-    this->m_server.on(AsyncURIMatcher::dir  ("/files"),         HTTP_GET, [this](AsyncWebServerRequest *r) { this->processFileRequest(r); });
-    this->m_server.on(AsyncURIMatcher::exact("/coredump.elf"),  HTTP_GET, [this](AsyncWebServerRequest *r) { this->processCoreDumpRequest(r); });
-    this->m_server.on(AsyncURIMatcher::exact("/coredump.bin"),  HTTP_GET, [this](AsyncWebServerRequest *r) { this->processCoreDumpRequest(r); });
-    this->m_server.on(AsyncURIMatcher::exact("/crashlog.txt"),  HTTP_GET, [this](AsyncWebServerRequest *r) { this->processCrashLogRequest(r); });
-    this->m_server.on(AsyncURIMatcher::exact("/monitor"),       HTTP_GET, [this](AsyncWebServerRequest *r) { this->respondWithMonitorPage(r); });
-    this->m_server.on(AsyncURIMatcher::exact("/config-system"), HTTP_GET, [this](AsyncWebServerRequest *r) { this->respondWithSystemConfigPage(r); });
-    this->m_server.on(AsyncURIMatcher::exact("/config-system"), HTTP_POST,[this](AsyncWebServerRequest *r) { this->processSystemConfigPagePost(r); });
-    this->m_server.on(AsyncURIMatcher::exact("/config"),        HTTP_GET, [this](AsyncWebServerRequest *r) { this->respondWithHeatingConfigPage(r); });
-    this->m_server.on(AsyncURIMatcher::exact("/config"),        HTTP_POST,[this](AsyncWebServerRequest *r) { this->processHeatingConfigPagePost(r); });
-    this->m_server.on(AsyncURIMatcher::exact("/tasks"),         HTTP_GET, [this](AsyncWebServerRequest *r) { this->respondWithTaskList(r); });
-    this->m_server.on(AsyncURIMatcher::exact("/panic"),         HTTP_GET, [this](AsyncWebServerRequest *r) { softwareAbort(SW_RESET_PANIC_TEST); /* Force a crash to test crash logging */ });
-    this->m_server.on(AsyncURIMatcher::exact("/reset"),         HTTP_GET, [this](AsyncWebServerRequest *r) { softwareReset(SW_RESET_USER_RESET); });
-    this->m_server.on(AsyncURIMatcher::exact("/neohub"),        HTTP_POST,[this](AsyncWebServerRequest *r) { this->respondFromNeohub(r); }, nullptr, CMyWebServer::assemblePostBody);
-    this->m_server.on(AsyncURIMatcher::exact("/data/status"),   HTTP_GET, [this](AsyncWebServerRequest *r) { this->respondWithStatusData(r); });
-    this->m_server.on(AsyncURIMatcher::exact("/command"),       HTTP_POST,[this](AsyncWebServerRequest *r) { this->executeCommand(r); }, nullptr, CMyWebServer::assemblePostBody);
-    this->m_server.on(AsyncURIMatcher::exact("/scripts.js"),    HTTP_GET, [this](AsyncWebServerRequest *r) { this->respondWithString(r, "text/javascript", SCRIPTS_JS_STRING); });
-    this->m_server.on(AsyncURIMatcher::exact("/styles.css"),    HTTP_GET, [this](AsyncWebServerRequest *r) { this->respondWithString(r, "text/css", STYLES_CSS_STRING); });
-    this->m_server.on(AsyncURIMatcher::dir  ("/"),              HTTP_GET, [this](AsyncWebServerRequest *r) { this->respondWithError(r, 404, "File not found"); });
-    this->m_server.on(AsyncURIMatcher::exact("/command"),       HTTP_OPTIONS, [this](AsyncWebServerRequest *r) { this->respondToOptionsRequest(r); });
-    this->m_server.on(AsyncURIMatcher::exact("/data/status"),   HTTP_OPTIONS, [this](AsyncWebServerRequest *r) { this->respondToOptionsRequest(r); });
-    this->m_server.onNotFound([this](AsyncWebServerRequest *r) { this->respondWithError(r, 400, "Unsupported Method: " + methodToString(r->method()) + " on URL " + r->url()); });
+    WebWorker.setup();
+    this->on   (HTTP_GET,     "/",              [this](AsyncWebServerRequest *r) { this->respondWithMonitorPage(r); });
+    this->on   (HTTP_GET,     "/files",         [this](AsyncWebServerRequest *r) { this->respondWithDirectory(r, "/"); });
+    this->on   (HTTP_POST,    "/delete-file",   [this](AsyncWebServerRequest *r) { this->processDeleteFileRequest(r); });
+    this->onDir(HTTP_GET,     "/files",         [this](AsyncWebServerRequest *r) { this->processFileRequest(r); });
+    this->on   (HTTP_GET,     "/coredump.elf",  [this](AsyncWebServerRequest *r) { this->processCoreDumpRequest(r); });
+    this->on   (HTTP_GET,     "/coredump.bin",  [this](AsyncWebServerRequest *r) { this->processCoreDumpRequest(r); });
+    this->on   (HTTP_GET,     "/crashlog.txt",  [this](AsyncWebServerRequest *r) { this->processCrashLogRequest(r); });
+    this->on   (HTTP_GET,     "/monitor",       [this](AsyncWebServerRequest *r) { this->respondWithMonitorPage(r); });
+    this->on   (HTTP_GET,     "/config-system", [this](AsyncWebServerRequest *r) { this->respondWithSystemConfigPage(r); });
+    this->on   (HTTP_POST,    "/config-system", [this](AsyncWebServerRequest *r) { this->processSystemConfigPagePost(r); });
+    this->on   (HTTP_GET,     "/config",        [this](AsyncWebServerRequest *r) { this->respondWithHeatingConfigPage(r); });
+    this->on   (HTTP_POST,    "/config",        [this](AsyncWebServerRequest *r) { this->processHeatingConfigPagePost(r); });
+    this->on   (HTTP_GET,     "/tasks",         [this](AsyncWebServerRequest *r) { this->respondWithTaskList(r); });
+    this->on   (HTTP_GET,     "/metrics",       [this](AsyncWebServerRequest *r) { this->respondWithMetrics(r); });
+    this->on   (HTTP_GET,     "/memory",        [this](AsyncWebServerRequest *r) { this->respondWithMemoryPage(r); });
+    this->on   (HTTP_GET,     "/memory/trace.bin", [this](AsyncWebServerRequest *r) { this->respondWithMemoryTrace(r); });
+    this->on   (HTTP_GET,     "/panic",         [this](AsyncWebServerRequest *r) { softwareAbort(SW_RESET_PANIC_TEST); /* Force a crash to test crash logging */ });
+    this->on   (HTTP_GET,     "/reset",         [this](AsyncWebServerRequest *r) { softwareReset(SW_RESET_USER_RESET); });
+    this->on   (HTTP_POST,    "/neohub",        [this](AsyncWebServerRequest *r) { this->respondFromNeohub(r); }, CMyWebServer::assemblePostBody);
+    this->on   (HTTP_GET,     "/data/status",   [this](AsyncWebServerRequest *r) { this->respondWithStatusData(r); });
+    this->on   (HTTP_GET,     "/data/history",  [this](AsyncWebServerRequest *r) { this->respondWithHistoryData(r); });
+    this->on   (HTTP_GET,     "/data/recent",   [this](AsyncWebServerRequest *r) { this->respondWithRecentData(r); });
+    this->on   (HTTP_POST,    "/command",       [this](AsyncWebServerRequest *r) { this->executeCommand(r); }, CMyWebServer::assemblePostBody);
+    this->on   (HTTP_POST,    "/demand",        [this](AsyncWebServerRequest *r) { this->processDemandPost(r); }, CMyWebServer::assemblePostBody);
+    this->on   (HTTP_GET,     "/scripts.js",    [this](AsyncWebServerRequest *r) { this->respondWithString(r, "text/javascript", SCRIPTS_JS_STRING); });
+    this->on   (HTTP_GET,     "/styles.css",    [this](AsyncWebServerRequest *r) { this->respondWithString(r, "text/css", STYLES_CSS_STRING); });
+    this->m_demandSocket.onEvent([this](AsyncWebSocket* s, AsyncWebSocketClient* c, AwsEventType t, void* a, uint8_t* d, size_t l) { this->onDemandSocketEvent(s, c, t, a, d, l); });
+    this->m_server.addHandler(&this->m_demandSocket);   // Before the catch-all below
+    this->onDir(HTTP_GET,     "/",              [this](AsyncWebServerRequest *r) { this->respondWithError(r, 404, "File not found"); });
+    this->on   (HTTP_OPTIONS, "/command",       [this](AsyncWebServerRequest *r) { this->respondToOptionsRequest(r); });
+    this->on   (HTTP_OPTIONS, "/data/status",   [this](AsyncWebServerRequest *r) { this->respondToOptionsRequest(r); });
+    this->on   (HTTP_OPTIONS, "/data/history",  [this](AsyncWebServerRequest *r) { this->respondToOptionsRequest(r); });
+    this->on   (HTTP_OPTIONS, "/data/recent",   [this](AsyncWebServerRequest *r) { this->respondToOptionsRequest(r); });
+    this->m_server.onNotFound(this->metered(HTTP_ANY, "(not found)", [this](AsyncWebServerRequest *r) { this->respondWithError(r, 400, "Unsupported Method: " + methodToString(r->method()) + " on URL " + r->url()); }));
     this->m_server.begin();
 }
 
+// Route registration. Every route gets its own set of metrics.
+void CMyWebServer::on(WebRequestMethodComposite method, const char* uri, ArRequestHandlerFunction handler, ArBodyHandlerFunction onBody /* = nullptr */)
+{
+    this->m_server.on(AsyncURIMatcher::exact(uri), method, this->metered(method, uri, handler), nullptr, onBody);
+}
+
+void CMyWebServer::onDir(WebRequestMethodComposite method, const char* uri, ArRequestHandlerFunction handler)
+{
+    static std::list<String> labels;    // route labels must live forever and never move
+    labels.push_back(String(uri) + (uri[strlen(uri) - 1] == '/' ? "*" : "/*"));
+    this->m_server.on(AsyncURIMatcher::dir(uri), method, this->metered(method, labels.back().c_str(), handler));
+}
+
+// The number of bytes written is protected in AsyncWebServerResponse
+struct ResponseBytesAccess : public AsyncWebServerResponse {
+    static size_t get(const AsyncWebServerResponse* response) { return response->*(&ResponseBytesAccess::_writtenLength); }
+};
+
+// Wrap a handler so that it records requests, status codes, bytes sent and timings.
+// The response is only complete when the client disconnects (which may be much later
+// for chunked and deferred responses), so most of the recording happens there.
+ArRequestHandlerFunction CMyWebServer::metered(WebRequestMethodComposite method, const char* route, ArRequestHandlerFunction handler)
+{
+    HttpRouteMetrics* metrics = Metrics.addRoute(methodName(method), route);
+    return [metrics, handler](AsyncWebServerRequest* request) {
+        uint32_t start = micros();
+        metrics->requests++;
+        request->onDisconnect([metrics, request, start]() {
+            AsyncWebServerResponse* response = request->getResponse();
+            metrics->recordStatus(response ? response->code() : 0);
+            if (response) metrics->bytesSent += ResponseBytesAccess::get(response);
+            metrics->duration.observe(micros() - start);
+        });
+        handler(request);
+        metrics->handlerTime.observe(micros() - start);
+    };
+}
+
 void CMyWebServer::respondWithError(AsyncWebServerRequest* request, int code, const String& messageText)
 {
     AsyncWebServerResponse* r = request->beginResponse(code, "text/plain", messageText);
@@ -100,30 +167,40 @@ void CMyWebServer::finishHttpHtmlResponse(AsyncResponseStream* response)
 
 void CMyWebServer::respondFromNeohub(AsyncWebServerRequest* r)
 {
-    const int timeoutMillis = 2000;
-    bool disconnected = false;
-    int responseCode = 200;
-    String responseString;
-
     String* body = (String*)r->_tempObject;
     if (!body) {
-        responseCode = 400;
-        responseString = "{ \"error\": \"Empty request\" }";
+        AsyncWebServerResponse* response = r->beginResponse(400, "application/json", "{ \"error\": \"Empty request\" }");
+        response->addHeader("Access-Control-Allow-Origin", "*");
+        response->addHeader("Access-Control-Allow-Methods", "GET, POST, OPTIONS");
+        response->addHeader("Access-Control-Allow-Headers", "Content-Type");
+        r->send(response);
+        return;
     }
-    else {
-        responseString = NeohubManager.neohubCommand(*body, timeoutMillis);
 
-        if (responseString == emptyString) {
-            responseCode = 400;
-            responseString = "{ \"error\": \"Unable to retrieve data from Neohub\" }";
+    // The Neohub can take up to two seconds to answer - do this in the web worker.
+    // The body belongs to the request, so the job gets its own copy.
+    String command = *body;
+    this->deferResponse(r, [command](WebJobResult& result) {
+        const int timeoutMillis = 2000;
+        result.body = NeohubManager.neohubCommand(command, timeoutMillis);
+        if (result.body == emptyString) {
+            result.code = 400;
+            result.body = "{ \"error\": \"Unable to retrieve data from Neohub\" }";
         }
-    }
+    });
+}
 
-    AsyncWebServerResponse* response = r->beginResponse(responseCode, "application/json", responseString);
-    response->addHeader("Access-Control-Allow-Origin", "*");
-    response->addHeader("Access-Control-Allow-Methods", "GET, POST, OPTIONS");
-    response->addHeader("Access-Control-Allow-Headers", "Content-Type");
-    r->send(response);
+// Hand a slow request to the web worker; if that is busy, tell the client to retry
+void CMyWebServer::deferResponse(AsyncWebServerRequest* request, WebJob job)
+{
+    if (!WebWorker.submit(request, job)) {
+        AsyncWebServerResponse* response = request->beginResponse(503, "application/json", "{ \"error\": \"Busy, try again later\" }");
+        response->addHeader("Access-Control-Allow-Origin", "*");
+        response->addHeader("Access-Control-Allow-Methods", "GET, POST, OPTIONS");
+        response->addHeader("Access-Control-Allow-Headers", "Content-Type");
+        response->addHeader("Retry-After", "1");
+        request->send(response);
+    }
 }
 
 void CMyWebServer::assemblePostBody(
@@ -6,12 +6,13 @@
 #include <SdFat.h>
 
 #include "../tools/HtmlGenerator.h"
-#include "MyMutex.h"
+#include "SdAccessLock.h"
 #include "MyWifi.h"
 #include "NeohubConnection.h"
 #include "OneWireManager.h"  // OneWire sensor reading and management
 #include "SensorMap.h"       // Sensor name mapping
 #include "ValveManager.h"
+#include "WebWorker.h"
 
 struct WebResponseContext {
     String fileName;
@@ -20,12 +21,16 @@ struct WebResponseContext {
 class CMyWebServer {
   private:
     AsyncWebServer m_server;
+    AsyncWebSocket m_demandSocket;      // Manifold data (see DemandData.cpp)
     SdFs* m_sd;
-    MyMutex* m_sdMutex;
+    SdAccessLock* m_sdMutex;
 
   public:
     CMyWebServer(void);
-    void setup(SdFs* sd, MyMutex* sdMutex);
+    void setup(SdFs* sd, SdAccessLock* sdMutex);
+
+    // Close WebSocket connections that are gone, or over the limit. Call regularly.
+    void cleanupClients() { this->m_demandSocket.cleanupClients(); };
 
   private:
     // Simple responses
@@ -36,6 +41,8 @@ class CMyWebServer {
     void processFileRequest(AsyncWebServerRequest* request);
     void respondWithDirectory(AsyncWebServerRequest* request, const String& path);
     void respondWithFileContents(AsyncWebServerRequest* request, const String& fileName);
+    void respondWithConvertedSensorLog(AsyncWebServerRequest* request, const String& binaryFileName);
+    void respondWithFlashFile(AsyncWebServerRequest* request, const String& fileName);
     size_t sendFileChunk(WebResponseContext* context, uint8_t* buffer, size_t maxLen, size_t index);
     void processDeleteFileRequest(AsyncWebServerRequest* request);
 
@@ -46,6 +53,16 @@ class CMyWebServer {
     // Heatmiser Neohub pass-through
     void respondFromNeohub(AsyncWebServerRequest* request);
 
+    // Manifold data for the heating controller
+    void processDemandPost(AsyncWebServerRequest* request);
+    void onDemandSocketEvent(
+        AsyncWebSocket* server, AsyncWebSocketClient* client,
+        AwsEventType type, void* arg, uint8_t* data, size_t len
+    );
+
+    // Slow requests are completed by the web worker task
+    void deferResponse(AsyncWebServerRequest* request, WebJob job);
+
     // HTML pages - main functions
     AsyncResponseStream* startHttpHtmlResponse(AsyncWebServerRequest* request);
     void finishHttpHtmlResponse(AsyncResponseStream* response);
@@ -63,11 +80,21 @@ class CMyWebServer {
 
     // json
     void respondWithStatusData(AsyncWebServerRequest* response);
+    void respondWithHistoryData(AsyncWebServerRequest* request);
+    void respondWithRecentData(AsyncWebServerRequest* request);
     void executeCommand(AsyncWebServerRequest* response);
     void respondToOptionsRequest(AsyncWebServerRequest* request);
 
-    // Other pages for debugging
+    // Other pages for debugging and monitoring
     void respondWithTaskList(AsyncWebServerRequest* request);
+    void respondWithMetrics(AsyncWebServerRequest* request);
+    void respondWithMemoryPage(AsyncWebServerRequest* request);
+    void respondWithMemoryTrace(AsyncWebServerRequest* request);
+
+    // Route registration with metrics
+    void on(WebRequestMethodComposite method, const char* uri, ArRequestHandlerFunction handler, ArBodyHandlerFunction onBody = nullptr);
+    void onDir(WebRequestMethodComposite method, const char* uri, ArRequestHandlerFunction handler);
+    ArRequestHandlerFunction metered(WebRequestMethodComposite method, const char* route, ArRequestHandlerFunction handler);
 
     // Helper function
     static void assemblePostBody(
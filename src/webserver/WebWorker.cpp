@@ -0,0 +1,65 @@
+#include "WebWorker.h"
+
+CWebWorker WebWorker;
+
+void CWebWorker::setup(int queueDepth /* = 4 */)
+{
+    if (m_task) return;
+    m_queue = xQueueCreate(queueDepth, sizeof(PendingJob*));
+
+    BaseType_t ok = xTaskCreate(
+        staticWorkerTask,
+        "WebWorker",
+        6144,
+        this,  // argument passed to task
+        1,
+        &m_task
+    );
+    if (ok != pdPASS) m_task = nullptr;
+}
+
+// Called in the async_tcp task only, so nobody else can fill the queue between
+// the check for space and sending
+bool CWebWorker::submit(AsyncWebServerRequest* request, WebJob job)
+{
+    if (!m_queue || !m_task || uxQueueSpacesAvailable(m_queue) == 0) return false;
+
+    PendingJob* pending = new PendingJob();
+    pending->job = job;
+    pending->request = request->pause();
+    if (xQueueSend(m_queue, &pending, 0) != pdPASS) {
+        // Cannot happen, see above - but don't leave the client hanging
+        delete pending;
+        request->send(503, "text/plain", "Busy");
+        return true;
+    }
+    return true;
+}
+
+void CWebWorker::staticWorkerTask(void* arg)
+{
+    static_cast<CWebWorker*>(arg)->workerTask();
+}
+
+void CWebWorker::workerTask()
+{
+    for (;;) {
+        PendingJob* pending;
+        if (xQueueReceive(m_queue, &pending, portMAX_DELAY) != pdTRUE) continue;
+
+        WebJobResult result;
+        pending->job(result);
+
+        // The request is gone if the client disconnected while we were busy
+        if (auto request = pending->request.lock()) {
+            AsyncWebServerResponse* response = request->beginResponse(result.code, result.contentType, result.body);
+            if (result.contentType == "application/json") {
+                response->addHeader("Access-Control-Allow-Origin", "*");
+                response->addHeader("Access-Control-Allow-Methods", "GET, POST, OPTIONS");
+                response->addHeader("Access-Control-Allow-Headers", "Content-Type");
+            }
+            request->send(response);
+        }
+        delete pending;
+    }
+}
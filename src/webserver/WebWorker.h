@@ -0,0 +1,54 @@
+#ifndef __WEB_WORKER_H
+#define __WEB_WORKER_H
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+
+#include <functional>
+
+////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Deferred web responses
+//
+// Request handlers run in the async_tcp task, and while one of them waits for the Neohub
+// or scans the OneWire bus, no other HTTP client gets an answer. Handlers for such
+// requests pause the request and hand the work to the web worker task instead. The worker
+// runs the job and sends the response it produced, unless the client has gone away
+// in the meantime.
+//
+////////////////////////////////////////////////////////////////////////////////////////////
+
+// What a job produces. JSON responses include the CORS headers the JSON API uses.
+struct WebJobResult {
+    int code = 200;
+    String contentType = "application/json";
+    String body;
+};
+
+typedef std::function<void(WebJobResult& result)> WebJob;
+
+class CWebWorker {
+  private:
+    QueueHandle_t m_queue = nullptr;
+    TaskHandle_t m_task = nullptr;
+
+    struct PendingJob {
+        AsyncWebServerRequestPtr request;
+        WebJob job;
+    };
+
+  public:
+    void setup(int queueDepth = 4);
+
+    // Queue a job for the request; false if the queue is full (the request is
+    // then untouched and the caller must respond)
+    bool submit(AsyncWebServerRequest* request, WebJob job);
+
+  private:
+    static void staticWorkerTask(void* arg);
+    void workerTask();
+};
+
+extern CWebWorker WebWorker;  // Global singleton
+
+#endif
@@ -1,5 +1,6 @@
 #include "HtmlGenerator.h"
 #include "../MyWebServer.h"
+#include "MemDebug.h"
 #include "MyLog.h"
 #include "NeohubManager.h"
 #include "ValveManager.h"
@@ -47,8 +48,8 @@ void CMyWebServer::respondToOptionsRequest(AsyncWebServerRequest* request) {
 
 void CMyWebServer::executeCommand(AsyncWebServerRequest* request)
 {
-    JsonDocument commandJson;
-    JsonDocument responseJson;
+    JsonDocument commandJson(&JsonAllocator);
+    JsonDocument responseJson(&JsonAllocator);
 
     const String* body = (String*)request->_tempObject;
     if (!body || *body == emptyString) {
@@ -109,44 +110,77 @@ void CMyWebServer::executeCommand(AsyncWebServerRequest* request)
             request->send(makeCommandResponse(request, 400, "{ \"error\": \"unknown zone\" }"));
             return;
         }
-        NeohubZoneData* zd;
-        if (command == "GetZoneStatus") zd = NeohubManager.getZoneData(zoneName, /* forceLoad: */ true);
-        else if (command == "ZoneOn") zd = NeohubManager.forceZoneOn(zoneName);
-        else if (command == "ZoneOff") zd = NeohubManager.forceZoneOff(zoneName);
-        else if (command == "ZoneAuto") zd = NeohubManager.setZoneToAutomatic(zoneName);
-        if (!zd) {
-            request->send(makeCommandResponse(request, 400, "{ \"error\": \"unable to configure zone\" }"));
-            return;
-        }
-        request->send(makeCommandResponse(request, 200, 
-            StringPrintf(
+
+        // Talking to the Neohub takes a while - do it in the web worker
+        this->deferResponse(request, [command, zoneName](WebJobResult& result) {
+            NeohubZoneData* zd = nullptr;
+            if (command == "GetZoneStatus") zd = NeohubManager.getZoneData(zoneName, /* forceLoad: */ true);
+            else if (command == "ZoneOn") zd = NeohubManager.forceZoneOn(zoneName);
+            else if (command == "ZoneOff") zd = NeohubManager.forceZoneOff(zoneName);
+            else if (command == "ZoneAuto") zd = NeohubManager.setZoneToAutomatic(zoneName);
+            if (!zd) {
+                result.code = 400;
+                result.body = "{ \"error\": \"unable to configure zone\" }";
+                return;
+            }
+            result.body = StringPrintf(
                 R"({ "setpoint": %.1f, "on": %s})",
                 zd->roomSetpoint, BOOL_TO_STRING(zd->demand)
-            )
-        ));
+            );
+        });
         return;
     }
 
-    else if (command == "SensorScan") {
-        UBaseType_t prio = uxTaskPriorityGet(NULL);
-        vTaskPrioritySet(NULL, 13);
-
-        OneWireManager.scanForSensors();
-        if (OneWireManager.getCount() == 0) OneWireManager.scanForSensors();
-        
-        for (int i = 0; i < OneWireManager.getCount(); i++) {
-            const char* id = OneWireManager[i].id;
-            if (
-                SensorMap.getNameForId(id).isEmpty()) {
-                SensorMap.setNameForId(id, id);
+    // Autotune ("flow" | "room" | "cancel" | "apply")
+    else if (command == "Autotune") {
+        String action = commandJson["parameter"].as<String>();
+        if (action == "flow" || action == "room") {
+            if (!ValveManager.startAutotune(action == "flow" ? AutotuneLoop::FLOW : AutotuneLoop::ROOM)) {
+                request->send(makeCommandResponse(request, 400, "{ \"error\": \"unable to start tuning\" }"));
+                return;
             }
         }
-        OneWireManager.readAllSensors();
-
-        vTaskPrioritySet(NULL, prio);
+        else if (action == "cancel") {
+            ValveManager.cancelAutotune();
+        }
+        else if (action == "apply") {
+            if (!ValveManager.applyAutotune()) {
+                request->send(makeCommandResponse(request, 400, "{ \"error\": \"no tuning result\" }"));
+                return;
+            }
+            Config.saveToSdCard(*this->m_sd, *this->m_sdMutex, "/config.json");
+        }
+        else {
+            request->send(makeCommandResponse(request, 400, "{ \"error\": \"unknown action\" }"));
+            return;
+        }
         request->send(makeCommandResponse(request, 200, "{ \"reload\": true }"));
         return;
     }
+
+    else if (command == "SensorScan") {
+        // A bus scan takes seconds - do it in the web worker
+        this->deferResponse(request, [](WebJobResult& result) {
+            UBaseType_t prio = uxTaskPriorityGet(NULL);
+            vTaskPrioritySet(NULL, 13);
+
+            OneWireManager.scanForSensors();
+            if (OneWireManager.getCount() == 0) OneWireManager.scanForSensors();
+
+            for (int i = 0; i < OneWireManager.getCount(); i++) {
+                const char* id = OneWireManager[i].id;
+                if (
+                    SensorMap.getNameForId(id).isEmpty()) {
+                    SensorMap.setNameForId(id, id);
+                }
+            }
+            OneWireManager.readAllSensors();
+
+            vTaskPrioritySet(NULL, prio);
+            result.body = "{ \"reload\": true }";
+        });
+        return;
+    }
     else {
         request->send(makeCommandResponse(request, 400, "{ \"error\": \"Unknown Command\" }"));
     }
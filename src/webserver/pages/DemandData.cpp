@@ -0,0 +1,53 @@
+#include "../MyWebServer.h"
+#include "ManifoldManager.h"
+
+// Manifold data sent to the heating controller (see ManifoldDataPostJob)
+//
+//    /demand/ws    WebSocket; every text message is the JSON of one ManifoldData
+//    POST /demand  the same JSON as the body of a request
+//
+// The manifolds use the WebSocket, which stays open, so they can send every control cycle.
+// The web server closes the connection after every request, so POST is only good for
+// occasional updates and for testing (scripts/simulateManifolds.py).
+
+void CMyWebServer::processDemandPost(AsyncWebServerRequest* request)
+{
+    const String* body = (String*)request->_tempObject;
+    if (!body || *body == emptyString) {
+        this->respondWithError(request, 400, "Empty request");
+        return;
+    }
+    if (!ManifoldManager.addOrUpdateManifoldFromJson(*body)) {
+        this->respondWithError(request, 400, "Invalid manifold data");
+        return;
+    }
+    request->send(200, "text/plain", "OK");
+}
+
+// Runs in the async_tcp task, like the request handlers
+void CMyWebServer::onDemandSocketEvent(
+    AsyncWebSocket* server, AsyncWebSocketClient* client,
+    AwsEventType type, void* arg, uint8_t* data, size_t len
+)
+{
+    switch (type) {
+        case WS_EVT_CONNECT:
+            MyWebLog.printf("Manifold connected from %s\n", client->remoteIP().toString().c_str());
+            break;
+
+        case WS_EVT_DISCONNECT:
+            MyWebLog.printf("Manifold disconnected (client %u)\n", client->id());
+            break;
+
+        case WS_EVT_DATA: {
+            // The manifold data always fits into one frame
+            AwsFrameInfo* info = (AwsFrameInfo*)arg;
+            if (info->opcode != WS_TEXT || !info->final || info->index != 0 || info->len != len) break;
+            ManifoldManager.addOrUpdateManifoldFromJson((const char*)data, len);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
@@ -2,6 +2,9 @@
 #include "../MyWebServer.h"
 #include "MyLog.h"
 #include "EspTools.h"
+#include "LogStorage.h"
+#include "SensorLogBinary.h"
+#include "SensorLogWriter.h"
 
 void CMyWebServer::processFileRequest(AsyncWebServerRequest* request)
 {
@@ -12,6 +15,12 @@ void CMyWebServer::processFileRequest(AsyncWebServerRequest* request)
     }
     fileName = fileName.substring(6);
 
+    // Logs on the internal flash
+    if (fileName.startsWith("/" LOG_STORAGE_FLASH_PREFIX)) {
+        respondWithFlashFile(request, fileName.substring(1 + strlen(LOG_STORAGE_FLASH_PREFIX)));
+        return;
+    }
+
     // Open the file briefly and check for existence and what it is
     if (!this->m_sdMutex->lock(__PRETTY_FUNCTION__)) {
         request->send(400, "text/plain", "Unable to access SD card");
@@ -25,6 +34,19 @@ void CMyWebServer::processFileRequest(AsyncWebServerRequest* request)
     f.close();
     this->m_sdMutex->unlock();
 
+    // Sensor logs only kept in binary are converted to CSV for downloads
+    if (!exists && fileName.endsWith(".csv")) {
+        String binaryFileName = fileName.substring(0, fileName.length() - 4) + ".bin";
+        if (this->m_sdMutex->lock(__PRETTY_FUNCTION__)) {
+            bool binaryExists = this->m_sd->exists(binaryFileName);
+            this->m_sdMutex->unlock();
+            if (binaryExists) {
+                respondWithConvertedSensorLog(request, binaryFileName);
+                return;
+            }
+        }
+    }
+
     // Errors unless it is a file or directoy
     if (!exists) {
         request->send(404, "text/plain", "File not found");
@@ -118,7 +140,7 @@ size_t CMyWebServer::sendFileChunk(WebResponseContext* context, uint8_t* buffer,
 
 void CMyWebServer::respondWithFileContents(AsyncWebServerRequest* request, const String& fileName)
 {
-    String contentType = fileName.endsWith(".csv") ? "text/csv" : "text/plain";
+    String contentType = fileName.endsWith(".csv") ? "text/csv" : fileName.endsWith(".gz") ? "application/gzip" : "text/plain";
 
     // Allocate a streaming context on heap so it outlives this function
     WebResponseContext* ctx = new WebResponseContext();
@@ -133,6 +155,37 @@ void CMyWebServer::respondWithFileContents(AsyncWebServerRequest* request, const
     request->send(response);
 }
 
+void CMyWebServer::respondWithConvertedSensorLog(AsyncWebServerRequest* request, const String& binaryFileName)
+{
+    SensorBinaryLog.flush();
+    auto source = std::make_shared<SensorLogBinaryCsvSource>(this->m_sd, this->m_sdMutex, binaryFileName.c_str());
+    AsyncWebServerResponse* response = request->beginChunkedResponse(
+        "text/csv",
+        [source](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+            return source->read(buffer, maxLen);
+        }
+    );
+    request->send(response);
+}
+
+void CMyWebServer::respondWithFlashFile(AsyncWebServerRequest* request, const String& fileName)
+{
+    File file = LogStorage.isFlashAvailable() ? LogStorage.openFlashFile(fileName.c_str()) : File();
+    if (!file || file.isDirectory()) {
+        request->send(404, "text/plain", "File not found");
+        return;
+    }
+
+    // FFat does its own locking, and the file is closed with the last copy of the handle
+    AsyncWebServerResponse* response = request->beginChunkedResponse(
+        "text/plain",
+        [file](uint8_t* buffer, size_t maxLen, size_t index) mutable -> size_t {
+            return file.read(buffer, maxLen);
+        }
+    );
+    request->send(response);
+}
+
 struct DirectoryEntry {
     String name;
     uint16_t date;
@@ -151,6 +204,14 @@ struct DirectoryEntry {
             time = 0;
         }
     }
+    DirectoryEntry(const String& name, size_t size, time_t modified) : name(name), isDirectory(false), sizeKb(size / 1024.0)
+    {
+        // FAT date and time, as SdFat reports them
+        struct tm tm;
+        gmtime_r(&modified, &tm);
+        date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+        time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+    }
     const char* formatDate(char* buf, size_t len)
     {
         if (date == 0) {
@@ -178,15 +239,17 @@ void CMyWebServer::respondWithDirectory(AsyncWebServerRequest* request, const St
     if (this->m_sdMutex->lock(__PRETTY_FUNCTION__)) {
         // Collect all files in the directory
 
-        FsFile dir = this->m_sd->open("/", O_RDONLY);
+        FsFile dir = this->m_sd->open(path.length() > 0 ? path.c_str() : "/", O_RDONLY);
         if (!dir.isOpen()) {
+            this->m_sdMutex->unlock();
             request->send(400, "text/plain", "Unable to open directory");
             return;
         }
 
         if (!dir.isDir()) {
-            request->send(400, "text/plain", "Not a directory");
             dir.close();
+            this->m_sdMutex->unlock();
+            request->send(400, "text/plain", "Not a directory");
             return;
         }
 
@@ -201,6 +264,19 @@ void CMyWebServer::respondWithDirectory(AsyncWebServerRequest* request, const St
         this->m_sdMutex->unlock();
     }
 
+    // Logs on the internal flash are listed with the root directory
+    bool isRoot = path.length() == 0 || path == "/";
+    if (isRoot && LogStorage.isFlashAvailable()) {
+        File root = LogStorage.openFlashRoot();
+        if (root && root.isDirectory()) {
+            for (File f = root.openNextFile(); f; f = root.openNextFile()) {
+                if (f.isDirectory()) continue;
+                const char* name = strrchr(f.name(), '/');
+                entries.push_back(DirectoryEntry(String(LOG_STORAGE_FLASH_PREFIX) + (name ? name + 1 : f.name()), f.size(), f.getLastWrite()));
+            }
+        }
+    }
+
     // Sort by descending timestamp, with directories on top
 
     auto cmp = [](const DirectoryEntry& a, const DirectoryEntry& b) {
@@ -230,9 +306,23 @@ void CMyWebServer::respondWithDirectory(AsyncWebServerRequest* request, const St
         response->printf("<td class='right'>%.1f</td>", coreDump.size() / 1024.0);
         response->printf("<td></td><td class='delete-file'></td></tr>");
     }
+
+    // Files in subdirectories (the log archive) are shown with the directory, which is also
+    // what the delete button sends
+    String prefix = path;
+    while (prefix.startsWith("/")) prefix = prefix.substring(1);
+    if (prefix.length() > 0 && !prefix.endsWith("/")) prefix += "/";
+
     for (DirectoryEntry& e : entries) {
+        String name = prefix + e.name;
         response->print("<tr>");
-        response->printf("<td><a href='/files/%s'>%s</a></td>", e.name.c_str(), e.name.c_str());
+        if (e.name.endsWith(".bin") && e.name.startsWith("Sensor Values ")) {
+            String csvName = name.substring(0, name.length() - 4) + ".csv";
+            response->printf("<td><a href='/files/%s'>%s</a> (<a href='/files/%s'>csv</a>)</td>", name.c_str(), name.c_str(), csvName.c_str());
+        }
+        else {
+            response->printf("<td><a href='/files/%s'>%s</a></td>", name.c_str(), name.c_str());
+        }
         response->printf("<td class='right'>%.1f</td>", e.sizeKb);
 
         char buf[25];
@@ -278,6 +368,14 @@ void CMyWebServer::processDeleteFileRequest(AsyncWebServerRequest* request)
 
         bool result = false;
 
+        if (filename.startsWith("/" LOG_STORAGE_FLASH_PREFIX)) {
+            result = LogStorage.isFlashAvailable() && LogStorage.removeFlashFile(filename.c_str() + 1 + strlen(LOG_STORAGE_FLASH_PREFIX));
+            request->send(result ? 200 : 500, "text/plain", result ? "file deleted" : "delete failed");
+            return;
+        }
+
+        SensorLogWriter.release(filename.c_str());
+        SensorBinaryLog.release(filename.c_str());
         if (this->m_sdMutex->lock(__PRETTY_FUNCTION__)) {
             result = this->m_sd->remove(filename.c_str());
             this->m_sdMutex->unlock();
@@ -28,12 +28,12 @@ void CMyWebServer::respondWithHeatingConfigPage(AsyncWebServerRequest *request)
               html.print("<td class='delete-row'></td>");
             });
             int i = 0;
-            for (NeohubZone z: NeohubManager.getActiveZones()) {
-              html.element("tr", [this, &html, i, z]{
+            for (const NeohubZone &z: NeohubManager.getActiveZones()) {
+              html.element("tr", [this, &html, i, &z]{
                 html.print("<td class='handle seq'/>");
-                html.print(String(i+1).c_str());
+                html.print(i+1);
                 html.print("</td>");
-                html.fieldTableSelect("name='zone_a'", [this, &html, z]{
+                html.fieldTableSelect("name='zone_a'", [this, &html, &z]{
                   this->generateZoneOptions(html, z.id);
                 });
                 html.print("<td class='delete-row'></td>");
@@ -55,12 +55,12 @@ void CMyWebServer::respondWithHeatingConfigPage(AsyncWebServerRequest *request)
               html.print("<td class='delete-row'></td>");
             });
             int i = 0;
-            for (NeohubZone z: NeohubManager.getMonitoredZones()) {
-              html.element("tr", [this, &html, i, z]{
+            for (const NeohubZone &z: NeohubManager.getMonitoredZones()) {
+              html.element("tr", [this, &html, i, &z]{
                 html.print("<td class='handle seq'/>");
-                html.print(String(i+1).c_str());
+                html.print(i+1);
                 html.print("</td>");
-                html.fieldTableSelect("name='zone_m'", [this, &html, z]{
+                html.fieldTableSelect("name='zone_m'", [this, &html, &z]{
                   this->generateZoneOptions(html, z.id);
                 });
                 html.print("<td class='delete-row'></td>");
@@ -87,7 +87,9 @@ void CMyWebServer::respondWithHeatingConfigPage(AsyncWebServerRequest *request)
             html.print("<td>minutes for 1x proportional gain</td>");
           });
           html.fieldTableRow("", [this, &html]{
-            html.print(("<td colspan=2><small>K<sub>i</sub> = " + String(ValveManager.getRoomIntegralGain(),3) + "</small></td>").c_str());
+            html.print("<td colspan=2><small>K<sub>i</sub> = ");
+            html.number(ValveManager.getRoomIntegralGain(), 3);
+            html.print("</small></td>");
           });
         });
       });
@@ -109,7 +111,15 @@ void CMyWebServer::respondWithHeatingConfigPage(AsyncWebServerRequest *request)
             html.print("<td>minutes for 1x proportional gain</td>");
           });
           html.fieldTableRow("", [this, &html]{
-            html.print(("<td colspan=2><small>K<sub>i</sub> = " + String(ValveManager.getFlowIntegralGain(),3) + "</small></td>").c_str());
+            html.print("<td colspan=2><small>K<sub>i</sub> = ");
+            html.number(ValveManager.getFlowIntegralGain(), 3);
+            html.print("</small></td>");
+          });
+          html.fieldTableRow("Feedforward", [&html]{
+            html.fieldTableSelect("colspan=2", "name='flow-feedforward'", [&html]{
+              html.option("1", "From input and return temperature",  Config.getFlowFeedforward() == true);
+              html.option("0", "None",  Config.getFlowFeedforward() == false);
+            });
           });
           html.fieldTableRow("Valve Direction", [&html]{
             html.fieldTableSelect("colspan=2", "name='valve-direction'", [&html]{
@@ -120,6 +130,69 @@ void CMyWebServer::respondWithHeatingConfigPage(AsyncWebServerRequest *request)
         });
       });
 
+      html.block("Automatic Tuning", [this, &html]{
+        AutotuneStatus status = ValveManager.getAutotuneStatus();
+        bool flow = status.loop == AutotuneLoop::FLOW;
+        html.fieldTable( [this, &html, &status, flow] {
+          html.fieldTableRow("Status", [&html, &status, flow]{
+            html.print("<td colspan=2 id='autotuneState'>");
+            if (status.loop == AutotuneLoop::NONE) html.print("Not run");
+            else html.text(status.message);
+            if (status.loop != AutotuneLoop::NONE) html.print(flow ? " (flow loop)" : " (room loop)");
+            html.print("</td>");
+          });
+          if (status.loop != AutotuneLoop::NONE) {
+            html.fieldTableRow("", [&html, &status]{
+              html.print("<td colspan=2 id='autotuneProgress'><small>");
+              html.print(status.cycles);
+              html.print(" cycles, ");
+              html.print(status.elapsedSeconds / 60);
+              html.print(" min</small></td>");
+            });
+          }
+          if (status.state == RelayAutotune::DONE) {
+            const AutotuneResult& r = status.result;
+            html.fieldTableRow("Proportional Gain", [&html, &r, flow]{
+              html.print("<td>");
+              html.number(r.proportionalGain, 2);
+              html.print(flow ? "</td><td>% per &deg;C flow temperature</td>" : "</td><td>&deg;C flow per &deg;C room temperature</td>");
+            });
+            html.fieldTableRow("Integral Time", [&html, &r, flow]{
+              html.print("<td>");
+              html.number(flow ? r.integralTimeSeconds : r.integralTimeSeconds / 60, 1);
+              html.print(flow ? "</td><td>seconds</td>" : "</td><td>minutes</td>");
+            });
+            html.fieldTableRow("", [&html, &r]{
+              html.print("<td colspan=2><small>");
+              html.text(r.rule);
+              html.print(" from K<sub>u</sub> = ");
+              html.number(r.ultimateGain, 2);
+              html.print(", T<sub>u</sub> = ");
+              html.number(r.ultimatePeriodSeconds, 0);
+              html.print("s; simulated overshoot ");
+              html.number(r.overshoot * 100, 0);
+              html.print("%, settled after ");
+              html.number(r.settlingSeconds / 60, 0);
+              html.print(" min</small></td>");
+            });
+          }
+          html.fieldTableRow("", [&html, &status]{
+            html.print("<td colspan=2>");
+            if (status.state == RelayAutotune::RUNNING) {
+              html.print("<a href='#' onclick='sendCommand({command:\"Autotune\", parameter:\"cancel\"})'>Cancel</a>");
+            }
+            else {
+              html.print("<a href='#' onclick='sendCommand({command:\"Autotune\", parameter:\"flow\"})'>Tune Flow</a> ");
+              html.print("<a href='#' onclick='sendCommand({command:\"Autotune\", parameter:\"room\"})'>Tune Room</a> ");
+              if (status.state == RelayAutotune::DONE) {
+                html.print("<a href='#' onclick='sendCommand({command:\"Autotune\", parameter:\"apply\"})'>Apply</a>");
+              }
+            }
+            html.print("</td>");
+          });
+        });
+      });
+
       html.block("Sensor Names",
         [&html] {
           html.print("<a class='sensor-scan' href='#' onclick='sendCommand({command:\"SensorScan\"})'>Scan</a>");
@@ -131,16 +204,17 @@ void CMyWebServer::respondWithHeatingConfigPage(AsyncWebServerRequest *request)
               int sensorCount = SensorMap.getCount();
               for (int i = 0; i < sensorCount; i++) {
                 SensorMapEntry * entry = SensorMap[i];
-                String fieldParameter = "name='s-" + entry->id + "' type='text'";
-                html.fieldTableRow(entry->id.c_str(), "class='handle'", [this, &html, fieldParameter, entry]{
+                html.fieldTableRow(entry->id.c_str(), "class='handle'", [this, &html, entry]{
                   html.print("<td id='"); html.print(entry->id.c_str()); html.print("-temp' class='has-data'>");
                   float temperature = COneWireManager::SENSOR_NOT_FOUND;
                   OneWireSensor * sensor = OneWireManager.getSensor(entry->id.c_str());
                   if (sensor) temperature = sensor->calibratedTemperature();
                   if (temperature == COneWireManager::SENSOR_NOT_FOUND) html.print("???");
-                  if (temperature > -50) html.print(String(temperature, 1).c_str());
+                  if (temperature > -50) html.number(temperature, 1);
                   html.print("</td>");
-                  html.fieldTableInput(fieldParameter.c_str(), entry->name.c_str());
+                  char fieldParameter[64];
+                  snprintf(fieldParameter, sizeof(fieldParameter), "name='s-%s' type='text'", entry->id.c_str());
+                  html.fieldTableInput(fieldParameter, entry->name.c_str());
                   html.print("<td class='delete-row'></td>");
                 });
               }
@@ -197,7 +271,7 @@ void CMyWebServer::generateZoneOptions(HtmlGenerator &html, int selectedZone)
   html.option("", "Not Selected", false);
   for (auto &i: zones)
   {
-    html.option(String(i.zone.id).c_str(), i.zone.name.c_str(), /* selected: */ selectedZone == i.zone.id);
+    html.option(i.zone.id, i.zone.name.c_str(), /* selected: */ selectedZone == i.zone.id);
   }
 }
 
@@ -260,6 +334,9 @@ void CMyWebServer::processHeatingConfigPagePost(AsyncWebServerRequest *request)
     else if (key == "valve-direction") {
       pidReconfigured |= update(Config.getFlowValveInverted(), &CConfig::setFlowValveInverted, (bool) p->value().toInt());
     }
+    else if (key == "flow-feedforward") {
+      pidReconfigured |= update(Config.getFlowFeedforward(), &CConfig::setFlowFeedforward, (bool) p->value().toInt());
+    }
     else if (key == "sensor-input") {
       Config.setInputSensorId(p->value());
     }
@@ -288,12 +365,9 @@ void CMyWebServer::processHeatingConfigPagePost(AsyncWebServerRequest *request)
 
   SensorMap.removeFromIndex(sensorIndex); // Remove any remaining sensors
   Config.saveToSdCard(*this->m_sd, *this->m_sdMutex, "/config.json");
-  if (pidReconfigured) {
-    ValveManager.loadConfig();
-    // includes loading the flow range
-  }
-  else if (flowRangeReconfigured) {
-    ValveManager.setFlowSetpointRange(Config.getFlowMinSetpoint(), Config.getFlowMaxSetpoint());
+  if (pidReconfigured || flowRangeReconfigured) {
+    // In the next control cycle; includes loading the flow range
+    ValveManager.requestConfigReload();
   }
 
   Config.print(MyLog);
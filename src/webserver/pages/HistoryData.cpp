@@ -0,0 +1,133 @@
+#include "../MyWebServer.h"
+#include "MyRtc.h"
+#include "RecentHistory.h"
+#include "SensorHistory.h"
+
+// Sensor history for charts, aggregated on the device
+//
+//    /data/history?from=...&to=...&step=...&columns=...&format=...
+//
+//  - from, to:  UTC time as seconds since 1970 or "yyyy-mm-dd[ hh:mm[:ss]]"
+//               (default: the last 24 hours)
+//  - step:      bucket width in seconds (default: range / 500, at least 5s)
+//  - columns:   comma separated column names as in the CSV header line (default: all)
+//  - format:    "json" (default) or "csv"
+//
+// Each bucket has min, avg and max for each column. Buckets without any data are left out.
+//
+//    /data/recent?...
+//
+// takes the same parameters but reads from the in-memory history instead of the SD card.
+
+static bool getTimeParameter(AsyncWebServerRequest* request, const char* name, time_t* result)
+{
+    const AsyncWebParameter* p = request->getParam(name);
+    if (!p) return true;
+
+    const String& value = p->value();
+    if (value.length() > 0 && value.indexOf('-') < 0) {
+        char* end;
+        long long seconds = strtoll(value.c_str(), &end, 10);
+        if (*end != '\0') return false;
+        *result = (time_t)seconds;
+        return true;
+    }
+    return parseSensorLogTime(value.c_str(), result);
+}
+
+// Parameters shared by /data/history and /data/recent
+struct HistoryParameters {
+    time_t from;
+    time_t to;
+    uint32_t step;
+    SensorHistoryAggregator::Format format;
+    const char* contentType;
+    const AsyncWebParameter* columns;
+};
+
+static bool getHistoryParameters(AsyncWebServerRequest* request, time_t defaultFrom, HistoryParameters& result, String& error)
+{
+    const int maxBuckets = 5000;
+    const uint32_t minStep = 5;
+
+    result.to = MyRtc.getTime().getUnixTime();
+    result.from = defaultFrom;
+    if (!getTimeParameter(request, "from", &result.from) || !getTimeParameter(request, "to", &result.to)) {
+        error = "Invalid time in from= or to=";
+        return false;
+    }
+    if (result.to <= result.from) {
+        error = "Empty time range";
+        return false;
+    }
+
+    result.step = (result.to - result.from) / 500;
+    const AsyncWebParameter* stepParameter = request->getParam("step");
+    if (stepParameter) result.step = stepParameter->value().toInt();
+    if (result.step < minStep) result.step = minStep;
+    if ((result.to - result.from) / result.step > maxBuckets) {
+        error = "Too many buckets, increase step=";
+        return false;
+    }
+
+    result.format = SensorHistoryAggregator::FORMAT_JSON;
+    result.contentType = "application/json";
+    const AsyncWebParameter* formatParameter = request->getParam("format");
+    if (formatParameter && formatParameter->value() == "csv") {
+        result.format = SensorHistoryAggregator::FORMAT_CSV;
+        result.contentType = "text/csv";
+    }
+
+    result.columns = request->getParam("columns");
+    return true;
+}
+
+// Send the output of a query (SensorHistoryQuery or RecentHistoryQuery) as a chunked response
+template <typename Query>
+static void sendHistoryResponse(AsyncWebServerRequest* request, const char* contentType, std::shared_ptr<Query> query)
+{
+    AsyncWebServerResponse* response = request->beginChunkedResponse(
+        contentType,
+        [query](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+            size_t n = query->read(buffer, maxLen);
+            if (n == 0 && !query->isDone()) return RESPONSE_TRY_AGAIN;
+            return n;
+        }
+    );
+    response->addHeader("Access-Control-Allow-Origin", "*");
+    response->addHeader("Access-Control-Allow-Methods", "GET, POST, OPTIONS");
+    response->addHeader("Access-Control-Allow-Headers", "Content-Type");
+    request->send(response);
+}
+
+void CMyWebServer::respondWithHistoryData(AsyncWebServerRequest* request)
+{
+    HistoryParameters p;
+    String error;
+    if (!getHistoryParameters(request, MyRtc.getTime().getUnixTime() - 24 * 3600, p, error)) {
+        this->respondWithError(request, 400, error);
+        return;
+    }
+
+    auto query = std::make_shared<SensorHistoryQuery>(this->m_sd, this->m_sdMutex, p.from, p.to, p.step, p.format);
+    if (p.columns) query->getAggregator().setColumns(p.columns->value());
+    sendHistoryResponse(request, p.contentType, query);
+}
+
+// Same as /data/history, but from the in-memory history (default: everything held there)
+void CMyWebServer::respondWithRecentData(AsyncWebServerRequest* request)
+{
+    time_t oldest = RecentHistory.getOldestTime();
+    if (oldest == 0) oldest = MyRtc.getTime().getUnixTime() - 3600;
+
+    HistoryParameters p;
+    String error;
+    if (!getHistoryParameters(request, oldest, p, error)) {
+        this->respondWithError(request, 400, error);
+        return;
+    }
+
+    auto query = std::make_shared<RecentHistoryQuery>(p.from, p.to, p.step, p.format);
+    if (p.columns) query->getAggregator().setColumns(p.columns->value());
+    sendHistoryResponse(request, p.contentType, query);
+}
@@ -0,0 +1,104 @@
+#include <esp_heap_caps.h>
+
+#include "../MyWebServer.h"
+#include "MemDebug.h"
+
+// Heap state for finding fragmentation and what causes it (see MemDebug.h)
+//
+// /memory?trace=start starts recording an allocation trace, /memory?trace=stop stops it.
+// /memory/trace.bin downloads the trace (and stops it) for scripts/replayHeapTrace.py.
+
+void CMyWebServer::respondWithMemoryPage(AsyncWebServerRequest* request)
+{
+    String traceMessage;
+    if (request->hasParam("trace")) {
+        String action = request->getParam("trace")->value();
+        if (action == "start") traceMessage = MemDebug.startTrace() ? "Trace started" : "Unable to allocate the trace buffer";
+        else if (action == "stop") {
+            MemDebug.stopTrace();
+            traceMessage = "Trace stopped";
+        }
+    }
+
+    AsyncResponseStream* response = request->beginResponseStream("text/plain");
+
+    struct {
+        const char* name;
+        uint32_t caps;
+    } heaps[] = {
+        {"internal", MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT},
+        {"psram", MALLOC_CAP_SPIRAM},
+    };
+
+    // Fragmentation: how much of the free memory is not in the largest free block
+    response->println("Heap      |     free | min free |  largest | free blocks | used blocks | fragmentation");
+    response->println("----------+----------+----------+----------+-------------+-------------+--------------");
+    for (auto& h : heaps) {
+        multi_heap_info_t info;
+        heap_caps_get_info(&info, h.caps);
+        if (info.total_free_bytes == 0 && info.total_allocated_bytes == 0) continue;
+        response->printf(
+            "%-9s | %8u | %8u | %8u | %11u | %11u | %11.0f %%\n",
+            h.name,
+            info.total_free_bytes,
+            info.minimum_free_bytes,
+            info.largest_free_block,
+            info.free_blocks,
+            info.allocated_blocks,
+            info.total_free_bytes ? 100.0 * (info.total_free_bytes - info.largest_free_block) / info.total_free_bytes : 0.0
+        );
+    }
+    response->println();
+
+    response->println("Tag       | allocations/s |  bytes/s | allocations |       frees | bytes allocated");
+    response->println("----------+---------------+----------+-------------+-------------+----------------");
+    for (int i = 0; i < MEM_TAG_COUNT; i++) {
+        CMemDebug::TagStats s = MemDebug.getTagStats(i);
+        response->printf(
+            "%-9s | %13.1f | %8.0f | %11u | %11u | %15llu\n",
+            memTagName(i),
+            s.allocationsPerSecond,
+            s.bytesPerSecond,
+            s.allocations,
+            s.frees,
+            s.bytesAllocated
+        );
+    }
+    response->println();
+
+    // Many small blocks that live long are what splits up the free memory
+    response->println("Block size | blocks in use |    bytes");
+    response->println("-----------+---------------+---------");
+    for (int i = 0; i < CMemDebug::SIZE_CLASSES; i++) {
+        CMemDebug::SizeClass c = MemDebug.getSizeClass(i);
+        size_t limit = CMemDebug::sizeClassLimit(i);
+        if (limit) response->printf("<= %7u | %13d | %8lld\n", limit, c.blocks, c.bytes);
+        else response->printf("   larger  | %13d | %8lld\n", c.blocks, c.bytes);
+    }
+    response->println();
+
+    if (traceMessage.length()) response->println(traceMessage);
+    response->printf(
+        "Trace: %s, %u of %u records, %u dropped\n",
+        MemDebug.isTracing() ? "recording" : "stopped",
+        MemDebug.getTraceCount(),
+        MemDebug.getTraceCapacity(),
+        MemDebug.getTraceDropped()
+    );
+    response->println("Start with /memory?trace=start, download from /memory/trace.bin");
+    request->send(response);
+}
+
+void CMyWebServer::respondWithMemoryTrace(AsyncWebServerRequest* request)
+{
+    MemDebug.stopTrace();
+    AsyncWebServerResponse* response = request->beginResponse(
+        "application/octet-stream",
+        MemDebug.getTraceSize(),
+        [](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+            return MemDebug.readTrace(index, buffer, maxLen);
+        }
+    );
+    response->addHeader("Content-Disposition", "attachment; filename=\"trace.bin\"");
+    request->send(response);
+}
@@ -0,0 +1,273 @@
+#include <esp_heap_caps.h>
+
+#include "../MyWebServer.h"
+#include "BackgroundFileWriter.h"
+#include "BoilerDemand.h"
+#include "DemandAggregator.h"
+#include "EspTools.h"
+#include "EventLog.h"
+#include "LogStorage.h"
+#include "MdnsDiscovery.h"
+#include "ManifoldManager.h"
+#include "ManifoldTelemetry.h"
+#include "MemDebug.h"
+#include "Metrics.h"
+#include "MyMutex.h"
+
+// Prometheus text format (version 0.0.4) for scraping by the monitoring system
+
+static void writeHeapMetrics(Print& out)
+{
+    struct {
+        const char* label;
+        uint32_t caps;
+    } heaps[] = {
+        {"type=\"internal\"", MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT},
+        {"type=\"psram\"", MALLOC_CAP_SPIRAM},
+    };
+
+    writeMetricHeader(out, "heap_free_bytes", "gauge", "Free heap");
+    for (auto& h : heaps) writeMetric(out, "heap_free_bytes", h.label, (uint64_t)heap_caps_get_free_size(h.caps));
+    writeMetricHeader(out, "heap_min_free_bytes", "gauge", "Lowest free heap since startup");
+    for (auto& h : heaps) writeMetric(out, "heap_min_free_bytes", h.label, (uint64_t)heap_caps_get_minimum_free_size(h.caps));
+    writeMetricHeader(out, "heap_largest_free_block_bytes", "gauge", "Largest block that can currently be allocated");
+    for (auto& h : heaps) writeMetric(out, "heap_largest_free_block_bytes", h.label, (uint64_t)heap_caps_get_largest_free_block(h.caps));
+
+    char labels[24];
+    writeMetricHeader(out, "heap_allocations_total", "counter", "Allocations by tag (see /memory)");
+    for (int i = 0; i < MEM_TAG_COUNT; i++) {
+        snprintf(labels, sizeof(labels), "tag=\"%s\"", memTagName(i));
+        writeMetric(out, "heap_allocations_total", labels, (uint64_t)MemDebug.getTagStats(i).allocations);
+    }
+    writeMetricHeader(out, "heap_allocated_bytes_total", "counter", "Bytes allocated by tag");
+    for (int i = 0; i < MEM_TAG_COUNT; i++) {
+        snprintf(labels, sizeof(labels), "tag=\"%s\"", memTagName(i));
+        writeMetric(out, "heap_allocated_bytes_total", labels, MemDebug.getTagStats(i).bytesAllocated);
+    }
+    writeMetricHeader(out, "heap_frees_total", "counter", "Frees by the tag of the freeing task");
+    for (int i = 0; i < MEM_TAG_COUNT; i++) {
+        snprintf(labels, sizeof(labels), "tag=\"%s\"", memTagName(i));
+        writeMetric(out, "heap_frees_total", labels, (uint64_t)MemDebug.getTagStats(i).frees);
+    }
+}
+
+static void writeTaskMetrics(Print& out)
+{
+    UBaseType_t n = uxTaskGetNumberOfTasks();
+    TaskStatus_t* ts = (TaskStatus_t*)malloc(n * sizeof(TaskStatus_t));
+    if (!ts) return;
+    uint32_t totalRunTime;
+    n = uxTaskGetSystemState(ts, n, &totalRunTime);
+
+    char labels[48];
+    writeMetricHeader(out, "task_stack_high_water_bytes", "gauge", "Minimum free stack space since the task started");
+    for (UBaseType_t i = 0; i < n; i++) {
+        snprintf(labels, sizeof(labels), "task=\"%s\"", ts[i].pcTaskName);
+        writeMetric(out, "task_stack_high_water_bytes", labels, (uint64_t)ts[i].usStackHighWaterMark);
+    }
+    free(ts);
+}
+
+static void writeOneWireMetrics(Print& out)
+{
+    const COneWireManager::Totals& t = OneWireManager.totals;
+    writeMetricHeader(out, "onewire_sensors", "gauge", "Number of known OneWire sensors");
+    writeMetric(out, "onewire_sensors", "", (uint64_t)OneWireManager.getCount());
+    writeMetricHeader(out, "onewire_readings_total", "counter", "OneWire sensor read attempts");
+    writeMetric(out, "onewire_readings_total", "", (uint64_t)t.readings);
+    writeMetricHeader(out, "onewire_errors_total", "counter", "OneWire sensor read errors by type");
+    writeMetric(out, "onewire_errors_total", "type=\"crc\"", (uint64_t)t.crcErrors);
+    writeMetric(out, "onewire_errors_total", "type=\"no_response\"", (uint64_t)t.noResponseErrors);
+    writeMetric(out, "onewire_errors_total", "type=\"other\"", (uint64_t)t.otherErrors);
+    writeMetricHeader(out, "onewire_failures_total", "counter", "OneWire sensor reads that failed after all retries");
+    writeMetric(out, "onewire_failures_total", "", (uint64_t)t.failures);
+}
+
+static void writeBackgroundWriterMetrics(Print& out)
+{
+    int n = BackgroundFileWriter.getFileCount();
+    char labels[80];
+
+    struct {
+        const char* name;
+        const char* type;
+        const char* help;
+    } metrics[] = {
+        {"background_writer_buffer_bytes", "gauge", "Size of the buffer for a file written in the background"},
+        {"background_writer_high_water_bytes", "gauge", "Most bytes waiting in the buffer at one time"},
+        {"background_writer_written_bytes_total", "counter", "Bytes written to the file"},
+        {"background_writer_dropped_bytes_total", "counter", "Bytes dropped because the buffer was full"},
+        {"background_writer_drains_total", "counter", "Writes of buffered data to the file"},
+        {"background_writer_errors_total", "counter", "Writes that failed"},
+    };
+
+    for (int m = 0; m < (int)(sizeof(metrics) / sizeof(metrics[0])); m++) {
+        writeMetricHeader(out, metrics[m].name, metrics[m].type, metrics[m].help);
+        for (int i = 0; i < n; i++) {
+            const CBackgroundFileWriter::FileStats& s = BackgroundFileWriter.getFileStats(i);
+            uint64_t values[] = {s.bufferSize, s.highWater, s.bytesWritten, s.bytesDropped, s.drains, s.errors};
+            snprintf(labels, sizeof(labels), "file=\"%s\"", s.fileName);
+            writeMetric(out, metrics[m].name, labels, values[m]);
+        }
+    }
+}
+
+static void writeLogStorageMetrics(Print& out)
+{
+    const CLogStorage::Stats& s = LogStorage.stats;
+    writeMetricHeader(out, "log_storage_written_bytes_total", "counter", "Log bytes appended by storage tier");
+    writeMetric(out, "log_storage_written_bytes_total", "tier=\"flash\"", s.flashBytes);
+    writeMetric(out, "log_storage_written_bytes_total", "tier=\"sd\"", s.sdBytes);
+    writeMetricHeader(out, "log_storage_migrated_bytes_total", "counter", "Log bytes moved from flash to the SD card");
+    writeMetric(out, "log_storage_migrated_bytes_total", "", s.migratedBytes);
+    writeMetricHeader(out, "log_storage_flash_errors_total", "counter", "Appends to flash that fell back to the SD card");
+    writeMetric(out, "log_storage_flash_errors_total", "", (uint64_t)s.flashErrors);
+    writeMetricHeader(out, "log_storage_flash_bytes", "gauge", "Size and use of the flash log partition");
+    writeMetric(out, "log_storage_flash_bytes", "type=\"total\"", (uint64_t)LogStorage.flashTotalBytes());
+    writeMetric(out, "log_storage_flash_bytes", "type=\"used\"", (uint64_t)LogStorage.flashUsedBytes());
+}
+
+static void writeSdAccessMetrics(Print& out, SdAccessLock& sd)
+{
+    static const char* priorityLabels[SD_PRIORITY_COUNT] = {
+        "priority=\"control\"", "priority=\"log\"", "priority=\"interactive\"", "priority=\"background\"",
+    };
+    writeMetricHeader(out, "sd_access_wait_seconds", "histogram", "Time waited for the SD card by priority");
+    for (int i = 0; i < SD_PRIORITY_COUNT; i++) sd.stats.waitTime[i].write(out, "sd_access_wait_seconds", priorityLabels[i]);
+    writeMetricHeader(out, "sd_access_hold_seconds", "histogram", "Time the SD card was held for one access");
+    sd.stats.holdTime.write(out, "sd_access_hold_seconds", "");
+    writeMetricHeader(out, "sd_access_queue_depth", "gauge", "Requests waiting for the SD card");
+    writeMetric(out, "sd_access_queue_depth", "", (uint64_t)sd.getQueueDepth());
+    writeMetricHeader(out, "sd_access_max_queue_depth", "gauge", "Most requests waiting for the SD card at one time");
+    writeMetric(out, "sd_access_max_queue_depth", "", (uint64_t)sd.stats.maxQueueDepth);
+}
+
+static void writeMutexMetrics(Print& out)
+{
+    char labels[64];
+    writeMetricHeader(out, "mutex_acquisitions_total", "counter", "Times a mutex was locked");
+    for (MyMutex* m = MyMutex::first(); m; m = m->next()) {
+        snprintf(labels, sizeof(labels), "mutex=\"%s\"", m->getName().c_str());
+        writeMetric(out, "mutex_acquisitions_total", labels, (uint64_t)m->getStats().acquisitions);
+    }
+    writeMetricHeader(out, "mutex_contended_total", "counter", "Times a mutex was locked after waiting for another holder");
+    for (MyMutex* m = MyMutex::first(); m; m = m->next()) {
+        snprintf(labels, sizeof(labels), "mutex=\"%s\"", m->getName().c_str());
+        writeMetric(out, "mutex_contended_total", labels, (uint64_t)m->getStats().contended);
+    }
+    writeMetricHeader(out, "mutex_wait_seconds", "histogram", "Time waited for a mutex that was locked");
+    for (MyMutex* m = MyMutex::first(); m; m = m->next()) {
+        snprintf(labels, sizeof(labels), "mutex=\"%s\"", m->getName().c_str());
+        m->getStats().waitTime.write(out, "mutex_wait_seconds", labels);
+    }
+    writeMetricHeader(out, "mutex_max_hold_seconds", "gauge", "Longest time a mutex was held");
+    uint32_t mhz = ESP.getCpuFreqMHz();
+    for (MyMutex* m = MyMutex::first(); m; m = m->next()) {
+        snprintf(labels, sizeof(labels), "mutex=\"%s\"", m->getName().c_str());
+        writeMetric(out, "mutex_max_hold_seconds", labels, m->getStats().maxHoldCycles / (mhz * 1e6));
+    }
+}
+
+static void writeManifoldPostMetrics(Print& out)
+{
+    const ManifoldDataPostJob::Stats& s = ManifoldDataPostJob::getStats();
+    writeMetricHeader(out, "manifold_post_requests_total", "counter", "Manifold data sent to the heating controller");
+    writeMetric(out, "manifold_post_requests_total", "", (uint64_t)s.requests);
+    writeMetricHeader(out, "manifold_post_failures_total", "counter", "Manifold data that could not be sent");
+    writeMetric(out, "manifold_post_failures_total", "", (uint64_t)s.failures);
+    writeMetricHeader(out, "manifold_post_connects_total", "counter", "Connections opened to the heating controller");
+    writeMetric(out, "manifold_post_connects_total", "", (uint64_t)s.connects);
+
+    const CManifoldTelemetry::Stats& t = ManifoldTelemetry.stats;
+    writeMetricHeader(out, "manifold_telemetry_packets_total", "counter", "Manifold data packets sent and received by UDP multicast");
+    writeMetric(out, "manifold_telemetry_packets_total", "result=\"sent\"", (uint64_t)t.sent);
+    writeMetric(out, "manifold_telemetry_packets_total", "result=\"send_error\"", (uint64_t)t.sendErrors);
+    writeMetric(out, "manifold_telemetry_packets_total", "result=\"accepted\"", (uint64_t)t.accepted);
+    writeMetric(out, "manifold_telemetry_packets_total", "result=\"invalid\"", (uint64_t)t.invalid);
+    writeMetric(out, "manifold_telemetry_packets_total", "result=\"out_of_order\"", (uint64_t)t.outOfOrder);
+}
+
+static void writeMdnsMetrics(Print& out)
+{
+    CMdnsDiscovery::Stats s = MdnsDiscovery.getStats();
+    writeMetricHeader(out, "mdns_lookups_total", "counter", "Host and service lookups by result");
+    writeMetric(out, "mdns_lookups_total", "result=\"cached\"", (uint64_t)s.cacheHits);
+    writeMetric(out, "mdns_lookups_total", "result=\"answered\"", (uint64_t)(s.queries - s.failures));
+    writeMetric(out, "mdns_lookups_total", "result=\"stale\"", (uint64_t)s.staleAnswers);
+    writeMetric(out, "mdns_lookups_total", "result=\"failed\"", (uint64_t)(s.failures - s.staleAnswers));
+}
+
+static void writeDemandMetrics(Print& out)
+{
+    DemandSummary s = DemandAggregator.getSummary();
+    writeMetricHeader(out, "demand_highest_celsius", "gauge", "Highest flow demand of the manifolds reporting");
+    writeMetric(out, "demand_highest_celsius", "", s.highest);
+    writeMetricHeader(out, "demand_weighted_average_celsius", "gauge", "Flow demand of the manifolds reporting, weighted");
+    writeMetric(out, "demand_weighted_average_celsius", "", s.weightedAverage);
+    writeMetricHeader(out, "demand_manifolds", "gauge", "Manifolds counted in the demand by state");
+    writeMetric(out, "demand_manifolds", "state=\"current\"", (uint64_t)(s.active - s.aged));
+    writeMetric(out, "demand_manifolds", "state=\"aged\"", (uint64_t)s.aged);
+    writeMetricHeader(out, "demand_changes_total", "counter", "Changes of the demand summary");
+    writeMetric(out, "demand_changes_total", "", (uint64_t)s.changes);
+    writeMetricHeader(out, "boiler_flow_request_celsius", "gauge", "Flow temperature requested from the boiler");
+    writeMetric(out, "boiler_flow_request_celsius", "", BoilerDemand.getFlowRequest());
+}
+
+static void writeEventLogMetrics(Print& out)
+{
+    char labels[16];
+    writeMetricHeader(out, "event_log_events_total", "counter", "Events recorded by core");
+    for (int core = 0; core < 2; core++) {
+        snprintf(labels, sizeof(labels), "core=\"%d\"", core);
+        writeMetric(out, "event_log_events_total", labels, (uint64_t)EventLog.getStats(core).events);
+    }
+    writeMetricHeader(out, "event_log_dropped_total", "counter", "Events dropped because the ring of the core was full");
+    for (int core = 0; core < 2; core++) {
+        snprintf(labels, sizeof(labels), "core=\"%d\"", core);
+        writeMetric(out, "event_log_dropped_total", labels, (uint64_t)EventLog.getStats(core).dropped);
+    }
+    writeMetricHeader(out, "event_log_high_water_bytes", "gauge", "Most bytes waiting to be formatted at one time");
+    for (int core = 0; core < 2; core++) {
+        snprintf(labels, sizeof(labels), "core=\"%d\"", core);
+        writeMetric(out, "event_log_high_water_bytes", labels, (uint64_t)EventLog.getStats(core).highWater);
+    }
+}
+
+void CMyWebServer::respondWithMetrics(AsyncWebServerRequest* request)
+{
+    AsyncResponseStream* response = request->beginResponseStream("text/plain; version=0.0.4");
+    response->setCode(200);
+
+    writeMetricHeader(*response, "uptime_seconds", "counter", "Time since the last restart");
+    writeMetric(*response, "uptime_seconds", "", (uint64_t)uptime());
+
+    writeHeapMetrics(*response);
+    writeTaskMetrics(*response);
+
+    writeMetricHeader(*response, "control_loop_interval_seconds", "histogram", "Time between the starts of two control cycles");
+    Metrics.controlLoopInterval.write(*response, "control_loop_interval_seconds", "");
+    writeMetricHeader(*response, "control_loop_duration_seconds", "histogram", "Time taken by the parts of a control cycle");
+    Metrics.controlTime.write(*response, "control_loop_duration_seconds", "step=\"control\"");
+    Metrics.sensorLogTime.write(*response, "control_loop_duration_seconds", "step=\"log\"");
+    Metrics.sensorReadTime.write(*response, "control_loop_duration_seconds", "step=\"read_sensors\"");
+
+    writeMetricHeader(*response, "neohub_round_trip_seconds", "histogram", "Time from sending a Neohub command until the response arrived");
+    Metrics.neohubRoundTrip.write(*response, "neohub_round_trip_seconds", "");
+    writeMetricHeader(*response, "neohub_errors_total", "counter", "Neohub commands without a response");
+    writeMetric(*response, "neohub_errors_total", "type=\"timeout\"", (uint64_t)Metrics.neohubTimeouts);
+    writeMetric(*response, "neohub_errors_total", "type=\"error\"", (uint64_t)Metrics.neohubErrors);
+
+    writeOneWireMetrics(*response);
+    writeBackgroundWriterMetrics(*response);
+    writeEventLogMetrics(*response);
+    writeSdAccessMetrics(*response, *this->m_sdMutex);
+    writeMutexMetrics(*response);
+    writeLogStorageMetrics(*response);
+    writeManifoldPostMetrics(*response);
+    writeDemandMetrics(*response);
+    writeMdnsMetrics(*response);
+
+    Metrics.writeHttpMetrics(*response);
+
+    request->send(response);
+}
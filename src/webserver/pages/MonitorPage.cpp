@@ -1,4 +1,5 @@
 #include "../MyWebServer.h"
+#include "MemDebug.h"
 #include "NeohubManager.h"
 #include "ValveManager.h"
 
@@ -8,6 +9,35 @@ const String &CMyWebServer::mapSensorName(const String &id) const{
   return displayName;
 }
 
+// <td> with a temperature that is updated by monitorPage_refreshData, id='z<zone>-<suffix>'
+static void zoneTemperatureCell(HtmlGenerator &html, int zoneId, const char *suffix, bool off, double temperature) {
+  html.print("<td id=z");
+  html.print(zoneId);
+  html.print(suffix);
+  html.print(off ? " class='has-data off'>" : " class='has-data'>");
+  if (temperature != NeohubZoneData::NO_TEMPERATURE) html.number(temperature, 1);
+  html.print("</td>");
+}
+
+// <td> with a value that is updated by monitorPage_refreshData
+static void dataCell(HtmlGenerator &html, const char *id, double value, int decimals, const char *unit = "") {
+  html.print("<td id='");
+  html.print(id);
+  html.print("' class='has-data'>");
+  html.number(value, decimals);
+  html.print(unit);
+  html.print("</td>");
+}
+
+static void zoneRow(HtmlGenerator &html, const NeohubZoneData *d, bool active) {
+  html.print(active ? "<tr><th class='gap-right active'>" : "<tr><th class='gap-right'>");
+  html.print(d->zone.name.c_str());
+  html.print("</th>");
+  zoneTemperatureCell(html, d->zone.id, "-room-temp", !d->demand, d->roomTemperature);
+  zoneTemperatureCell(html, d->zone.id, "-floor-temp", d->floorLimitTriggered, d->floorTemperature);
+  html.print("</tr>\n");
+}
+
 void CMyWebServer::respondWithMonitorPage(AsyncWebServerRequest *request) {
   bool expertMode = true;
   AsyncResponseStream *response = startHttpHtmlResponse(request);
@@ -18,25 +48,28 @@ void CMyWebServer::respondWithMonitorPage(AsyncWebServerRequest *request) {
   html.blockLayout([this, expertMode, &html]{
 
     html.block("Control", [this, expertMode, &html]{
-      html.element("table", "class='field-table center-all-td'", [this, expertMode, &html] {
-        html.print("<thead><tr>");
-        html.print("<th style='border-bottom: none; min-width: 130px'></th><th style='width: 5em' class='gap-right'>Setpoint</th>");
-        html.print("<th style='width: 5em' class='gap-right'>Actual</th><th style='width: 5em' class='gap-right' >Diff.</th>");
+      ControlState state = ValveManager.getState();
+      html.element("table", "class='field-table center-all-td'", [this, expertMode, &state, &html] {
+        html.print(
+          "<thead><tr>"
+          "<th style='border-bottom: none; min-width: 130px'></th><th style='width: 5em' class='gap-right'>Setpoint</th>"
+          "<th style='width: 5em' class='gap-right'>Actual</th><th style='width: 5em' class='gap-right' >Diff.</th>"
+        );
         if (expertMode) {
-          html.print("<th style='width: 5em' class='gap-right'>P</th><th style='width: 5em' >I</th>");
+          html.print("<th style='width: 5em' class='gap-right'>P</th><th style='width: 5em' class='gap-right'>I</th><th style='width: 5em' >FF</th>");
         }
         html.print("</tr></thead>");
 
-        html.fieldTableRow("Room", [this, expertMode, &html]{
+        html.fieldTableRow("Room", [this, expertMode, &state, &html]{
           double sp = Config.getRoomSetpoint();
-          double t = ValveManager.inputs.roomTemperature;
-          double d = t - sp;
-          html.element("td", "id='roomSetpoint' class='has-data'",  String(sp,1).c_str());
-          html.element("td", "id='roomTemperature' class='has-data'", String(t,1).c_str());
-          html.element("td", "id='roomError' class='has-data'", String(d,1).c_str());
+          double t = state.inputs.roomTemperature;
+          dataCell(html, "roomSetpoint", sp, 1);
+          dataCell(html, "roomTemperature", t, 1);
+          dataCell(html, "roomError", t - sp, 1);
           if (expertMode) {
-            html.element("td", "id='roomD' class='has-data'", String(ValveManager.getRoomProportionalTerm(),1).c_str());
-            html.element("td", "id='roomI' class='has-data'", String(ValveManager.getRoomIntegralTerm(),1).c_str());
+            dataCell(html, "roomD", state.roomProportionalTerm, 1);
+            dataCell(html, "roomI", state.roomIntegralTerm, 1);
+            html.print("<td></td>");
           }
         });
         if (NeohubManager.getActiveZones().size() == 1 && NeohubManager.getMonitoredZones().size() == 0) {
@@ -44,28 +77,24 @@ void CMyWebServer::respondWithMonitorPage(AsyncWebServerRequest *request) {
           if (d && d->floorTemperature != NeohubZoneData::NO_TEMPERATURE) {
             html.fieldTableRow("Floor", [d, &html]{
               html.print("<td></td>");
-              double ft = d->floorTemperature;
-              String p = "id=z" + String(d->zone.id) + "-floor-temp class='has-data";
-              if (d->floorLimitTriggered) p += " off";
-              p += "'";
-              html.element("td", p.c_str(),  String(ft,1).c_str());
+              zoneTemperatureCell(html, d->zone.id, "-floor-temp", d->floorLimitTriggered, d->floorTemperature);
             });
           }
         }
-        html.fieldTableRow("Flow", [this, expertMode, &html]{
-          double sp = ValveManager.getFlowSetpoint();
-          double t = ValveManager.inputs.flowTemperature;
-          double d = t - sp;
-          html.element("td", "id='flowSetpoint' class='has-data'", String(sp,1).c_str());
-          html.element("td", "id='flowTemperature' class='has-data'", String(t,1).c_str());
-          html.element("td", "id='flowError' class='has-data'", String(d,1).c_str());
+        html.fieldTableRow("Flow", [this, expertMode, &state, &html]{
+          double sp = state.outputs.targetFlowTemperature;
+          double t = state.inputs.flowTemperature;
+          dataCell(html, "flowSetpoint", sp, 1);
+          dataCell(html, "flowTemperature", t, 1);
+          dataCell(html, "flowError", t - sp, 1);
           if (expertMode) {
-            html.element("td", "id='flowD' class='has-data'", String(ValveManager.getFlowProportionalTerm(),1).c_str());
-            html.element("td", "id='flowI' class='has-data'", String(ValveManager.getFlowIntegralTerm(),1).c_str());
+            dataCell(html, "flowD", state.flowProportionalTerm, 1);
+            dataCell(html, "flowI", state.flowIntegralTerm, 1);
+            dataCell(html, "flowF", state.flowFeedforwardTerm, 1);
           }
         });
         html.fieldTableRow("Valve", [this, &html]{
-          html.element("td", "id='valvePosition' class='has-data'", (String(ValveManager.getValvePosition(),0) + "%").c_str());
+          dataCell(html, "valvePosition", ValveManager.getValvePosition(), 0, "%");
           if (ValveManager.valveUnderManualControl()) {
             html.print("<td id='valveManualFlag' colspan=2 class='manual-control'>Manual Control</td>");
           }
@@ -79,71 +108,20 @@ void CMyWebServer::respondWithMonitorPage(AsyncWebServerRequest *request) {
     if (NeohubManager.getActiveZones().size() > 1 || NeohubManager.getMonitoredZones().size() > 0) {
       html.block("Zones", [this, &html]{
         html.element("table", "class='monitor-table tight'", [this, &html]{
-          html.print("<thead>");
-          html.print("<tr class='tight'><th rowspan=2 style='vertical-align: bottom' class='gap-right'>Zone</th><th colspan=4>Temperatures</th></tr>");
-          html.print("<tr class='tight'><th>Air</th><th>Floor</th></tr>");
-          html.print("</thead>");
+          html.print(
+            "<thead>"
+            "<tr class='tight'><th rowspan=2 style='vertical-align: bottom' class='gap-right'>Zone</th><th colspan=4>Temperatures</th></tr>"
+            "<tr class='tight'><th>Air</th><th>Floor</th></tr>"
+            "</thead>"
+          );
           html.element("tbody", [this, &html]{
-            for (NeohubZone z: NeohubManager.getActiveZones()) {
+            for (const NeohubZone &z: NeohubManager.getActiveZones()) {
               NeohubZoneData *d = NeohubManager.getZoneData(z.id);
-              if (!d) continue;
-              html.element("tr", [this, &html, d] {
-
-                html.element("th", "class='gap-right active'", [d, &html]{
-                  html.print(d->zone.name.c_str());
-                });
-
-                String p = "id=z" + String(d->zone.id) + "-room-temp class='has-data";
-                if (!d->demand) p += " off";
-                p += "'";
-
-                html.element("td", p.c_str(), [d, &html]{
-                  if (d->roomTemperature != NeohubZoneData::NO_TEMPERATURE) {
-                    html.print(String(d->roomTemperature,1).c_str());
-                  }
-                });
-
-                p = "id=z" + String(d->zone.id) + "-floor-temp class='has-data";
-                if (d->floorLimitTriggered) p += " off";
-                p += "'";
-
-                html.element("td", p.c_str(), [d, &html]{
-                  if (d->floorTemperature != NeohubZoneData::NO_TEMPERATURE) {
-                    html.print(String(d->floorTemperature,1).c_str());
-                  }
-                });
-              });
+              if (d) zoneRow(html, d, true);
             }
-
-            for (NeohubZone z: NeohubManager.getMonitoredZones()) {
+            for (const NeohubZone &z: NeohubManager.getMonitoredZones()) {
               NeohubZoneData *d = NeohubManager.getZoneData(z.id);
-              if (!d) continue;
-              html.element("tr", [this, &html, d] {
-
-                html.element("th", "class='gap-right'", [d, &html]{
-                  html.print(d->zone.name.c_str());
-                });
-
-                String p = "id=z" + String(d->zone.id) + "-room-temp class='has-data";
-                if (!d->demand) p += " off";
-                p += "'";
-
-                html.element("td", p.c_str(), [d, &html]{
-                  if (d->roomTemperature != NeohubZoneData::NO_TEMPERATURE) {
-                    html.print(String(d->roomTemperature,1).c_str());
-                  }
-                });
-
-                p = "id=z" + String(d->zone.id) + "-floor-temp class='has-data";
-                if (d->floorLimitTriggered) p += " off";
-                p += "'";
-
-                html.element("td", p.c_str(), [d, &html]{
-                  if (d->floorTemperature != NeohubZoneData::NO_TEMPERATURE) {
-                    html.print(String(d->floorTemperature,1).c_str());
-                  }
-                });
-              });
+              if (d) zoneRow(html, d, false);
             }
           });
         });
@@ -152,37 +130,25 @@ void CMyWebServer::respondWithMonitorPage(AsyncWebServerRequest *request) {
 
     html.block("Sensors", [this, &html]{
       html.element("table", "class='monitor-table'", [this, &html]{
-        html.print("<thead>");
-        html.print("<tr class='tight'><th rowspan=2 style='vertical-align: bottom' class='gap-right'>Sensor</th><th rowspan=2 style='vertical-align: bottom' class='gap-right'>Temp</th><th colspan=4>Errors</th></tr>");
-        html.print("<tr class='tight'><th>CRC</th><th>Empty</th><th>Other</th><th>Fail</th></tr>");
-        html.print("</thead>");
+        html.print(
+          "<thead>"
+          "<tr class='tight'><th rowspan=2 style='vertical-align: bottom' class='gap-right'>Sensor</th><th rowspan=2 style='vertical-align: bottom' class='gap-right'>Temp</th><th colspan=4>Errors</th></tr>"
+          "<tr class='tight'><th>CRC</th><th>Empty</th><th>Other</th><th>Fail</th></tr>"
+          "</thead>"
+        );
         html.element("tbody", [this, &html]{
           int sensorCount = SensorMap.getCount();
-          int totalReadings = 0;
-          int totalCrcErrors = 0;
-          int totalNoResponseErrors = 0;
-          int totalOtherErrors = 0;
-          int totalFailures = 0;
           for (int i = 0; i < sensorCount; i++) {
             SensorMapEntry * entry = SensorMap[i];
             OneWireSensor * sensor = OneWireManager.getSensor(entry->id.c_str());
             float temperature = COneWireManager::SENSOR_NOT_FOUND;
-            if (sensor) {
-              temperature = sensor->calibratedTemperature();
-              totalReadings += sensor->readings;
-              totalCrcErrors += sensor->crcErrors;
-              totalNoResponseErrors += sensor->noResponseErrors;
-              totalOtherErrors += sensor->otherErrors;
-              totalFailures += sensor->failures;
-            }
+            if (sensor) temperature = sensor->calibratedTemperature();
 
-            html.print("<tr>");
-            html.print("<th>");
+            html.print("<tr><th>");
             html.print(entry->name.c_str());
-            html.print("</th>");
-            html.print("<td id='"); html.print(entry->id.c_str()); html.print("-temp' class='has-data'>");
+            html.print("</th><td id='"); html.print(entry->id.c_str()); html.print("-temp' class='has-data'>");
             if (temperature == COneWireManager::SENSOR_NOT_FOUND) html.print("???");
-            if (temperature > -50) html.print(String(temperature, 1).c_str());
+            if (temperature > -50) html.number(temperature, 1);
             html.print("</td>");
             if (sensor) {
               char buffer[500];
@@ -214,29 +180,46 @@ void CMyWebServer::respondWithMonitorPage(AsyncWebServerRequest *request) {
 }
 
 void CMyWebServer::respondWithStatusData(AsyncWebServerRequest *request) {
-  JsonDocument statusJson;
+  JsonDocument statusJson(&JsonAllocator);
+  ControlState state = ValveManager.getState();
 
   {
     double sp = Config.getRoomSetpoint();
-    double t = ValveManager.inputs.roomTemperature;
+    double t = state.inputs.roomTemperature;
     statusJson["roomSetpoint"]    = sp;
     if (t != NeohubZoneData::NO_TEMPERATURE) {
       statusJson["roomTemperature"] = t;
       statusJson["roomError"]  = t - sp;
     }
-    statusJson["roomProportionalTerm"] = ValveManager.getRoomProportionalTerm();
-    statusJson["roomIntegralTerm"] = ValveManager.getRoomIntegralTerm();
+    statusJson["roomProportionalTerm"] = state.roomProportionalTerm;
+    statusJson["roomIntegralTerm"] = state.roomIntegralTerm;
   }
   {
-    double sp = ValveManager.getFlowSetpoint();
-    double t = ValveManager.inputs.flowTemperature;
+    double sp = state.outputs.targetFlowTemperature;
+    double t = state.inputs.flowTemperature;
     statusJson["flowSetpoint"] = sp;
     if (t != NeohubZoneData::NO_TEMPERATURE) {
       statusJson["flowTemperature"] = t;
       statusJson["flowError"]       = t - sp;
     }
-    statusJson["flowProportionalTerm"] = ValveManager.getFlowProportionalTerm();
-    statusJson["flowIntegralTerm"]     = ValveManager.getFlowIntegralTerm();
+    statusJson["flowProportionalTerm"] = state.flowProportionalTerm;
+    statusJson["flowIntegralTerm"]     = state.flowIntegralTerm;
+    statusJson["flowFeedforwardTerm"]  = state.flowFeedforwardTerm;
+  }
+  statusJson["controlCycle"] = state.cycle;
+
+  {
+    AutotuneStatus autotune = ValveManager.getAutotuneStatus();
+    if (autotune.loop != AutotuneLoop::NONE) {
+      statusJson["autotune"]["loop"] = autotune.loop == AutotuneLoop::FLOW ? "flow" : "room";
+      statusJson["autotune"]["message"] = autotune.message;
+      statusJson["autotune"]["cycles"] = autotune.cycles;
+      statusJson["autotune"]["elapsedSeconds"] = autotune.elapsedSeconds;
+      if (autotune.state == RelayAutotune::DONE) {
+        statusJson["autotune"]["proportionalGain"] = autotune.result.proportionalGain;
+        statusJson["autotune"]["integralTimeSeconds"] = autotune.result.integralTimeSeconds;
+      }
+    }
   }
 
   statusJson["valvePosition"]        = ValveManager.getValvePosition();
@@ -1,6 +1,8 @@
 #include "../MyWebServer.h"
 #include "NeohubManager.h"
 #include "ESPmDNS.h"
+#include "ManifoldManager.h"
+#include "BoilerDemand.h"
 
 void CMyWebServer::respondWithSystemConfigPage(AsyncWebServerRequest *request) {
   AsyncResponseStream *response = this->startHttpHtmlResponse(request);
@@ -40,7 +42,28 @@ void CMyWebServer::respondWithSystemConfigPage(AsyncWebServerRequest *request) {
       html.block("Heating Controller", [this, &html]{
         html.fieldTable( [this, &html] {
           html.fieldTableRow("URL", [&html]{
-            html.fieldTableInput("name='hc_url' style='width: 20em'", Config.getHeatingControllerAddress().c_str());
+            html.fieldTableInput("name='hc_url' style='width: 20em' placeholder='host name, address or auto'", Config.getHeatingControllerAddress().c_str());
+          });
+          html.fieldTableRow("Send Data", [&html]{
+            html.fieldTableSelect("name='hc_multicast'", [&html]{
+              html.option("0", "HTTP to the URL",  Config.getHeatingControllerMulticast() == false);
+              html.option("1", "UDP multicast",  Config.getHeatingControllerMulticast() == true);
+            });
+          });
+          html.fieldTableRow("This Device", [&html]{
+            html.fieldTableSelect("name='hc_role'", [&html]{
+              html.option("0", "Manifold only",  Config.getActAsHeatingController() == false);
+              html.option("1", "Also the heating controller",  Config.getActAsHeatingController() == true);
+            });
+          });
+          html.fieldTableRow("Demand Weights", [&html]{
+            html.fieldTableInput("name='hc_weights' style='width: 20em' placeholder='name=weight, ...'", Config.getDemandWeights().c_str());
+          });
+          html.fieldTableRow("Boiler Flow", [&html]{
+            html.fieldTableSelect("name='hc_boiler'", [&html]{
+              html.option("0", "Highest demand",  Config.getBoilerUseWeightedAverage() == false);
+              html.option("1", "Weighted average",  Config.getBoilerUseWeightedAverage() == true);
+            });
           });
         });
       });
@@ -106,6 +129,7 @@ void CMyWebServer::processSystemConfigPagePost(AsyncWebServerRequest *request) {
   bool hostnameChanged = false;     // Flag if we have to redirect to the new hostname
   bool changesMade     = false;     // Flag if any changes were nade and we need to save them
   bool reconnectNeohub = false;     // Flag if we have to reconnect to the neohub
+  bool boilerChanged   = false;     // Flag if the boiler flow request has to be computed again
 
   int count = request->params();
   for (int i = 0; i < count; i++) {
@@ -136,6 +160,35 @@ void CMyWebServer::processSystemConfigPagePost(AsyncWebServerRequest *request) {
       Config.setHeatingControllerAddress(p->value());
       changesMade = true;
     }
+    if (key == "hc_multicast" && (bool)p->value().toInt() != Config.getHeatingControllerMulticast()) {
+      Config.setHeatingControllerMulticast((bool)p->value().toInt());
+      changesMade = true;
+    }
+    if (key == "hc_role" && (bool)p->value().toInt() != Config.getActAsHeatingController()) {
+      Config.setActAsHeatingController((bool)p->value().toInt());
+      changesMade = true;
+      boilerChanged = true;
+    }
+    if (key == "hc_weights" && p->value() != Config.getDemandWeights()) {
+      Config.setDemandWeights(p->value());
+      ManifoldManager.setDemandWeights(p->value());
+      changesMade = true;
+      boilerChanged = true;
+    }
+    if (key == "hc_boiler" && (bool)p->value().toInt() != Config.getBoilerUseWeightedAverage()) {
+      Config.setBoilerUseWeightedAverage((bool)p->value().toInt());
+      changesMade = true;
+      boilerChanged = true;
+    }
+  }
+
+  if (boilerChanged) {
+    BoilerDemand.refresh();
+  }
+
+  // The display name is advertised with the services
+  if (changesMade) {
+    ManifoldManager.advertise();
   }
 
   if (changesMade) {
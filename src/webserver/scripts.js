@@ -269,6 +269,7 @@ function monitorPage_refreshData() {
             $("#flowTemperature").text(fmt(data.flowTemperature, 1))
             $("#flowD").text(fmt(data.flowProportionalTerm, 1))
             $("#flowI").text(fmt(data.flowIntegralTerm, 1))
+            $("#flowF").text(fmt(data.flowFeedforwardTerm, 1))
 
             var d = fmt(data.roomError, 1)
             if (fmt != '0.0' && data.roomError > 0) d = '+' + d
@@ -280,6 +281,10 @@ function monitorPage_refreshData() {
 
             $("#valvePosition").text(fmt(data.valvePosition, 0) + "%")
             $("#valveManualFlag").toggle(data.valveManualControl)
+            if (data.autotune) {
+                $("#autotuneState").text(data.autotune.message + " (" + data.autotune.loop + " loop)")
+                $("#autotuneProgress small").text(data.autotune.cycles + " cycles, " + fmt(data.autotune.elapsedSeconds / 60, 0) + " min")
+            }
             if (data.sensors) {
                 data.sensors.forEach(function (sensor) {
                     $("#" + sensor.id + "-temp").text(fmt(sensor.temperature, 1))